@@ -0,0 +1,296 @@
+#include <errno.h>
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#if defined(__GLIBC__) && (__GLIBC__ > 2 || __GLIBC_MINOR__ >= 33)
+# include <malloc.h>
+# define HAVE_MALLINFO2
+#endif
+
+#include "config.h"
+#include "parser/json/json.h"
+#include "parser/json/decoder.h"
+#include "parser/json/decoder/builtin.h"
+#include "parser/json/decoder/cjson.h"
+#include "parser/json/decoder/simd.h"
+#include "util/util.h"
+
+// JSON decoder benchmark, cJSON against built-in and SIMD
+// decoders (plain and json_document) and lazy decode with one
+// lookup, on generated asset index shaped document
+//
+// Usage: JSONBench [-n entries] [-r runs] [-o output] [file]
+// -n: Entries in generated document (default 50000, ~5 MB)
+// -r: Runs per decoder, best is reported (default 5)
+// -o: Only write generated document to `output` so same
+//     input can be given to other tools
+// file: Benchmark this document instead generating one
+
+#define DEFAULT_ENTRIES 50000
+#define DEFAULT_RUNS 5
+
+typedef int (*decode_func)(struct json_node** root, const char* data, size_t len);
+
+static const struct {
+  const char* name;
+  decode_func decode;
+} decoders[] = {
+  {"cJSON", json_decode_cjson},
+  {"cJSON document", json_decode_cjson_document},
+  {"Built-in", json_decode_builtin},
+  {"Built-in document", json_decode_builtin_document},
+  {"SIMD", json_decode_simd},
+  {"SIMD document", json_decode_simd_document},
+};
+
+static const char* assetDirs[] = {
+  "sounds/ambient/cave",
+  "sounds/mob/zombie",
+  "sounds/music/game",
+  "textures/block",
+  "lang"
+};
+
+// Fixed seed so every run generates same document
+static uint64_t nextRandom(uint64_t* state) {
+  *state ^= *state << 13;
+  *state ^= *state >> 7;
+  *state ^= *state << 17;
+  return *state;
+}
+
+static void printAssetKey(FILE* stream, size_t index) {
+  fprintf(stream, "minecraft/%s/asset%zu.ogg", assetDirs[index % ARRAY_SIZE(assetDirs)], index);
+}
+
+// Same shape as assets/indexes/<id>.json: {"objects": {path:
+// {"hash": sha1, "size": n}, ...}}
+static char* generateAssetIndex(size_t entries, size_t* len) {
+  char* data = NULL;
+  FILE* stream = open_memstream(&data, len);
+  if (!stream)
+    return NULL;
+
+  uint64_t state = 0x9E3779B97F4A7C15;
+  fputs("{\"objects\": {", stream);
+  for (size_t i = 0; i < entries; i++) {
+    fputs(i > 0 ? ", \"" : "\"", stream);
+    printAssetKey(stream, i);
+    fputs("\": {\"hash\": \"", stream);
+    for (int j = 0; j < 40; j++)
+      fputc("0123456789abcdef"[nextRandom(&state) & 0xF], stream);
+    fprintf(stream, "\", \"size\": %" PRIu64 "}", nextRandom(&state) % 4000000);
+  }
+  fputs("}}", stream);
+
+  if (fclose(stream) != 0) {
+    free(data);
+    return NULL;
+  }
+  return data;
+}
+
+static char* readFile(const char* path, size_t* len) {
+  FILE* file = fopen(path, "rb");
+  if (!file)
+    return NULL;
+
+  char* data = NULL;
+  FILE* stream = open_memstream(&data, len);
+  if (!stream)
+    goto open_memstream_error;
+
+  char buffer[64 * 1024];
+  size_t readSize;
+  while ((readSize = fread(buffer, 1, sizeof(buffer), file)) > 0)
+    fwrite(buffer, 1, readSize, stream);
+
+  bool failed = ferror(file);
+  if (fclose(stream) != 0 || failed) {
+    free(data);
+    data = NULL;
+  }
+open_memstream_error:
+  fclose(file);
+  return data;
+}
+
+static size_t heapInUse() {
+#ifdef HAVE_MALLINFO2
+  struct mallinfo2 info = mallinfo2();
+  return info.uordblks + info.hblkhd;
+#else
+  return 0;
+#endif
+}
+
+struct result {
+  double decodeTime;
+  double freeTime;
+  size_t heapSize;
+};
+
+static void keepBest(struct result* best, double decodeTime, double freeTime, size_t heapSize) {
+  if (decodeTime < best->decodeTime)
+    best->decodeTime = decodeTime;
+  if (freeTime < best->freeTime)
+    best->freeTime = freeTime;
+  best->heapSize = heapSize;
+}
+
+static int runDecoder(decode_func decode, const char* data, size_t len, int runs, struct result* best) {
+  *best = (struct result) {.decodeTime = 1e9, .freeTime = 1e9};
+  for (int i = 0; i < runs; i++) {
+    struct json_node* root = NULL;
+    size_t heapBefore = heapInUse();
+    double start = util_get_monotonic();
+    int res = decode(&root, data, len);
+    double decoded = util_get_monotonic();
+    size_t heap = heapInUse() - heapBefore;
+    if (res < 0)
+      return res;
+
+    json_free(root);
+    keepBest(best, decoded - start, util_get_monotonic() - decoded, heap);
+  }
+  return 0;
+}
+
+// Lazy decode only pays for what is looked up, so time it with
+// lookup of last entry (what reading one field of response does)
+static int runLazy(const char* data, size_t len, size_t entries, int runs, struct result* best) {
+  char* key = NULL;
+  size_t keyLen = 0;
+  FILE* stream = open_memstream(&key, &keyLen);
+  if (!stream)
+    return -ENOMEM;
+  if (entries > 0)
+    printAssetKey(stream, entries - 1);
+  if (fclose(stream) != 0)
+    return -ENOMEM;
+
+  int res = 0;
+  *best = (struct result) {.decodeTime = 1e9, .freeTime = 1e9};
+  for (int i = 0; i < runs; i++) {
+    struct json_node* root = NULL;
+    struct json_node* node = NULL;
+    size_t heapBefore = heapInUse();
+    double start = util_get_monotonic();
+    if ((res = json_decode_lazy(&root, data, len)) < 0)
+      break;
+    if (json_get_member(root, "objects", &node) >= 0 && entries > 0)
+      res = json_get_member(node, key, &node);
+    double decoded = util_get_monotonic();
+    size_t heap = heapInUse() - heapBefore;
+
+    json_free(root);
+    if (res < 0)
+      break;
+    keepBest(best, decoded - start, util_get_monotonic() - decoded, heap);
+  }
+
+  free(key);
+  return res;
+}
+
+static void printResult(const char* name, size_t len, struct result* result) {
+  printf("%-20s %9.2f ms %9.1f MB/s %9.2f ms", name, result->decodeTime * 1000, len / result->decodeTime / 1e6, result->freeTime * 1000);
+#ifdef HAVE_MALLINFO2
+  printf(" %9.1f MB", result->heapSize / 1e6);
+#endif
+  printf("\n");
+}
+
+int main(int argc, char** argv) {
+  size_t entries = DEFAULT_ENTRIES;
+  int runs = DEFAULT_RUNS;
+  const char* output = NULL;
+
+  int opt;
+  while ((opt = getopt(argc, argv, "n:r:o:")) != -1) {
+    switch (opt) {
+      case 'n':
+        entries = strtoull(optarg, NULL, 10);
+        break;
+      case 'r':
+        runs = atoi(optarg);
+        break;
+      case 'o':
+        output = optarg;
+        break;
+      default:
+        fprintf(stderr, "Usage: %s [-n entries] [-r runs] [-o output] [file]\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+  }
+  if (runs < 1)
+    runs = 1;
+
+  if (util_init() < 0) {
+    fprintf(stderr, "Cannot initialize util\n");
+    return EXIT_FAILURE;
+  }
+
+  int ret = EXIT_FAILURE;
+  size_t len = 0;
+  char* data;
+  if (optind < argc) {
+    // Lookup key in lazy run only exist in generated document
+    entries = 0;
+    data = readFile(argv[optind], &len);
+  } else {
+    data = generateAssetIndex(entries, &len);
+  }
+  if (!data) {
+    fprintf(stderr, "Cannot read or generate document: %s\n", strerror(errno));
+    goto no_document;
+  }
+
+  if (output) {
+    FILE* file = fopen(output, "wb");
+    bool written = file && fwrite(data, 1, len, file) == len;
+    if (file && fclose(file) != 0)
+      written = false;
+    
+    if (!written)
+      fprintf(stderr, "Cannot write '%s': %s\n", output, strerror(errno));
+    else
+      ret = EXIT_SUCCESS;
+    goto write_error;
+  }
+
+  printf("Document: %zu bytes, best of %d runs\n", len, runs);
+  printf("%-20s %12s %14s %12s", "Decoder", "Decode", "Throughput", "Free");
+#ifdef HAVE_MALLINFO2
+  printf(" %12s", "Heap");
+#endif
+  printf("\n");
+
+  struct result result;
+  for (size_t i = 0; i < ARRAY_SIZE(decoders); i++) {
+    int res = runDecoder(decoders[i].decode, data, len, runs, &result);
+    if (res < 0) {
+      printf("%-20s failed: %d\n", decoders[i].name, res);
+      continue;
+    }
+    printResult(decoders[i].name, len, &result);
+  }
+
+  int res = runLazy(data, len, entries, runs, &result);
+  if (res < 0)
+    printf("%-20s failed: %d\n", "Lazy + lookup", res);
+  else
+    printResult("Lazy + lookup", len, &result);
+  ret = EXIT_SUCCESS;
+
+write_error:
+  free(data);
+no_document:
+  util_cleanup();
+  return ret;
+}
@@ -20,6 +20,8 @@ set(BUILD_SOURCES
   src/auth/minecraft_auth.c
   src/auth/xsts_auth.c
   src/auth/xbl_like_auth.c
+  src/auth/batch_auth.c
+  src/auth/token_store.c
   
   src/minecraft_api/api.c
   src/minecraft_api/schema.c
@@ -27,15 +29,28 @@ set(BUILD_SOURCES
   src/stacktrace/provider/libbacktrace.c
   
   src/networking/http_request.c
+  src/networking/http_request_template.c
   src/networking/http_response.c
   src/networking/http_headers.c
+  src/networking/http_header_block.c
+  src/networking/http_content_decoder.c
+  src/networking/hpack.c
+  src/networking/http2.c
   src/networking/http_headers_serializer/normal.c
   src/networking/transport/transport_socket.c
   src/networking/transport/transport_ssl.c
   src/networking/transport/transport.c
   src/networking/networking.c
   src/networking/easy.c
+  src/networking/connection_pool.c
+  src/networking/http_pipeline.c
+  src/networking/http_body_sink.c
+  src/networking/async_connect.c
+  src/networking/async_http.c
+  src/networking/resolver.c
+  src/networking/happy_eyeballs.c
  
+  src/util/arena.c
   src/util/circular_buffer.c
   src/util/util.c
   src/util/uwuify.c
@@ -47,6 +62,7 @@ set(BUILD_SOURCES
   src/parser/json/json.c
   src/parser/json/decoder/builtin.c
   src/parser/json/decoder/cjson.c
+  src/parser/json/decoder/simd.c
   src/parser/json/decoder.c
   
   src/dummy.c
@@ -102,6 +118,14 @@ macro(AddDependencies)
   
   link_libraries(-lcrypto -lssl)
   
+  if (DEFINED CONFIG_NETWORKING_CONTENT_ENCODING)
+    link_libraries(-lz)
+  endif()
+  
+  if (DEFINED CONFIG_NETWORKING_CONTENT_ENCODING_BROTLI)
+    link_libraries(-lbrotlidec)
+  endif()
+  
   if (DEFINED CONFIG_STACKTRACE_USE_DLADDR)
     link_libraries(-ldl)
   endif()
@@ -0,0 +1,421 @@
+#include <errno.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "batch_auth.h"
+#include "bug.h"
+#include "config.h"
+#include "logging/logging.h"
+#include "microsoft_auth.h"
+#include "minecraft_auth.h"
+#include "minecraft_api/api.h"
+#include "util/util.h"
+#include "vec.h"
+#include "xbox_live_auth.h"
+#include "xsts_auth.h"
+
+static const char* stageNames[BATCH_AUTH_STAGE_COUNT] = {
+  [BATCH_AUTH_MICROSOFT] = "Microsoft",
+  [BATCH_AUTH_XBOX_LIVE] = "XBoxLive",
+  [BATCH_AUTH_XSTS] = "XSTS",
+  [BATCH_AUTH_MINECRAFT] = "Minecraft",
+  [BATCH_AUTH_PROFILE] = "Profile"
+};
+
+static const char* stageHosts[BATCH_AUTH_STAGE_COUNT] = {
+  [BATCH_AUTH_MICROSOFT] = CONFIG_MICROSOFT_LOGIN_HOSTNAME,
+  [BATCH_AUTH_XBOX_LIVE] = "user.auth.xboxlive.com",
+  [BATCH_AUTH_XSTS] = "xsts.auth.xboxlive.com",
+  [BATCH_AUTH_MINECRAFT] = CONFIG_MINECRAFT_API_HOSTNAME,
+  [BATCH_AUTH_PROFILE] = CONFIG_MINECRAFT_API_HOSTNAME
+};
+
+const char* batch_auth_stage_name(enum batch_auth_stage stage) {
+  if (stage < 0 || stage >= BATCH_AUTH_STAGE_COUNT)
+    return "Unknown";
+  return stageNames[stage];
+}
+
+// Accounts waiting for a host queue up on its slot and are
+// started in order as requests to it complete
+struct host_slot {
+  const char* hostname;
+  int inFlight;
+  vec_t(struct account_state*) waiting;
+};
+
+struct batch_context {
+  struct batch_auth_account* accounts;
+  size_t count;
+
+  pthread_mutex_t lock;
+  pthread_cond_t allFinished;
+  size_t finished;
+  vec_t(struct host_slot*) hosts;
+  int maxPerHost;
+};
+
+// One account's chain, each stage started from callback of
+// previous one (on I/O thread) so nothing waits on a thread
+struct account_state {
+  struct batch_context* ctx;
+  size_t index;
+  struct batch_auth_account* account;
+
+  enum batch_auth_stage stage;
+  double stageStart;
+
+  struct microsoft_auth_arg microsoftArg;
+  struct microsoft_auth_result* microsoftResult;
+  struct xbox_live_auth_result* xboxLiveResult;
+  struct xsts_auth_result* xstsResult;
+  struct minecraft_auth_result* minecraftAuthResult;
+  struct minecraft_api* minecraftAPI;
+};
+
+static struct host_slot* findHostSlot(struct batch_context* ctx, const char* hostname) {
+  struct host_slot* slot;
+  int i;
+  vec_foreach(&ctx->hosts, slot, i)
+    if (strcmp(slot->hostname, hostname) == 0)
+      return slot;
+  return NULL;
+}
+
+// Slots and their queues created upfront so queueing
+// an account never fails
+static int createHostSlots(struct batch_context* ctx) {
+  for (int stage = 0; stage < BATCH_AUTH_STAGE_COUNT; stage++) {
+    if (findHostSlot(ctx, stageHosts[stage]))
+      continue;
+
+    if (vec_reserve(&ctx->hosts, ctx->hosts.length + 1) < 0)
+      return -ENOMEM;
+
+    struct host_slot* slot = malloc(sizeof(*slot));
+    if (!slot)
+      return -ENOMEM;
+
+    *slot = (struct host_slot) {
+      .hostname = stageHosts[stage]
+    };
+    vec_init(&slot->waiting);
+    vec_push(&ctx->hosts, slot);
+    if (vec_reserve(&slot->waiting, ctx->count) < 0)
+      return -ENOMEM;
+  }
+  return 0;
+}
+
+static void startStage(struct account_state* self);
+
+// Return true if request can be sent now else `self` is
+// queued and started once other request to host completes
+static bool acquireHost(struct account_state* self) {
+  struct batch_context* ctx = self->ctx;
+  pthread_mutex_lock(&ctx->lock);
+  struct host_slot* slot = findHostSlot(ctx, stageHosts[self->stage]);
+  bool acquired = slot->inFlight < ctx->maxPerHost;
+  if (acquired)
+    slot->inFlight++;
+  else
+    vec_push(&slot->waiting, self);
+  pthread_mutex_unlock(&ctx->lock);
+  return acquired;
+}
+
+// Hand slot over to first waiting account if any
+static void releaseHost(struct batch_context* ctx, const char* hostname) {
+  pthread_mutex_lock(&ctx->lock);
+  struct host_slot* slot = findHostSlot(ctx, hostname);
+  struct account_state* next = NULL;
+  if (slot->waiting.length > 0) {
+    next = slot->waiting.data[0];
+    vec_splice(&slot->waiting, 0, 1);
+  } else {
+    slot->inFlight--;
+  }
+  pthread_mutex_unlock(&ctx->lock);
+
+  if (next)
+    startStage(next);
+}
+
+static void freeAccountState(struct account_state* self) {
+  microsoft_auth_free(self->microsoftResult);
+  xbox_live_free(self->xboxLiveResult);
+  xsts_free(self->xstsResult);
+  minecraft_auth_free(self->minecraftAuthResult);
+  minecraft_api_free(self->minecraftAPI);
+  free(self);
+}
+
+static void finishAccount(struct account_state* self, int res) {
+  struct batch_context* ctx = self->ctx;
+  struct batch_auth_account* account = self->account;
+  account->result = res;
+  if (res < 0)
+    pr_error("Account #%zu failed at %s stage: %d", self->index, batch_auth_stage_name(account->failedStage), res);
+  else
+    pr_info("Account #%zu logged in as %s (UUID: %s)", self->index, account->username, account->uuid);
+  freeAccountState(self);
+
+  // batch_auth_run may return right after, ctx not
+  // touched once unlocked
+  pthread_mutex_lock(&ctx->lock);
+  if (++ctx->finished == ctx->count)
+    pthread_cond_broadcast(&ctx->allFinished);
+  pthread_mutex_unlock(&ctx->lock);
+}
+
+// Stage's request completed, return true if chain continues
+static bool endStage(struct account_state* self, int res) {
+  self->account->stageTime[self->stage] = util_get_monotonic() - self->stageStart;
+  releaseHost(self->ctx, stageHosts[self->stage]);
+  if (res < 0) {
+    finishAccount(self, res);
+    return false;
+  }
+  return true;
+}
+
+static void runStage(struct account_state* self, enum batch_auth_stage stage) {
+  self->stage = stage;
+  self->account->failedStage = stage;
+  self->stageStart = util_get_monotonic();
+  if (acquireHost(self))
+    startStage(self);
+}
+
+static void onMicrosoftDone(void* udata, int res, struct microsoft_auth_result* result) {
+  struct account_state* self = udata;
+  self->microsoftResult = result;
+  if (res >= 0 && result->refreshToken && !(self->account->newRefreshToken = strdup(result->refreshToken)))
+    res = -ENOMEM;
+
+  if (endStage(self, res))
+    runStage(self, BATCH_AUTH_XBOX_LIVE);
+}
+
+static void onXboxLiveDone(void* udata, int res, struct xbox_live_auth_result* result) {
+  struct account_state* self = udata;
+  self->xboxLiveResult = result;
+  if (endStage(self, res))
+    runStage(self, BATCH_AUTH_XSTS);
+}
+
+static void onXstsDone(void* udata, int res, struct xsts_auth_result* result) {
+  struct account_state* self = udata;
+  self->xstsResult = result;
+  if (endStage(self, res))
+    runStage(self, BATCH_AUTH_MINECRAFT);
+}
+
+static void onMinecraftDone(void* udata, int res, struct minecraft_auth_result* result) {
+  struct account_state* self = udata;
+  self->minecraftAuthResult = result;
+  if (res >= 0) {
+    self->account->minecraftTokenExpire = result->expireTimestamp;
+    if (!(self->account->minecraftToken = strdup(result->token)) ||
+        !(self->minecraftAPI = minecraft_api_new(result->token)))
+      res = -ENOMEM;
+  }
+
+  if (endStage(self, res))
+    runStage(self, BATCH_AUTH_PROFILE);
+}
+
+static void onProfileDone(void* udata, enum minecraft_api_error_code apiRes) {
+  struct account_state* self = udata;
+  struct batch_auth_account* account = self->account;
+  int res = 0;
+  switch (apiRes) {
+    case MINECRAFT_API_OK:
+      account->username = strdup(self->minecraftAPI->callResult.profile.username);
+      account->uuid = strdup(self->minecraftAPI->callResult.profile.uuid);
+      if (!account->username || !account->uuid)
+        res = -ENOMEM;
+      break;
+    case MINECRAFT_API_NOT_FOUND:
+      res = -ENOENT;
+      break;
+    case MINECRAFT_API_NETWORK_ERROR:
+      res = self->minecraftAPI->lastError.errorNum;
+      break;
+    default:
+      res = -EINVAL;
+      break;
+  }
+
+  if (endStage(self, res))
+    finishAccount(self, 0);
+}
+
+// Send request of current stage, host slot already acquired
+static void startStage(struct account_state* self) {
+  int res = 0;
+  switch (self->stage) {
+    case BATCH_AUTH_MICROSOFT:
+      res = microsoft_auth_refresh_async(&self->microsoftArg, onMicrosoftDone, self);
+      break;
+    case BATCH_AUTH_XBOX_LIVE:
+      res = xbox_live_auth_async(self->microsoftResult->accessToken, onXboxLiveDone, self);
+      break;
+    case BATCH_AUTH_XSTS:
+      res = xsts_auth_async(self->xboxLiveResult->token, onXstsDone, self);
+      break;
+    case BATCH_AUTH_MINECRAFT:
+      res = minecraft_auth_async(self->xstsResult->userhash, self->xstsResult->token, onMinecraftDone, self);
+      break;
+    case BATCH_AUTH_PROFILE:
+      res = minecraft_api_get_profile_async(self->minecraftAPI, onProfileDone, self);
+      break;
+    default:
+      BUG();
+  }
+
+  // Callback won't be called, fail it here
+  if (res < 0)
+    endStage(self, res);
+}
+
+static void startAccount(struct batch_context* ctx, size_t index) {
+  struct batch_auth_account* account = &ctx->accounts[index];
+  struct account_state* self = malloc(sizeof(*self));
+  if (!self) {
+    account->result = -ENOMEM;
+    goto state_alloc_error;
+  }
+
+  *self = (struct account_state) {
+    .ctx = ctx,
+    .index = index,
+    .account = account,
+    .microsoftArg = {
+      .clientID = CONFIG_AUTH_AZURE_CLIENT_ID,
+      .tenant = "consumers",
+      .hostname = CONFIG_MICROSOFT_LOGIN_HOSTNAME,
+      .scope = "XboxLive.signin%20offline_access",
+      .refreshToken = account->refreshToken,
+
+      .protocol = MICROSOFT_AUTH_HTTPS,
+      .port = 443
+    }
+  };
+
+  // Device code flow needs user interaction
+  if (!account->refreshToken) {
+    account->failedStage = BATCH_AUTH_MICROSOFT;
+    finishAccount(self, -EINVAL);
+    return;
+  }
+
+  runStage(self, BATCH_AUTH_MICROSOFT);
+  return;
+
+state_alloc_error:
+  account->failedStage = BATCH_AUTH_MICROSOFT;
+  pr_error("Account #%zu failed at %s stage: %d", index, batch_auth_stage_name(account->failedStage), account->result);
+  pthread_mutex_lock(&ctx->lock);
+  ctx->finished++;
+  pthread_mutex_unlock(&ctx->lock);
+}
+
+static void collectStats(struct batch_context* ctx, struct batch_auth_stats* stats) {
+  for (size_t i = 0; i < ctx->count; i++) {
+    struct batch_auth_account* account = &ctx->accounts[i];
+    if (account->result < 0)
+      stats->failed++;
+    else
+      stats->succeeded++;
+
+    for (int stage = 0; stage < BATCH_AUTH_STAGE_COUNT; stage++) {
+      double time = account->stageTime[stage];
+      if (time <= 0)
+        continue;
+
+      stats->stageTotal[stage] += time;
+      stats->stageCount[stage]++;
+      if (time > stats->stageMax[stage])
+        stats->stageMax[stage] = time;
+    }
+  }
+}
+
+int batch_auth_run(struct batch_auth_account* accounts, size_t count, struct batch_auth_stats* stats) {
+  int res = 0;
+  for (size_t i = 0; i < count; i++) {
+    struct batch_auth_account* account = &accounts[i];
+    *account = (struct batch_auth_account) {
+      .refreshToken = account->refreshToken
+    };
+  }
+
+  struct batch_context ctx = {
+    .accounts = accounts,
+    .count = count,
+    .maxPerHost = CONFIG_AUTH_BATCH_MAX_PER_HOST
+  };
+  pthread_mutex_init(&ctx.lock, NULL);
+  pthread_cond_init(&ctx.allFinished, NULL);
+  vec_init(&ctx.hosts);
+
+  if ((res = createHostSlots(&ctx)) < 0)
+    goto create_host_slots_error;
+
+  // Every account started at once, host slots decide
+  // how many requests actually in flight
+  double startTime = util_get_monotonic();
+  for (size_t i = 0; i < count; i++)
+    startAccount(&ctx, i);
+
+  pthread_mutex_lock(&ctx.lock);
+  while (ctx.finished < count)
+    pthread_cond_wait(&ctx.allFinished, &ctx.lock);
+  pthread_mutex_unlock(&ctx.lock);
+
+  if (stats) {
+    *stats = (struct batch_auth_stats) {
+      .wallTime = util_get_monotonic() - startTime
+    };
+    collectStats(&ctx, stats);
+  }
+
+create_host_slots_error:;
+  struct host_slot* slot;
+  int i;
+  vec_foreach(&ctx.hosts, slot, i) {
+    vec_deinit(&slot->waiting);
+    free(slot);
+  }
+  vec_deinit(&ctx.hosts);
+  pthread_cond_destroy(&ctx.allFinished);
+  pthread_mutex_destroy(&ctx.lock);
+  return res;
+}
+
+void batch_auth_print_stats(struct batch_auth_stats* stats) {
+  pr_info("Batch auth: %d succeeded, %d failed in %.3lf s", stats->succeeded, stats->failed, stats->wallTime);
+  for (int stage = 0; stage < BATCH_AUTH_STAGE_COUNT; stage++) {
+    if (stats->stageCount[stage] == 0)
+      continue;
+
+    pr_info("  %-10s avg %.3lf s, max %.3lf s (%d accounts)",
+            batch_auth_stage_name(stage),
+            stats->stageTotal[stage] / stats->stageCount[stage],
+            stats->stageMax[stage],
+            stats->stageCount[stage]);
+  }
+}
+
+void batch_auth_account_cleanup(struct batch_auth_account* self) {
+  free(self->username);
+  free(self->uuid);
+  free(self->minecraftToken);
+  free(self->newRefreshToken);
+  self->username = NULL;
+  self->uuid = NULL;
+  self->minecraftToken = NULL;
+  self->newRefreshToken = NULL;
+}
@@ -0,0 +1,72 @@
+#ifndef _headers_1671700212_FluffyLauncher_batch_auth
+#define _headers_1671700212_FluffyLauncher_batch_auth
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Authenticate many accounts at once, each account's
+// Microsoft -> XBoxLive -> XSTS -> Minecraft -> profile
+// chain runs as asynchronous requests on I/O threads with
+// limited number of requests in flight to each host
+
+enum batch_auth_stage {
+  BATCH_AUTH_MICROSOFT,
+  BATCH_AUTH_XBOX_LIVE,
+  BATCH_AUTH_XSTS,
+  BATCH_AUTH_MINECRAFT,
+  BATCH_AUTH_PROFILE,
+
+  BATCH_AUTH_STAGE_COUNT
+};
+
+struct batch_auth_account {
+  // Input, required as device code flow
+  // needs user interaction
+  const char* refreshToken;
+
+  // Output (owned, freed by batch_auth_account_cleanup)
+  // 0 on success or negative errno from failed stage
+  // Errors:
+  // -EINVAL: No refresh token
+  // -ENOENT: Account doesn't own Minecraft
+  // -ENOMEM: Not enough memory
+  int result;
+  enum batch_auth_stage failedStage;
+
+  char* username;
+  char* uuid;
+  char* minecraftToken;
+  uint64_t minecraftTokenExpire;
+
+  // Refresh token given back by Microsoft (it may be rotated)
+  char* newRefreshToken;
+
+  // Seconds spent in each stage (including waiting for host slot)
+  double stageTime[BATCH_AUTH_STAGE_COUNT];
+};
+
+struct batch_auth_stats {
+  int succeeded;
+  int failed;
+  double wallTime;
+
+  double stageTotal[BATCH_AUTH_STAGE_COUNT];
+  double stageMax[BATCH_AUTH_STAGE_COUNT];
+  int stageCount[BATCH_AUTH_STAGE_COUNT];
+};
+
+// Blocks until every account is done, I/O threads must be
+// running. Failure of one account doesn't affect others,
+// result of each account stored into it
+// Return 0 on success (even if some accounts failed)
+// Errors:
+// -ENOMEM: Not enough memory
+[[nodiscard]]
+int batch_auth_run(struct batch_auth_account* accounts, size_t count, struct batch_auth_stats* stats);
+
+void batch_auth_print_stats(struct batch_auth_stats* stats);
+const char* batch_auth_stage_name(enum batch_auth_stage stage);
+void batch_auth_account_cleanup(struct batch_auth_account* self);
+
+#endif
+
@@ -60,3 +60,56 @@ void microsoft_auth_free(struct microsoft_auth_result* authResult) {
   free((char*) authResult->idToken);
   free(authResult);
 }
+
+struct microsoft_auth_async {
+  struct microsoft_auth_result* result;
+  struct microsoft_auth_stage2* stage2;
+  microsoft_auth_callback callback;
+  void* udata;
+};
+
+static void onStage2Done(void* udata, int res) {
+  struct microsoft_auth_async* ctx = udata;
+  struct microsoft_auth_result* result = ctx->result;
+  microsoft_auth_stage2_free(ctx->stage2);
+  if (res < 0) {
+    microsoft_auth_free(result);
+    result = NULL;
+  }
+  
+  ctx->callback(ctx->udata, res, result);
+  free(ctx);
+}
+
+int microsoft_auth_refresh_async(struct microsoft_auth_arg* arg, microsoft_auth_callback callback, void* udata) {
+  int res = 0;
+  struct microsoft_auth_async* ctx = malloc(sizeof(*ctx));
+  if (!ctx)
+    return -ENOMEM;
+  *ctx = (struct microsoft_auth_async) {
+    .callback = callback,
+    .udata = udata
+  };
+  
+  if (!(ctx->result = malloc(sizeof(*ctx->result)))) {
+    res = -ENOMEM;
+    goto result_alloc_error;
+  }
+  *ctx->result = (struct microsoft_auth_result) {};
+  
+  if (!(ctx->stage2 = microsoft_auth_stage2_new(ctx->result, arg, NULL))) {
+    res = -ENOMEM;
+    goto stage2_failure;
+  }
+  
+  if ((res = microsoft_auth_stage2_refresh_async(ctx->stage2, onStage2Done, ctx)) < 0)
+    goto stage2_failure;
+  return 0;
+
+stage2_failure:
+  microsoft_auth_stage2_free(ctx->stage2);
+  microsoft_auth_free(ctx->result);
+result_alloc_error:
+  free(ctx);
+  return res;
+}
@@ -41,5 +41,17 @@ struct microsoft_auth_arg {
 int microsoft_auth(struct microsoft_auth_result** result, struct microsoft_auth_arg* arg);
 void microsoft_auth_free(struct microsoft_auth_result* authResult);
 
+// Called once with same result as microsoft_auth and owned
+// `result` (NULL on failure)
+typedef void (*microsoft_auth_callback)(void* udata, int res, struct microsoft_auth_result* result);
+
+// microsoft_auth with `arg->refreshToken` on I/O threads,
+// device code flow waits for user so it's blocking only
+// `arg` must stay valid until `callback` called
+// Errors (returned, `callback` won't be called):
+// -EINVAL: No refresh token
+// -ENOMEM: Not enough memory
+int microsoft_auth_refresh_async(struct microsoft_auth_arg* arg, microsoft_auth_callback callback, void* udata);
+
 #endif
 
@@ -9,6 +9,7 @@
 
 #include "buffer.h"
 #include "bug.h"
+#include "networking/async_http.h"
 #include "networking/http_request.h"
 #include "networking/http_response.h"
 #include "networking/transport/transport.h"
@@ -64,10 +65,10 @@ static const struct json_schema stage2ResponseSchema = {
   }
 };
 
-static int process(struct microsoft_auth_stage2* self, char* body, size_t bodyLen) {
+static int process(struct microsoft_auth_stage2* self, int status, char* body, size_t bodyLen) {
   int res = 0;
   struct json_node* root = NULL;
-  if (json_decode_default(&root, body, bodyLen) < 0) {
+  if (json_decode_default_document(&root, body, bodyLen) < 0) {
     pr_critical("Failure parsing Microsoft server response body for token");
     res = -EINVAL;
     goto invalid_response;
@@ -96,6 +97,10 @@ static int process(struct microsoft_auth_stage2* self, char* body, size_t bodyLe
     } else if (strcmp(errorStr, "expired_token") == 0) {
       res = -ETIMEDOUT;
       goto token_not_ready;
+    } else if (status == 400 && (strcmp(errorStr, "invalid_grant") == 0 || strcmp(errorStr, "interaction_required") == 0)) {
+      // Refresh token revoked/expired, only this may discard it
+      res = -EKEYREJECTED;
+      goto token_not_ready;
     }
     
     if (strcmp(errorStr, "bad_verification_code") == 0)
@@ -130,44 +135,33 @@ invalid_response:
   return res;
 }
 
-static int tryGetToken(struct microsoft_auth_stage2* self, struct http_request* pollReq) {
-  int res = 0;
-  struct transport* connection;
-  if ((res = networking_easy_new_connection(true, self->arg->hostname, self->arg->port, &connection)) < 0)
-    goto error_new_connection;
-  
-  if ((res = http_request_send(pollReq, connection)) < 0)
-    goto send_request_error;
-  
-  char* responseBody = NULL;
-  size_t responseBodyLen = 0;
-  FILE* responseBodyFile = open_memstream(&responseBody, &responseBodyLen);
-  if (!responseBodyFile) {
-    res = -ENOMEM;
-    goto fail_open_memfd;
+// Check status of token response and process it
+static int handleResponse(struct microsoft_auth_stage2* self, int status, struct http_body_sink_memory* responseBody) {
+  if (status != 200 && status != 400) {
+    pr_critical("Authentication server responded with %d (200 or 400 was expected)", status);
+    return -EFAULT;
   }
   
-  res = http_response_recv(NULL, connection, responseBodyFile);
-  fclose(responseBodyFile);
+  int res = process(self, status, responseBody->data, responseBody->length);
   if (res < 0)
-    goto receive_error;
+    pr_critical("Error processing Microsoft authentication server response: %d", res);
+  return res;
+}
+
+static int tryGetToken(struct microsoft_auth_stage2* self, struct http_request* pollReq) {
+  int res = 0;
+  struct http_body_sink_memory responseBody;
+  http_body_sink_memory_init(&responseBody, JSON_DECODE_MAX_BYTES);
   
-  if (res != 200 && res != 400) {
-    pr_critical("Authentication server responded with %d (200 or 400 was expected)", res);
-    res = -EFAULT;
+  // Polling same host repeatedly so keep the connection alive
+  res = networking_easy_send_http(pollReq, NULL, true, self->arg->hostname, self->arg->port, &responseBody.super);
+  if (res < 0)
     goto receive_error;
-  }
   
   // Process poll response
-  res = process(self, responseBody, responseBodyLen);
-  if (res < 0)
-    pr_critical("Error processing Microsoft authentication server response: %d", res);
+  res = handleResponse(self, res, &responseBody);
 receive_error:
-  free(responseBody);
-fail_open_memfd:
-send_request_error:
-  connection->close(connection);
-error_new_connection:
+  http_body_sink_memory_cleanup(&responseBody);
   return res;
 }
 
@@ -191,6 +185,10 @@ static int devicodeAuth(struct microsoft_auth_stage2* self) {
   if (!pollRequest) 
     goto poll_request_creation_error;
   
+  // Same request sent on every poll
+  if ((res = http_request_compile(pollRequest)) < 0)
+    goto compile_error;
+  
   pr_alert("Open %s in your browser and provide %s code to authenticate", self->stage1->verificationURL, self->stage1->userCode);
   
   while (time(NULL) < self->stage1->expireTimestamp) {
@@ -209,6 +207,7 @@ static int devicodeAuth(struct microsoft_auth_stage2* self) {
   }
 
 poll_error:
+compile_error:
   free((char*) pollRequest->requestData);
   http_request_free(pollRequest);
 poll_request_creation_error:
@@ -223,33 +222,44 @@ location_creation_error:
   return res;
 }
 
-static int refreshTokenAuth(struct microsoft_auth_stage2* self) {
+// Request must be freed before `*location` as it only
+// points to it
+static int newRefreshRequest(struct microsoft_auth_stage2* self, char** location, struct http_request** request) {
   int res = 0;
-  char* location = NULL;
-  util_asprintf(&location, "/%s/oauth2/v2.0/token", self->arg->tenant);
-  if (!location) {
-    res = -ENOMEM;
-    goto location_creation_error;
-  }
+  *location = NULL;
+  util_asprintf(location, "/%s/oauth2/v2.0/token", self->arg->tenant);
+  if (!*location)
+    return -ENOMEM;
   
-  struct http_request* pollRequest;
   struct easy_http_headers headers[] = {
     {"Accept", "application/json"},
     {"Content-Type", "application/x-www-form-urlencoded"},
     {NULL, NULL}
   };
-  res = networking_easy_new_http(&pollRequest, HTTP_POST, self->arg->hostname, location, headers, "grant_type=refresh_token&client_id=%s&refresh_token=%s", self->arg->clientID, self->arg->refreshToken);  
-  if (res < 0) 
-    goto refresh_request_creation_error;
+  res = networking_easy_new_http(request, HTTP_POST, self->arg->hostname, *location, headers, "grant_type=refresh_token&client_id=%s&refresh_token=%s", self->arg->clientID, self->arg->refreshToken);  
+  if (!*request) {
+    free(*location);
+    return res < 0 ? res : -ENOMEM;
+  }
+  return 0;
+}
+
+static void freeRefreshRequest(char* location, struct http_request* request) {
+  free((char*) request->requestData);
+  http_request_free(request);
+  free(location);
+}
+
+static int refreshTokenAuth(struct microsoft_auth_stage2* self) {
+  int res = 0;
+  char* location;
+  struct http_request* refreshRequest;
+  if ((res = newRefreshRequest(self, &location, &refreshRequest)) < 0)
+    return res;
   
   pr_info("Authenticating via refresh token...");
-  res = tryGetToken(self, pollRequest);
-  
-  free((char*) pollRequest->requestData);
-  http_request_free(pollRequest);
-refresh_request_creation_error:
-  free(location);
-location_creation_error:
+  res = tryGetToken(self, refreshRequest);
+  freeRefreshRequest(location, refreshRequest);
   return res;
 }
 
@@ -258,7 +268,7 @@ int microsoft_auth_stage2_run(struct microsoft_auth_stage2* self) {
   if (self->arg->refreshToken) {
     BUG_ON(self->stage1);
     int res = refreshTokenAuth(self);
-    if (res >= 0)
+    if (res >= 0 || !self->stage1)
       return res;
   }
   
@@ -267,3 +277,54 @@ int microsoft_auth_stage2_run(struct microsoft_auth_stage2* self) {
   
   return devicodeAuth(self);
 }
+
+struct refresh_async {
+  struct microsoft_auth_stage2* stage2;
+  char* location;
+  struct http_request* request;
+  struct http_body_sink_memory responseBody;
+  microsoft_auth_stage2_callback callback;
+  void* udata;
+};
+
+static void onRefreshDone(void* udata, int res) {
+  struct refresh_async* ctx = udata;
+  if (res >= 0)
+    res = handleResponse(ctx->stage2, res, &ctx->responseBody);
+  
+  http_body_sink_memory_cleanup(&ctx->responseBody);
+  freeRefreshRequest(ctx->location, ctx->request);
+  ctx->callback(ctx->udata, res);
+  free(ctx);
+}
+
+int microsoft_auth_stage2_refresh_async(struct microsoft_auth_stage2* self, microsoft_auth_stage2_callback callback, void* udata) {
+  int res = 0;
+  if (!self->arg->refreshToken)
+    return -EINVAL;
+  
+  struct refresh_async* ctx = malloc(sizeof(*ctx));
+  if (!ctx)
+    return -ENOMEM;
+  *ctx = (struct refresh_async) {
+    .stage2 = self,
+    .callback = callback,
+    .udata = udata
+  };
+  http_body_sink_memory_init(&ctx->responseBody, JSON_DECODE_MAX_BYTES);
+  
+  if ((res = newRefreshRequest(self, &ctx->location, &ctx->request)) < 0)
+    goto request_creation_error;
+  
+  pr_info("Authenticating via refresh token...");
+  if ((res = networking_async_send_http(ctx->request, NULL, true, self->arg->hostname, self->arg->port, &ctx->responseBody.super, onRefreshDone, ctx)) < 0)
+    goto send_error;
+  return 0;
+
+send_error:
+  freeRefreshRequest(ctx->location, ctx->request);
+request_creation_error:
+  http_body_sink_memory_cleanup(&ctx->responseBody);
+  free(ctx);
+  return res;
+}
@@ -19,8 +19,18 @@ void microsoft_auth_stage2_free(struct microsoft_auth_stage2 *self);
 // Errors:
 // -EPERM: User declined authorization request 
 // -ETIMEDOUT: Device code expired out and user havent authenticate yet
+// -EKEYREJECTED: Server rejected the refresh token (invalid_grant/interaction_required)
 // -EFAULT: Catch it all error
 int microsoft_auth_stage2_run(struct microsoft_auth_stage2* self);
 
+typedef void (*microsoft_auth_stage2_callback)(void* udata, int res);
+
+// Refresh token part of microsoft_auth_stage2_run on I/O
+// threads, `callback` called from there with same result
+// Errors (returned, `callback` won't be called):
+// -EINVAL: No refresh token
+// -ENOMEM: Not enough memory
+int microsoft_auth_stage2_refresh_async(struct microsoft_auth_stage2* self, microsoft_auth_stage2_callback callback, void* udata);
+
 #endif
 
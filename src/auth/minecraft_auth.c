@@ -51,39 +51,49 @@ invalid_response:
   return res;
 }
 
+// Turn status code and JSON from server into result
+static int processResponse(struct minecraft_auth_result* self, int status, struct json_node* root) {
+  int res = status;
+  
+  // XSTS token rejected
+  if (status == 401)
+    res = -EKEYREJECTED;
+  else if (root == NULL)
+    res = -EINVAL;
+  else if (status == 200) 
+    res = processResult200(self, root);
+  
+  if (res < 0)
+    pr_critical("Error processing Minecraft services API response: %d", res);
+  return res;
+}
+
+static struct easy_http_headers requestHeaders[] = {
+  {"Accept", "application/json"},
+  {"Content-Type", "application/json"},
+  {NULL, NULL}
+};
+
+#define LOGIN_BODY_FORMAT "{\"identityToken\": \"XBL3.0 x=%s;%s\"}"
+
 int minecraft_auth(const char* userhash, const char* xstsToken, struct minecraft_auth_result** result) {
   int res = 0;
   struct minecraft_auth_result* self = malloc(sizeof(*self));
   *self = (struct minecraft_auth_result) {};
   
   struct json_node* responseJSON;
-  struct easy_http_headers headers[] = {
-    {"Accept", "application/json"},
-    {"Content-Type", "application/json"},
-    {NULL, NULL}
-  };
   res = networking_easy_do_json_http_rpc(&responseJSON,
                                          true,
                                          HTTP_POST, 
                                          CONFIG_MINECRAFT_API_HOSTNAME, 
                                          "/authentication/login_with_xbox",
-                                         headers,
-                                         "{\"identityToken\": \"XBL3.0 x=%s;%s\"}", userhash, xstsToken);
+                                         requestHeaders,
+                                         LOGIN_BODY_FORMAT, userhash, xstsToken);
   if (res < 0)
     goto request_error;
   
-  if (responseJSON == NULL) {
-    res = -EINVAL;
-    goto invalid_response;
-  }
-  
-  if (res == 200) 
-    res = processResult200(self, responseJSON);
+  res = processResponse(self, res, responseJSON);
   json_free(responseJSON);
-  
-invalid_response:
-  if (res < 0)
-    pr_critical("Error processing Minecraft services API response: %d", res);
 request_error:
   if (result && res >= 0)
     *result = self;
@@ -99,3 +109,59 @@ void minecraft_auth_free(struct minecraft_auth_result* self) {
   free((char*) self->token);
   free(self);
 }
+
+struct minecraft_auth_async {
+  struct minecraft_auth_result* result;
+  minecraft_auth_callback callback;
+  void* udata;
+};
+
+static void onResponse(void* udata, int res, struct json_node* root) {
+  struct minecraft_auth_async* ctx = udata;
+  struct minecraft_auth_result* self = ctx->result;
+  if (res >= 0)
+    res = processResponse(self, res, root);
+  json_free(root);
+  
+  if (res < 0) {
+    minecraft_auth_free(self);
+    self = NULL;
+  }
+  ctx->callback(ctx->udata, res, self);
+  free(ctx);
+}
+
+int minecraft_auth_async(const char* userhash, const char* xstsToken, minecraft_auth_callback callback, void* udata) {
+  int res = 0;
+  struct minecraft_auth_async* ctx = malloc(sizeof(*ctx));
+  if (!ctx)
+    return -ENOMEM;
+  *ctx = (struct minecraft_auth_async) {
+    .callback = callback,
+    .udata = udata
+  };
+  
+  if (!(ctx->result = malloc(sizeof(*ctx->result)))) {
+    res = -ENOMEM;
+    goto result_alloc_error;
+  }
+  *ctx->result = (struct minecraft_auth_result) {};
+  
+  res = networking_easy_do_json_http_rpc_async(onResponse,
+                                               ctx,
+                                               true,
+                                               HTTP_POST, 
+                                               CONFIG_MINECRAFT_API_HOSTNAME, 
+                                               "/authentication/login_with_xbox",
+                                               requestHeaders,
+                                               LOGIN_BODY_FORMAT, userhash, xstsToken);
+  if (res < 0)
+    goto request_error;
+  return 0;
+
+request_error:
+  minecraft_auth_free(ctx->result);
+result_alloc_error:
+  free(ctx);
+  return res;
+}
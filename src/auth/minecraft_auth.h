@@ -11,5 +11,15 @@ struct minecraft_auth_result {
 int minecraft_auth(const char* userhash, const char* xstsToken, struct minecraft_auth_result** result);
 void minecraft_auth_free(struct minecraft_auth_result* self);
 
+// Called once with same result as minecraft_auth and owned
+// `result` (NULL on failure)
+typedef void (*minecraft_auth_callback)(void* udata, int res, struct minecraft_auth_result* result);
+
+// Same as minecraft_auth, `callback` called from I/O thread
+// (see networking_easy_do_json_http_rpc_async)
+// Return 0 if started or negative errno where `callback`
+// won't be called
+int minecraft_auth_async(const char* userhash, const char* xstsToken, minecraft_auth_callback callback, void* udata);
+
 #endif
 
@@ -0,0 +1,366 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "token_store.h"
+#include "config.h"
+#include "logging/logging.h"
+#include "microsoft_auth.h"
+#include "minecraft_auth.h"
+#include "util/util.h"
+#include "xbox_live_auth.h"
+#include "xsts_auth.h"
+
+static const char* slotNames[TOKEN_STORE_SLOT_COUNT] = {
+  [TOKEN_STORE_MICROSOFT] = "microsoft",
+  [TOKEN_STORE_XBOX_LIVE] = "xbox_live",
+  [TOKEN_STORE_XSTS] = "xsts",
+  [TOKEN_STORE_MINECRAFT] = "minecraft"
+};
+
+static void clearToken(struct token_store_token* token) {
+  free(token->token);
+  free(token->userhash);
+  *token = (struct token_store_token) {};
+}
+
+// Values are stored one per line
+static bool isStorable(const char* value) {
+  return value == NULL || strpbrk(value, "\r\n") == NULL;
+}
+
+static int replaceString(char** field, const char* value) {
+  char* copy = NULL;
+  if (value && !(copy = strdup(value)))
+    return -ENOMEM;
+
+  free(*field);
+  *field = copy;
+  return 0;
+}
+
+static int parseLine(struct token_store* self, char* line) {
+  line[strcspn(line, "\r\n")] = '\0';
+  if (line[0] == '#' || line[0] == '\0')
+    return 0;
+
+  char* value = strchr(line, '=');
+  if (!value)
+    return 0;
+  *value = '\0';
+  value++;
+
+  if (strcmp(line, "refresh_token") == 0)
+    return replaceString(&self->refreshToken, value);
+
+  char* field = strchr(line, '.');
+  if (!field)
+    return 0;
+  *field = '\0';
+  field++;
+
+  for (int slot = 0; slot < TOKEN_STORE_SLOT_COUNT; slot++) {
+    if (strcmp(line, slotNames[slot]) != 0)
+      continue;
+
+    struct token_store_token* token = &self->tokens[slot];
+    if (strcmp(field, "token") == 0)
+      return replaceString(&token->token, value);
+    else if (strcmp(field, "userhash") == 0)
+      return replaceString(&token->userhash, value);
+    else if (strcmp(field, "expire") == 0)
+      token->expireTimestamp = strtoull(value, NULL, 10);
+    return 0;
+  }
+
+  // Unknown entries ignored so older version can read newer file
+  return 0;
+}
+
+int token_store_load(struct token_store* self, const char* path) {
+  int res = 0;
+  *self = (struct token_store) {};
+  if (!(self->path = strdup(path)))
+    return -ENOMEM;
+
+  FILE* file = fopen(path, "r");
+  if (!file) {
+    if (errno == ENOENT) {
+      pr_info("Token store '%s' doesn't exist yet, starting empty", path);
+      return 0;
+    }
+
+    pr_error("Cannot open token store '%s': %s", path, strerror(errno));
+    res = -EIO;
+    goto open_error;
+  }
+
+  char* line = NULL;
+  size_t lineSize = 0;
+  while (getline(&line, &lineSize, file) >= 0)
+    if ((res = parseLine(self, line)) < 0)
+      break;
+
+  if (res >= 0 && ferror(file))
+    res = -EIO;
+
+  free(line);
+  fclose(file);
+open_error:
+  if (res < 0)
+    token_store_cleanup(self);
+  return res;
+}
+
+static int writeContent(struct token_store* self, FILE* file) {
+  fprintf(file, "# FluffyLauncher token store, contains credentials keep it private\n");
+  if (self->refreshToken)
+    fprintf(file, "refresh_token=%s\n", self->refreshToken);
+
+  for (int slot = 0; slot < TOKEN_STORE_SLOT_COUNT; slot++) {
+    struct token_store_token* token = &self->tokens[slot];
+    if (!token->token)
+      continue;
+
+    fprintf(file, "%s.token=%s\n", slotNames[slot], token->token);
+    if (token->userhash)
+      fprintf(file, "%s.userhash=%s\n", slotNames[slot], token->userhash);
+    fprintf(file, "%s.expire=%" PRIu64 "\n", slotNames[slot], token->expireTimestamp);
+  }
+
+  if (fflush(file) != 0 || ferror(file) || fsync(fileno(file)) < 0)
+    return -EIO;
+  return 0;
+}
+
+int token_store_save(struct token_store* self) {
+  int res = 0;
+  char* tmpPath = NULL;
+  util_asprintf(&tmpPath, "%s.tmp", self->path);
+  if (!tmpPath)
+    return -ENOMEM;
+
+  int fd = open(tmpPath, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+  if (fd < 0) {
+    pr_error("Cannot create '%s': %s", tmpPath, strerror(errno));
+    res = -EIO;
+    goto open_error;
+  }
+
+  FILE* file = fdopen(fd, "w");
+  if (!file) {
+    close(fd);
+    res = -EIO;
+    goto fdopen_error;
+  }
+
+  res = writeContent(self, file);
+  if (fclose(file) != 0 && res >= 0)
+    res = -EIO;
+  if (res < 0)
+    goto write_error;
+
+  // Readers see either old or new store never partial one
+  if (rename(tmpPath, self->path) < 0) {
+    pr_error("Cannot replace token store '%s': %s", self->path, strerror(errno));
+    res = -EIO;
+    goto rename_error;
+  }
+
+  free(tmpPath);
+  return 0;
+
+rename_error:
+write_error:
+fdopen_error:
+  unlink(tmpPath);
+open_error:
+  free(tmpPath);
+  return res;
+}
+
+void token_store_cleanup(struct token_store* self) {
+  for (int slot = 0; slot < TOKEN_STORE_SLOT_COUNT; slot++)
+    clearToken(&self->tokens[slot]);
+  free(self->refreshToken);
+  free(self->path);
+  *self = (struct token_store) {};
+}
+
+bool token_store_is_valid(struct token_store* self, enum token_store_slot slot) {
+  struct token_store_token* token = &self->tokens[slot];
+  if (!token->token || token->expireTimestamp == 0)
+    return false;
+  if (slot == TOKEN_STORE_XBOX_LIVE || slot == TOKEN_STORE_XSTS)
+    if (!token->userhash)
+      return false;
+
+  return (uint64_t) time(NULL) + CONFIG_AUTH_TOKEN_EXPIRE_MARGIN < token->expireTimestamp;
+}
+
+int token_store_set(struct token_store* self, enum token_store_slot slot, const char* token, const char* userhash, uint64_t expireTimestamp) {
+  if (!isStorable(token) || !isStorable(userhash))
+    return -EINVAL;
+
+  struct token_store_token new = {
+    .token = token ? strdup(token) : NULL,
+    .userhash = userhash ? strdup(userhash) : NULL,
+    .expireTimestamp = expireTimestamp
+  };
+  if ((token && !new.token) || (userhash && !new.userhash)) {
+    clearToken(&new);
+    return -ENOMEM;
+  }
+
+  clearToken(&self->tokens[slot]);
+  self->tokens[slot] = new;
+  return 0;
+}
+
+int token_store_set_refresh_token(struct token_store* self, const char* refreshToken) {
+  if (!isStorable(refreshToken))
+    return -EINVAL;
+  return replaceString(&self->refreshToken, refreshToken);
+}
+
+void token_store_invalidate(struct token_store* self, enum token_store_slot slot) {
+  for (int i = slot; i < TOKEN_STORE_SLOT_COUNT; i++)
+    clearToken(&self->tokens[i]);
+}
+
+static int runMicrosoft(struct token_store* self) {
+  int res = 0;
+  struct microsoft_auth_arg arg = {
+    .clientID = CONFIG_AUTH_AZURE_CLIENT_ID,
+    .tenant = "consumers",
+    .hostname = CONFIG_MICROSOFT_LOGIN_HOSTNAME,
+    .scope = "XboxLive.signin%20offline_access",
+    .refreshToken = self->refreshToken,
+
+    .protocol = MICROSOFT_AUTH_HTTPS,
+    .port = 443
+  };
+
+  struct microsoft_auth_result* result = NULL;
+  if ((res = microsoft_auth(&result, &arg)) < 0)
+    return res;
+
+  if ((res = token_store_set(self, TOKEN_STORE_MICROSOFT, result->accessToken, NULL, result->expiresTimestamp)) < 0)
+    goto store_error;
+  if (result->refreshToken)
+    res = token_store_set_refresh_token(self, result->refreshToken);
+
+store_error:
+  microsoft_auth_free(result);
+  return res;
+}
+
+static int runXboxLive(struct token_store* self) {
+  int res = 0;
+  struct xbox_live_auth_result* result = NULL;
+  if ((res = xbox_live_auth(self->tokens[TOKEN_STORE_MICROSOFT].token, &result)) < 0)
+    return res;
+
+  if (!result->token)
+    res = -EINVAL;
+  else
+    res = token_store_set(self, TOKEN_STORE_XBOX_LIVE, result->token, result->userhash, result->expireTimestamp);
+  xbox_live_free(result);
+  return res;
+}
+
+static int runXSTS(struct token_store* self) {
+  int res = 0;
+  struct xsts_auth_result* result = NULL;
+  if ((res = xsts_auth(self->tokens[TOKEN_STORE_XBOX_LIVE].token, &result)) < 0)
+    return res;
+
+  if (!result->token)
+    res = -EINVAL;
+  else
+    res = token_store_set(self, TOKEN_STORE_XSTS, result->token, result->userhash, result->expireTimestamp);
+  xsts_free(result);
+  return res;
+}
+
+static int runMinecraft(struct token_store* self) {
+  int res = 0;
+  struct token_store_token* xsts = &self->tokens[TOKEN_STORE_XSTS];
+  struct minecraft_auth_result* result = NULL;
+  if ((res = minecraft_auth(xsts->userhash, xsts->token, &result)) < 0)
+    return res;
+
+  if (!result->token)
+    res = -EINVAL;
+  else
+    res = token_store_set(self, TOKEN_STORE_MINECRAFT, result->token, NULL, result->expireTimestamp);
+  minecraft_auth_free(result);
+  return res;
+}
+
+static int (*const stageRunners[TOKEN_STORE_SLOT_COUNT])(struct token_store*) = {
+  [TOKEN_STORE_MICROSOFT] = runMicrosoft,
+  [TOKEN_STORE_XBOX_LIVE] = runXboxLive,
+  [TOKEN_STORE_XSTS] = runXSTS,
+  [TOKEN_STORE_MINECRAFT] = runMinecraft
+};
+
+// Server refused the token (rather than network failing or
+// responding unexpectedly), stages report only that as -EKEYREJECTED
+static bool isRejected(int res) {
+  return res == -EKEYREJECTED;
+}
+
+int token_store_authenticate(struct token_store* self) {
+  int res = 0;
+
+  while (true) {
+    // Resume after the latest still valid token
+    int start = TOKEN_STORE_MICROSOFT;
+    for (int slot = TOKEN_STORE_MINECRAFT; slot >= TOKEN_STORE_MICROSOFT; slot--) {
+      if (token_store_is_valid(self, slot)) {
+        start = slot + 1;
+        break;
+      }
+    }
+
+    if (start == TOKEN_STORE_SLOT_COUNT) {
+      pr_info("Using cached Minecraft token");
+      return 0;
+    }
+    if (start > TOKEN_STORE_MICROSOFT)
+      pr_info("Using cached %s token", slotNames[start - 1]);
+
+    int slot;
+    for (slot = start; slot < TOKEN_STORE_SLOT_COUNT; slot++) {
+      pr_info("Authenticating with %s...", slotNames[slot]);
+      if ((res = stageRunners[slot](self)) < 0)
+        break;
+    }
+
+    if (res >= 0)
+      return 0;
+
+    pr_error("Fail to authenticate with %s: %d", slotNames[slot], res);
+    if (!isRejected(res))
+      return res;
+
+    if (slot == start && start > TOKEN_STORE_MICROSOFT) {
+      // Cached input got revoked, go back a stage
+      pr_notice("Cached %s token rejected, discarding it", slotNames[start - 1]);
+      token_store_invalidate(self, start - 1);
+    } else if (slot == TOKEN_STORE_MICROSOFT && self->refreshToken) {
+      // Fall back to device code flow
+      pr_notice("Refresh token rejected, discarding it");
+      free(self->refreshToken);
+      self->refreshToken = NULL;
+    } else {
+      return res;
+    }
+  }
+}
@@ -0,0 +1,79 @@
+#ifndef _headers_1671787551_FluffyLauncher_token_store
+#define _headers_1671787551_FluffyLauncher_token_store
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// Persistent cache of tokens along authentication chain so
+// next launch only redo stages whose token has expired
+
+enum token_store_slot {
+  TOKEN_STORE_MICROSOFT,
+  TOKEN_STORE_XBOX_LIVE,
+  TOKEN_STORE_XSTS,
+  TOKEN_STORE_MINECRAFT,
+
+  TOKEN_STORE_SLOT_COUNT
+};
+
+struct token_store_token {
+  char* token;
+
+  // Only for XBoxLive and XSTS
+  char* userhash;
+
+  // Unix timestamp, 0 if unknown (never considered valid)
+  uint64_t expireTimestamp;
+};
+
+struct token_store {
+  char* path;
+
+  // Microsoft's refresh token (outlive all other tokens)
+  char* refreshToken;
+  struct token_store_token tokens[TOKEN_STORE_SLOT_COUNT];
+};
+
+// Load store from `path`, missing file gives empty store
+// Errors:
+// -ENOMEM: Not enough memory
+// -EIO: I/O error
+[[nodiscard]]
+int token_store_load(struct token_store* self, const char* path);
+
+// Atomically replace file with current content (only readable
+// by owner as it contain credentials)
+// Errors:
+// -ENOMEM: Not enough memory
+// -EIO: I/O error
+[[nodiscard]]
+int token_store_save(struct token_store* self);
+
+void token_store_cleanup(struct token_store* self);
+
+// Token present and not expiring within CONFIG_AUTH_TOKEN_EXPIRE_MARGIN
+bool token_store_is_valid(struct token_store* self, enum token_store_slot slot);
+
+// Replace content of slot (strings are copied, userhash may be NULL)
+// Errors:
+// -ENOMEM: Not enough memory
+[[nodiscard]]
+int token_store_set(struct token_store* self, enum token_store_slot slot, const char* token, const char* userhash, uint64_t expireTimestamp);
+[[nodiscard]]
+int token_store_set_refresh_token(struct token_store* self, const char* refreshToken);
+
+// Forget `slot` and every slot after it (they were derived from it)
+void token_store_invalidate(struct token_store* self, enum token_store_slot slot);
+
+// Run authentication chain starting after last valid cached
+// token and update store, Minecraft token is in
+// self->tokens[TOKEN_STORE_MINECRAFT] on success
+// Errors:
+// -ENOMEM: Not enough memory
+// Other errors from stage which failed (-EKEYREJECTED is handled
+// by discarding the rejected token and retrying)
+[[nodiscard]]
+int token_store_authenticate(struct token_store* self);
+
+#endif
+
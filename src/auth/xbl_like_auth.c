@@ -40,6 +40,39 @@ static const struct json_schema xblLike200ResponseSchema = {
   }
 };
 
+struct xbl_like_expire_response {
+  buffer_t* notAfter;
+};
+
+// Optional so loaded seperately
+static const struct json_schema xblLikeExpireSchema = {
+  .entries = {
+    JSON_SCHEMA_ENTRY("$.NotAfter", JSON_STRING, struct xbl_like_expire_response, notAfter),
+    {}
+  }
+};
+
+// Parse "2022-12-06T05:36:32.1234567Z" into unix timestamp
+static int parseTimestamp(const char* string, uint64_t* result) {
+  int year, month, day, hour, minute, second;
+  if (sscanf(string, "%d-%d-%dT%d:%d:%d", &year, &month, &day, &hour, &minute, &second) != 6)
+    return -EINVAL;
+  if (year < 1970 || month < 1 || month > 12 || day < 1 || day > 31 ||
+      hour < 0 || hour > 23 || minute < 0 || minute > 59 || second < 0 || second > 60)
+    return -EINVAL;
+  
+  // Days from civil (timegm isn't POSIX)
+  int y = month <= 2 ? year - 1 : year;
+  int era = y / 400;
+  int yearOfEra = y - era * 400;
+  int dayOfYear = (153 * (month > 2 ? month - 3 : month + 9) + 2) / 5 + day - 1;
+  int dayOfEra = yearOfEra * 365 + yearOfEra / 4 - yearOfEra / 100 + dayOfYear;
+  int64_t days = (int64_t) era * 146097 + dayOfEra - 719468;
+  
+  *result = (uint64_t) days * 86400 + hour * 3600 + minute * 60 + second;
+  return 0;
+}
+
 static int processResult200(struct xbl_like_auth_result* self, struct json_node* root) {
   int res = 0;
   struct xbl_like_200_response response = {};
@@ -54,6 +87,13 @@ static int processResult200(struct xbl_like_auth_result* self, struct json_node*
   if (response.displayclaims_xui->array.length >= 2)
     pr_warn("There are more than one entry in $.DisplayClaims.xui array");
   
+  struct xbl_like_expire_response expire = {};
+  if (json_schema_load(&xblLikeExpireSchema, root, &expire) != 0 ||
+      parseTimestamp(buffer_string(expire.notAfter), &self->expireTimestamp) < 0) {
+    pr_warn("XBL like server response has no valid NotAfter, token wont be cached");
+    self->expireTimestamp = 0;
+  }
+  
   self->token = strdup(buffer_string(response.token));
   self->userhash = strdup(buffer_string(response.userhash));
   if (!self->token || !self->userhash) {
@@ -78,8 +118,9 @@ static const struct json_schema xblLike401ResponseSchema = {
 
 static int processResult401(struct xbl_like_auth_result* self, struct json_node* root) {
   int res = 0;
+  // 401 without XErr body is the input token being rejected
   if (root == NULL) {
-    res = -EINVAL;
+    res = -EKEYREJECTED;
     goto invalid_response;
   }
   
@@ -119,38 +160,45 @@ invalid_response:
   return res;
 }
 
+// Turn status code and JSON from server into result
+static int processResponse(struct xbl_like_auth_result* self, int status, struct json_node* root) {
+  int res = status;
+  if (status == 200)
+    res = processResult200(self, root);
+  else if (status == 401)
+    res = processResult401(self, root); 
+  else
+    pr_critical("Unexpected XBL like server responded with %d", status);
+  
+  if (res < 0)
+    pr_critical("Error processing XBL like server response: %d", res);
+  return res;
+}
+
+static struct easy_http_headers requestHeaders[] = {
+  {"Accept", "application/json"},
+  {"Content-Type", "application/json"},
+  {NULL, NULL}
+};
+
 int xbl_like_auth(const char* hostname, const char* location, const char* requestBody, struct xbl_like_auth_result* result) {
   int res = 0;
   struct xbl_like_auth_result self = (struct xbl_like_auth_result) {};
   
-  struct easy_http_headers headers[] = {
-    {"Accept", "application/json"},
-    {"Content-Type", "application/json"},
-    {NULL, NULL}
-  };
-  
   struct json_node* responseJson;
   res = networking_easy_do_json_http_rpc(&responseJson, 
                                          true,
                                          HTTP_POST, 
                                          hostname, 
                                          location, 
-                                         headers,
+                                         requestHeaders,
                                          "%s",
                                          requestBody);
   if (res < 0)
     goto request_error;
   
-  if (res == 200)
-    res = processResult200(&self, responseJson);
-  else if (res == 401)
-    res = processResult401(&self, responseJson); 
-  else if (res >= 0)
-    pr_critical("Unexpected XBL like server responded with %d", res);
+  res = processResponse(&self, res, responseJson);
   json_free(responseJson);
-  
-  if (res < 0)
-    pr_critical("Error processing XBL like server response: %d", res);
 request_error: 
   if (result && res >= 0)
     *result = self;  
@@ -159,5 +207,45 @@ request_error:
   return res;
 }
 
+struct xbl_like_auth_async {
+  xbl_like_auth_callback callback;
+  void* udata;
+};
+
+static void onResponse(void* udata, int res, struct json_node* root) {
+  struct xbl_like_auth_async* ctx = udata;
+  struct xbl_like_auth_result self = (struct xbl_like_auth_result) {};
+  if (res >= 0)
+    res = processResponse(&self, res, root);
+  json_free(root);
+  
+  ctx->callback(ctx->udata, res, res >= 0 ? &self : NULL);
+  if (res < 0)
+    xbl_like_auth_free(&self);
+  free(ctx);
+}
 
+int xbl_like_auth_async(const char* hostname, const char* location, const char* requestBody, xbl_like_auth_callback callback, void* udata) {
+  int res = 0;
+  struct xbl_like_auth_async* ctx = malloc(sizeof(*ctx));
+  if (!ctx)
+    return -ENOMEM;
+  *ctx = (struct xbl_like_auth_async) {
+    .callback = callback,
+    .udata = udata
+  };
+  
+  res = networking_easy_do_json_http_rpc_async(onResponse,
+                                               ctx,
+                                               true,
+                                               HTTP_POST, 
+                                               hostname, 
+                                               location, 
+                                               requestHeaders,
+                                               "%s",
+                                               requestBody);
+  if (res < 0)
+    free(ctx);
+  return res;
+}
 
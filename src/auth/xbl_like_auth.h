@@ -6,6 +6,9 @@
 struct xbl_like_auth_result {
   const char* token;
   const char* userhash;
+  
+  // From NotAfter or 0 if server didn't tell
+  uint64_t expireTimestamp;
 };
 
 enum xbl_error {
@@ -18,5 +21,16 @@ enum xbl_error {
 
 int xbl_like_auth(const char* hostname, const char* location, const char* requestBody, struct xbl_like_auth_result* result);
 
+// Called once with same result as xbl_like_auth, on success
+// callee owns strings in `result` (struct itself only valid
+// during the call) else `result` is NULL
+typedef void (*xbl_like_auth_callback)(void* udata, int res, struct xbl_like_auth_result* result);
+
+// Same as xbl_like_auth but `callback` called from I/O
+// thread once done (see networking_easy_do_json_http_rpc_async)
+// Return 0 if started or negative errno where `callback`
+// won't be called
+int xbl_like_auth_async(const char* hostname, const char* location, const char* requestBody, xbl_like_auth_callback callback, void* udata);
+
 #endif
 
@@ -6,13 +6,7 @@
 #include "xbox_live_auth.h"
 #include "util/util.h"
 
-int xbox_live_auth(const char* microsoftToken, struct xbox_live_auth_result** result) {
-  int res = 0;
-  struct xbox_live_auth_result* self = malloc(sizeof(*self));
-  if (!self)
-    return -ENOMEM;
-  *self = (struct xbox_live_auth_result) {};
-  
+static char* newRequestBody(const char* microsoftToken) {
   char* requestBody = NULL;
   util_asprintf(&requestBody, 
 "{ \
@@ -24,7 +18,17 @@ int xbox_live_auth(const char* microsoftToken, struct xbox_live_auth_result** re
   \"RelyingParty\": \"http://auth.xboxlive.com\", \
   \"TokenType\": \"JWT\" \
 }", microsoftToken);
+  return requestBody;
+}
 
+int xbox_live_auth(const char* microsoftToken, struct xbox_live_auth_result** result) {
+  int res = 0;
+  struct xbox_live_auth_result* self = malloc(sizeof(*self));
+  if (!self)
+    return -ENOMEM;
+  *self = (struct xbox_live_auth_result) {};
+  
+  char* requestBody = newRequestBody(microsoftToken);
   if (!requestBody) {
     res = -ENOMEM;
     goto request_body_creation_error;
@@ -37,6 +41,7 @@ int xbox_live_auth(const char* microsoftToken, struct xbox_live_auth_result** re
   
   self->token = xblLikeAuthResult.token;
   self->userhash = xblLikeAuthResult.userhash;
+  self->expireTimestamp = xblLikeAuthResult.expireTimestamp;
 xbl_like_auth_error:
   free(requestBody);
 request_body_creation_error:
@@ -55,3 +60,62 @@ void xbox_live_free(struct xbox_live_auth_result* self) {
   free((char*) self->token);
   free(self);
 }
+
+struct xbox_live_auth_async {
+  struct xbox_live_auth_result* result;
+  xbox_live_auth_callback callback;
+  void* udata;
+};
+
+static void onXblLikeAuthDone(void* udata, int res, struct xbl_like_auth_result* xblLikeAuthResult) {
+  struct xbox_live_auth_async* ctx = udata;
+  struct xbox_live_auth_result* self = ctx->result;
+  if (res >= 0) {
+    self->token = xblLikeAuthResult->token;
+    self->userhash = xblLikeAuthResult->userhash;
+    self->expireTimestamp = xblLikeAuthResult->expireTimestamp;
+  } else {
+    xbox_live_free(self);
+    self = NULL;
+  }
+  
+  ctx->callback(ctx->udata, res, self);
+  free(ctx);
+}
+
+int xbox_live_auth_async(const char* microsoftToken, xbox_live_auth_callback callback, void* udata) {
+  int res = 0;
+  struct xbox_live_auth_async* ctx = malloc(sizeof(*ctx));
+  if (!ctx)
+    return -ENOMEM;
+  *ctx = (struct xbox_live_auth_async) {
+    .callback = callback,
+    .udata = udata
+  };
+  
+  if (!(ctx->result = malloc(sizeof(*ctx->result)))) {
+    res = -ENOMEM;
+    goto result_alloc_error;
+  }
+  *ctx->result = (struct xbox_live_auth_result) {};
+  
+  // Body only needed until request is serialized
+  char* requestBody = newRequestBody(microsoftToken);
+  if (!requestBody) {
+    res = -ENOMEM;
+    goto request_body_creation_error;
+  }
+  
+  res = xbl_like_auth_async("user.auth.xboxlive.com", "/user/authenticate", requestBody, onXblLikeAuthDone, ctx);
+  free(requestBody);
+  if (res < 0)
+    goto xbl_like_auth_error;
+  return 0;
+
+xbl_like_auth_error:
+request_body_creation_error:
+  xbox_live_free(ctx->result);
+result_alloc_error:
+  free(ctx);
+  return res;
+}
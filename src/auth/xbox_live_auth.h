@@ -1,13 +1,26 @@
 #ifndef _headers_1668950532_FluffyLauncher_xbox_live_auth
 #define _headers_1668950532_FluffyLauncher_xbox_live_auth
 
+#include <stdint.h>
+
 struct xbox_live_auth_result {
   const char* token;
   const char* userhash;
+  uint64_t expireTimestamp;
 };
 
 int xbox_live_auth(const char* microsoftToken, struct xbox_live_auth_result** result);
 void xbox_live_free(struct xbox_live_auth_result* self);
 
+// Called once with same result as xbox_live_auth and owned
+// `result` (NULL on failure)
+typedef void (*xbox_live_auth_callback)(void* udata, int res, struct xbox_live_auth_result* result);
+
+// Same as xbox_live_auth, `callback` called from I/O thread
+// (see xbl_like_auth_async)
+// Return 0 if started or negative errno where `callback`
+// won't be called
+int xbox_live_auth_async(const char* microsoftToken, xbox_live_auth_callback callback, void* udata);
+
 #endif
 
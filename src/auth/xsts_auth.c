@@ -6,13 +6,7 @@
 #include "xsts_auth.h"
 #include "util/util.h"
 
-int xsts_auth(const char* xblToken, struct xsts_auth_result** result) {
-  int res = 0;
-  struct xsts_auth_result* self = malloc(sizeof(*self));
-  if (!self)
-    return -ENOMEM;
-  *self = (struct xsts_auth_result) {};
-  
+static char* newRequestBody(const char* xblToken) {
   char* requestBody = NULL;
   util_asprintf(&requestBody, 
 "{ \
@@ -25,7 +19,17 @@ int xsts_auth(const char* xblToken, struct xsts_auth_result** result) {
   \"RelyingParty\": \"rp://api.minecraftservices.com/\", \
   \"TokenType\": \"JWT\" \
 }", xblToken);
+  return requestBody;
+}
 
+int xsts_auth(const char* xblToken, struct xsts_auth_result** result) {
+  int res = 0;
+  struct xsts_auth_result* self = malloc(sizeof(*self));
+  if (!self)
+    return -ENOMEM;
+  *self = (struct xsts_auth_result) {};
+  
+  char* requestBody = newRequestBody(xblToken);
   if (!requestBody) {
     res = -ENOMEM;
     goto request_body_creation_error;
@@ -38,6 +42,7 @@ int xsts_auth(const char* xblToken, struct xsts_auth_result** result) {
   
   self->token = xblLikeAuthResult.token;
   self->userhash = xblLikeAuthResult.userhash;
+  self->expireTimestamp = xblLikeAuthResult.expireTimestamp;
 xbl_like_auth_error:
   free(requestBody);
 request_body_creation_error:
@@ -56,3 +61,62 @@ void xsts_free(struct xsts_auth_result* self) {
   free((char*) self->token);
   free(self);
 }
+
+struct xsts_auth_async {
+  struct xsts_auth_result* result;
+  xsts_auth_callback callback;
+  void* udata;
+};
+
+static void onXblLikeAuthDone(void* udata, int res, struct xbl_like_auth_result* xblLikeAuthResult) {
+  struct xsts_auth_async* ctx = udata;
+  struct xsts_auth_result* self = ctx->result;
+  if (res >= 0) {
+    self->token = xblLikeAuthResult->token;
+    self->userhash = xblLikeAuthResult->userhash;
+    self->expireTimestamp = xblLikeAuthResult->expireTimestamp;
+  } else {
+    xsts_free(self);
+    self = NULL;
+  }
+  
+  ctx->callback(ctx->udata, res, self);
+  free(ctx);
+}
+
+int xsts_auth_async(const char* xblToken, xsts_auth_callback callback, void* udata) {
+  int res = 0;
+  struct xsts_auth_async* ctx = malloc(sizeof(*ctx));
+  if (!ctx)
+    return -ENOMEM;
+  *ctx = (struct xsts_auth_async) {
+    .callback = callback,
+    .udata = udata
+  };
+  
+  if (!(ctx->result = malloc(sizeof(*ctx->result)))) {
+    res = -ENOMEM;
+    goto result_alloc_error;
+  }
+  *ctx->result = (struct xsts_auth_result) {};
+  
+  // Body only needed until request is serialized
+  char* requestBody = newRequestBody(xblToken);
+  if (!requestBody) {
+    res = -ENOMEM;
+    goto request_body_creation_error;
+  }
+  
+  res = xbl_like_auth_async("xsts.auth.xboxlive.com", "/xsts/authorize", requestBody, onXblLikeAuthDone, ctx);
+  free(requestBody);
+  if (res < 0)
+    goto xbl_like_auth_error;
+  return 0;
+
+xbl_like_auth_error:
+request_body_creation_error:
+  xsts_free(ctx->result);
+result_alloc_error:
+  free(ctx);
+  return res;
+}
@@ -1,13 +1,26 @@
 #ifndef _headers_1669033884_FluffyLauncher_xsts_auth
 #define _headers_1669033884_FluffyLauncher_xsts_auth
 
+#include <stdint.h>
+
 struct xsts_auth_result {
   const char* token;
   const char* userhash;
+  uint64_t expireTimestamp;
 };
 
 int xsts_auth(const char* xblToken, struct xsts_auth_result** result);
 void xsts_free(struct xsts_auth_result* self);
 
+// Called once with same result as xsts_auth and owned
+// `result` (NULL on failure)
+typedef void (*xsts_auth_callback)(void* udata, int res, struct xsts_auth_result* result);
+
+// Same as xsts_auth, `callback` called from I/O thread
+// (see xbl_like_auth_async)
+// Return 0 if started or negative errno where `callback`
+// won't be called
+int xsts_auth_async(const char* xblToken, xsts_auth_callback callback, void* udata);
+
 #endif
 
@@ -1,55 +1,541 @@
-/*
-#include <stdlib.h>
-#include <sys/select.h>
 #include <errno.h>
-#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
 #include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
 
+#include "config.h"
 #include "io_threads.h"
+#include "bug.h"
+#include "panic.h"
+#include "util/util.h"
 #include "vec.h"
 
-struct custom_file_descriptor {
-  // If this descriptor being handled one would win and
-  // other threads go back waiting with poll
-  atomic_bool isBeingHandled;
-  int fd;
-  
-  struct file_operations* ops; 
-};
-
-enum control_code {
-  CONTROL_UNSET,
-  CONTROL_UPDATE,
-};
+#if IS_ENABLED(CONFIG_IO_THREADS_USE_EPOLL)
+# include <sys/epoll.h>
+#endif
 
 static pthread_t* threads = NULL;
-static vec_int_t descriptorsToWatch;
-static int controlWriteFD = -1;
-static int controlReadFD = -1;
+static int threadCount = 0;
+static atomic_bool isStopping = false;
+static pthread_mutex_t startLock = PTHREAD_MUTEX_INITIALIZER;
+
+// Written to wake up threads (stopping or poll set changed)
+static int wakeReadFD = -1;
+static int wakeWriteFD = -1;
+
+static void wakeThreads() {
+  char dummy = 0;
+  while (write(wakeWriteFD, &dummy, 1) < 0 && errno == EINTR)
+    ;
+}
+
+void io_watch_init(struct io_watch* self, int fd, io_watch_callback callback, void* udata) {
+  *self = (struct io_watch) {
+    .fd = fd,
+    .callback = callback,
+    .udata = udata
+  };
+}
+
+#if IS_ENABLED(CONFIG_IO_THREADS_USE_EPOLL)
+// Every thread waits on same epoll instance and EPOLLONESHOT
+// makes sure only one thread gets an event of a watch
+static int epollFD = -1;
+
+static int toEpollEvents(int events) {
+  int result = EPOLLONESHOT;
+  if (events & IO_EVENT_READ)
+    result |= EPOLLIN | EPOLLRDHUP;
+  if (events & IO_EVENT_WRITE)
+    result |= EPOLLOUT;
+  return result;
+}
+
+static int fromEpollEvents(int events) {
+  int result = 0;
+  if (events & (EPOLLIN | EPOLLRDHUP))
+    result |= IO_EVENT_READ;
+  if (events & EPOLLOUT)
+    result |= IO_EVENT_WRITE;
+  if (events & (EPOLLERR | EPOLLHUP))
+    result |= IO_EVENT_ERROR;
+  return result;
+}
+
+static int backendInit() {
+  epollFD = epoll_create1(EPOLL_CLOEXEC);
+  if (epollFD < 0)
+    return -errno;
+
+  // Level triggered without oneshot, so all threads see stop request
+  struct epoll_event event = {
+    .events = EPOLLIN,
+    .data.ptr = NULL
+  };
+  if (epoll_ctl(epollFD, EPOLL_CTL_ADD, wakeReadFD, &event) < 0) {
+    close(epollFD);
+    epollFD = -1;
+    return -errno;
+  }
+  return 0;
+}
+
+static void backendCleanup() {
+  close(epollFD);
+  epollFD = -1;
+}
+
+int io_watch_arm(struct io_watch* self, int events) {
+  if (epollFD < 0)
+    return -EINVAL;
+
+  struct epoll_event event = {
+    .events = toEpollEvents(events),
+    .data.ptr = self
+  };
+
+  // Another I/O thread may run (and free) the watch as soon
+  // as epoll_ctl returns, so nothing touches it after that
+  int op = self->isRegistered ? EPOLL_CTL_MOD : EPOLL_CTL_ADD;
+  self->armedEvents = events;
+  self->isRegistered = true;
+  if (epoll_ctl(epollFD, op, self->fd, &event) < 0) {
+    self->isRegistered = op == EPOLL_CTL_MOD;
+    return errno == ENOMEM || errno == ENOSPC ? -ENOMEM : -EINVAL;
+  }
+  return 0;
+}
+
+void io_watch_remove(struct io_watch* self) {
+  if (!self->isRegistered)
+    return;
+
+  epoll_ctl(epollFD, EPOLL_CTL_DEL, self->fd, NULL);
+  self->isRegistered = false;
+  self->armedEvents = 0;
+}
+
+static void* ioThread(void* udata) {
+  struct epoll_event event;
+  while (!atomic_load(&isStopping)) {
+    int res = epoll_wait(epollFD, &event, 1, -1);
+    if (res < 0 && errno != EINTR)
+      panic("epoll_wait failed: %d", errno);
+    if (res <= 0)
+      continue;
 
-int io_threads_start(int threadCount) {
-  vec_init(&descriptorsToWatch);
-  
+    // Wake pipe
+    if (event.data.ptr == NULL)
+      continue;
+
+    struct io_watch* watch = event.data.ptr;
+    watch->armedEvents = 0;
+    watch->callback(watch, fromEpollEvents(event.events));
+  }
+  return NULL;
+}
+#else
+// Leader/followers: one thread at a time polls on behalf of
+// all others, dispatching outside the lock so other thread can
+// take over polling meanwhile
+static pthread_mutex_t pollerLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t watchesLock = PTHREAD_MUTEX_INITIALIZER;
+static vec_t(struct io_watch*) watches;
+
+static void drainWakePipe() {
+  char dummy[64];
+  while (read(wakeReadFD, dummy, sizeof(dummy)) > 0)
+    ;
+}
+
+static int backendInit() {
+  vec_init(&watches);
+  return 0;
+}
+
+static void backendCleanup() {
+  vec_deinit(&watches);
+}
+
+int io_watch_arm(struct io_watch* self, int events) {
+  if (threads == NULL)
+    return -EINVAL;
+
+  pthread_mutex_lock(&watchesLock);
+  if (!self->isRegistered) {
+    if (vec_reserve(&watches, watches.length + 1) < 0) {
+      pthread_mutex_unlock(&watchesLock);
+      return -ENOMEM;
+    }
+    vec_push(&watches, self);
+    self->isRegistered = true;
+  }
+  self->armedEvents = events;
+  pthread_mutex_unlock(&watchesLock);
+
+  // Current poller need to include this
+  wakeThreads();
+  return 0;
+}
+
+void io_watch_remove(struct io_watch* self) {
+  pthread_mutex_lock(&watchesLock);
+  if (self->isRegistered)
+    vec_remove(&watches, self);
+  self->isRegistered = false;
+  self->armedEvents = 0;
+  pthread_mutex_unlock(&watchesLock);
+}
+
+static int toPollEvents(int events) {
+  int result = 0;
+  if (events & IO_EVENT_READ)
+    result |= POLLIN;
+  if (events & IO_EVENT_WRITE)
+    result |= POLLOUT;
+  return result;
+}
+
+static int fromPollEvents(int events) {
+  int result = 0;
+  if (events & POLLIN)
+    result |= IO_EVENT_READ;
+  if (events & POLLOUT)
+    result |= IO_EVENT_WRITE;
+  if (events & (POLLERR | POLLHUP | POLLNVAL))
+    result |= IO_EVENT_ERROR;
+  return result;
+}
+
+// Poll once and take one ready watch (disarmed) or NULL
+static struct io_watch* pollOnce(struct pollfd** pollFds, struct io_watch*** pollWatches, size_t* capacity) {
+  pthread_mutex_lock(&watchesLock);
+  size_t count = 1;
+  if ((size_t) watches.length + 1 > *capacity) {
+    size_t newCapacity = watches.length + 1;
+    struct pollfd* newFds = realloc(*pollFds, newCapacity * sizeof(**pollFds));
+    if (newFds)
+      *pollFds = newFds;
+    struct io_watch** newWatches = realloc(*pollWatches, newCapacity * sizeof(**pollWatches));
+    if (newWatches)
+      *pollWatches = newWatches;
+    if (!newFds || !newWatches) {
+      pthread_mutex_unlock(&watchesLock);
+      return NULL;
+    }
+    *capacity = newCapacity;
+  }
+
+  (*pollFds)[0] = (struct pollfd) {
+    .fd = wakeReadFD,
+    .events = POLLIN
+  };
+
+  struct io_watch* watch;
+  int i;
+  vec_foreach(&watches, watch, i) {
+    if (watch->armedEvents == 0)
+      continue;
+
+    (*pollFds)[count] = (struct pollfd) {
+      .fd = watch->fd,
+      .events = toPollEvents(watch->armedEvents)
+    };
+    (*pollWatches)[count] = watch;
+    count++;
+  }
+  pthread_mutex_unlock(&watchesLock);
+
+  int res = poll(*pollFds, count, -1);
+  if (res < 0 && errno != EINTR)
+    panic("poll failed: %d", errno);
+  if (res <= 0)
+    return NULL;
+
+  if ((*pollFds)[0].revents)
+    drainWakePipe();
+
+  struct io_watch* ready = NULL;
+  pthread_mutex_lock(&watchesLock);
+  for (size_t i = 1; i < count; i++) {
+    struct io_watch* current = (*pollWatches)[i];
+    if ((*pollFds)[i].revents == 0 || current->armedEvents == 0)
+      continue;
+
+    // Keep revents for dispatch, other ready watches would be
+    // picked on next poll by whoever leads
+    current->armedEvents = 0;
+    (*pollFds)[0].revents = (*pollFds)[i].revents;
+    ready = current;
+    break;
+  }
+  pthread_mutex_unlock(&watchesLock);
+  return ready;
+}
+
+static void* ioThread(void* udata) {
+  struct pollfd* pollFds = NULL;
+  struct io_watch** pollWatches = NULL;
+  size_t capacity = 0;
+
+  while (!atomic_load(&isStopping)) {
+    pthread_mutex_lock(&pollerLock);
+    struct io_watch* ready = NULL;
+    if (!atomic_load(&isStopping))
+      ready = pollOnce(&pollFds, &pollWatches, &capacity);
+    int events = ready ? fromPollEvents(pollFds[0].revents) : 0;
+    pthread_mutex_unlock(&pollerLock);
+
+    if (ready)
+      ready->callback(ready, events);
+  }
+
+  free(pollFds);
+  free(pollWatches);
+  return NULL;
+}
+#endif
+
+// Timers for both backends on one thread, sorted list isn't
+// worth it for the few timers in flight at once
+static pthread_t timerThread;
+static bool hasTimerThread = false;
+static pthread_mutex_t timerLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t timerChanged;
+static pthread_cond_t timerFinished = PTHREAD_COND_INITIALIZER;
+static vec_t(struct io_timer*) timers;
+static struct io_timer* runningTimer = NULL;
+
+void io_timer_init(struct io_timer* self, io_timer_callback callback, void* udata) {
+  *self = (struct io_timer) {
+    .callback = callback,
+    .udata = udata
+  };
+}
+
+int io_timer_start(struct io_timer* self, double deadline) {
   int res = 0;
-  threads = calloc(threadCount, sizeof(*threads));
-  if (!threads)
-    return -ENOMEM;
-  
-  int controlPipe[2] = {0, 0};
-  res = pipe(controlPipe);
-  if (res < 0)
-    goto fail_to_create_control_pipe;
-  controlWriteFD = controlPipe[0];
-  controlReadFD = controlPipe[1];
-  
-fail_to_create_control_pipe:
+  pthread_mutex_lock(&timerLock);
+  if (!hasTimerThread) {
+    res = -EINVAL;
+    goto start_error;
+  }
+
+  if (!self->isPending) {
+    if (vec_reserve(&timers, timers.length + 1) < 0) {
+      res = -ENOMEM;
+      goto start_error;
+    }
+    vec_push(&timers, self);
+    self->isPending = true;
+  }
+  self->deadline = deadline;
+  pthread_cond_signal(&timerChanged);
+
+start_error:
+  pthread_mutex_unlock(&timerLock);
+  return res;
+}
+
+bool io_timer_cancel(struct io_timer* self) {
+  pthread_mutex_lock(&timerLock);
+  bool wasPending = self->isPending;
+  if (wasPending) {
+    vec_remove(&timers, self);
+    self->isPending = false;
+  }
+
+  while (runningTimer == self && !pthread_equal(pthread_self(), timerThread))
+    pthread_cond_wait(&timerFinished, &timerLock);
+  pthread_mutex_unlock(&timerLock);
+  return wasPending;
+}
+
+static struct timespec toTimespec(double time) {
+  time_t seconds = (time_t) time;
+  return (struct timespec) {
+    .tv_sec = seconds,
+    .tv_nsec = (long) ((time - (double) seconds) * 1000000000.0)
+  };
+}
+
+static void* timerThreadMain(void* udata) {
+  pthread_mutex_lock(&timerLock);
+  while (!atomic_load(&isStopping)) {
+    struct io_timer* earliest = NULL;
+    int earliestIndex = 0;
+    struct io_timer* timer;
+    int i;
+    vec_foreach(&timers, timer, i) {
+      if (earliest && earliest->deadline <= timer->deadline)
+        continue;
+      earliest = timer;
+      earliestIndex = i;
+    }
+
+    if (!earliest) {
+      pthread_cond_wait(&timerChanged, &timerLock);
+      continue;
+    }
+
+    if (util_get_monotonic() < earliest->deadline) {
+      struct timespec until = toTimespec(earliest->deadline);
+      pthread_cond_timedwait(&timerChanged, &timerLock, &until);
+      continue;
+    }
+
+    vec_splice(&timers, earliestIndex, 1);
+    earliest->isPending = false;
+    runningTimer = earliest;
+    pthread_mutex_unlock(&timerLock);
+
+    earliest->callback(earliest);
+
+    pthread_mutex_lock(&timerLock);
+    runningTimer = NULL;
+    pthread_cond_broadcast(&timerFinished);
+  }
+  pthread_mutex_unlock(&timerLock);
+  return NULL;
+}
+
+// Timed waits use same clock as util_get_monotonic
+static int startTimerThread() {
+  int res = 0;
+  pthread_condattr_t attr;
+  pthread_condattr_init(&attr);
+  pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+  res = -pthread_cond_init(&timerChanged, &attr);
+  pthread_condattr_destroy(&attr);
   if (res < 0)
-    io_threads_stop();
+    return res;
+
+  vec_init(&timers);
+  if ((res = util_thread_create(&timerThread, NULL, timerThreadMain, NULL)) < 0) {
+    vec_deinit(&timers);
+    pthread_cond_destroy(&timerChanged);
+    return res;
+  }
+  util_set_thread_name(timerThread, "IO-Timer");
+
+  pthread_mutex_lock(&timerLock);
+  hasTimerThread = true;
+  pthread_mutex_unlock(&timerLock);
+  return 0;
+}
+
+// Pending timers are dropped without calling them
+static void stopTimerThread() {
+  if (!hasTimerThread)
+    return;
+
+  // Signalled under lock so thread can't miss it between
+  // checking isStopping and waiting
+  pthread_mutex_lock(&timerLock);
+  hasTimerThread = false;
+  pthread_cond_signal(&timerChanged);
+  pthread_mutex_unlock(&timerLock);
+  pthread_join(timerThread, NULL);
+
+  struct io_timer* timer;
+  int i;
+  vec_foreach(&timers, timer, i)
+    timer->isPending = false;
+  vec_deinit(&timers);
+  pthread_cond_destroy(&timerChanged);
+}
+
+int io_threads_start(int count) {
+  int res = 0;
+  if (count <= 0)
+    return -EINVAL;
+
+  pthread_mutex_lock(&startLock);
+  if (threads) {
+    res = -EINVAL;
+    goto already_started;
+  }
+
+  atomic_store(&isStopping, false);
+  int wakePipe[2];
+  if (pipe(wakePipe) < 0) {
+    res = -errno;
+    goto create_wake_pipe_error;
+  }
+  wakeReadFD = wakePipe[0];
+  wakeWriteFD = wakePipe[1];
+  fcntl(wakeReadFD, F_SETFL, O_NONBLOCK);
+  fcntl(wakeWriteFD, F_SETFL, O_NONBLOCK);
+
+  if ((res = backendInit()) < 0)
+    goto backend_init_error;
+
+  if ((res = startTimerThread()) < 0)
+    goto start_timer_thread_error;
+
+  threads = calloc(count, sizeof(*threads));
+  if (!threads) {
+    res = -ENOMEM;
+    goto alloc_threads_error;
+  }
+
+  for (threadCount = 0; threadCount < count; threadCount++) {
+    if ((res = util_thread_create(&threads[threadCount], NULL, ioThread, NULL)) < 0)
+      goto create_thread_error;
+
+    char name[32];
+    snprintf(name, sizeof(name), "IO-Thread-%d", threadCount);
+    util_set_thread_name(threads[threadCount], name);
+  }
+
+  pthread_mutex_unlock(&startLock);
+  return 0;
+
+create_thread_error:
+  pthread_mutex_unlock(&startLock);
+  io_threads_stop();
+  return res;
+
+alloc_threads_error:
+  atomic_store(&isStopping, true);
+  stopTimerThread();
+start_timer_thread_error:
+  backendCleanup();
+backend_init_error:
+  close(wakeReadFD);
+  close(wakeWriteFD);
+  wakeReadFD = wakeWriteFD = -1;
+create_wake_pipe_error:
+already_started:
+  pthread_mutex_unlock(&startLock);
   return res;
 }
 
 void io_threads_stop() {
-  vec_deinit(&descriptorsToWatch);
+  pthread_mutex_lock(&startLock);
+  if (!threads)
+    goto not_started;
+
+  atomic_store(&isStopping, true);
+  wakeThreads();
+  for (int i = 0; i < threadCount; i++)
+    pthread_join(threads[i], NULL);
+  stopTimerThread();
+
   free(threads);
+  threads = NULL;
+  threadCount = 0;
+
+  backendCleanup();
+  close(wakeReadFD);
+  close(wakeWriteFD);
+  wakeReadFD = wakeWriteFD = -1;
+not_started:
+  pthread_mutex_unlock(&startLock);
 }
-*/
\ No newline at end of file
+
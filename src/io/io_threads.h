@@ -1,12 +1,22 @@
 #ifndef _headers_1667913843_FluffyLauncher_io_thread
 #define _headers_1667913843_FluffyLauncher_io_thread
 
-// For the purpose of emulating
-// file descriptors with custom read/write
+// I/O reactor: pool of threads waiting for readiness of
+// watched file descriptors (epoll or poll based) and run
+// callback of ready ones, plus one timer thread for
+// deadlines. Also for the purpose of emulating file
+// descriptors with custom read/write
 
+#include <stdbool.h>
 #include <stddef.h>
 #include <sys/types.h>
 
+#define IO_EVENT_READ  0b0001
+#define IO_EVENT_WRITE 0b0010
+
+// Only reported, always waited
+#define IO_EVENT_ERROR 0b0100
+
 struct file_operations {
   // Same prototype as read/write/close in unistd.h
   ssize_t (*read)(struct file_operations* self, void* buffer, size_t readSize);
@@ -14,6 +24,24 @@ struct file_operations {
   int (*close)(struct file_operations* self);
 };
 
+struct io_watch;
+
+// Called from one of I/O threads with events occured
+// Watch is disarmed while callback runs so no two threads
+// run it at same time, call io_watch_arm to wait again or
+// io_watch_remove if done with it
+typedef void (*io_watch_callback)(struct io_watch* self, int events);
+
+struct io_watch {
+  int fd;
+  io_watch_callback callback;
+  void* udata;
+
+  // Private to io threads
+  int armedEvents;
+  bool isRegistered;
+};
+
 // Return 0 on success
 // Errors:
 // -ENOMEM: Not enough memory
@@ -22,6 +50,53 @@ struct file_operations {
 int io_threads_start(int threadCount);
 void io_threads_stop();
 
+void io_watch_init(struct io_watch* self, int fd, io_watch_callback callback, void* udata);
+
+// Wait for `events` once (callback called once then
+// disarmed again), callback may already run on other I/O
+// thread before this returns
+// Return 0 on success
+// Errors:
+// -EINVAL: I/O threads not started
+// -ENOMEM: Not enough memory
+[[nodiscard]]
+int io_watch_arm(struct io_watch* self, int events);
+
+// Stop watching, must not be armed (e.g. called from own
+// callback) and after this the watch can be freed
+void io_watch_remove(struct io_watch* self);
+
+struct io_timer;
+
+// Called from timer thread once, should only do quick work
+// (e.g. shutdown() a socket so its watch fires)
+typedef void (*io_timer_callback)(struct io_timer* self);
+
+struct io_timer {
+  io_timer_callback callback;
+  void* udata;
+
+  // Private to io threads
+  double deadline;
+  bool isPending;
+};
+
+void io_timer_init(struct io_timer* self, io_timer_callback callback, void* udata);
+
+// Call callback once at `deadline` (util_get_monotonic time),
+// starting pending timer again moves its deadline
+// Return 0 on success
+// Errors:
+// -EINVAL: I/O threads not started
+// -ENOMEM: Not enough memory
+[[nodiscard]]
+int io_timer_start(struct io_timer* self, double deadline);
+
+// Stop timer and wait for its callback if its running (except
+// when called from the callback) so timer can be freed after
+// Return true if timer was pending
+bool io_timer_cancel(struct io_timer* self);
+
 // Return normal fd of type being faked
 [[nodiscard]]
 int io_fake_file_fd(struct file_operations* ops);
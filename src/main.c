@@ -1,3 +1,4 @@
+#include <fcntl.h>
 #include <pthread.h>
 #include <stdlib.h>
 #include <stdio.h>
@@ -7,10 +8,14 @@
 #include <string.h>
 #include <signal.h>
 #include <threads.h>
+#include <unistd.h>
+#include <sys/stat.h>
 
+#include "auth/batch_auth.h"
 #include "auth/microsoft_auth.h"
 #include "logging/logging.h"
 #include "auth/minecraft_auth.h"
+#include "auth/token_store.h"
 #include "auth/xbox_live_auth.h"
 #include "auth/xsts_auth.h"
 #include "buffer.h"
@@ -19,8 +24,10 @@
 #include "minecraft_api/api.h"
 #include "networking/http_headers.h"
 #include "networking/http_request.h"
+#include "networking/connection_pool.h"
 #include "io/io_threads.h"
 #include "networking/networking.h"
+#include "networking/resolver.h"
 #include "networking/transport/transport.h"
 #include "networking/transport/transport_socket.h"
 #include "networking/transport/transport_ssl.h"
@@ -31,6 +38,7 @@
 #include "parser/json/json.h"
 #include "util/util.h"
 #include "util/circular_buffer.h"
+#include "vec.h"
 
 static atomic_bool shuttingDown = false;
 static pthread_t loggerThread;
@@ -62,12 +70,39 @@ static int init() {
   OpenSSL_add_all_ciphers();
   OpenSSL_add_all_digests();
   
+  if ((res = transport_ssl_init()) < 0) {
+    pr_emerg("Cannot initialize TLS: %d", res);
+    return res;
+  }
+  
+  // Writing to connection closed by server shouldn't kill us
+  signal(SIGPIPE, SIG_IGN);
+  
+  if ((res = resolver_init()) < 0) {
+    pr_emerg("Cannot start resolver: %d", res);
+    return res;
+  }
+  
+  if ((res = connection_pool_init()) < 0) {
+    pr_emerg("Cannot initialize connection pool: %d", res);
+    return res;
+  }
+  
+  if ((res = io_threads_start(CONFIG_IO_THREADS_COUNT)) < 0) {
+    pr_emerg("Cannot start I/O threads: %d", res);
+    return res;
+  }
+  
   stacktrace_init();
   return res;
 }
 
 static void shutdown() {
   stacktrace_cleanup();
+  connection_pool_cleanup();
+  io_threads_stop();
+  resolver_cleanup();
+  transport_ssl_cleanup();
   atomic_store(&shuttingDown, true);
   pr_info("Shutting down logger thread. Good bye UwU!");
   pthread_join(loggerThread, NULL);
@@ -80,64 +115,235 @@ static void sigHandler(int sig) {
   panic("Signal %d occured -w-", sig);
 }
 
-int main2(int argc, char** argv) {
-  int initResult = init();
-  if (initResult < 0) {
-    pr_emerg("Failure initializing launcher");
-    return EXIT_FAILURE;
+// Refresh tokens are credentials so they are read from file
+// instead of command line which other users can see in ps
+static FILE* openTokenFile(const char* path) {
+  if (strcmp(path, "-") == 0)
+    return stdin;
+  
+  int fd = open(path, O_RDONLY | O_CLOEXEC);
+  if (fd < 0) {
+    pr_error("Cannot open '%s': %s", path, strerror(errno));
+    return NULL;
   }
   
-  //signal(SIGSEGV, sigHandler);
+  struct stat info;
+  if (fstat(fd, &info) < 0) {
+    pr_error("Cannot stat '%s': %s", path, strerror(errno));
+    goto unsafe_file;
+  }
   
-  struct microsoft_auth_result* microsoftResult = NULL;
+  if (info.st_mode & (S_IRWXG | S_IRWXO)) {
+    pr_error("'%s' is accessible by other users, chmod it to 0600", path);
+    goto unsafe_file;
+  }
   
-  struct microsoft_auth_arg arg = {
-    .clientID = CONFIG_AUTH_AZURE_CLIENT_ID,
-    .tenant = "consumers",
-    .hostname = CONFIG_MICROSOFT_LOGIN_HOSTNAME,
-    .scope = "XboxLive.signin%20offline_access",
-    .refreshToken = NULL,
+  FILE* file = fdopen(fd, "r");
+  if (file)
+    return file;
+unsafe_file:
+  close(fd);
+  return NULL;
+}
+
+// One refresh token per line, empty and '#' lines ignored
+static int readRefreshTokens(const char* path, vec_str_t* tokens) {
+  int res = 0;
+  FILE* file = openTokenFile(path);
+  if (!file)
+    return -EIO;
+  
+  char* line = NULL;
+  size_t lineSize = 0;
+  while (getline(&line, &lineSize, file) >= 0) {
+    line[strcspn(line, "\r\n")] = '\0';
+    if (line[0] == '\0' || line[0] == '#')
+      continue;
     
-    .protocol = MICROSOFT_AUTH_HTTPS,
-    .port = 443
-  };
+    // vec_push always evaluates to 0 so reserve first to catch ENOMEM
+    char* token = strdup(line);
+    if (!token || vec_reserve(tokens, tokens->length + 1) < 0) {
+      free(token);
+      res = -ENOMEM;
+      break;
+    }
+    vec_push(tokens, token);
+  }
   
-  pr_info("Authenticating with Microsoft...");
-  int res = microsoft_auth(&microsoftResult, &arg);
-  if (res < 0) {
-    pr_error("Fail to authenticate with Microsoft: %d", res);
-    goto microsoft_auth_failure;
+  if (res >= 0 && ferror(file))
+    res = -EIO;
+  
+  // Don't leave credential around in freed memory
+  if (line)
+    memset(line, 0, lineSize);
+  free(line);
+  if (file != stdin)
+    fclose(file);
+  return res;
+}
+
+static void writeTokens(FILE* file, struct batch_auth_account* accounts, int count) {
+  for (int i = 0; i < count; i++)
+    fprintf(file, "%s\n", accounts[i].newRefreshToken ? accounts[i].newRefreshToken : accounts[i].refreshToken);
+}
+
+// Microsoft rotates refresh tokens so old ones go stale, token
+// file is replaced with current token of each account (in same
+// order, comments aren't kept) or they are printed to stdout one
+// per line if tokens came from stdin
+static int saveRefreshTokens(const char* path, struct batch_auth_account* accounts, int count) {
+  if (strcmp(path, "-") == 0) {
+    writeTokens(stdout, accounts, count);
+    return fflush(stdout) != 0 ? -EIO : 0;
   }
-  pr_info("Sucessfully authenticated with Microsoft!"); 
   
-  pr_info("Authenticating with XBoxLive..."); 
-  struct xbox_live_auth_result* xboxLiveResult = NULL;
-  res = xbox_live_auth(microsoftResult->accessToken, &xboxLiveResult);
-  if (res < 0) {
-    pr_error("Fail to authenticate with XBoxLive: %d", res);
-    goto xbl_auth_failure;
+  bool rotated = false;
+  for (int i = 0; i < count; i++)
+    if (accounts[i].newRefreshToken && strcmp(accounts[i].newRefreshToken, accounts[i].refreshToken) != 0)
+      rotated = true;
+  if (!rotated)
+    return 0;
+  
+  int res = 0;
+  char* tmpPath = NULL;
+  util_asprintf(&tmpPath, "%s.tmp", path);
+  if (!tmpPath)
+    return -ENOMEM;
+  
+  int fd = open(tmpPath, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+  if (fd < 0) {
+    pr_error("Cannot create '%s': %s", tmpPath, strerror(errno));
+    res = -EIO;
+    goto open_error;
   }
-  pr_info("Sucessfully authenticated with XBoxLive!"); 
   
-  pr_info("Authenticating with XSTS..."); 
-  struct xsts_auth_result* xstsResult = NULL;
-  res = xsts_auth(xboxLiveResult->token, &xstsResult);
-  if (res < 0) {
-    pr_error("Fail to authenticate with XSTS: %d", res);
-    goto xsts_auth_failure;
+  FILE* file = fdopen(fd, "w");
+  if (!file) {
+    close(fd);
+    res = -EIO;
+    goto write_error;
+  }
+  
+  writeTokens(file, accounts, count);
+  if (fflush(file) != 0 || ferror(file) || fsync(fileno(file)) < 0)
+    res = -EIO;
+  if (fclose(file) != 0 && res >= 0)
+    res = -EIO;
+  if (res < 0)
+    goto write_error;
+  
+  if (rename(tmpPath, path) < 0) {
+    pr_error("Cannot replace '%s': %s", path, strerror(errno));
+    res = -EIO;
+    goto write_error;
   }
-  pr_info("Sucessfully authenticated with XSTS!"); 
+  
+  free(tmpPath);
+  return 0;
+
+write_error:
+  unlink(tmpPath);
+open_error:
+  free(tmpPath);
+  return res;
+}
 
-  pr_info("Authenticating with Minecraft...");
-  struct minecraft_auth_result* minecraftAuthResult = NULL;
-  res = minecraft_auth(xstsResult->userhash, xstsResult->token, &minecraftAuthResult);
+// `path` contains refresh token of each account ("-" for stdin)
+static int batchLogin(const char* path) {
+  int res = 0;
+  vec_str_t refreshTokens;
+  vec_init(&refreshTokens);
+  if ((res = readRefreshTokens(path, &refreshTokens)) < 0) {
+    pr_error("Fail to read refresh tokens from '%s': %d", path, res);
+    goto read_failure;
+  }
+  
+  int count = refreshTokens.length;
+  if (count == 0) {
+    pr_error("No refresh token in '%s'", path);
+    res = -EINVAL;
+    goto read_failure;
+  }
+  
+  struct batch_auth_account* accounts = calloc(count, sizeof(*accounts));
+  if (!accounts) {
+    res = -ENOMEM;
+    goto read_failure;
+  }
+  
+  for (int i = 0; i < count; i++)
+    accounts[i].refreshToken = refreshTokens.data[i];
+  
+  pr_info("Authenticating %d accounts...", count);
+  struct batch_auth_stats stats;
+  if ((res = batch_auth_run(accounts, count, &stats)) < 0) {
+    pr_error("Fail to run batch authentication: %d", res);
+    goto batch_failure;
+  }
+  batch_auth_print_stats(&stats);
+  
+  if ((res = saveRefreshTokens(path, accounts, count)) < 0)
+    pr_error("Fail to save rotated refresh tokens: %d", res);
+  
+batch_failure:
+  for (int i = 0; i < count; i++)
+    batch_auth_account_cleanup(&accounts[i]);
+  free(accounts);
+read_failure:;
+  int i;
+  char* token;
+  vec_foreach(&refreshTokens, token, i) {
+    memset(token, 0, strlen(token));
+    free(token);
+  }
+  vec_deinit(&refreshTokens);
+  return res;
+}
+
+int main2(int argc, char** argv) {
+  int initResult = init();
+  if (initResult < 0) {
+    pr_emerg("Failure initializing launcher");
+    return EXIT_FAILURE;
+  }
+  
+  //signal(SIGSEGV, sigHandler);
+  
+  // Usage: FluffyLauncher [refresh token file or - for stdin]
+  if (argc > 1) {
+    int res = -EINVAL;
+    if (argc == 2)
+      res = batchLogin(argv[1]);
+    else
+      pr_error("Expected one refresh token file (or - for stdin)");
+    pr_info("Shutting down...");
+    shutdown();
+    return res < 0 ? EXIT_FAILURE : EXIT_SUCCESS;
+  }
+  
+  struct token_store tokenStore;
+  int res = token_store_load(&tokenStore, CONFIG_AUTH_TOKEN_STORE_PATH);
   if (res < 0) {
-    pr_error("Fail to authenticate with Minecraft: %d", res);
-    goto minecraft_auth_failed;
+    pr_error("Fail to load token store: %d", res);
+    goto token_store_load_failure;
   }
+  
+  if (!tokenStore.refreshToken && strlen(CONFIG_TMP_REFRESH_TOKEN) > 0 &&
+      (res = token_store_set_refresh_token(&tokenStore, CONFIG_TMP_REFRESH_TOKEN)) < 0)
+    goto authenticate_failure;
+  
+  res = token_store_authenticate(&tokenStore);
+  
+  // Keep whatever stages succeeded even if later one failed
+  int saveRes = token_store_save(&tokenStore);
+  if (saveRes < 0)
+    pr_warn("Fail to save token store: %d", saveRes);
+  
+  if (res < 0)
+    goto authenticate_failure;
   pr_info("Sucessfully authenticated with Minecraft...");
 
-  struct minecraft_api* minecraftAPI = minecraft_api_new(minecraftAuthResult->token);
+  struct minecraft_api* minecraftAPI = minecraft_api_new(tokenStore.tokens[TOKEN_STORE_MINECRAFT].token);
   if (!minecraftAPI) {
     res = -ENOMEM;
     goto minecraft_api_create_failure;
@@ -158,14 +364,9 @@ user_dont_have_minecraft:
 fail_to_fetch_profile:
   minecraft_api_free(minecraftAPI);
 minecraft_api_create_failure:
-  minecraft_auth_free(minecraftAuthResult);
-minecraft_auth_failed:
-  xsts_free(xstsResult);  
-xsts_auth_failure:
-  xbox_live_free(xboxLiveResult); 
-xbl_auth_failure:
-  microsoft_auth_free(microsoftResult); 
-microsoft_auth_failure:
+authenticate_failure:
+  token_store_cleanup(&tokenStore);
+token_store_load_failure:
   
   pr_info("Shutting down...");
   shutdown();
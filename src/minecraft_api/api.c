@@ -17,6 +17,7 @@
 static void cleanLastCall(struct minecraft_api* self) {
   if (self->lastJSON)
     json_free(self->lastJSON);
+  self->lastJSON = NULL;
 }
 
 struct minecraft_api* minecraft_api_new(const char* token) {
@@ -65,12 +66,8 @@ static bool testAndReportError(struct minecraft_api* self) {
   return true;
 }
 
-enum minecraft_api_error_code minecraft_api_get_profile(struct minecraft_api* self) {
-  cleanLastCall(self);
-  
-  if ((self->lastError.errorNum = networking_easy_do_json_http_rpc(&self->lastJSON, true, HTTP_GET, CONFIG_MINECRAFT_API_HOSTNAME, "/minecraft/profile", self->requestHeaders, "")) < 0) 
-    return MINECRAFT_API_NETWORK_ERROR; 
-  
+// Read profile out of self->lastJSON
+static enum minecraft_api_error_code processProfile(struct minecraft_api* self) {
   if (self->lastJSON == NULL)
     return MINECRAFT_API_PARSE_SERVER_ERROR;
   
@@ -87,6 +84,50 @@ enum minecraft_api_error_code minecraft_api_get_profile(struct minecraft_api* se
   return 0;
 }
 
+enum minecraft_api_error_code minecraft_api_get_profile(struct minecraft_api* self) {
+  cleanLastCall(self);
+  
+  if ((self->lastError.errorNum = networking_easy_do_json_http_rpc(&self->lastJSON, true, HTTP_GET, CONFIG_MINECRAFT_API_HOSTNAME, "/minecraft/profile", self->requestHeaders, "")) < 0) 
+    return MINECRAFT_API_NETWORK_ERROR; 
+  return processProfile(self);
+}
+
+struct minecraft_api_async {
+  struct minecraft_api* api;
+  minecraft_api_callback callback;
+  void* udata;
+};
+
+static void onProfileResponse(void* udata, int res, struct json_node* root) {
+  struct minecraft_api_async* ctx = udata;
+  struct minecraft_api* self = ctx->api;
+  enum minecraft_api_error_code apiRes = MINECRAFT_API_NETWORK_ERROR;
+  if ((self->lastError.errorNum = res) >= 0) {
+    self->lastJSON = root;
+    apiRes = processProfile(self);
+  }
+  
+  ctx->callback(ctx->udata, apiRes);
+  free(ctx);
+}
+
+int minecraft_api_get_profile_async(struct minecraft_api* self, minecraft_api_callback callback, void* udata) {
+  int res = 0;
+  struct minecraft_api_async* ctx = malloc(sizeof(*ctx));
+  if (!ctx)
+    return -ENOMEM;
+  *ctx = (struct minecraft_api_async) {
+    .api = self,
+    .callback = callback,
+    .udata = udata
+  };
+  
+  cleanLastCall(self);
+  if ((res = networking_easy_do_json_http_rpc_async(onProfileResponse, ctx, true, HTTP_GET, CONFIG_MINECRAFT_API_HOSTNAME, "/minecraft/profile", self->requestHeaders, "")) < 0)
+    free(ctx);
+  return res;
+}
+
 bool minecraft_api_have_own_minecraft(struct minecraft_api* self) {
   if (minecraft_api_get_profile(self) == 0)
     return true;
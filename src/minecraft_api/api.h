@@ -54,6 +54,14 @@ void minecraft_api_free(struct minecraft_api* self);
 // MINECRAFT_API_NOT_FOUND: Profile cant be found 
 enum minecraft_api_error_code minecraft_api_get_profile(struct minecraft_api* self);
 
+typedef void (*minecraft_api_callback)(void* udata, enum minecraft_api_error_code res);
+
+// Same as minecraft_api_get_profile but `callback` called
+// from I/O thread once done, `self` mustn't be used until then
+// Return 0 if started or negative errno where `callback`
+// won't be called
+int minecraft_api_get_profile_async(struct minecraft_api* self, minecraft_api_callback callback, void* udata);
+
 bool minecraft_api_have_own_minecraft(struct minecraft_api* self);
 
 #endif
@@ -0,0 +1,188 @@
+#include <errno.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+
+#include "async_connect.h"
+#include "config.h"
+#include "happy_eyeballs.h"
+#include "io/io_threads.h"
+#include "logging/logging.h"
+#include "networking.h"
+#include "resolver.h"
+#include "transport/transport.h"
+#include "transport/transport_socket.h"
+#include "transport/transport_ssl.h"
+#include "util/util.h"
+
+struct async_connect {
+  // Watch and timer for TLS handshake, TCP connect
+  // has its own in happy_eyeballs_connect_async
+  struct io_watch watch;
+  struct io_timer timer;
+  atomic_bool hasTimedOut;
+
+  bool isSecure;
+  char* hostname;
+  uint16_t port;
+  double deadline;
+  struct transport_socket* socket;
+  struct transport_ssl* ssl;
+
+  async_connect_callback callback;
+  void* udata;
+};
+
+static void complete(struct async_connect* self, int res) {
+  io_watch_remove(&self->watch);
+  io_timer_cancel(&self->timer);
+  if (res < 0 && atomic_load(&self->hasTimedOut))
+    res = -ETIMEDOUT;
+
+  struct transport* result = NULL;
+  if (res >= 0)
+    result = self->ssl ? &self->ssl->super : &self->socket->super;
+  else if (self->ssl)
+    transport_ssl_free(self->ssl); /* Also closes socket */
+  else if (self->socket)
+    transport_socket_free(self->socket);
+
+  if (res < 0)
+    pr_error("Cant connect to %s:%d (Reason: %d)", self->hostname, self->port, res);
+
+  self->callback(self->udata, res, result);
+  free(self->hostname);
+  free(self);
+}
+
+// Run handshake as far as possible without blocking
+// Return -EAGAIN if waiting for `wantedEvents`
+static int handshakeStep(struct async_connect* self, int* wantedEvents) {
+  int res = transport_ssl_connect_step(self->ssl, TRANSPORT_TLS_ANY, wantedEvents);
+  if (res < 0)
+    return res;
+  if (transport_ssl_verify_host(self->ssl) == false)
+    return -EFAULT;
+
+  if (transport_ssl_is_session_reused(self->ssl))
+    pr_debug("Resumed TLS session with %s", self->hostname);
+  return 0;
+}
+
+static void onHandshakeReady(struct io_watch* watch, int events) {
+  struct async_connect* self = watch->udata;
+  int wantedEvents = 0;
+  int res = handshakeStep(self, &wantedEvents);
+  if (res == -EAGAIN && (res = io_watch_arm(&self->watch, wantedEvents)) >= 0)
+    return;
+
+  complete(self, res);
+}
+
+// Handshake fails on its own once socket is shut down
+static void onTimeout(struct io_timer* timer) {
+  struct async_connect* self = timer->udata;
+  atomic_store(&self->hasTimedOut, true);
+  shutdown(self->socket->fd, SHUT_RDWR);
+}
+
+static void onConnected(void* udata, int res, struct ip_address* winner) {
+  struct async_connect* self = udata;
+  if (res < 0)
+    goto connect_error;
+
+  int fd = res;
+  self->socket = transport_socket_new(CONFIG_NETWORKING_IO_TIMEOUT > 0 ? CONFIG_NETWORKING_IO_TIMEOUT : -1);
+  if (!self->socket) {
+    close(fd);
+    res = -ENOMEM;
+    goto socket_creation_error;
+  }
+  transport_socket_adopt(self->socket, fd, winner);
+
+  if (!self->isSecure) {
+    res = 0;
+    goto ssl_not_needed;
+  }
+
+  if (!(self->ssl = transport_ssl_new(&self->socket->super, self->hostname, true))) {
+    res = -ENOMEM;
+    goto ssl_creation_error;
+  }
+
+  io_watch_init(&self->watch, fd, onHandshakeReady, self);
+  if (self->deadline >= 0 && (res = io_timer_start(&self->timer, self->deadline)) < 0)
+    goto timer_start_error;
+
+  // Let I/O thread do even the first step so this callback
+  // (maybe on timer thread) returns quickly
+  if ((res = io_watch_arm(&self->watch, IO_EVENT_WRITE)) < 0)
+    goto arm_error;
+  return;
+
+arm_error:
+timer_start_error:
+ssl_creation_error:
+socket_creation_error:
+connect_error:
+ssl_not_needed:
+  complete(self, res);
+}
+
+static void onResolved(void* udata, int res, struct resolver_result* resolved) {
+  struct async_connect* self = udata;
+  if (res < 0)
+    goto resolve_error;
+
+  // Same order as networking_easy_new_connection so broken
+  // IPv6 (or IPv4) only costs one attempt delay
+  happy_eyeballs_sort(resolved->addresses, resolved->count);
+  if ((res = happy_eyeballs_connect_async(resolved->addresses, resolved->count, self->port, self->deadline, onConnected, self)) < 0)
+    goto connect_error;
+  free(resolved);
+  return;
+
+connect_error:
+  free(resolved);
+resolve_error:
+  complete(self, res);
+}
+
+int networking_async_connect(bool isSecure, const char* hostname, uint16_t port, int connectTimeoutMilis, async_connect_callback callback, void* udata) {
+  int res = 0;
+  struct async_connect* self = malloc(sizeof(*self));
+  if (!self)
+    return -ENOMEM;
+
+  *self = (struct async_connect) {
+    .isSecure = isSecure,
+    .port = port,
+    .deadline = -1,
+    .callback = callback,
+    .udata = udata
+  };
+  atomic_init(&self->hasTimedOut, false);
+  io_watch_init(&self->watch, -1, onHandshakeReady, self);
+  io_timer_init(&self->timer, onTimeout, self);
+  if (connectTimeoutMilis >= 0)
+    self->deadline = util_get_monotonic() + connectTimeoutMilis / 1000.0;
+
+  if (!(self->hostname = strdup(hostname))) {
+    res = -ENOMEM;
+    goto hostname_dup_error;
+  }
+
+  // Resolver threads do the lookup so a slow name
+  // server doesn't block caller either
+  if ((res = resolver_resolve_async(hostname, onResolved, self)) < 0)
+    goto resolve_error;
+  return 0;
+
+resolve_error:
+  free(self->hostname);
+hostname_dup_error:
+  free(self);
+  return res;
+}
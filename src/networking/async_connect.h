@@ -0,0 +1,35 @@
+#ifndef _headers_1671687302_FluffyLauncher_async_connect
+#define _headers_1671687302_FluffyLauncher_async_connect
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// Establish connection (name lookup, TCP connect and TLS
+// handshake) on resolver and I/O threads without blocking
+// calling thread, every resolved address raced like
+// networking_easy_new_connection does
+
+struct transport;
+
+// `res` is 0 on success and `transport` is the new connection
+// else negative errno and `transport` is NULL
+// Called from I/O, timer or resolver thread (or before
+// networking_async_connect returns if hostname was cached
+// and connect failed right away)
+typedef void (*async_connect_callback)(void* udata, int res, struct transport* transport);
+
+// TCP connect and TLS handshake must finish within
+// `connectTimeoutMilis` (-1 for no limit), returned transport
+// has CONFIG_NETWORKING_IO_TIMEOUT as I/O timeout
+// Return 0 if connecting started (`callback` will be called
+// exactly once) or negative errno where `callback` won't
+// be called
+// Errors:
+// -ENOMEM: Not enough memory
+// Resolve and connect errors (and -ETIMEDOUT) are given to
+// `callback`
+[[nodiscard]]
+int networking_async_connect(bool isSecure, const char* hostname, uint16_t port, int connectTimeoutMilis, async_connect_callback callback, void* udata);
+
+#endif
+
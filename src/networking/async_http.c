@@ -0,0 +1,288 @@
+#include <errno.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+
+#include "async_http.h"
+#include "async_connect.h"
+#include "connection_pool.h"
+#include "http_request.h"
+#include "http_response.h"
+#include "io/io_threads.h"
+#include "transport/transport.h"
+#include "util/util.h"
+#include "vec.h"
+
+struct async_http {
+  bool isSecure;
+  char* hostname;
+  uint16_t port;
+  struct http_timeouts timeouts;
+  double deadline;
+
+  // Serialized request and how much of it sent
+  vec_char_t request;
+  size_t sent;
+
+  struct http_response* response;
+  struct http_response localResponse;
+  struct http_body_sink* sink;
+  struct http_response_parser* parser;
+
+  struct connection_pool_entry* connection;
+  struct io_watch watch;
+
+  // Timer shuts the socket down so pending watch fires and
+  // exchange fails on I/O thread. Lock makes sure it never
+  // shuts down fd which was already closed (and maybe reused)
+  struct io_timer timer;
+  pthread_mutex_t lock;
+  int fd;
+  bool hasTimedOut;
+
+  async_http_callback callback;
+  void* udata;
+};
+
+// Same as in easy.c, failures which mean server closed
+// idle connection before we sent request
+static bool isStaleConnectionError(int err) {
+  return err == -ECONNRESET || err == -EPIPE || err == -ENODATA;
+}
+
+static void freeExchange(struct async_http* self) {
+  if (self->response == &self->localResponse)
+    http_response_free(&self->localResponse);
+  pthread_mutex_destroy(&self->lock);
+  vec_deinit(&self->request);
+  free(self->hostname);
+  free(self);
+}
+
+static void complete(struct async_http* self, int res) {
+  io_timer_cancel(&self->timer);
+  self->callback(self->udata, res);
+  freeExchange(self);
+}
+
+static void onTimeout(struct io_timer* timer) {
+  struct async_http* self = timer->udata;
+  pthread_mutex_lock(&self->lock);
+  self->hasTimedOut = true;
+  if (self->fd >= 0)
+    shutdown(self->fd, SHUT_RDWR);
+  pthread_mutex_unlock(&self->lock);
+}
+
+// Nearer of I/O timeout from now and request deadline
+static int restartTimer(struct async_http* self) {
+  double at = self->deadline;
+  if (self->timeouts.ioMilis >= 0) {
+    double ioDeadline = util_get_monotonic() + self->timeouts.ioMilis / 1000.0;
+    if (at < 0 || ioDeadline < at)
+      at = ioDeadline;
+  }
+
+  if (at < 0)
+    return 0;
+  return io_timer_start(&self->timer, at);
+}
+
+// Connect timeout clamped to what left of request deadline
+static int getConnectTimeout(struct async_http* self) {
+  if (self->deadline < 0)
+    return self->timeouts.connectMilis;
+
+  double remaining = self->deadline - util_get_monotonic();
+  int remainingMilis = remaining > 0 ? (int) (remaining * 1000.0) + 1 : 0;
+  if (self->timeouts.connectMilis < 0 || remainingMilis < self->timeouts.connectMilis)
+    return remainingMilis;
+  return self->timeouts.connectMilis;
+}
+
+// Send rest of request then read as much response as
+// available without blocking
+// Return http status code once response complete or -EAGAIN
+// if waiting for `wantedEvents`
+static int exchangeStep(struct async_http* self, int* wantedEvents) {
+  int res = 0;
+  struct transport* transport = self->connection->transport;
+  while (self->sent < (size_t) self->request.length) {
+    size_t written = 0;
+    if ((res = transport->try_write(transport, self->request.data + self->sent, self->request.length - self->sent, &written, wantedEvents)) < 0)
+      return res;
+    self->sent += written;
+  }
+
+  char buffer[16 * 1024];
+  while (true) {
+    size_t readSize = 0;
+    res = transport->try_read(transport, buffer, sizeof(buffer), &readSize, wantedEvents);
+    if (res == -ENODATA)
+      return http_response_parser_finish(self->parser);
+    if (res < 0)
+      return res;
+
+    size_t consumed = 0;
+    res = http_response_parser_feed(self->parser, buffer, readSize, &consumed);
+    if (res == -EAGAIN)
+      continue;
+
+    // Server sent something after response, connection
+    // is in unknown state
+    if (res >= 0 && consumed < readSize)
+      self->response->canReuseConnection = false;
+    return res;
+  }
+}
+
+static void startAttempt(struct async_http* self);
+
+// Connection done with (response complete or failed)
+static void finishAttempt(struct async_http* self, int res) {
+  io_watch_remove(&self->watch);
+  io_timer_cancel(&self->timer);
+  http_response_parser_free(self->parser);
+  self->parser = NULL;
+
+  pthread_mutex_lock(&self->lock);
+  self->fd = -1;
+  bool hasTimedOut = self->hasTimedOut;
+  pthread_mutex_unlock(&self->lock);
+  if (res < 0 && hasTimedOut)
+    res = -ETIMEDOUT;
+
+  // Nothing written to sink yet if status line not received
+  struct connection_pool_entry* connection = self->connection;
+  self->connection = NULL;
+  if (res < 0 && connection->isReused && isStaleConnectionError(res) && self->response->status == 0) {
+    connection_pool_put(connection, NULL);
+    startAttempt(self);
+    return;
+  }
+
+  connection_pool_put(connection, res < 0 ? NULL : self->response);
+  complete(self, res);
+}
+
+static void onReady(struct io_watch* watch, int events) {
+  struct async_http* self = watch->udata;
+  int wantedEvents = 0;
+  int res = exchangeStep(self, &wantedEvents);
+  if (res != -EAGAIN)
+    goto exchange_done;
+
+  // Watch can't be touched once armed, it may already
+  // running on other I/O thread
+  if ((res = restartTimer(self)) < 0)
+    goto exchange_done;
+  if ((res = io_watch_arm(&self->watch, wantedEvents)) < 0)
+    goto exchange_done;
+  return;
+
+exchange_done:
+  finishAttempt(self, res);
+}
+
+static void attachConnection(struct async_http* self, struct connection_pool_entry* connection) {
+  int res = 0;
+  self->connection = connection;
+  self->sent = 0;
+  if (!(self->parser = http_response_parser_new(self->response, self->sink))) {
+    res = -ENOMEM;
+    goto parser_alloc_error;
+  }
+
+  int fd = connection->transport->get_sockfd(connection->transport);
+  pthread_mutex_lock(&self->lock);
+  if (self->hasTimedOut) {
+    pthread_mutex_unlock(&self->lock);
+    res = -ETIMEDOUT;
+    goto timed_out;
+  }
+  self->fd = fd;
+  pthread_mutex_unlock(&self->lock);
+
+  io_watch_init(&self->watch, fd, onReady, self);
+  if ((res = restartTimer(self)) < 0)
+    goto timer_error;
+  if ((res = io_watch_arm(&self->watch, IO_EVENT_WRITE)) < 0)
+    goto arm_error;
+  return;
+
+arm_error:
+timer_error:
+timed_out:
+parser_alloc_error:
+  finishAttempt(self, res);
+}
+
+static void onConnected(void* udata, int res, struct transport* transport) {
+  struct async_http* self = udata;
+  struct connection_pool_entry* connection = NULL;
+  if (res < 0 || (res = connection_pool_adopt(&connection, transport, self->isSecure, self->hostname, self->port)) < 0) {
+    complete(self, res);
+    return;
+  }
+  attachConnection(self, connection);
+}
+
+static void startAttempt(struct async_http* self) {
+  int res = 0;
+  struct connection_pool_entry* connection = connection_pool_take_idle(self->isSecure, self->hostname, self->port, false);
+  if (connection) {
+    attachConnection(self, connection);
+    return;
+  }
+
+  if ((res = networking_async_connect(self->isSecure, self->hostname, self->port, getConnectTimeout(self), onConnected, self)) < 0)
+    complete(self, res);
+}
+
+int networking_async_send_http(struct http_request* request, struct http_response* response, bool isSecure, const char* hostname, uint16_t port, struct http_body_sink* sink, async_http_callback callback, void* udata) {
+  int res = 0;
+  struct async_http* self = malloc(sizeof(*self));
+  if (!self)
+    return -ENOMEM;
+
+  *self = (struct async_http) {
+    .isSecure = isSecure,
+    .port = port,
+    .timeouts = request->timeouts,
+    .deadline = -1,
+    .response = response,
+    .sink = sink,
+    .fd = -1,
+    .callback = callback,
+    .udata = udata
+  };
+  pthread_mutex_init(&self->lock, NULL);
+  vec_init(&self->request);
+  io_timer_init(&self->timer, onTimeout, self);
+  if (request->timeouts.requestMilis >= 0)
+    self->deadline = util_get_monotonic() + request->timeouts.requestMilis / 1000.0;
+
+  if (!self->response) {
+    if ((res = http_response_static_init(&self->localResponse)) < 0)
+      goto init_response_error;
+    self->response = &self->localResponse;
+  }
+
+  if (!(self->hostname = strdup(hostname))) {
+    res = -ENOMEM;
+    goto hostname_dup_error;
+  }
+  if ((res = http_request_serialize(request, &self->request)) < 0)
+    goto serialize_error;
+
+  startAttempt(self);
+  return 0;
+
+serialize_error:
+hostname_dup_error:
+init_response_error:
+  freeExchange(self);
+  return res;
+}
+
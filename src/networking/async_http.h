@@ -0,0 +1,45 @@
+#ifndef _headers_1700454131_FluffyLauncher_async_http
+#define _headers_1700454131_FluffyLauncher_async_http
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// HTTP/1.1 exchange driven by I/O threads so many requests
+// can be in flight without a thread each
+
+struct http_request;
+struct http_response;
+struct http_body_sink;
+
+// Called once from I/O, timer or resolver thread (or before
+// networking_async_send_http returns) with http status code
+// or negative errno, same as networking_easy_send_http result
+typedef void (*async_http_callback)(void* udata, int res);
+
+// Asynchronous networking_easy_send_http: pooled connection
+// reused if possible (retried once on new connection if it
+// turns out closed by server) else connected with
+// networking_async_connect, HTTP/2 isn't spoken so idle
+// HTTP/2 connections are left for blocking callers
+// `request`, `response` (initialized or NULL) and `sink` must
+// stay valid until `callback` called, request is serialized
+// before this returns so it can be freed by callback
+// Limited by `request->timeouts` like blocking variant
+// Return 0 if request started (`callback` will be called
+// exactly once) or negative errno where `callback` won't
+// be called
+// Errors:
+// -ENOMEM: Not enough memory
+// -EINVAL: Invalid request
+[[nodiscard]]
+int networking_async_send_http(struct http_request* request,
+                               struct http_response* response,
+                               bool isSecure,
+                               const char* hostname,
+                               uint16_t port,
+                               struct http_body_sink* sink,
+                               async_http_callback callback,
+                               void* udata);
+
+#endif
+
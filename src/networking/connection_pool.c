@@ -0,0 +1,232 @@
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "connection_pool.h"
+#include "config.h"
+#include "easy.h"
+#include "http2.h"
+#include "http_response.h"
+#include "transport/transport.h"
+#include "transport/transport_ssl.h"
+#include "util/util.h"
+#include "vec.h"
+
+static pthread_mutex_t poolLock = PTHREAD_MUTEX_INITIALIZER;
+static vec_t(struct connection_pool_entry*) idleConnections;
+static bool isInitialized = false;
+
+static void freeEntry(struct connection_pool_entry* entry) {
+  if (!entry)
+    return;
+
+  http2_connection_free(entry->http2);
+  if (entry->transport)
+    entry->transport->close(entry->transport);
+  free(entry->hostname);
+  free(entry);
+}
+
+int connection_pool_init() {
+  pthread_mutex_lock(&poolLock);
+  if (!isInitialized) {
+    vec_init(&idleConnections);
+    isInitialized = true;
+  }
+  pthread_mutex_unlock(&poolLock);
+  return 0;
+}
+
+void connection_pool_flush() {
+  pthread_mutex_lock(&poolLock);
+  struct connection_pool_entry* entry;
+  int i;
+  vec_foreach(&idleConnections, entry, i)
+    freeEntry(entry);
+  vec_clear(&idleConnections);
+  pthread_mutex_unlock(&poolLock);
+}
+
+void connection_pool_cleanup() {
+  connection_pool_flush();
+
+  pthread_mutex_lock(&poolLock);
+  vec_deinit(&idleConnections);
+  isInitialized = false;
+  pthread_mutex_unlock(&poolLock);
+}
+
+static bool isSameTarget(struct connection_pool_entry* entry, bool isSecure, const char* hostname, uint16_t port) {
+  return entry->isSecure == isSecure && entry->port == port && strcmp(entry->hostname, hostname) == 0;
+}
+
+// Idle connection should not have anything to read, if it is
+// readable its either closed by server or server sent something
+// unexpected. Either way it can't be used anymore
+static bool isStillUsable(struct connection_pool_entry* entry, double now) {
+  if (now - entry->idleSince >= entry->idleTimeout)
+    return false;
+  if (entry->http2 && !http2_connection_is_usable(entry->http2))
+    return false;
+  
+  // Leftover bytes after last response
+  if (transport_get_buffered_size(entry->transport) > 0)
+    return false;
+
+  int fd = entry->transport->get_sockfd(entry->transport);
+  if (fd < 0)
+    return false;
+
+  struct pollfd pollfd = {
+    .fd = fd,
+    .events = POLLIN
+  };
+
+  int res;
+  while ((res = poll(&pollfd, 1, 0)) < 0 && errno == EINTR)
+    ;
+  return res == 0;
+}
+
+// Must be called with poolLock held
+static void evictUnusable() {
+  double now = util_get_monotonic();
+  for (int i = 0; i < idleConnections.length;) {
+    struct connection_pool_entry* entry = idleConnections.data[i];
+    if (isStillUsable(entry, now)) {
+      i++;
+      continue;
+    }
+
+    vec_splice(&idleConnections, i, 1);
+    freeEntry(entry);
+  }
+}
+
+struct connection_pool_entry* connection_pool_take_idle(bool isSecure, const char* hostname, uint16_t port, bool allowHttp2) {
+  struct connection_pool_entry* entry = NULL;
+  pthread_mutex_lock(&poolLock);
+  if (!isInitialized)
+    goto not_initialized;
+  evictUnusable();
+
+  // Most recently used first as its least likely closed by server
+  for (int i = idleConnections.length - 1; i >= 0; i--) {
+    struct connection_pool_entry* candidate = idleConnections.data[i];
+    if (!isSameTarget(candidate, isSecure, hostname, port) || (candidate->http2 && !allowHttp2))
+      continue;
+
+    entry = candidate;
+    entry->isReused = true;
+    vec_splice(&idleConnections, i, 1);
+    break;
+  }
+
+not_initialized:
+  pthread_mutex_unlock(&poolLock);
+  return entry;
+}
+
+int connection_pool_adopt(struct connection_pool_entry** result, struct transport* transport, bool isSecure, const char* hostname, uint16_t port) {
+  int res = 0;
+  struct connection_pool_entry* entry = malloc(sizeof(*entry));
+  if (!entry) {
+    transport->close(transport);
+    res = -ENOMEM;
+    goto alloc_entry_error;
+  }
+
+  *entry = (struct connection_pool_entry) {
+    .hostname = strdup(hostname),
+    .port = port,
+    .isSecure = isSecure,
+    .transport = transport,
+    .isReused = false,
+    .idleTimeout = CONFIG_NETWORKING_POOL_IDLE_TIMEOUT,
+    .requestsLeft = -1
+  };
+  if (!entry->hostname) {
+    res = -ENOMEM;
+    goto alloc_hostname_error;
+  }
+
+  const char* protocol = isSecure ? transport_ssl_get_alpn(container_of(transport, struct transport_ssl, super)) : NULL;
+  if (protocol && strcmp(protocol, "h2") == 0 && !(entry->http2 = http2_connection_new(transport)))
+    res = -ENOMEM;
+
+alloc_hostname_error:
+  if (res < 0) {
+    freeEntry(entry);
+    entry = NULL;
+  }
+alloc_entry_error:
+  *result = entry;
+  return res;
+}
+
+int connection_pool_get(struct connection_pool_entry** result, bool isSecure, const char* hostname, uint16_t port, int connectTimeoutMilis) {
+  int res = 0;
+  struct transport* transport = NULL;
+  if ((*result = connection_pool_take_idle(isSecure, hostname, port, true)))
+    return 0;
+
+  // Server which doesn't know ALPN just speaks HTTP/1.1
+  static const char* const alpnProtocols[] = {"h2", "http/1.1", NULL};
+  const char* const* alpn = IS_ENABLED(CONFIG_NETWORKING_HTTP2) && isSecure ? alpnProtocols : NULL;
+  if ((res = networking_easy_new_connection_alpn(isSecure, hostname, port, connectTimeoutMilis, alpn, &transport)) < 0)
+    return res;
+  return connection_pool_adopt(result, transport, isSecure, hostname, port);
+}
+
+static int countIdleFor(struct connection_pool_entry* target) {
+  int count = 0;
+  struct connection_pool_entry* entry;
+  int i;
+  vec_foreach(&idleConnections, entry, i)
+    if (isSameTarget(entry, target->isSecure, target->hostname, target->port))
+      count++;
+  return count;
+}
+
+void connection_pool_put(struct connection_pool_entry* entry, struct http_response* response) {
+  if (!entry)
+    return;
+
+  if (!response || !response->canReuseConnection)
+    goto close_connection;
+  if (entry->http2 && !http2_connection_is_usable(entry->http2))
+    goto close_connection;
+
+  if (entry->requestsLeft > 0)
+    entry->requestsLeft--;
+
+  // Server tells how many requests left for this connection
+  if (response->keepAliveMax >= 0)
+    entry->requestsLeft = response->keepAliveMax;
+  if (entry->requestsLeft == 0)
+    goto close_connection;
+
+  // Server will close idle connection after this so
+  // dont keep it longer than that
+  entry->idleTimeout = CONFIG_NETWORKING_POOL_IDLE_TIMEOUT;
+  if (response->keepAliveTimeout >= 0 && response->keepAliveTimeout < entry->idleTimeout)
+    entry->idleTimeout = response->keepAliveTimeout;
+  entry->idleSince = util_get_monotonic();
+
+  pthread_mutex_lock(&poolLock);
+  // vec_push always evaluates to 0 so reserve first to catch ENOMEM
+  if (!isInitialized || countIdleFor(entry) >= CONFIG_NETWORKING_POOL_MAX_IDLE_PER_HOST ||
+      vec_reserve(&idleConnections, idleConnections.length + 1) < 0) {
+    pthread_mutex_unlock(&poolLock);
+    goto close_connection;
+  }
+  vec_push(&idleConnections, entry);
+  pthread_mutex_unlock(&poolLock);
+  return;
+
+close_connection:
+  freeEntry(entry);
+}
+
@@ -0,0 +1,80 @@
+#ifndef _headers_1671502215_FluffyLauncher_connection_pool
+#define _headers_1671502215_FluffyLauncher_connection_pool
+
+#include <stdint.h>
+#include <stdbool.h>
+
+// Pool of persistent HTTP/1.1 and HTTP/2 connections keyed
+// by (hostname, port, isSecure), each lent to one caller at
+// a time
+
+struct http_response;
+struct http2_connection;
+struct transport;
+
+struct connection_pool_entry {
+  char* hostname;
+  uint16_t port;
+  bool isSecure;
+
+  struct transport* transport;
+
+  // Set if server picked HTTP/2 with ALPN, requests then go
+  // through it instead of directly to transport
+  struct http2_connection* http2;
+
+  // Whether this connection was taken from idle list (server may
+  // already closed it while we didn't know yet)
+  bool isReused;
+
+  // Monotonic time when put into idle list
+  double idleSince;
+
+  // Idle timeout in seconds
+  double idleTimeout;
+
+  // Number of requests allowed on this connection
+  // or -1 for unlimited
+  int requestsLeft;
+};
+
+[[nodiscard]]
+int connection_pool_init();
+void connection_pool_cleanup();
+
+// Get idle connection or create new one if there none
+// within `connectTimeoutMilis` (-1 for no limit), secure
+// connections offer HTTP/2 if CONFIG_NETWORKING_HTTP2
+// Return 0 on success
+// Errors:
+// -ENOMEM: Not enough memory
+// Also errors from networking_easy_new_connection
+[[nodiscard]]
+int connection_pool_get(struct connection_pool_entry** result, bool isSecure, const char* hostname, uint16_t port, int connectTimeoutMilis);
+
+// Take idle connection to the target without connecting new
+// one, HTTP/2 ones skipped unless `allowHttp2`
+// Return NULL if there none
+struct connection_pool_entry* connection_pool_take_idle(bool isSecure, const char* hostname, uint16_t port, bool allowHttp2);
+
+// Make entry of freshly connected `transport` (owned by the
+// entry after this, closed on error) so it can be put to the
+// pool, HTTP/2 if server picked it with ALPN
+// Errors:
+// -ENOMEM: Not enough memory
+[[nodiscard]]
+int connection_pool_adopt(struct connection_pool_entry** result, struct transport* transport, bool isSecure, const char* hostname, uint16_t port);
+
+// Return connection to the pool after response completely
+// read or close it if it can't be reused. Pass NULL response
+// if the request failed (the connection is always closed)
+// HTTP/2 connection kept as long as it accepts new streams,
+// it is lent to one caller at a time like HTTP/1.1 one so
+// concurrent callers to same host still use a connection each
+void connection_pool_put(struct connection_pool_entry* entry, struct http_response* response);
+
+// Close all idle connections
+void connection_pool_flush();
+
+#endif
+
@@ -5,61 +5,92 @@
 #include <string.h>
 
 #include "bug.h"
+#include "config.h"
+#include "async_http.h"
 #include "easy.h"
+#include "connection_pool.h"
+#include "happy_eyeballs.h"
+#include "http2.h"
+#include "http_content_decoder.h"
 #include "http_headers.h"
+#include "http_pipeline.h"
 #include "http_request.h"
 #include "networking.h"
 #include "networking/http_request.h"
 #include "networking/http_response.h"
+#include "networking/resolver.h"
 #include "parser/json/json.h"
 #include "parser/json/decoder.h"
+#include "parser/json/decoder/builtin.h"
 #include "transport/transport.h"
 #include "transport/transport_socket.h"
 #include "transport/transport_ssl.h"
 #include "logging/logging.h"
 #include "util/util.h"
 
-int networking_easy_new_connection(bool isSecure, const char* hostname, uint16_t port, struct transport** result) {
+int networking_easy_new_connection(bool isSecure, const char* hostname, uint16_t port, int connectTimeoutMilis, struct transport** result) {
+  return networking_easy_new_connection_alpn(isSecure, hostname, port, connectTimeoutMilis, NULL, result);
+}
+
+int networking_easy_new_connection_alpn(bool isSecure, const char* hostname, uint16_t port, int connectTimeoutMilis, const char* const* alpn, struct transport** result) {
   int res = 0;
-  struct ip_address ip;
+  struct resolver_result* resolved = NULL;
   struct transport* transportResult = NULL;
-  if ((res = networking_resolve(hostname, &ip, NETWORKING_RESOLVE_PREFER_IPV4)) < 0)
-    goto resolve_error;
+  int ioTimeout = CONFIG_NETWORKING_IO_TIMEOUT > 0 ? CONFIG_NETWORKING_IO_TIMEOUT : -1;
   
-  ip.port = port;
+  // Whole connect shares one deadline
+  double deadline = -1;
+  if (connectTimeoutMilis >= 0)
+    deadline = util_get_monotonic() + connectTimeoutMilis / 1000.0;
+  
+  if ((res = resolver_resolve(hostname, &resolved, connectTimeoutMilis)) < 0)
+    goto resolve_error;
   
-  struct transport_socket* socketTransport = transport_socket_new(1000);
+  struct transport_socket* socketTransport = transport_socket_new(ioTimeout);
   if (socketTransport == NULL) {
     res = -ENOMEM;
     goto socket_transport_creation_error;
   }
   transportResult = &socketTransport->super;
+  transport_set_deadline(&socketTransport->super, deadline);
   
-  if ((res = transport_socket_connect(socketTransport, &ip)) < 0) 
+  // Resolver keep system (RFC 6724) order, interleave families
+  // so broken IPv6 (or IPv4) only costs one attempt delay
+  happy_eyeballs_sort(resolved->addresses, resolved->count);
+  if ((res = transport_socket_connect_any(socketTransport, resolved->addresses, resolved->count, port)) < 0) 
     goto connect_error;
+  transport_set_deadline(&socketTransport->super, -1);
   
   if (!isSecure) {
     transportResult = &socketTransport->super;
     goto ssl_not_needed;
   }
   
-  struct transport_ssl* sslTransport = transport_ssl_new(&socketTransport->super, true);
+  struct transport_ssl* sslTransport = transport_ssl_new(&socketTransport->super, hostname, true);
   if (sslTransport == NULL) {
     res = -ENOMEM;
     goto ssl_transport_creation_error;
   }
   transportResult = &sslTransport->super;
+  transport_set_deadline(&sslTransport->super, deadline);
   
+  if (alpn && (res = transport_ssl_set_alpn(sslTransport, alpn)) < 0)
+    goto set_alpn_error;
   if ((res = transport_ssl_connect(sslTransport, TRANSPORT_TLS_ANY)) < 0) 
     goto ssl_connect_error;
+  transport_set_deadline(&sslTransport->super, -1);
   
   if (transport_ssl_verify_host(sslTransport) == false) {
     res = -EFAULT;
     goto verify_host_error;
   }
+  
+  if (transport_ssl_is_session_reused(sslTransport))
+    pr_debug("Resumed TLS session with %s", hostname);
 
 verify_host_error:
 ssl_connect_error: 
+set_alpn_error:
 ssl_transport_creation_error:
 connect_error:
   if (res < 0) {
@@ -71,10 +102,187 @@ resolve_error:
   if (res < 0) 
     pr_error("Cant connect to %s:%d (Reason: %d)", hostname, port, res);
 ssl_not_needed:
+  free(resolved);
   *result = transportResult;
   return res;
 }
 
+// Failures which mean server closed idle connection
+// before we sent request
+static bool isStaleConnectionError(int err) {
+  return err == -ECONNRESET || err == -EPIPE || err == -ENODATA;
+}
+
+// Connect timeout clamped to what left of request deadline
+static int getConnectTimeout(struct http_timeouts* timeouts, double deadline) {
+  if (deadline < 0)
+    return timeouts->connectMilis;
+  
+  double remaining = deadline - util_get_monotonic();
+  int remainingMilis = remaining > 0 ? (int) (remaining * 1000.0) + 1 : 0;
+  if (timeouts->connectMilis < 0 || remainingMilis < timeouts->connectMilis)
+    return remainingMilis;
+  return timeouts->connectMilis;
+}
+
+static void applyTimeouts(struct transport* transport, struct http_timeouts* timeouts, double deadline) {
+  transport_set_timeout(transport, timeouts->ioMilis);
+  transport_set_deadline(transport, deadline);
+}
+
+// Send request as one stream of HTTP/2 connection
+static int sendHttp2(struct http2_connection* connection, struct http_request* req, struct http_response* response, struct http_body_sink* sink) {
+  struct http_pipeline_entry entry = {
+    .request = req,
+    .response = response,
+    .sink = sink,
+    .result = -ECONNRESET
+  };
+  
+  int res = http2_connection_run(connection, &entry, 1);
+  return res < 0 ? res : entry.result;
+}
+
+// Pooled connection must not carry previous request's deadline
+static void clearDeadline(struct connection_pool_entry* connection) {
+  transport_set_deadline(connection->transport, -1);
+}
+
+int networking_easy_send_http(struct http_request* req, struct http_response* _response, bool isSecure, const char* hostname, uint16_t port, struct http_body_sink* sink) {
+  int res = 0;
+  struct connection_pool_entry* connection = NULL;
+  double deadline = -1;
+  if (req->timeouts.requestMilis >= 0)
+    deadline = util_get_monotonic() + req->timeouts.requestMilis / 1000.0;
+  
+  struct http_response localResponse;
+  struct http_response* response = _response;
+  if (!response) {
+    if ((res = http_response_static_init(&localResponse)) < 0)
+      goto init_response_error;
+    response = &localResponse;
+  }
+  
+  // Retry only happen if failed connection was reused one, new
+  // connection failing is real error
+retry_request:
+  if ((res = connection_pool_get(&connection, isSecure, hostname, port, getConnectTimeout(&req->timeouts, deadline))) < 0)
+    goto connect_error;
+  
+  applyTimeouts(connection->transport, &req->timeouts, deadline);
+  response->status = 0;
+  if (connection->http2) {
+    res = sendHttp2(connection->http2, req, response, sink);
+    goto http2_done;
+  }
+  
+  if ((res = http_request_send(req, connection->transport)) < 0)
+    goto send_error;
+  if ((res = http_response_recv(response, connection->transport, sink)) < 0)
+    goto receive_error;
+
+http2_done:
+receive_error:
+send_error:
+  clearDeadline(connection);
+  
+  // Nothing written to `sink` yet if status line not received
+  if (res < 0 && connection->isReused && isStaleConnectionError(res) && response->status == 0) {
+    connection_pool_put(connection, NULL);
+    connection = NULL;
+    goto retry_request;
+  }
+  
+  connection_pool_put(connection, res < 0 ? NULL : response);
+connect_error:
+  if (response == &localResponse)
+    http_response_free(&localResponse);
+init_response_error:
+  return res;
+}
+
+int networking_easy_send_http_pipelined(struct http_pipeline_entry* entries, size_t count, bool isSecure, const char* hostname, uint16_t port) {
+  int res = 0;
+  size_t done = 0;
+  if (count == 0)
+    return 0;
+  
+  struct http_timeouts* timeouts = &entries[0].request->timeouts;
+  double deadline = -1;
+  if (timeouts->requestMilis >= 0)
+    deadline = util_get_monotonic() + timeouts->requestMilis / 1000.0;
+  
+  // HTTP/2 only runs entries still unanswered
+  for (size_t i = 0; i < count; i++) {
+    if (!entries[i].request || !http_pipeline_can_pipeline(entries[i].request))
+      return -EINVAL;
+    entries[i].result = -ECONNRESET;
+  }
+  
+  while (done < count) {
+    struct connection_pool_entry* connection = NULL;
+    if ((res = connection_pool_get(&connection, isSecure, hostname, port, getConnectTimeout(timeouts, deadline))) < 0)
+      goto connect_error;
+    applyTimeouts(connection->transport, timeouts, deadline);
+    
+    // Need last response to know whether connection reusable
+    struct http_pipeline_entry* last = &entries[count - 1];
+    struct http_response lastResponse;
+    bool useLocalResponse = last->response == NULL;
+    if (useLocalResponse) {
+      if ((res = http_response_static_init(&lastResponse)) < 0) {
+        connection_pool_put(connection, NULL);
+        goto init_response_error;
+      }
+      last->response = &lastResponse;
+    }
+    
+    bool wasReused = connection->isReused;
+    size_t completed = 0;
+    if (connection->http2)
+      res = http2_connection_run(connection->http2, &entries[done], count - done);
+    else
+      res = http_pipeline_run(connection->transport, &entries[done], count - done, 0);
+    clearDeadline(connection);
+    if (res >= 0) {
+      completed = res;
+      res = 0;
+      
+      // HTTP/2 answers out of order, continue from first
+      // entry not answered (or failed)
+      while (done < count && entries[done].result >= 0)
+        done++;
+    }
+    
+    connection_pool_put(connection, res >= 0 && done == count ? last->response : NULL);
+    if (useLocalResponse) {
+      http_response_free(&lastResponse);
+      last->response = NULL;
+    }
+    
+    if (res < 0)
+      goto pipeline_error;
+    if (done == count)
+      break;
+    
+    // Unanswered requests are resent if there were progress or
+    // the connection was stale, otherwise its real error. Only
+    // entries without status line received are -ECONNRESET so
+    // their sink and response are still untouched
+    int failure = entries[done].result;
+    if (failure != -ECONNRESET || (completed == 0 && !wasReused)) {
+      res = failure;
+      goto request_error;
+    }
+  }
+
+request_error:
+pipeline_error:
+init_response_error:
+connect_error:
+  return res;
+}
+
 int networking_easy_new_http_va(struct http_request** requestPtr, enum http_method method, const char* hostname, const char* location, struct easy_http_headers* headers, const char* requestBodyFormat, va_list args) {
   struct http_request* req = http_request_new();
   int res = 0;
@@ -103,6 +311,12 @@ int networking_easy_new_http_va(struct http_request** requestPtr, enum http_meth
   
   if (hostname && (res = http_headers_set(req->headers, "Host", hostname) < 0)) 
     goto request_preparation_error;
+  
+  // Response decoded by http_response_recv, caller's
+  // headers below can still override it
+  const char* acceptEncoding = http_content_encoding_accepted();
+  if (acceptEncoding && (res = http_headers_set(req->headers, "Accept-Encoding", acceptEncoding)) < 0)
+    goto request_preparation_error;
 
   for (int i = 0; headers[i].key && headers[i].value; i++) {
     const char* key = headers[i].key;
@@ -175,6 +389,28 @@ int networking_easy_do_http(void** response,
   return res;
 }
 
+// Build request and send it with body going to `sink`
+static int sendHttpVa(struct http_body_sink* sink,
+                      bool isSecure,
+                      enum http_method method, 
+                      const char* hostname, 
+                      const char* location, 
+                      struct easy_http_headers* headers,
+                      const char* requestBodyFormat,
+                      va_list args) {
+  int res = 0;
+  struct http_request* req;
+  int port = isSecure ? 443 : 80;
+  
+  if ((res = networking_easy_new_http_va(&req, method, hostname, location, headers, requestBodyFormat, args)) < 0)
+    return res;
+  
+  res = networking_easy_send_http(req, NULL, isSecure, hostname, port, sink);
+  free((char*) req->requestData);
+  http_request_free(req);
+  return res;
+}
+
 int networking_easy_do_http_va(void** responseBodyPtr, 
                             size_t* responseBodyLengthPtr, 
                             bool isSecure,
@@ -185,40 +421,20 @@ int networking_easy_do_http_va(void** responseBodyPtr,
                             const char* requestBodyFormat,
                             va_list args) {
   int res = 0;
-  struct http_request* req;
   char* responseBody = NULL;
   size_t responseBodyLength = 0;
-  int port = isSecure ? 443 : 80;
   
-  if ((res = networking_easy_new_http_va(&req, method, hostname, location, headers, requestBodyFormat, args)) < 0)
-    goto create_request_error;
+  // Body preallocated from Content-Length and handed to
+  // caller without another copy, bodies are JSON responses
+  // so nothing bigger than decoder accepts is collected
+  struct http_body_sink_memory sink;
+  http_body_sink_memory_init(&sink, JSON_DECODE_MAX_BYTES);
   
-  FILE* memfd = open_memstream(&responseBody, &responseBodyLength);
-  if (!memfd) {
-    res = -ENOMEM;
-    goto memfd_open_error;
-  }
+  res = sendHttpVa(&sink.super, isSecure, method, hostname, location, headers, requestBodyFormat, args);
+  if (res >= 0)
+    responseBody = http_body_sink_memory_take(&sink, &responseBodyLength);
+  http_body_sink_memory_cleanup(&sink);
   
-  struct transport* connection;
-  if ((res = networking_easy_new_connection(isSecure, hostname, port, &connection)) < 0)
-    goto connect_error;
-  
-  if ((res = http_request_send(req, connection)) < 0)
-    goto send_error;
-  if ((res = http_response_recv(NULL, connection, memfd)) < 0)
-    goto receive_error;
-
-receive_error:
-send_error:
-  connection->close(connection);
-connect_error:
-  fclose(memfd);
-  if (res < 0)
-    free(responseBody);
-memfd_open_error:
-  free((char*) req->requestData);
-  http_request_free(req);
-create_request_error:
   if (res < 0)
     responseBody = NULL;
   if (!responseBody)
@@ -235,6 +451,27 @@ create_request_error:
   return res;
 }
 
+// Streaming decode with built-in decoder, dead code in default
+// config as CONFIG_JSON_LAZY_RESPONSES (default y) collects whole
+// body and decodes it lazily instead
+#if IS_ENABLED(CONFIG_JSON_DECODER_DEFAULT_BUILTIN) && !IS_ENABLED(CONFIG_JSON_LAZY_RESPONSES)
+struct json_body_sink {
+  struct http_body_sink super;
+  struct json_builtin_decoder decoder;
+};
+
+static int jsonSinkWrite(struct http_body_sink* _self, const void* data, size_t len) {
+  struct json_body_sink* self = container_of(_self, struct json_body_sink, super);
+  int res = json_builtin_decoder_feed(&self->decoder, data, len);
+  
+  // Malformed body reported once response is done, rest
+  // of it still read so connection can be reused
+  if (res == -EINVAL || res == -EOVERFLOW)
+    res = 0;
+  return res;
+}
+#endif
+
 int networking_easy_do_json_http_rpc_va(struct json_node** rootPtr, 
                                      bool isSecure,
                                      enum http_method method, 
@@ -243,28 +480,140 @@ int networking_easy_do_json_http_rpc_va(struct json_node** rootPtr,
                                      struct easy_http_headers* headers,
                                      const char* requestBodyFormat,
                                      va_list args) {
-  void* responseBody = NULL;
-  size_t responseBodyLen = 0;
   struct json_node* root = NULL;
   int res = 0;
+  int decodeRes = 0;
+
+#if IS_ENABLED(CONFIG_JSON_DECODER_DEFAULT_BUILTIN) && !IS_ENABLED(CONFIG_JSON_LAZY_RESPONSES)
+  // Decoded as body arrives instead of collecting it first
+  // (into one document, callers only read the response and
+  // free it, if allocating it fails nodes just get malloc'ed)
+  struct json_body_sink sink = {
+    .super.write = jsonSinkWrite
+  };
+  json_builtin_decoder_init(&sink.decoder, json_document_new());
+  
+  res = sendHttpVa(&sink.super, isSecure, method, hostname, location, headers, requestBodyFormat, args);
+  if (res >= 0 && rootPtr)
+    decodeRes = json_builtin_decoder_finish(&sink.decoder, &root);
+  json_builtin_decoder_cleanup(&sink.decoder);
+  if (res < 0)
+    goto request_error;
+#else
+  void* responseBody = NULL;
+  size_t responseBodyLen = 0;
 
   if ((res = networking_easy_do_http_va(&responseBody, &responseBodyLen, isSecure, method, hostname, location, headers, requestBodyFormat, args)) < 0)
     goto request_error;
   
+  // Callers only read few fields through json_schema_load
+  if (rootPtr && IS_ENABLED(CONFIG_JSON_LAZY_RESPONSES))
+    decodeRes = json_decode_lazy(&root, responseBody, responseBodyLen);
+  else if (rootPtr)
+    decodeRes = json_decode_default_document(&root, responseBody, responseBodyLen);
+  free(responseBody);
+#endif
+  
   char* errmsg = NULL;
-  int decodeRes;
-  if (rootPtr && (decodeRes = json_decode_default(&root, responseBody, responseBodyLen)) < 0) {
+  if (decodeRes < 0) {
     pr_error("Failed parsing response from '%s://%s/%s': %s (Errno: %d, Response code: %d)", isSecure ? "https" : "http", hostname, location, errmsg ? errmsg : "Error message unavailable", decodeRes, res);
     free(errmsg);
     root = NULL;
-    goto fail_parsing;
   }
 
-fail_parsing:
-  free(responseBody);
 request_error:
   if (res >= 0 && rootPtr)
     *rootPtr = root;
   
   return res;
 }
+
+struct json_rpc_async {
+  struct http_request* request;
+  struct http_body_sink_memory sink;
+  easy_json_rpc_callback callback;
+  void* udata;
+};
+
+static void freeJsonRpcAsync(struct json_rpc_async* self) {
+  http_body_sink_memory_cleanup(&self->sink);
+  free((char*) self->request->requestData);
+  http_request_free(self->request);
+  free(self);
+}
+
+// Body always collected first, decoders can't be fed across
+// I/O callbacks on different threads
+static void onJsonRpcDone(void* udata, int res) {
+  struct json_rpc_async* self = udata;
+  struct json_node* root = NULL;
+  int decodeRes = 0;
+  if (res >= 0 && IS_ENABLED(CONFIG_JSON_LAZY_RESPONSES))
+    decodeRes = json_decode_lazy(&root, self->sink.data, self->sink.length);
+  else if (res >= 0)
+    decodeRes = json_decode_default_document(&root, self->sink.data, self->sink.length);
+  
+  if (decodeRes < 0) {
+    pr_error("Failed parsing JSON response (Errno: %d, Response code: %d)", decodeRes, res);
+    root = NULL;
+  }
+  
+  self->callback(self->udata, res, root);
+  freeJsonRpcAsync(self);
+}
+
+int networking_easy_do_json_http_rpc_async_va(easy_json_rpc_callback callback,
+                                           void* udata,
+                                           bool isSecure,
+                                           enum http_method method, 
+                                           const char* hostname, 
+                                           const char* location, 
+                                           struct easy_http_headers* headers,
+                                           const char* requestBodyFormat,
+                                           va_list args) {
+  int res = 0;
+  struct json_rpc_async* self = malloc(sizeof(*self));
+  if (!self)
+    return -ENOMEM;
+  
+  *self = (struct json_rpc_async) {
+    .callback = callback,
+    .udata = udata
+  };
+  http_body_sink_memory_init(&self->sink, JSON_DECODE_MAX_BYTES);
+  // Request is NULL without error if body can't be formatted
+  res = networking_easy_new_http_va(&self->request, method, hostname, location, headers, requestBodyFormat, args);
+  if (!self->request) {
+    res = res < 0 ? res : -ENOMEM;
+    goto request_creation_error;
+  }
+  
+  if ((res = networking_async_send_http(self->request, NULL, isSecure, hostname, isSecure ? 443 : 80, &self->sink.super, onJsonRpcDone, self)) < 0)
+    goto send_error;
+  return 0;
+
+send_error:
+  freeJsonRpcAsync(self);
+  return res;
+
+request_creation_error:
+  http_body_sink_memory_cleanup(&self->sink);
+  free(self);
+  return res;
+}
+
+int networking_easy_do_json_http_rpc_async(easy_json_rpc_callback callback,
+                                           void* udata,
+                                           bool isSecure,
+                                           enum http_method method, 
+                                           const char* hostname, 
+                                           const char* location, 
+                                           struct easy_http_headers* headers,
+                                           const char* requestBodyFormat,
+                                           ...) {
+  va_list args;
+  va_start(args, requestBodyFormat);
+  int res = networking_easy_do_json_http_rpc_async_va(callback, udata, isSecure, method, hostname, location, headers, requestBodyFormat, args);
+  va_end(args);
+  return res;
+}
@@ -5,6 +5,9 @@
 #include <stdbool.h>
 
 #include "http_request.h"
+#include "http_response.h"
+#include "http_pipeline.h"
+#include "http_body_sink.h"
 #include "networking/transport/transport.h"
 #include "parser/json/json.h"
 
@@ -15,11 +18,63 @@ struct easy_http_headers {
 };
 
 // Contain convenience wrappers for commonly used stuffs
+
+// Resolve, connect and handshake within `connectTimeoutMilis`
+// (-1 for no limit), returned transport has no deadline and
+// CONFIG_NETWORKING_IO_TIMEOUT as I/O timeout
+// Errors:
+// -ETIMEDOUT: Didn't connect in time
 int networking_easy_new_connection(bool isSecure, 
                                    const char* hostname, 
                                    uint16_t port, 
+                                   int connectTimeoutMilis,
                                    struct transport** result);
 
+// Same as networking_easy_new_connection but offering `alpn`
+// protocols (NULL terminated or NULL for none) in TLS handshake,
+// see transport_ssl_get_alpn for what server picked
+int networking_easy_new_connection_alpn(bool isSecure, 
+                                        const char* hostname, 
+                                        uint16_t port, 
+                                        int connectTimeoutMilis,
+                                        const char* const* alpn,
+                                        struct transport** result);
+
+// Send request and receive response over pooled connection
+// (reused if possible, HTTP/2 if server supports it). Retried once on new connection if
+// reused connection turns out closed by server
+// Limited by `req->timeouts` (set them to override defaults)
+// `response` must be initialized or NULL
+// Return http status code on success
+// Errors:
+// -ETIMEDOUT: Connect, read or write took too long or
+//             request didn't finish in time
+// Errors from connection_pool_get, http_request_send
+// and http_response_recv
+int networking_easy_send_http(struct http_request* req,
+                              struct http_response* response,
+                              bool isSecure,
+                              const char* hostname,
+                              uint16_t port,
+                              struct http_body_sink* sink);
+
+// Pipeline requests to same host over pooled connection(s)
+// (or run them as concurrent streams if connection is HTTP/2),
+// requests left unanswered when server closes connection
+// resent on new connection
+// Timeouts taken from first entry's request and request
+// timeout covers whole pipeline
+// Return 0 if all requests completed (result of each request
+// in its entry)
+// Errors:
+// -EINVAL: There non idempotent request
+// Or error of first failed request
+int networking_easy_send_http_pipelined(struct http_pipeline_entry* entries,
+                                        size_t count,
+                                        bool isSecure,
+                                        const char* hostname,
+                                        uint16_t port);
+
 // Conveniencly create and prepare HTTP request
 // return 0 on success
 // Negative errno on error
@@ -40,6 +95,8 @@ int networking_easy_new_http(struct http_request** result,
                              const char* requestBodyFormat,
                              ...);
 
+// Collect response body into malloc'ed `*response`, bodies
+// larger than CONFIG_JSON_DECODE_MAX_SIZE fail with -E2BIG
 int networking_easy_do_http_va(void** response, 
                             size_t* responseLength, 
                             bool isSecure,
@@ -78,5 +135,37 @@ int networking_easy_do_json_http_rpc(struct json_node** root,
                                      const char* requestBodyFormat,
                                      ...);
 
+// Called once with http status code or negative errno and
+// decoded response (owned by callee, NULL if request failed
+// or body isn't JSON)
+typedef void (*easy_json_rpc_callback)(void* udata, int res, struct json_node* root);
+
+// Asynchronous networking_easy_do_json_http_rpc, exchange
+// runs on I/O threads through networking_async_send_http
+// (so HTTP/1.1 only) and `callback` called from there,
+// `headers` and body only needed until this returns
+// Return 0 if request started or negative errno where
+// `callback` won't be called
+// Errors:
+// -ENOMEM: Not enough memory
+int networking_easy_do_json_http_rpc_async_va(easy_json_rpc_callback callback,
+                                           void* udata,
+                                           bool isSecure,
+                                           enum http_method method, 
+                                           const char* hostname, 
+                                           const char* location, 
+                                           struct easy_http_headers* headers,
+                                           const char* requestBodyFormat,
+                                           va_list args);
+int networking_easy_do_json_http_rpc_async(easy_json_rpc_callback callback,
+                                           void* udata,
+                                           bool isSecure,
+                                           enum http_method method, 
+                                           const char* hostname, 
+                                           const char* location, 
+                                           struct easy_http_headers* headers,
+                                           const char* requestBodyFormat,
+                                           ...);
+
 #endif
 
@@ -0,0 +1,428 @@
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+
+#include "happy_eyeballs.h"
+#include "config.h"
+#include "io/io_threads.h"
+#include "networking.h"
+#include "util/util.h"
+#include "vec.h"
+
+void happy_eyeballs_sort(struct ip_address* addresses, size_t count) {
+  // Stable interleave: at each position take next address of
+  // the wanted family if there still any
+  for (size_t i = 1; i < count; i++) {
+    enum ip_family wanted = addresses[i - 1].family == NETWORKING_IPV4 ? NETWORKING_IPV6 : NETWORKING_IPV4;
+    if (addresses[i].family == wanted)
+      continue;
+
+    size_t found = i + 1;
+    while (found < count && addresses[found].family != wanted)
+      found++;
+    if (found >= count)
+      break;
+
+    struct ip_address tmp = addresses[found];
+    memmove(&addresses[i + 1], &addresses[i], (found - i) * sizeof(*addresses));
+    addresses[i] = tmp;
+  }
+}
+
+struct attempt {
+  int fd;
+  size_t index;
+};
+
+static void closeAttempts(struct attempt* attempts, size_t count, int except) {
+  for (size_t i = 0; i < count; i++)
+    if (attempts[i].fd != except)
+      close(attempts[i].fd);
+}
+
+// Milliseconds until `at` (rounded up, never negative)
+static int milisUntil(double at, double now) {
+  if (at <= now)
+    return 0;
+  return (int) ((at - now) * 1000.0) + 1;
+}
+
+int happy_eyeballs_connect(struct ip_address* addresses, size_t count, uint16_t port, int timeoutMilis, struct ip_address* winner) {
+  int res = 0;
+  if (count == 0)
+    return -EINVAL;
+
+  struct attempt* attempts = calloc(count, sizeof(*attempts));
+  struct pollfd* pollFds = calloc(count, sizeof(*pollFds));
+  if (!attempts || !pollFds) {
+    res = -ENOMEM;
+    goto alloc_error;
+  }
+
+  size_t activeCount = 0;
+  size_t next = 0;
+  int lastError = -ECONNREFUSED;
+  int resultFd = -1;
+  size_t resultIndex = 0;
+
+  double now = util_get_monotonic();
+  double deadline = timeoutMilis < 0 ? -1 : now + timeoutMilis / 1000.0;
+  double nextAttemptAt = now;
+
+  while (resultFd < 0) {
+    now = util_get_monotonic();
+    if (deadline >= 0 && now >= deadline) {
+      res = -ETIMEDOUT;
+      goto race_failed;
+    }
+
+    if (next < count && (activeCount == 0 || now >= nextAttemptAt)) {
+      struct ip_address addr = addresses[next];
+      addr.port = port;
+
+      int fd = -1;
+      res = networking_connect_nonblocking(&addr, NETWORKING_TCP, &fd);
+      if (res == 0) {
+        resultFd = fd;
+        resultIndex = next;
+        break;
+      }
+
+      if (res == -EINPROGRESS) {
+        attempts[activeCount] = (struct attempt) {
+          .fd = fd,
+          .index = next
+        };
+        activeCount++;
+        nextAttemptAt = now + CONFIG_NETWORKING_CONNECT_ATTEMPT_DELAY / 1000.0;
+      } else {
+        // Failed right away (e.g. no route for the family)
+        lastError = res;
+      }
+      next++;
+      continue;
+    }
+
+    if (activeCount == 0) {
+      res = lastError;
+      goto race_failed;
+    }
+
+    int waitMilis = -1;
+    if (next < count)
+      waitMilis = milisUntil(nextAttemptAt, now);
+    if (deadline >= 0 && (waitMilis < 0 || milisUntil(deadline, now) < waitMilis))
+      waitMilis = milisUntil(deadline, now);
+
+    for (size_t i = 0; i < activeCount; i++)
+      pollFds[i] = (struct pollfd) {
+        .fd = attempts[i].fd,
+        .events = POLLOUT
+      };
+
+    int pollRes = poll(pollFds, activeCount, waitMilis);
+    if (pollRes < 0 && errno != EINTR) {
+      res = -EFAULT;
+      goto race_failed;
+    }
+    if (pollRes <= 0)
+      continue;
+
+    // Compact attempts while checking them
+    size_t kept = 0;
+    for (size_t i = 0; i < activeCount; i++) {
+      if (pollFds[i].revents == 0 || resultFd >= 0) {
+        attempts[kept++] = attempts[i];
+        continue;
+      }
+
+      if ((res = networking_connect_finish(attempts[i].fd)) == 0) {
+        resultFd = attempts[i].fd;
+        resultIndex = attempts[i].index;
+        attempts[kept++] = attempts[i];
+        continue;
+      }
+
+      lastError = res;
+      close(attempts[i].fd);
+
+      // Don't wait rest of the delay for dead attempt
+      nextAttemptAt = now;
+    }
+    activeCount = kept;
+  }
+
+  closeAttempts(attempts, activeCount, resultFd);
+  if (winner) {
+    *winner = addresses[resultIndex];
+    winner->port = port;
+  }
+  free(attempts);
+  free(pollFds);
+  return resultFd;
+
+race_failed:
+  closeAttempts(attempts, activeCount, -1);
+alloc_error:
+  free(attempts);
+  free(pollFds);
+  return res;
+}
+
+struct async_race;
+
+struct async_attempt {
+  struct io_watch watch;
+  struct async_race* race;
+  size_t index;
+};
+
+struct async_race {
+  pthread_mutex_t lock;
+
+  // One for the race until its callback called and one
+  // for each attempt still connecting
+  int refs;
+  struct io_timer timer;
+
+  struct ip_address* addresses;
+  size_t count;
+  size_t next;
+  uint16_t port;
+  double deadline;
+  int lastError;
+  bool isFinished;
+
+  // Attempts still connecting, aborted once race is over
+  vec_t(struct async_attempt*) attempts;
+
+  happy_eyeballs_callback callback;
+  void* udata;
+};
+
+static void unrefRace(struct async_race* self) {
+  pthread_mutex_lock(&self->lock);
+  bool isLast = --self->refs == 0;
+  pthread_mutex_unlock(&self->lock);
+  if (!isLast)
+    return;
+
+  vec_deinit(&self->attempts);
+  pthread_mutex_destroy(&self->lock);
+  free(self->addresses);
+  free(self);
+}
+
+// Must be called with lock held. Remaining attempts are shut
+// down so their watches fire and clean them up
+static void markFinished(struct async_race* self) {
+  self->isFinished = true;
+
+  struct async_attempt* attempt;
+  int i;
+  vec_foreach(&self->attempts, attempt, i)
+    shutdown(attempt->watch.fd, SHUT_RDWR);
+}
+
+// Called after markFinished without lock held
+static void completeRace(struct async_race* self, int res, size_t winnerIndex) {
+  io_timer_cancel(&self->timer);
+
+  struct ip_address winner;
+  if (res >= 0) {
+    winner = self->addresses[winnerIndex];
+    winner.port = self->port;
+  }
+  self->callback(self->udata, res, res >= 0 ? &winner : NULL);
+  unrefRace(self);
+}
+
+static void onAttemptReady(struct io_watch* watch, int events);
+
+// Start connecting to next address, ones failing right away
+// are skipped. Must be called with lock held
+// Return connected fd (index stored in `connectedIndex`),
+// -EINPROGRESS if attempt started or last error if there no
+// more addresses
+static int startNextAttempt(struct async_race* self, size_t* connectedIndex) {
+  while (self->next < self->count) {
+    size_t index = self->next++;
+    struct ip_address addr = self->addresses[index];
+    addr.port = self->port;
+
+    int fd = -1;
+    int res = networking_connect_nonblocking(&addr, NETWORKING_TCP, &fd);
+    if (res == 0) {
+      *connectedIndex = index;
+      return fd;
+    }
+
+    // Failed right away (e.g. no route for the family)
+    if (res != -EINPROGRESS) {
+      self->lastError = res;
+      continue;
+    }
+
+    struct async_attempt* attempt = malloc(sizeof(*attempt));
+    if (!attempt || vec_reserve(&self->attempts, self->attempts.length + 1) < 0) {
+      free(attempt);
+      close(fd);
+      self->lastError = -ENOMEM;
+      continue;
+    }
+
+    *attempt = (struct async_attempt) {
+      .race = self,
+      .index = index
+    };
+    io_watch_init(&attempt->watch, fd, onAttemptReady, attempt);
+    if ((res = io_watch_arm(&attempt->watch, IO_EVENT_WRITE)) < 0) {
+      free(attempt);
+      close(fd);
+      self->lastError = res;
+      continue;
+    }
+
+    vec_push(&self->attempts, attempt);
+    self->refs++;
+    return -EINPROGRESS;
+  }
+  return self->lastError;
+}
+
+// Wake up for next attempt or for deadline whichever nearer
+static int scheduleTimer(struct async_race* self) {
+  double at = self->deadline;
+  if (self->next < self->count) {
+    double nextAttemptAt = util_get_monotonic() + CONFIG_NETWORKING_CONNECT_ATTEMPT_DELAY / 1000.0;
+    if (at < 0 || nextAttemptAt < at)
+      at = nextAttemptAt;
+  }
+
+  if (at < 0)
+    return 0;
+  return io_timer_start(&self->timer, at);
+}
+
+// Start next attempt and keep the timer going, must be called
+// with lock held
+// Return -EINPROGRESS while race continues else its result
+// (connected fd or error) and race is marked finished
+static int advance(struct async_race* self, size_t* winnerIndex) {
+  int res = startNextAttempt(self, winnerIndex);
+  if (res >= 0)
+    goto race_over;
+
+  // Out of addresses but earlier attempts may still connect
+  if (self->attempts.length == 0)
+    goto race_over;
+  if ((res = scheduleTimer(self)) < 0)
+    goto race_over;
+  return -EINPROGRESS;
+
+race_over:
+  markFinished(self);
+  return res;
+}
+
+static void onAttemptReady(struct io_watch* watch, int events) {
+  struct async_attempt* attempt = watch->udata;
+  struct async_race* self = attempt->race;
+  int fd = watch->fd;
+  size_t winnerIndex = attempt->index;
+  int res = networking_connect_finish(fd);
+
+  pthread_mutex_lock(&self->lock);
+  io_watch_remove(watch);
+  vec_remove(&self->attempts, attempt);
+  free(attempt);
+
+  // Lost the race (or shut down by markFinished)
+  if (self->isFinished) {
+    pthread_mutex_unlock(&self->lock);
+    close(fd);
+    goto attempt_done;
+  }
+
+  if (res == 0) {
+    markFinished(self);
+    pthread_mutex_unlock(&self->lock);
+    completeRace(self, fd, winnerIndex);
+    goto attempt_done;
+  }
+
+  // Don't wait rest of the delay for dead attempt
+  close(fd);
+  self->lastError = res;
+  res = advance(self, &winnerIndex);
+  pthread_mutex_unlock(&self->lock);
+  if (res != -EINPROGRESS)
+    completeRace(self, res, winnerIndex);
+
+attempt_done:
+  unrefRace(self);
+}
+
+static void onAttemptTimer(struct io_timer* timer) {
+  struct async_race* self = timer->udata;
+  size_t winnerIndex = 0;
+  int res;
+
+  pthread_mutex_lock(&self->lock);
+  if (self->isFinished) {
+    pthread_mutex_unlock(&self->lock);
+    return;
+  }
+
+  if (self->deadline >= 0 && util_get_monotonic() >= self->deadline) {
+    res = -ETIMEDOUT;
+    markFinished(self);
+  } else {
+    res = advance(self, &winnerIndex);
+  }
+  pthread_mutex_unlock(&self->lock);
+
+  if (res != -EINPROGRESS)
+    completeRace(self, res, winnerIndex);
+}
+
+int happy_eyeballs_connect_async(struct ip_address* addresses, size_t count, uint16_t port, double deadline, happy_eyeballs_callback callback, void* udata) {
+  if (count == 0)
+    return -EINVAL;
+
+  struct async_race* self = malloc(sizeof(*self));
+  if (!self)
+    return -ENOMEM;
+
+  *self = (struct async_race) {
+    .refs = 1,
+    .count = count,
+    .port = port,
+    .deadline = deadline < 0 ? -1 : deadline,
+    .lastError = -ECONNREFUSED,
+    .callback = callback,
+    .udata = udata
+  };
+
+  if (!(self->addresses = malloc(count * sizeof(*addresses)))) {
+    free(self);
+    return -ENOMEM;
+  }
+  memcpy(self->addresses, addresses, count * sizeof(*addresses));
+
+  pthread_mutex_init(&self->lock, NULL);
+  vec_init(&self->attempts);
+  io_timer_init(&self->timer, onAttemptTimer, self);
+
+  size_t winnerIndex = 0;
+  pthread_mutex_lock(&self->lock);
+  int res = advance(self, &winnerIndex);
+  pthread_mutex_unlock(&self->lock);
+  if (res != -EINPROGRESS)
+    completeRace(self, res, winnerIndex);
+  return 0;
+}
@@ -0,0 +1,52 @@
+#ifndef _headers_1671948610_FluffyLauncher_happy_eyeballs
+#define _headers_1671948610_FluffyLauncher_happy_eyeballs
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "networking.h"
+
+// Happy Eyeballs (RFC 8305): race non blocking connects
+// to every address with staggered starts so one slow or
+// blackholed address (or whole family) doesn't stall
+
+// Reorder addresses in place alternating between families,
+// starting with family of first address (relative order
+// within each family kept)
+void happy_eyeballs_sort(struct ip_address* addresses, size_t count);
+
+// Connect to `port` of `addresses` (tried in order given, see
+// happy_eyeballs_sort) starting next attempt every
+// CONFIG_NETWORKING_CONNECT_ATTEMPT_DELAY ms or as soon as
+// previous attempt failed, first established connection wins
+// and others are closed
+// Return connected non blocking socket fd and the address
+// used stored into `winner` (if not NULL)
+// Errors:
+// -ETIMEDOUT: No connection established in `timeoutMilis`
+//             (-1 for no limit)
+// -EINVAL: No addresses
+// Or error of last failed attempt (see networking_connect)
+[[nodiscard]]
+int happy_eyeballs_connect(struct ip_address* addresses, size_t count, uint16_t port, int timeoutMilis, struct ip_address* winner);
+
+// `res` is connected non blocking socket fd and `winner` the
+// address used, or negative errno and `winner` is NULL
+typedef void (*happy_eyeballs_callback)(void* udata, int res, struct ip_address* winner);
+
+// Same race as happy_eyeballs_connect but attempts are waited
+// by I/O threads and staggered by I/O timer, `addresses` are
+// copied. `callback` is called exactly once from I/O or timer
+// thread (or before this returns if every address failed
+// right away)
+// `deadline` is util_get_monotonic time (negative for none)
+// Return 0 if race started
+// Errors:
+// -EINVAL: No addresses
+// -ENOMEM: Not enough memory
+// Connect errors (and -ETIMEDOUT) are given to `callback`
+[[nodiscard]]
+int happy_eyeballs_connect_async(struct ip_address* addresses, size_t count, uint16_t port, double deadline, happy_eyeballs_callback callback, void* udata);
+
+#endif
+
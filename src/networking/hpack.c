@@ -0,0 +1,613 @@
+#include <errno.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+#include "hpack.h"
+#include "vec.h"
+
+#define STATIC_TABLE_SIZE 61
+
+// Appendix A
+static const struct {
+  const char* name;
+  const char* value;
+} staticTable[STATIC_TABLE_SIZE] = {
+  {":authority", ""},
+  {":method", "GET"},
+  {":method", "POST"},
+  {":path", "/"},
+  {":path", "/index.html"},
+  {":scheme", "http"},
+  {":scheme", "https"},
+  {":status", "200"},
+  {":status", "204"},
+  {":status", "206"},
+  {":status", "304"},
+  {":status", "400"},
+  {":status", "404"},
+  {":status", "500"},
+  {"accept-charset", ""},
+  {"accept-encoding", "gzip, deflate"},
+  {"accept-language", ""},
+  {"accept-ranges", ""},
+  {"accept", ""},
+  {"access-control-allow-origin", ""},
+  {"age", ""},
+  {"allow", ""},
+  {"authorization", ""},
+  {"cache-control", ""},
+  {"content-disposition", ""},
+  {"content-encoding", ""},
+  {"content-language", ""},
+  {"content-length", ""},
+  {"content-location", ""},
+  {"content-range", ""},
+  {"content-type", ""},
+  {"cookie", ""},
+  {"date", ""},
+  {"etag", ""},
+  {"expect", ""},
+  {"expires", ""},
+  {"from", ""},
+  {"host", ""},
+  {"if-match", ""},
+  {"if-modified-since", ""},
+  {"if-none-match", ""},
+  {"if-range", ""},
+  {"if-unmodified-since", ""},
+  {"last-modified", ""},
+  {"link", ""},
+  {"location", ""},
+  {"max-forwards", ""},
+  {"proxy-authenticate", ""},
+  {"proxy-authorization", ""},
+  {"range", ""},
+  {"referer", ""},
+  {"refresh", ""},
+  {"retry-after", ""},
+  {"server", ""},
+  {"set-cookie", ""},
+  {"strict-transport-security", ""},
+  {"transfer-encoding", ""},
+  {"user-agent", ""},
+  {"vary", ""},
+  {"via", ""},
+  {"www-authenticate", ""}
+};
+
+// Huffman code (Appendix B) is canonical so code lengths are
+// enough to rebuild it, symbol 256 is EOS
+#define HUFFMAN_SYMBOLS 257
+#define HUFFMAN_MAX_LENGTH 30
+#define HUFFMAN_EOS 256
+
+static const uint8_t huffmanLengths[HUFFMAN_SYMBOLS] = {
+  13, 23, 28, 28, 28, 28, 28, 28, 28, 24, 30, 28, 28, 30, 28, 28,
+  28, 28, 28, 28, 28, 28, 30, 28, 28, 28, 28, 28, 28, 28, 28, 28,
+   6, 10, 10, 12, 13,  6,  8, 11, 10, 10,  8, 11,  8,  6,  6,  6,
+   5,  5,  5,  6,  6,  6,  6,  6,  6,  6,  7,  8, 15,  6, 12, 10,
+  13,  6,  7,  7,  7,  7,  7,  7,  7,  7,  7,  7,  7,  7,  7,  7,
+   7,  7,  7,  7,  7,  7,  7,  7,  8,  7,  8, 13, 19, 13, 14,  6,
+  15,  5,  6,  5,  6,  5,  6,  6,  6,  5,  7,  7,  6,  6,  6,  5,
+   6,  7,  6,  5,  5,  6,  7,  7,  7,  7,  7, 15, 11, 14, 13, 28,
+  20, 22, 20, 20, 22, 22, 22, 23, 22, 23, 23, 23, 23, 23, 24, 23,
+  24, 24, 22, 23, 24, 23, 23, 23, 23, 21, 22, 23, 22, 23, 23, 24,
+  22, 21, 20, 22, 22, 23, 23, 21, 23, 22, 22, 24, 21, 22, 23, 23,
+  21, 21, 22, 21, 23, 22, 23, 23, 20, 22, 22, 22, 23, 22, 22, 23,
+  26, 26, 20, 19, 22, 23, 22, 25, 26, 26, 26, 27, 27, 26, 24, 25,
+  19, 21, 26, 27, 27, 26, 27, 24, 21, 21, 26, 26, 28, 27, 27, 27,
+  20, 24, 20, 21, 22, 21, 21, 23, 22, 22, 25, 25, 24, 24, 26, 23,
+  26, 27, 26, 26, 27, 27, 27, 27, 27, 28, 27, 27, 27, 27, 27, 26,
+  30
+};
+
+static uint32_t huffmanCodes[HUFFMAN_SYMBOLS];
+
+// Canonical decoding: codes of each length are consecutive
+static uint32_t firstCode[HUFFMAN_MAX_LENGTH + 1];
+static uint16_t firstSymbolIndex[HUFFMAN_MAX_LENGTH + 1];
+static uint16_t lengthCount[HUFFMAN_MAX_LENGTH + 1];
+static uint16_t sortedSymbols[HUFFMAN_SYMBOLS];
+static pthread_once_t huffmanOnce = PTHREAD_ONCE_INIT;
+
+static void buildHuffman() {
+  for (int symbol = 0; symbol < HUFFMAN_SYMBOLS; symbol++)
+    lengthCount[huffmanLengths[symbol]]++;
+
+  uint32_t code = 0;
+  uint16_t index = 0;
+  for (int length = 1; length <= HUFFMAN_MAX_LENGTH; length++) {
+    firstCode[length] = code;
+    firstSymbolIndex[length] = index;
+    code = (code + lengthCount[length]) << 1;
+    index += lengthCount[length];
+  }
+
+  uint32_t nextCode[HUFFMAN_MAX_LENGTH + 1];
+  uint16_t nextIndex[HUFFMAN_MAX_LENGTH + 1];
+  memcpy(nextCode, firstCode, sizeof(nextCode));
+  memcpy(nextIndex, firstSymbolIndex, sizeof(nextIndex));
+  for (int symbol = 0; symbol < HUFFMAN_SYMBOLS; symbol++) {
+    int length = huffmanLengths[symbol];
+    huffmanCodes[symbol] = nextCode[length]++;
+    sortedSymbols[nextIndex[length]++] = symbol;
+  }
+}
+
+// Return decoded length or -EFAULT
+static ssize_t huffmanDecode(const uint8_t* data, size_t length, char* output) {
+  char* cur = output;
+  uint32_t code = 0;
+  int codeLength = 0;
+  for (size_t i = 0; i < length; i++) {
+    for (int bit = 7; bit >= 0; bit--) {
+      code = (code << 1) | ((data[i] >> bit) & 1);
+      codeLength++;
+
+      uint32_t offset = code - firstCode[codeLength];
+      if (offset < lengthCount[codeLength]) {
+        uint16_t symbol = sortedSymbols[firstSymbolIndex[codeLength] + offset];
+        if (symbol == HUFFMAN_EOS)
+          return -EFAULT;
+        *cur++ = symbol;
+        code = 0;
+        codeLength = 0;
+      } else if (codeLength == HUFFMAN_MAX_LENGTH) {
+        return -EFAULT;
+      }
+    }
+  }
+
+  // Padding is most significant bits of EOS (all ones) and
+  // shorter than a byte (section 5.2)
+  if (codeLength > 7 || code != (1u << codeLength) - 1)
+    return -EFAULT;
+  return cur - output;
+}
+
+static size_t huffmanEncodedLength(const char* string, size_t length) {
+  size_t bits = 0;
+  for (size_t i = 0; i < length; i++)
+    bits += huffmanLengths[(uint8_t) string[i]];
+  return (bits + 7) / 8;
+}
+
+static int reserveOutput(vec_byte_t* output, size_t extra) {
+  size_t needed = output->length + extra;
+  if (needed <= (size_t) output->capacity)
+    return 0;
+  if (needed > INT32_MAX)
+    return -ENOMEM;
+
+  size_t newCapacity = output->capacity > 0 ? output->capacity : 256;
+  while (newCapacity < needed)
+    newCapacity *= 2;
+  if (vec_reserve(output, newCapacity) < 0)
+    return -ENOMEM;
+  return 0;
+}
+
+static int appendInteger(vec_byte_t* output, uint8_t flags, int prefixBits, size_t value) {
+  int res = 0;
+  uint8_t bytes[16];
+  int length = 0;
+  size_t max = (1u << prefixBits) - 1;
+
+  if (value < max) {
+    bytes[length++] = flags | value;
+  } else {
+    bytes[length++] = flags | max;
+    value -= max;
+    while (value >= 128) {
+      bytes[length++] = (value & 127) | 128;
+      value >>= 7;
+    }
+    bytes[length++] = value;
+  }
+
+  if ((res = reserveOutput(output, length)) < 0)
+    return res;
+  memcpy(output->data + output->length, bytes, length);
+  output->length += length;
+  return 0;
+}
+
+static int appendString(vec_byte_t* output, const char* string, size_t length) {
+  int res = 0;
+  size_t huffmanLength = huffmanEncodedLength(string, length);
+  bool useHuffman = huffmanLength < length;
+  if ((res = appendInteger(output, useHuffman ? 0x80 : 0, 7, useHuffman ? huffmanLength : length)) < 0)
+    return res;
+  if ((res = reserveOutput(output, useHuffman ? huffmanLength : length)) < 0)
+    return res;
+
+  if (!useHuffman) {
+    memcpy(output->data + output->length, string, length);
+    output->length += length;
+    return 0;
+  }
+
+  uint64_t pending = 0;
+  int pendingBits = 0;
+  for (size_t i = 0; i < length; i++) {
+    uint8_t symbol = string[i];
+    pending = (pending << huffmanLengths[symbol]) | huffmanCodes[symbol];
+    pendingBits += huffmanLengths[symbol];
+    while (pendingBits >= 8) {
+      pendingBits -= 8;
+      output->data[output->length++] = pending >> pendingBits;
+    }
+    pending &= (1u << pendingBits) - 1;
+  }
+
+  // Pad with EOS prefix
+  if (pendingBits > 0)
+    output->data[output->length++] = (pending << (8 - pendingBits)) | ((1u << (8 - pendingBits)) - 1);
+  return 0;
+}
+
+// Dynamic table
+
+static size_t entrySize(size_t nameLength, size_t valueLength) {
+  return nameLength + valueLength + 32;
+}
+
+static void tableInit(struct hpack_table* self) {
+  *self = (struct hpack_table) {
+    .maxSize = HPACK_DEFAULT_TABLE_SIZE
+  };
+}
+
+static void tableCleanup(struct hpack_table* self) {
+  for (size_t i = 0; i < self->count; i++)
+    free(self->entries[i].name);
+  free(self->entries);
+  *self = (struct hpack_table) {};
+}
+
+static void evictOldest(struct hpack_table* self) {
+  struct hpack_entry* oldest = &self->entries[0];
+  self->size -= entrySize(oldest->nameLength, oldest->valueLength);
+  free(oldest->name);
+  memmove(&self->entries[0], &self->entries[1], (self->count - 1) * sizeof(*self->entries));
+  self->count--;
+}
+
+static void tableSetMaxSize(struct hpack_table* self, size_t maxSize) {
+  self->maxSize = maxSize;
+  while (self->size > self->maxSize)
+    evictOldest(self);
+}
+
+// Copy of field made before evicting as name may refer to
+// evicted entry. `*stored` false if it didn't fit (table is
+// emptied then, section 4.4) and caller must free copy
+static int tableInsert(struct hpack_table* self, const char* name, size_t nameLength, const char* value, size_t valueLength, struct hpack_entry* result, bool* stored) {
+  char* copy = malloc(nameLength + valueLength + 2);
+  if (!copy)
+    return -ENOMEM;
+  memcpy(copy, name, nameLength);
+  copy[nameLength] = '\0';
+  memcpy(copy + nameLength + 1, value, valueLength);
+  copy[nameLength + 1 + valueLength] = '\0';
+
+  struct hpack_entry entry = {
+    .name = copy,
+    .nameLength = nameLength,
+    .value = copy + nameLength + 1,
+    .valueLength = valueLength
+  };
+
+  size_t size = entrySize(nameLength, valueLength);
+  while (self->count > 0 && self->size + size > self->maxSize)
+    evictOldest(self);
+
+  *result = entry;
+  *stored = false;
+  if (size > self->maxSize)
+    return 0;
+
+  if (self->count == self->capacity) {
+    size_t newCapacity = self->capacity > 0 ? self->capacity * 2 : 16;
+    struct hpack_entry* newEntries = realloc(self->entries, newCapacity * sizeof(*newEntries));
+    if (!newEntries) {
+      free(copy);
+      return -ENOMEM;
+    }
+    self->entries = newEntries;
+    self->capacity = newCapacity;
+  }
+
+  self->entries[self->count++] = entry;
+  self->size += size;
+  *stored = true;
+  return 0;
+}
+
+// Index as in section 2.3.3, 0 if out of range
+static bool lookupIndex(struct hpack_table* self, size_t index, const char** name, size_t* nameLength, const char** value, size_t* valueLength) {
+  if (index == 0)
+    return false;
+
+  if (index <= STATIC_TABLE_SIZE) {
+    *name = staticTable[index - 1].name;
+    *nameLength = strlen(*name);
+    *value = staticTable[index - 1].value;
+    *valueLength = strlen(*value);
+    return true;
+  }
+
+  size_t dynamicIndex = index - STATIC_TABLE_SIZE - 1;
+  if (dynamicIndex >= self->count)
+    return false;
+
+  struct hpack_entry* entry = &self->entries[self->count - 1 - dynamicIndex];
+  *name = entry->name;
+  *nameLength = entry->nameLength;
+  *value = entry->value;
+  *valueLength = entry->valueLength;
+  return true;
+}
+
+// Decoder
+
+void hpack_decoder_init(struct hpack_decoder* self) {
+  pthread_once(&huffmanOnce, buildHuffman);
+  *self = (struct hpack_decoder) {
+    .sizeLimit = HPACK_DEFAULT_TABLE_SIZE
+  };
+  tableInit(&self->table);
+}
+
+void hpack_decoder_cleanup(struct hpack_decoder* self) {
+  tableCleanup(&self->table);
+  free(self->scratch);
+  self->scratch = NULL;
+}
+
+static int decodeInteger(const uint8_t** cur, const uint8_t* end, int prefixBits, size_t* result) {
+  if (*cur >= end)
+    return -EFAULT;
+
+  size_t max = (1u << prefixBits) - 1;
+  size_t value = **cur & max;
+  (*cur)++;
+  if (value < max)
+    goto decoded;
+
+  // Anything above 2^28 is nonsense for any field
+  for (int shift = 0;; shift += 7) {
+    if (*cur >= end || shift > 21)
+      return -EFAULT;
+
+    uint8_t byte = *(*cur)++;
+    value += (size_t) (byte & 127) << shift;
+    if (!(byte & 128))
+      break;
+  }
+
+decoded:
+  *result = value;
+  return 0;
+}
+
+// Decode string into scratch at `*scratchUsed` (advanced past it)
+static int decodeString(struct hpack_decoder* self, const uint8_t** cur, const uint8_t* end, size_t* scratchUsed, size_t* offset, size_t* length) {
+  int res = 0;
+  if (*cur >= end)
+    return -EFAULT;
+
+  bool isHuffman = **cur & 0x80;
+  size_t encodedLength;
+  if ((res = decodeInteger(cur, end, 7, &encodedLength)) < 0)
+    return res;
+  if (encodedLength > (size_t) (end - *cur))
+    return -EFAULT;
+
+  // Shortest code is 5 bits
+  size_t maxLength = isHuffman ? encodedLength * 8 / 5 + 1 : encodedLength;
+  size_t needed = *scratchUsed + maxLength + 1;
+  if (needed > self->scratchCapacity) {
+    size_t newCapacity = self->scratchCapacity > 0 ? self->scratchCapacity : 256;
+    while (newCapacity < needed)
+      newCapacity *= 2;
+    char* newScratch = realloc(self->scratch, newCapacity);
+    if (!newScratch)
+      return -ENOMEM;
+    self->scratch = newScratch;
+    self->scratchCapacity = newCapacity;
+  }
+
+  char* output = self->scratch + *scratchUsed;
+  if (isHuffman) {
+    ssize_t decodedLength = huffmanDecode(*cur, encodedLength, output);
+    if (decodedLength < 0)
+      return decodedLength;
+    *length = decodedLength;
+  } else {
+    memcpy(output, *cur, encodedLength);
+    *length = encodedLength;
+  }
+  output[*length] = '\0';
+
+  *offset = *scratchUsed;
+  *scratchUsed += *length + 1;
+  *cur += encodedLength;
+  return 0;
+}
+
+// Literal field (section 6.2), `prefixBits` of name index
+static int decodeLiteral(struct hpack_decoder* self, const uint8_t** cur, const uint8_t* end, int prefixBits, bool addToTable, hpack_field_func callback, void* udata) {
+  int res = 0;
+  size_t scratchUsed = 0;
+  size_t nameIndex;
+  if ((res = decodeInteger(cur, end, prefixBits, &nameIndex)) < 0)
+    return res;
+
+  const char* name = NULL;
+  size_t nameLength = 0;
+  size_t nameOffset = 0;
+  if (nameIndex > 0) {
+    const char* unusedValue;
+    size_t unusedValueLength;
+    if (!lookupIndex(&self->table, nameIndex, &name, &nameLength, &unusedValue, &unusedValueLength))
+      return -EFAULT;
+  } else if ((res = decodeString(self, cur, end, &scratchUsed, &nameOffset, &nameLength)) < 0) {
+    return res;
+  }
+
+  size_t valueOffset;
+  size_t valueLength;
+  if ((res = decodeString(self, cur, end, &scratchUsed, &valueOffset, &valueLength)) < 0)
+    return res;
+
+  // Scratch may moved while decoding value
+  if (nameIndex == 0)
+    name = self->scratch + nameOffset;
+  const char* value = self->scratch + valueOffset;
+
+  if (!addToTable)
+    return callback(udata, name, nameLength, value, valueLength);
+
+  struct hpack_entry entry;
+  bool stored;
+  if ((res = tableInsert(&self->table, name, nameLength, value, valueLength, &entry, &stored)) < 0)
+    return res;
+  res = callback(udata, entry.name, entry.nameLength, entry.value, entry.valueLength);
+  if (!stored)
+    free(entry.name);
+  return res;
+}
+
+int hpack_decode(struct hpack_decoder* self, const uint8_t* data, size_t length, hpack_field_func callback, void* udata) {
+  int res = 0;
+  const uint8_t* cur = data;
+  const uint8_t* end = data + length;
+
+  while (cur < end) {
+    uint8_t first = *cur;
+    if (first & 0x80) {
+      size_t index;
+      const char* name;
+      const char* value;
+      size_t nameLength;
+      size_t valueLength;
+      if ((res = decodeInteger(&cur, end, 7, &index)) < 0)
+        return res;
+      if (!lookupIndex(&self->table, index, &name, &nameLength, &value, &valueLength))
+        return -EFAULT;
+      if ((res = callback(udata, name, nameLength, value, valueLength)) < 0)
+        return res;
+    } else if (first & 0x40) {
+      if ((res = decodeLiteral(self, &cur, end, 6, true, callback, udata)) < 0)
+        return res;
+    } else if (first & 0x20) {
+      size_t maxSize;
+      if ((res = decodeInteger(&cur, end, 5, &maxSize)) < 0)
+        return res;
+      if (maxSize > self->sizeLimit)
+        return -EFAULT;
+      tableSetMaxSize(&self->table, maxSize);
+    } else {
+      // Without indexing and never indexed differ only for
+      // intermediaries
+      if ((res = decodeLiteral(self, &cur, end, 4, false, callback, udata)) < 0)
+        return res;
+    }
+  }
+  return 0;
+}
+
+// Encoder
+
+void hpack_encoder_init(struct hpack_encoder* self) {
+  pthread_once(&huffmanOnce, buildHuffman);
+  *self = (struct hpack_encoder) {};
+  tableInit(&self->table);
+}
+
+void hpack_encoder_cleanup(struct hpack_encoder* self) {
+  tableCleanup(&self->table);
+}
+
+void hpack_encoder_set_max_size(struct hpack_encoder* self, size_t maxSize) {
+  // No point using more than default, saves memory
+  if (maxSize > HPACK_DEFAULT_TABLE_SIZE)
+    maxSize = HPACK_DEFAULT_TABLE_SIZE;
+  if (maxSize == self->table.maxSize)
+    return;
+
+  tableSetMaxSize(&self->table, maxSize);
+  self->sizeUpdatePending = true;
+}
+
+// Find full match (`*fullMatch` set) or else name only match, 0 if none
+static size_t findField(struct hpack_encoder* self, const char* name, size_t nameLength, const char* value, size_t valueLength, bool* fullMatch) {
+  size_t nameIndex = 0;
+  *fullMatch = false;
+
+  for (int i = 0; i < STATIC_TABLE_SIZE; i++) {
+    if (strcmp(staticTable[i].name, name) != 0)
+      continue;
+    if (strcmp(staticTable[i].value, value) == 0) {
+      *fullMatch = true;
+      return i + 1;
+    }
+    if (nameIndex == 0)
+      nameIndex = i + 1;
+  }
+
+  for (size_t i = 0; i < self->table.count; i++) {
+    struct hpack_entry* entry = &self->table.entries[self->table.count - 1 - i];
+    if (entry->nameLength != nameLength || memcmp(entry->name, name, nameLength) != 0)
+      continue;
+    if (entry->valueLength == valueLength && memcmp(entry->value, value, valueLength) == 0) {
+      *fullMatch = true;
+      return STATIC_TABLE_SIZE + 1 + i;
+    }
+    if (nameIndex == 0)
+      nameIndex = STATIC_TABLE_SIZE + 1 + i;
+  }
+  return nameIndex;
+}
+
+int hpack_encode(struct hpack_encoder* self, vec_byte_t* output, const char* name, const char* value, bool sensitive) {
+  int res = 0;
+  size_t nameLength = strlen(name);
+  size_t valueLength = strlen(value);
+
+  if (self->sizeUpdatePending) {
+    if ((res = appendInteger(output, 0x20, 5, self->table.maxSize)) < 0)
+      return res;
+    self->sizeUpdatePending = false;
+  }
+
+  bool fullMatch;
+  size_t index = findField(self, name, nameLength, value, valueLength, &fullMatch);
+  if (fullMatch && !sensitive)
+    return appendInteger(output, 0x80, 7, index);
+
+  // Too big for table, indexing would only flush it
+  bool addToTable = !sensitive && entrySize(nameLength, valueLength) <= self->table.maxSize;
+  uint8_t flags = addToTable ? 0x40 : (sensitive ? 0x10 : 0);
+  int prefixBits = addToTable ? 6 : 4;
+  if ((res = appendInteger(output, flags, prefixBits, index)) < 0)
+    return res;
+  if (index == 0 && (res = appendString(output, name, nameLength)) < 0)
+    return res;
+  if ((res = appendString(output, value, valueLength)) < 0)
+    return res;
+
+  if (addToTable) {
+    struct hpack_entry entry;
+    bool stored;
+    if ((res = tableInsert(&self->table, name, nameLength, value, valueLength, &entry, &stored)) < 0)
+      return res;
+    if (!stored)
+      free(entry.name);
+  }
+  return 0;
+}
+
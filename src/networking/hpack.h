@@ -0,0 +1,88 @@
+#ifndef _headers_1672295340_FluffyLauncher_hpack
+#define _headers_1672295340_FluffyLauncher_hpack
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "vec.h"
+
+// HPACK field compression for HTTP/2 (RFC 7541), one encoder
+// and one decoder per connection as both keep state across
+// header blocks
+
+typedef vec_t(uint8_t) vec_byte_t;
+
+// Dynamic table size both sides start with and most we allow
+#define HPACK_DEFAULT_TABLE_SIZE 4096
+
+struct hpack_entry {
+  // Name and value in one allocation (name lowercase)
+  char* name;
+  size_t nameLength;
+  char* value;
+  size_t valueLength;
+};
+
+struct hpack_table {
+  // Oldest first, newest is index 1 of dynamic part
+  struct hpack_entry* entries;
+  size_t count;
+  size_t capacity;
+
+  // Size as RFC 7541 section 4.1 counts it
+  size_t size;
+  size_t maxSize;
+};
+
+struct hpack_decoder {
+  struct hpack_table table;
+
+  // Largest table size encoder may switch to
+  size_t sizeLimit;
+
+  // Huffman decoded strings
+  char* scratch;
+  size_t scratchCapacity;
+};
+
+struct hpack_encoder {
+  struct hpack_table table;
+
+  // Peer changed its limit, size update goes at start of
+  // next block
+  bool sizeUpdatePending;
+};
+
+// Called for each decoded field, strings NUL terminated and
+// valid during call
+// Return 0 or negative errno to stop decoding
+typedef int (*hpack_field_func)(void* udata, const char* name, size_t nameLength, const char* value, size_t valueLength);
+
+void hpack_decoder_init(struct hpack_decoder* self);
+void hpack_decoder_cleanup(struct hpack_decoder* self);
+
+// Decode whole header block
+// Errors:
+// -EFAULT: Malformed block (connection must be closed as
+//          table state can't be trusted anymore)
+// -ENOMEM: Not enough memory
+// Or errors from `callback`
+[[nodiscard]]
+int hpack_decode(struct hpack_decoder* self, const uint8_t* data, size_t length, hpack_field_func callback, void* udata);
+
+void hpack_encoder_init(struct hpack_encoder* self);
+void hpack_encoder_cleanup(struct hpack_encoder* self);
+
+// Peer's SETTINGS_HEADER_TABLE_SIZE
+void hpack_encoder_set_max_size(struct hpack_encoder* self, size_t maxSize);
+
+// Append field to block in `output`, `name` must be lowercase
+// `sensitive` fields never enter any table (RFC 7541 section 7.1.3)
+// Errors:
+// -ENOMEM: Not enough memory
+[[nodiscard]]
+int hpack_encode(struct hpack_encoder* self, vec_byte_t* output, const char* name, const char* value, bool sensitive);
+
+#endif
+
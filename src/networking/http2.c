@@ -0,0 +1,981 @@
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+#include "http2.h"
+#include "bug.h"
+#include "hpack.h"
+#include "http_body_sink.h"
+#include "http_content_decoder.h"
+#include "http_header_block.h"
+#include "http_headers.h"
+#include "http_pipeline.h"
+#include "http_request.h"
+#include "http_request_template.h"
+#include "http_response.h"
+#include "transport/transport.h"
+#include "vec.h"
+
+#define CONNECTION_PREFACE "PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n"
+#define FRAME_HEADER_SIZE 9
+
+// Default initial window (RFC 9113 section 6.9.2)
+#define DEFAULT_WINDOW 65535
+#define MAX_WINDOW 0x7fffffff
+#define MAX_STREAM_ID 0x7fffffff
+
+// Assumed until peer's SETTINGS arrive, least peer should
+// allow (RFC 9113 section 6.5.2), streams over real limit
+// are refused and left for caller to resend
+#define INITIAL_MAX_STREAMS 100
+
+// Queued frames written once they pile up this much even
+// if there more to queue
+#define OUTPUT_FLUSH_SIZE (64 * 1024)
+
+enum frame_type {
+  FRAME_DATA = 0x0,
+  FRAME_HEADERS = 0x1,
+  FRAME_PRIORITY = 0x2,
+  FRAME_RST_STREAM = 0x3,
+  FRAME_SETTINGS = 0x4,
+  FRAME_PUSH_PROMISE = 0x5,
+  FRAME_PING = 0x6,
+  FRAME_GOAWAY = 0x7,
+  FRAME_WINDOW_UPDATE = 0x8,
+  FRAME_CONTINUATION = 0x9
+};
+
+#define FLAG_END_STREAM 0x1
+#define FLAG_ACK 0x1
+#define FLAG_END_HEADERS 0x4
+#define FLAG_PADDED 0x8
+#define FLAG_PRIORITY 0x20
+
+enum settings_id {
+  SETTINGS_HEADER_TABLE_SIZE = 0x1,
+  SETTINGS_ENABLE_PUSH = 0x2,
+  SETTINGS_MAX_CONCURRENT_STREAMS = 0x3,
+  SETTINGS_INITIAL_WINDOW_SIZE = 0x4,
+  SETTINGS_MAX_FRAME_SIZE = 0x5
+};
+
+enum error_code {
+  ERROR_NO_ERROR = 0x0,
+  ERROR_PROTOCOL = 0x1,
+  ERROR_INTERNAL = 0x2,
+  ERROR_FLOW_CONTROL = 0x3,
+  ERROR_FRAME_SIZE = 0x6,
+  ERROR_REFUSED_STREAM = 0x7,
+  ERROR_CANCEL = 0x8,
+  ERROR_COMPRESSION = 0x9
+};
+
+enum stream_state {
+  // Not started yet (or skipped entry)
+  STREAM_IDLE,
+  STREAM_OPEN,
+  STREAM_CLOSED
+};
+
+struct http2_stream {
+  struct http_pipeline_entry* entry;
+  uint32_t id;
+  enum stream_state state;
+
+  struct http_response* response;
+  struct http_response localResponse;
+  bool hasLocalResponse;
+
+  // Caller's sink or decoder in front of it
+  struct http_body_sink* sink;
+  struct http_content_decoder decoder;
+  size_t contentLength;
+  bool gotFinalHeaders;
+
+  // Request body not sent yet
+  const char* body;
+  size_t bodyLeft;
+  bool bodyPending;
+  int64_t sendWindow;
+
+  uint32_t receivedUnacked;
+};
+
+// Fields of one header block being decoded
+struct header_block_context {
+  struct http2_stream* stream;
+  bool isTrailer;
+  int status;
+
+  // First error which only fails the stream
+  int error;
+};
+
+static uint32_t readUint32(const uint8_t* data) {
+  return (uint32_t) data[0] << 24 | (uint32_t) data[1] << 16 | (uint32_t) data[2] << 8 | data[3];
+}
+
+static void writeUint32(uint8_t* data, uint32_t value) {
+  data[0] = value >> 24;
+  data[1] = value >> 16;
+  data[2] = value >> 8;
+  data[3] = value;
+}
+
+static int reserveOutput(vec_byte_t* output, size_t extra) {
+  size_t needed = output->length + extra;
+  if (needed <= (size_t) output->capacity)
+    return 0;
+  if (needed > INT32_MAX)
+    return -ENOMEM;
+
+  size_t newCapacity = output->capacity > 0 ? output->capacity : 1024;
+  while (newCapacity < needed)
+    newCapacity *= 2;
+  if (vec_reserve(output, newCapacity) < 0)
+    return -ENOMEM;
+  return 0;
+}
+
+static int queueFrame(struct http2_connection* self, enum frame_type type, uint8_t flags, uint32_t streamId, const void* payload, size_t length) {
+  int res = 0;
+  if ((res = reserveOutput(&self->output, FRAME_HEADER_SIZE + length)) < 0)
+    return res;
+
+  uint8_t* header = self->output.data + self->output.length;
+  header[0] = length >> 16;
+  header[1] = length >> 8;
+  header[2] = length;
+  header[3] = type;
+  header[4] = flags;
+  writeUint32(header + 5, streamId & MAX_STREAM_ID);
+  if (length > 0)
+    memcpy(header + FRAME_HEADER_SIZE, payload, length);
+  self->output.length += FRAME_HEADER_SIZE + length;
+  return 0;
+}
+
+static int queueWindowUpdate(struct http2_connection* self, uint32_t streamId, uint32_t increment) {
+  uint8_t payload[4];
+  writeUint32(payload, increment);
+  return queueFrame(self, FRAME_WINDOW_UPDATE, 0, streamId, payload, sizeof(payload));
+}
+
+static int queueRstStream(struct http2_connection* self, uint32_t streamId, enum error_code code) {
+  uint8_t payload[4];
+  writeUint32(payload, code);
+  return queueFrame(self, FRAME_RST_STREAM, 0, streamId, payload, sizeof(payload));
+}
+
+static int flushOutput(struct http2_connection* self) {
+  int res = 0;
+  if (self->output.length == 0)
+    return 0;
+
+  res = self->transport->write(self->transport, self->output.data, self->output.length);
+  self->output.length = 0;
+  if (res < 0 && self->error == 0)
+    self->error = res;
+  return res;
+}
+
+// Tell peer why and give up the connection, streams still open
+// fail with `err`
+static int connectionError(struct http2_connection* self, enum error_code code, int err) {
+  if (self->error != 0)
+    return self->error;
+
+  // We never accept streams so last stream ID is always 0
+  uint8_t payload[8] = {};
+  writeUint32(payload + 4, code);
+  if (queueFrame(self, FRAME_GOAWAY, 0, 0, payload, sizeof(payload)) >= 0)
+    flushOutput(self);
+  self->error = err;
+  return err;
+}
+
+struct http2_connection* http2_connection_new(struct transport* transport) {
+  struct http2_connection* self = malloc(sizeof(*self));
+  if (!self)
+    return NULL;
+
+  *self = (struct http2_connection) {
+    .transport = transport,
+    .nextStreamId = 1,
+    .peerMaxFrameSize = HTTP2_MAX_FRAME_SIZE,
+    .peerMaxConcurrentStreams = INITIAL_MAX_STREAMS,
+    .peerInitialWindow = DEFAULT_WINDOW,
+    .sendWindow = DEFAULT_WINDOW
+  };
+  vec_init(&self->output);
+  vec_init(&self->headerBlock);
+  vec_init(&self->requestBlock);
+  hpack_encoder_init(&self->encoder);
+  hpack_decoder_init(&self->decoder);
+
+  if (!(self->frame = malloc(HTTP2_MAX_FRAME_SIZE))) {
+    http2_connection_free(self);
+    return NULL;
+  }
+  return self;
+}
+
+void http2_connection_free(struct http2_connection* self) {
+  if (!self)
+    return;
+
+  hpack_encoder_cleanup(&self->encoder);
+  hpack_decoder_cleanup(&self->decoder);
+  vec_deinit(&self->output);
+  vec_deinit(&self->headerBlock);
+  vec_deinit(&self->requestBlock);
+  free(self->frame);
+  free(self);
+}
+
+bool http2_connection_is_usable(struct http2_connection* self) {
+  return self->error == 0 && !self->goawayReceived && self->nextStreamId <= MAX_STREAM_ID;
+}
+
+static int queuePreface(struct http2_connection* self) {
+  int res = 0;
+  if ((res = reserveOutput(&self->output, sizeof(CONNECTION_PREFACE) - 1)) < 0)
+    return res;
+  memcpy(self->output.data + self->output.length, CONNECTION_PREFACE, sizeof(CONNECTION_PREFACE) - 1);
+  self->output.length += sizeof(CONNECTION_PREFACE) - 1;
+
+  uint8_t settings[12];
+  settings[0] = 0;
+  settings[1] = SETTINGS_ENABLE_PUSH;
+  writeUint32(settings + 2, 0);
+  settings[6] = 0;
+  settings[7] = SETTINGS_INITIAL_WINDOW_SIZE;
+  writeUint32(settings + 8, HTTP2_STREAM_WINDOW);
+  if ((res = queueFrame(self, FRAME_SETTINGS, 0, 0, settings, sizeof(settings))) < 0)
+    return res;
+
+  // Connection window can only be changed by WINDOW_UPDATE
+  if ((res = queueWindowUpdate(self, 0, HTTP2_CONNECTION_WINDOW - DEFAULT_WINDOW)) < 0)
+    return res;
+  self->prefaceSent = true;
+  return 0;
+}
+
+static struct http2_stream* findStream(struct http2_connection* self, uint32_t streamId) {
+  for (size_t i = 0; i < self->streamCount; i++)
+    if (self->streams[i].state == STREAM_OPEN && self->streams[i].id == streamId)
+      return &self->streams[i];
+  return NULL;
+}
+
+static void finishStream(struct http2_connection* self, struct http2_stream* stream, int result) {
+  if (stream->state != STREAM_OPEN)
+    return;
+
+  stream->state = STREAM_CLOSED;
+  stream->entry->result = result;
+  stream->response->decodedSize = stream->sink == &stream->decoder.super ? stream->decoder.decodedSize : stream->response->writtenSize;
+  stream->response->canReuseConnection = result >= 0 && http2_connection_is_usable(self);
+  http_content_decoder_cleanup(&stream->decoder);
+  self->openStreams--;
+}
+
+// Stream error (RFC 9113 section 5.4.2), connection carries on
+static void resetStream(struct http2_connection* self, struct http2_stream* stream, enum error_code code, int err) {
+  if (queueRstStream(self, stream->id, code) < 0) {
+    connectionError(self, ERROR_INTERNAL, -ENOMEM);
+    return;
+  }
+  finishStream(self, stream, err);
+}
+
+static void completeStream(struct http2_connection* self, struct http2_stream* stream) {
+  int res = 0;
+  struct http_body_sink* sink = stream->sink;
+  if (sink && sink->finish && (res = sink->finish(sink)) < 0) {
+    finishStream(self, stream, res);
+    return;
+  }
+  finishStream(self, stream, stream->response->status);
+}
+
+// Bring response back to state http_response_recv starts with
+static void resetResponse(struct http_response* response) {
+  free((char*) response->description);
+  response->description = NULL;
+  http_headers_free(response->headers);
+  response->headers = NULL;
+  http_header_block_reset(&response->headerBlock);
+  http_headers_clear(response->trailers);
+
+  response->status = 0;
+  response->writtenSize = 0;
+  response->decodedSize = 0;
+  response->contentEncoding = HTTP_CONTENT_IDENTITY;
+  response->canReuseConnection = false;
+  response->keepAliveTimeout = -1;
+  response->keepAliveMax = -1;
+}
+
+static bool isConnectionSpecific(const char* name) {
+  // Not allowed in HTTP/2 (RFC 9113 section 8.2.2), Host
+  // becomes :authority and Content-Length computed from body
+  static const char* names[] = {
+    "connection", "keep-alive", "proxy-connection", "transfer-encoding",
+    "upgrade", "te", "host", "content-length"
+  };
+  for (size_t i = 0; i < sizeof(names) / sizeof(*names); i++)
+    if (strcmp(name, names[i]) == 0)
+      return true;
+  return false;
+}
+
+static bool isSensitive(const char* name) {
+  return strcmp(name, "authorization") == 0 || strcmp(name, "proxy-authorization") == 0 ||
+         strcmp(name, "cookie") == 0;
+}
+
+// Encode lowercase copy of `name`
+static int encodeHeader(struct http2_connection* self, const char* name, const char* value) {
+  int res = 0;
+  char stackName[128];
+  size_t len = strlen(name);
+  char* lowered = len < sizeof(stackName) ? stackName : malloc(len + 1);
+  if (!lowered)
+    return -ENOMEM;
+
+  for (size_t i = 0; i <= len; i++)
+    lowered[i] = name[i] >= 'A' && name[i] <= 'Z' ? name[i] - 'A' + 'a' : name[i];
+
+  if (!isConnectionSpecific(lowered))
+    res = hpack_encode(&self->encoder, &self->requestBlock, lowered, value, isSensitive(lowered));
+
+  if (lowered != stackName)
+    free(lowered);
+  return res;
+}
+
+// Value of template slot overriding request's header, NULL
+// if request has no template or slot omitted
+static char* getSlotValue(struct http_request* req, enum http_request_template_slot slot, bool* isSet) {
+  *isSet = req->template != NULL;
+  if (!req->template)
+    return NULL;
+
+  size_t length;
+  const char* value = http_request_template_get(req->template, slot, &length);
+  return value ? strndup(value, length) : NULL;
+}
+
+// Fill requestBlock with request's header block
+// Errors:
+// -EINVAL: Request without method, location or Host
+// -ENOMEM: Not enough memory
+static int encodeRequest(struct http2_connection* self, struct http_request* req) {
+  int res = 0;
+  bool hostFromTemplate;
+  bool authorizationFromTemplate;
+  char* templateHost = getSlotValue(req, HTTP_TEMPLATE_HOST, &hostFromTemplate);
+  char* templateAuthorization = getSlotValue(req, HTTP_TEMPLATE_AUTHORIZATION, &authorizationFromTemplate);
+  const char* authority = hostFromTemplate ? templateHost : http_headers_get(req->headers, "Host");
+
+  // Checked before touching encoder as any field encoded must
+  // reach the peer or both tables go out of sync
+  if (!req->isMethodSet || !req->location || !authority) {
+    res = -EINVAL;
+    goto invalid_request;
+  }
+
+  self->requestBlock.length = 0;
+  if ((res = hpack_encode(&self->encoder, &self->requestBlock, ":method", http_request_method_tostring(req->method), false)) < 0 ||
+      (res = hpack_encode(&self->encoder, &self->requestBlock, ":scheme", "https", false)) < 0 ||
+      (res = hpack_encode(&self->encoder, &self->requestBlock, ":authority", authority, false)) < 0 ||
+      (res = hpack_encode(&self->encoder, &self->requestBlock, ":path", req->location, false)) < 0)
+    goto encode_error;
+
+  size_t cursor = 0;
+  const char* name;
+  const char* value;
+  while (http_headers_iterate(req->headers, &cursor, &name, &value)) {
+    if (authorizationFromTemplate && strcasecmp(name, "Authorization") == 0)
+      continue;
+    if ((res = encodeHeader(self, name, value)) < 0)
+      goto encode_error;
+  }
+
+  if (templateAuthorization && (res = hpack_encode(&self->encoder, &self->requestBlock, "authorization", templateAuthorization, true)) < 0)
+    goto encode_error;
+
+  if (req->requestData) {
+    char contentLength[32];
+    snprintf(contentLength, sizeof(contentLength), "%zu", req->requestDataLen);
+    if ((res = hpack_encode(&self->encoder, &self->requestBlock, "content-length", contentLength, false)) < 0)
+      goto encode_error;
+  }
+
+encode_error:
+invalid_request:
+  free(templateHost);
+  free(templateAuthorization);
+  return res;
+}
+
+// Queue HEADERS followed by CONTINUATION for the rest
+static int queueHeaderBlock(struct http2_connection* self, uint32_t streamId, bool endStream) {
+  int res = 0;
+  const uint8_t* block = self->requestBlock.data;
+  size_t remaining = self->requestBlock.length;
+  enum frame_type type = FRAME_HEADERS;
+  do {
+    size_t length = remaining < self->peerMaxFrameSize ? remaining : self->peerMaxFrameSize;
+    uint8_t flags = 0;
+    if (type == FRAME_HEADERS && endStream)
+      flags |= FLAG_END_STREAM;
+    if (length == remaining)
+      flags |= FLAG_END_HEADERS;
+
+    if ((res = queueFrame(self, type, flags, streamId, block, length)) < 0)
+      return res;
+    block += length;
+    remaining -= length;
+    type = FRAME_CONTINUATION;
+  } while (remaining > 0);
+  return 0;
+}
+
+static int startStream(struct http2_connection* self, struct http2_stream* stream) {
+  int res = 0;
+  struct http_request* req = stream->entry->request;
+
+  stream->response = stream->entry->response;
+  if (!stream->response) {
+    if ((res = http_response_static_init(&stream->localResponse)) < 0)
+      goto init_response_error;
+    stream->response = &stream->localResponse;
+    stream->hasLocalResponse = true;
+  }
+  resetResponse(stream->response);
+
+  if ((res = encodeRequest(self, req)) == -EINVAL)
+    goto invalid_request;
+  if (res < 0) {
+    // Encoder already changed its table
+    connectionError(self, ERROR_INTERNAL, res);
+    goto encode_error;
+  }
+
+  bool hasBody = req->requestData && req->requestDataLen > 0;
+  stream->id = self->nextStreamId;
+  self->nextStreamId += 2;
+  if ((res = queueHeaderBlock(self, stream->id, !hasBody)) < 0) {
+    connectionError(self, ERROR_INTERNAL, res);
+    goto queue_error;
+  }
+
+  stream->state = STREAM_OPEN;
+  stream->sink = stream->entry->sink;
+  stream->sendWindow = self->peerInitialWindow;
+  stream->body = req->requestData;
+  stream->bodyLeft = hasBody ? req->requestDataLen : 0;
+  stream->bodyPending = hasBody;
+  self->openStreams++;
+  return 0;
+
+queue_error:
+encode_error:
+invalid_request:
+init_response_error:
+  stream->state = STREAM_CLOSED;
+  stream->entry->result = res;
+  return res;
+}
+
+// Send as much request bodies as windows allow
+static int pumpBodies(struct http2_connection* self) {
+  int res = 0;
+  for (size_t i = 0; i < self->streamCount && self->sendWindow > 0; i++) {
+    struct http2_stream* stream = &self->streams[i];
+    if (stream->state != STREAM_OPEN || !stream->bodyPending)
+      continue;
+
+    while (stream->bodyLeft > 0 && stream->sendWindow > 0 && self->sendWindow > 0) {
+      size_t length = stream->bodyLeft;
+      if (length > self->peerMaxFrameSize)
+        length = self->peerMaxFrameSize;
+      if ((int64_t) length > stream->sendWindow)
+        length = stream->sendWindow;
+      if ((int64_t) length > self->sendWindow)
+        length = self->sendWindow;
+
+      uint8_t flags = length == stream->bodyLeft ? FLAG_END_STREAM : 0;
+      if ((res = queueFrame(self, FRAME_DATA, flags, stream->id, stream->body, length)) < 0)
+        return connectionError(self, ERROR_INTERNAL, res);
+
+      stream->body += length;
+      stream->bodyLeft -= length;
+      stream->sendWindow -= length;
+      self->sendWindow -= length;
+      if (self->output.length >= OUTPUT_FLUSH_SIZE && (res = flushOutput(self)) < 0)
+        return res;
+    }
+
+    if (stream->bodyLeft == 0)
+      stream->bodyPending = false;
+  }
+  return 0;
+}
+
+// Strip padding (and priority) from HEADERS or DATA payload
+static int stripPadding(uint8_t flags, const uint8_t** payload, size_t* length) {
+  size_t padding = 0;
+  if (flags & FLAG_PADDED) {
+    if (*length < 1)
+      return -EFAULT;
+    padding = (*payload)[0];
+    (*payload)++;
+    (*length)--;
+  }
+  if (padding > *length)
+    return -EFAULT;
+  *length -= padding;
+  return 0;
+}
+
+static int onHeaderField(void* udata, const char* name, size_t nameLength, const char* value, size_t valueLength) {
+  struct header_block_context* context = udata;
+  struct http2_stream* stream = context->stream;
+
+  // Still decoded to keep table in sync
+  if (!stream || context->error < 0)
+    return 0;
+
+  if (name[0] == ':') {
+    if (context->isTrailer) {
+      context->error = -EFAULT;
+    } else if (strcmp(name, ":status") == 0) {
+      if (valueLength != 3 || value[0] < '1' || value[0] > '9' ||
+          value[1] < '0' || value[1] > '9' || value[2] < '0' || value[2] > '9')
+        context->error = -EFAULT;
+      else
+        context->status = (value[0] - '0') * 100 + (value[1] - '0') * 10 + (value[2] - '0');
+    }
+    return 0;
+  }
+
+  int res = 0;
+  if (context->isTrailer)
+    res = http_headers_add(stream->response->trailers, name, value);
+  else
+    res = http_header_block_add(&stream->response->headerBlock, name, nameLength, value, valueLength);
+
+  // Field with characters we don't accept is skipped
+  if (res < 0 && res != -EINVAL)
+    context->error = res;
+  return 0;
+}
+
+static void onResponseHeaders(struct http2_connection* self, struct http2_stream* stream, int status) {
+  int res = 0;
+  struct http_response* response = stream->response;
+
+  // Informational (1xx) responses are followed by real one
+  if (status < 200) {
+    http_header_block_reset(&response->headerBlock);
+    return;
+  }
+
+  response->status = status;
+  stream->gotFinalHeaders = true;
+  if ((res = http_response_setup_decoding(response, &stream->decoder, &stream->sink)) < 0) {
+    resetStream(self, stream, ERROR_CANCEL, res);
+    return;
+  }
+
+  stream->contentLength = HTTP_BODY_SINK_UNKNOWN_LENGTH;
+  const char* contentLength = http_header_block_get(&response->headerBlock, "content-length");
+  if (contentLength) {
+    char* end;
+    errno = 0;
+    unsigned long long parsed = strtoull(contentLength, &end, 10);
+    if (errno == 0 && end != contentLength && *end == '\0')
+      stream->contentLength = parsed;
+  }
+
+  struct http_body_sink* sink = stream->sink;
+  if (sink && sink->begin && (res = sink->begin(sink, stream->contentLength)) < 0)
+    resetStream(self, stream, ERROR_CANCEL, res);
+}
+
+static int processHeaderBlock(struct http2_connection* self) {
+  int res = 0;
+  struct http2_stream* stream = findStream(self, self->headerBlockStream);
+  struct header_block_context context = {
+    .stream = stream,
+    .isTrailer = stream && stream->gotFinalHeaders
+  };
+  if (stream && !context.isTrailer)
+    http_header_block_reset(&stream->response->headerBlock);
+
+  res = hpack_decode(&self->decoder, self->headerBlock.data, self->headerBlock.length, onHeaderField, &context);
+  bool endStream = self->headerBlockEndsStream;
+  self->headerBlock.length = 0;
+  self->headerBlockStream = 0;
+  if (res == -EFAULT)
+    return connectionError(self, ERROR_COMPRESSION, -EFAULT);
+  if (res < 0)
+    return connectionError(self, ERROR_INTERNAL, res);
+
+  // Stream we reset or finished already
+  if (!stream)
+    return 0;
+
+  if (context.error == 0 && !context.isTrailer && context.status == 0)
+    context.error = -EFAULT;
+  if (context.error == 0 && context.isTrailer && !endStream)
+    context.error = -EFAULT;
+  if (context.error == 0 && !context.isTrailer && context.status < 200 && endStream)
+    context.error = -EFAULT;
+  if (context.error < 0) {
+    resetStream(self, stream, context.error == -EFAULT ? ERROR_PROTOCOL : ERROR_CANCEL, context.error);
+    return 0;
+  }
+
+  if (!context.isTrailer)
+    onResponseHeaders(self, stream, context.status);
+  if (endStream && stream->state == STREAM_OPEN)
+    completeStream(self, stream);
+  return 0;
+}
+
+static int appendHeaderFragment(struct http2_connection* self, const uint8_t* fragment, size_t length, uint8_t flags) {
+  int res = 0;
+
+  // Compressed block this big is abuse rather than response
+  if (self->headerBlock.length + length > HTTP_MAX_HEADER_SECTION)
+    return connectionError(self, ERROR_PROTOCOL, -E2BIG);
+  if ((res = reserveOutput(&self->headerBlock, length)) < 0)
+    return connectionError(self, ERROR_INTERNAL, res);
+  memcpy(self->headerBlock.data + self->headerBlock.length, fragment, length);
+  self->headerBlock.length += length;
+
+  if (flags & FLAG_END_HEADERS)
+    return processHeaderBlock(self);
+  return 0;
+}
+
+static int onHeadersFrame(struct http2_connection* self, uint8_t flags, uint32_t streamId, const uint8_t* payload, size_t length) {
+  if (streamId == 0 || stripPadding(flags, &payload, &length) < 0)
+    return connectionError(self, ERROR_PROTOCOL, -EFAULT);
+  if (flags & FLAG_PRIORITY) {
+    if (length < 5)
+      return connectionError(self, ERROR_FRAME_SIZE, -EFAULT);
+    payload += 5;
+    length -= 5;
+  }
+
+  self->headerBlockStream = streamId;
+  self->headerBlockEndsStream = flags & FLAG_END_STREAM;
+  return appendHeaderFragment(self, payload, length, flags);
+}
+
+// Give received bytes back to peer once half the window used
+static int consumeWindow(struct http2_connection* self, uint32_t* unacked, uint32_t streamId, uint32_t window, size_t length) {
+  *unacked += length;
+  if (*unacked < window / 2)
+    return 0;
+
+  int res = queueWindowUpdate(self, streamId, *unacked);
+  *unacked = 0;
+  return res;
+}
+
+static int onDataFrame(struct http2_connection* self, uint8_t flags, uint32_t streamId, const uint8_t* payload, size_t length) {
+  int res = 0;
+  size_t frameLength = length;
+  if (streamId == 0 || stripPadding(flags, &payload, &length) < 0)
+    return connectionError(self, ERROR_PROTOCOL, -EFAULT);
+
+  // Connection window counts frames of every stream, even the
+  // ones we already reset
+  if ((res = consumeWindow(self, &self->receivedUnacked, 0, HTTP2_CONNECTION_WINDOW, frameLength)) < 0)
+    return connectionError(self, ERROR_INTERNAL, res);
+
+  struct http2_stream* stream = findStream(self, streamId);
+  if (!stream)
+    return 0;
+  if (!stream->gotFinalHeaders) {
+    resetStream(self, stream, ERROR_PROTOCOL, -EFAULT);
+    return 0;
+  }
+
+  struct http_body_sink* sink = stream->sink;
+  if (length > 0 && sink && (res = sink->write(sink, payload, length)) < 0) {
+    resetStream(self, stream, ERROR_CANCEL, res);
+    return 0;
+  }
+
+  struct http_response* response = stream->response;
+  response->writtenSize += length;
+  if (response->onProgress)
+    response->onProgress(response->progressUdata, response->writtenSize, stream->contentLength);
+
+  if (flags & FLAG_END_STREAM) {
+    completeStream(self, stream);
+    return 0;
+  }
+  if ((res = consumeWindow(self, &stream->receivedUnacked, streamId, HTTP2_STREAM_WINDOW, frameLength)) < 0)
+    return connectionError(self, ERROR_INTERNAL, res);
+  return 0;
+}
+
+static int onSettingsFrame(struct http2_connection* self, uint8_t flags, uint32_t streamId, const uint8_t* payload, size_t length) {
+  if (streamId != 0)
+    return connectionError(self, ERROR_PROTOCOL, -EFAULT);
+  if (flags & FLAG_ACK) {
+    if (length != 0)
+      return connectionError(self, ERROR_FRAME_SIZE, -EFAULT);
+    self->settingsAcked = true;
+    return 0;
+  }
+  if (length % 6 != 0)
+    return connectionError(self, ERROR_FRAME_SIZE, -EFAULT);
+
+  for (size_t i = 0; i < length; i += 6) {
+    uint16_t id = (uint16_t) payload[i] << 8 | payload[i + 1];
+    uint32_t value = readUint32(payload + i + 2);
+    switch (id) {
+      case SETTINGS_HEADER_TABLE_SIZE:
+        hpack_encoder_set_max_size(&self->encoder, value);
+        break;
+      case SETTINGS_MAX_CONCURRENT_STREAMS:
+        self->peerMaxConcurrentStreams = value;
+        break;
+      case SETTINGS_INITIAL_WINDOW_SIZE:
+        if (value > MAX_WINDOW)
+          return connectionError(self, ERROR_FLOW_CONTROL, -EFAULT);
+
+        // Applies to open streams too (section 6.9.2)
+        for (size_t j = 0; j < self->streamCount; j++)
+          if (self->streams[j].state == STREAM_OPEN)
+            self->streams[j].sendWindow += (int64_t) value - self->peerInitialWindow;
+        self->peerInitialWindow = value;
+        break;
+      case SETTINGS_MAX_FRAME_SIZE:
+        if (value < 16384 || value > 16777215)
+          return connectionError(self, ERROR_PROTOCOL, -EFAULT);
+        self->peerMaxFrameSize = value;
+        break;
+    }
+  }
+
+  int res = queueFrame(self, FRAME_SETTINGS, FLAG_ACK, 0, NULL, 0);
+  return res < 0 ? connectionError(self, ERROR_INTERNAL, res) : 0;
+}
+
+static int onWindowUpdateFrame(struct http2_connection* self, uint32_t streamId, const uint8_t* payload, size_t length) {
+  if (length != 4)
+    return connectionError(self, ERROR_FRAME_SIZE, -EFAULT);
+
+  uint32_t increment = readUint32(payload) & MAX_WINDOW;
+  if (streamId == 0) {
+    if (increment == 0 || self->sendWindow + increment > MAX_WINDOW)
+      return connectionError(self, increment == 0 ? ERROR_PROTOCOL : ERROR_FLOW_CONTROL, -EFAULT);
+    self->sendWindow += increment;
+    return 0;
+  }
+
+  struct http2_stream* stream = findStream(self, streamId);
+  if (!stream)
+    return 0;
+  if (increment == 0 || stream->sendWindow + increment > MAX_WINDOW)
+    resetStream(self, stream, increment == 0 ? ERROR_PROTOCOL : ERROR_FLOW_CONTROL, -EFAULT);
+  else
+    stream->sendWindow += increment;
+  return 0;
+}
+
+static int onGoawayFrame(struct http2_connection* self, uint32_t streamId, const uint8_t* payload, size_t length) {
+  if (streamId != 0)
+    return connectionError(self, ERROR_PROTOCOL, -EFAULT);
+  if (length < 8)
+    return connectionError(self, ERROR_FRAME_SIZE, -EFAULT);
+
+  self->goawayReceived = true;
+  self->goawayLastStreamId = readUint32(payload) & MAX_STREAM_ID;
+
+  // Streams above last ID were never processed and safe
+  // to resend on another connection (section 6.8)
+  for (size_t i = 0; i < self->streamCount; i++) {
+    struct http2_stream* stream = &self->streams[i];
+    if (stream->state == STREAM_OPEN && stream->id > self->goawayLastStreamId)
+      finishStream(self, stream, -ECONNRESET);
+  }
+  return 0;
+}
+
+static int onRstStreamFrame(struct http2_connection* self, uint32_t streamId, const uint8_t* payload, size_t length) {
+  if (streamId == 0)
+    return connectionError(self, ERROR_PROTOCOL, -EFAULT);
+  if (length != 4)
+    return connectionError(self, ERROR_FRAME_SIZE, -EFAULT);
+
+  struct http2_stream* stream = findStream(self, streamId);
+  if (!stream)
+    return 0;
+
+  // Refused stream wasn't processed at all (section 8.7)
+  uint32_t code = readUint32(payload);
+  finishStream(self, stream, code == ERROR_REFUSED_STREAM ? -ECONNRESET : -EIO);
+  return 0;
+}
+
+// Read and handle one frame, queued frames flushed before
+// blocking for it
+static int processFrame(struct http2_connection* self) {
+  int res = 0;
+  if (transport_get_buffered_size(self->transport) < FRAME_HEADER_SIZE && (res = flushOutput(self)) < 0)
+    return res;
+
+  uint8_t header[FRAME_HEADER_SIZE];
+  if ((res = transport_read(self->transport, header, sizeof(header), NULL)) < 0)
+    goto read_error;
+
+  size_t length = (size_t) header[0] << 16 | (size_t) header[1] << 8 | header[2];
+  uint8_t type = header[3];
+  uint8_t flags = header[4];
+  uint32_t streamId = readUint32(header + 5) & MAX_STREAM_ID;
+  if (length > HTTP2_MAX_FRAME_SIZE)
+    return connectionError(self, ERROR_FRAME_SIZE, -EFAULT);
+  if (length > 0 && (res = transport_read(self->transport, self->frame, length, NULL)) < 0)
+    goto read_error;
+
+  // Header block must not be interleaved with anything
+  if (self->headerBlockStream != 0 && (type != FRAME_CONTINUATION || streamId != self->headerBlockStream))
+    return connectionError(self, ERROR_PROTOCOL, -EFAULT);
+
+  const uint8_t* payload = self->frame;
+  switch (type) {
+    case FRAME_DATA:
+      return onDataFrame(self, flags, streamId, payload, length);
+    case FRAME_HEADERS:
+      return onHeadersFrame(self, flags, streamId, payload, length);
+    case FRAME_CONTINUATION:
+      if (self->headerBlockStream == 0)
+        return connectionError(self, ERROR_PROTOCOL, -EFAULT);
+      return appendHeaderFragment(self, payload, length, flags);
+    case FRAME_SETTINGS:
+      return onSettingsFrame(self, flags, streamId, payload, length);
+    case FRAME_WINDOW_UPDATE:
+      return onWindowUpdateFrame(self, streamId, payload, length);
+    case FRAME_RST_STREAM:
+      return onRstStreamFrame(self, streamId, payload, length);
+    case FRAME_GOAWAY:
+      return onGoawayFrame(self, streamId, payload, length);
+    case FRAME_PING:
+      if (length != 8 || streamId != 0)
+        return connectionError(self, length != 8 ? ERROR_FRAME_SIZE : ERROR_PROTOCOL, -EFAULT);
+      if (flags & FLAG_ACK)
+        return 0;
+      if ((res = queueFrame(self, FRAME_PING, FLAG_ACK, 0, payload, length)) < 0)
+        return connectionError(self, ERROR_INTERNAL, res);
+      return 0;
+    case FRAME_PUSH_PROMISE:
+      // We disabled push in our settings
+      return connectionError(self, ERROR_PROTOCOL, -EFAULT);
+    default:
+      // PRIORITY and unknown frames are ignored
+      return 0;
+  }
+
+read_error:
+  self->error = res;
+  return res;
+}
+
+// Connection gone, open streams fail
+static void failOpenStreams(struct http2_connection* self) {
+  for (size_t i = 0; i < self->streamCount; i++) {
+    struct http2_stream* stream = &self->streams[i];
+    if (stream->state != STREAM_OPEN)
+      continue;
+
+    // Closed before any response is same as HTTP/1.1
+    // connection closed before response
+    int err = self->error;
+    if (err == -ENODATA || err == -ECONNRESET || err == -EPIPE)
+      err = stream->gotFinalHeaders ? -EFAULT : -ECONNRESET;
+    finishStream(self, stream, err);
+  }
+}
+
+int http2_connection_run(struct http2_connection* self, struct http_pipeline_entry* entries, size_t count) {
+  int res = 0;
+  if (!http2_connection_is_usable(self))
+    return -ECONNRESET;
+
+  struct http2_stream* streams = calloc(count, sizeof(*streams));
+  if (!streams)
+    return -ENOMEM;
+
+  size_t unanswered = 0;
+  for (size_t i = 0; i < count; i++) {
+    streams[i].entry = &entries[i];
+    streams[i].state = entries[i].result == -ECONNRESET ? STREAM_IDLE : STREAM_CLOSED;
+    if (streams[i].state == STREAM_IDLE)
+      unanswered++;
+  }
+  self->streams = streams;
+  self->streamCount = count;
+
+  if (!self->prefaceSent && (res = queuePreface(self)) < 0)
+    goto preface_error;
+
+  size_t next = 0;
+  int refused = 0;
+  while (self->error == 0) {
+    while (next < count && http2_connection_is_usable(self) && self->openStreams < self->peerMaxConcurrentStreams) {
+      if (streams[next].state == STREAM_IDLE)
+        startStream(self, &streams[next]);
+      next++;
+    }
+    if (self->error != 0 || pumpBodies(self) < 0)
+      break;
+
+    // Waiting for SETTINGS ACK too, otherwise it would arrive
+    // while connection idle in the pool
+    bool hasMore = next < count && http2_connection_is_usable(self);
+    if (self->openStreams == 0 && !hasMore && self->settingsAcked)
+      break;
+    
+    // Peer allows no streams, nothing would arrive until timeout
+    if (self->openStreams == 0 && hasMore && self->peerMaxConcurrentStreams == 0) {
+      refused = connectionError(self, ERROR_NO_ERROR, -ECONNREFUSED);
+      break;
+    }
+    if (processFrame(self) < 0)
+      break;
+  }
+
+  failOpenStreams(self);
+  flushOutput(self);
+
+  res = unanswered;
+  for (size_t i = 0; i < count; i++) {
+    if (entries[i].result == -ECONNRESET)
+      res--;
+    if (streams[i].hasLocalResponse)
+      http_response_free(&streams[i].localResponse);
+  }
+  if (refused < 0)
+    res = refused;
+
+preface_error:
+  self->streams = NULL;
+  self->streamCount = 0;
+  free(streams);
+  return res;
+}
+
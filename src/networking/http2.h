@@ -0,0 +1,106 @@
+#ifndef _headers_1672302284_FluffyLauncher_http2
+#define _headers_1672302284_FluffyLauncher_http2
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "hpack.h"
+
+// HTTP/2 (RFC 9113) client side over TLS connection which
+// negotiated "h2" with ALPN. Requests go out as concurrent
+// streams on one connection and responses land in same
+// http_response/http_body_sink as HTTP/1.1 ones
+// Connection is used by one caller at a time (connection pool
+// lends it out like HTTP/1.1 one), multiplexing only happens
+// between requests passed to same http2_connection_run, not
+// between requests of different callers
+
+struct transport;
+struct http_pipeline_entry;
+
+// Our receive windows, default 64 KiB would stall big
+// downloads every round trip
+#define HTTP2_STREAM_WINDOW (1024 * 1024)
+#define HTTP2_CONNECTION_WINDOW (16 * 1024 * 1024)
+
+// Largest frame we accept (default, never changed)
+#define HTTP2_MAX_FRAME_SIZE 16384
+
+struct http2_stream;
+
+struct http2_connection {
+  // Not owned
+  struct transport* transport;
+
+  struct hpack_encoder encoder;
+  struct hpack_decoder decoder;
+
+  bool prefaceSent;
+  bool settingsAcked;
+  uint32_t nextStreamId;
+
+  // Peer's settings
+  uint32_t peerMaxFrameSize;
+  uint32_t peerMaxConcurrentStreams;
+  int32_t peerInitialWindow;
+
+  // Flow control windows for sending (connection level)
+  // and received bytes not yet given back to peer
+  int64_t sendWindow;
+  uint32_t receivedUnacked;
+
+  bool goawayReceived;
+  uint32_t goawayLastStreamId;
+
+  // Connection level error, nothing else can be sent
+  int error;
+
+  // Frames waiting to be written
+  vec_byte_t output;
+
+  // Header block of request being started
+  vec_byte_t requestBlock;
+
+  // Payload of frame being processed
+  uint8_t* frame;
+
+  // Header block fragments until END_HEADERS
+  vec_byte_t headerBlock;
+  uint32_t headerBlockStream;
+  bool headerBlockEndsStream;
+
+  // Streams of running http2_connection_run
+  struct http2_stream* streams;
+  size_t streamCount;
+  uint32_t openStreams;
+};
+
+[[nodiscard]]
+struct http2_connection* http2_connection_new(struct transport* transport);
+void http2_connection_free(struct http2_connection* self);
+
+// Whether new streams can be started (no GOAWAY, no
+// connection error and stream IDs not exhausted)
+bool http2_connection_is_usable(struct http2_connection* self);
+
+// Send every request in `entries` as concurrent streams (up to
+// peer's limit) and receive responses as they interleave,
+// timeouts are from transport like HTTP/1.1
+// Entries with `result` other than -ECONNRESET are skipped
+// so caller sets every result to -ECONNRESET first and can run
+// same entries again on another connection to resend requests
+// the server never processed (those left -ECONNRESET)
+// `sink`s are called as frames arrive which means one entry's
+// body may be written between other's writes
+// Return number of entries answered in this run
+// Errors:
+// -ENOMEM: Not enough memory
+// -ECONNRESET: Connection no longer usable for new streams
+// -ECONNREFUSED: Peer's SETTINGS_MAX_CONCURRENT_STREAMS is 0
+//                while requests still waiting (connection closed)
+[[nodiscard]]
+int http2_connection_run(struct http2_connection* self, struct http_pipeline_entry* entries, size_t count);
+
+#endif
+
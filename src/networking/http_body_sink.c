@@ -0,0 +1,242 @@
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "http_body_sink.h"
+#include "util/util.h"
+
+// Memory sink
+#define MEMORY_SELF(ptr) container_of(ptr, struct http_body_sink_memory, super)
+
+// Reserve for `size` bytes of data plus NUL terminator (which
+// isn't counted in capacity)
+static int memoryReserve(struct http_body_sink_memory* self, size_t size) {
+  if (self->maxSize > 0 && size > self->maxSize)
+    return -E2BIG;
+  if (size == SIZE_MAX)
+    return -ENOMEM;
+  if (size <= self->capacity && self->data)
+    return 0;
+
+  char* newData = realloc(self->data, size + 1);
+  if (!newData)
+    return -ENOMEM;
+
+  self->data = newData;
+  self->capacity = size;
+  return 0;
+}
+
+static int memoryBegin(struct http_body_sink* _self, size_t contentLength) {
+  struct http_body_sink_memory* self = MEMORY_SELF(_self);
+  if (contentLength == HTTP_BODY_SINK_UNKNOWN_LENGTH)
+    return 0;
+  if (contentLength > SIZE_MAX - self->length)
+    return -E2BIG;
+
+  // Exact size known, one allocation for whole body
+  return memoryReserve(self, self->length + contentLength);
+}
+
+static int memoryWrite(struct http_body_sink* _self, const void* data, size_t len) {
+  struct http_body_sink_memory* self = MEMORY_SELF(_self);
+  int res = 0;
+  if (len > SIZE_MAX - self->length)
+    return -E2BIG;
+
+  size_t needed = self->length + len;
+  if (self->maxSize > 0 && needed > self->maxSize)
+    return -E2BIG;
+  
+  if (needed > self->capacity || !self->data) {
+    // Grow geometrically when length unknown, capped at maxSize
+    // so growth near the limit doesn't realloc on every write
+    size_t newSize = self->capacity > 0 ? self->capacity : 4096;
+    while (newSize < needed && newSize <= SIZE_MAX / 4)
+      newSize *= 2;
+    if (newSize < needed)
+      newSize = needed;
+    if (self->maxSize > 0 && newSize > self->maxSize)
+      newSize = self->maxSize;
+
+    if ((res = memoryReserve(self, newSize)) < 0)
+      return res;
+  }
+
+  memcpy(self->data + self->length, data, len);
+  self->length += len;
+  self->data[self->length] = '\0';
+  return 0;
+}
+
+static int memoryAcquire(struct http_body_sink* _self, size_t len, void** buffer) {
+  struct http_body_sink_memory* self = MEMORY_SELF(_self);
+  int res = 0;
+  if (len > SIZE_MAX - self->length)
+    return -E2BIG;
+
+  // Normally already reserved by begin
+  if ((res = memoryReserve(self, self->length + len)) < 0)
+    return res;
+
+  *buffer = self->data + self->length;
+  return 0;
+}
+
+static void memoryCommit(struct http_body_sink* _self, size_t len) {
+  struct http_body_sink_memory* self = MEMORY_SELF(_self);
+  self->length += len;
+  self->data[self->length] = '\0';
+}
+
+void http_body_sink_memory_init(struct http_body_sink_memory* self, size_t maxSize) {
+  *self = (struct http_body_sink_memory) {
+    .super = {
+      .begin = memoryBegin,
+      .write = memoryWrite,
+      .acquire = memoryAcquire,
+      .commit = memoryCommit
+    },
+    .maxSize = maxSize
+  };
+}
+
+void http_body_sink_memory_cleanup(struct http_body_sink_memory* self) {
+  free(self->data);
+  self->data = NULL;
+  self->length = 0;
+  self->capacity = 0;
+}
+
+char* http_body_sink_memory_take(struct http_body_sink_memory* self, size_t* length) {
+  char* data = self->data;
+  if (length)
+    *length = self->length;
+
+  self->data = NULL;
+  self->length = 0;
+  self->capacity = 0;
+  return data;
+}
+
+// Buffer sink
+#define BUFFER_SELF(ptr) container_of(ptr, struct http_body_sink_buffer, super)
+
+static int bufferBegin(struct http_body_sink* _self, size_t contentLength) {
+  struct http_body_sink_buffer* self = BUFFER_SELF(_self);
+  if (contentLength != HTTP_BODY_SINK_UNKNOWN_LENGTH && contentLength > self->size - self->length)
+    return -E2BIG;
+  return 0;
+}
+
+static int bufferAcquire(struct http_body_sink* _self, size_t len, void** buffer) {
+  struct http_body_sink_buffer* self = BUFFER_SELF(_self);
+  if (len > self->size - self->length)
+    return -E2BIG;
+
+  *buffer = (char*) self->buffer + self->length;
+  return 0;
+}
+
+static void bufferCommit(struct http_body_sink* _self, size_t len) {
+  BUFFER_SELF(_self)->length += len;
+}
+
+static int bufferWrite(struct http_body_sink* _self, const void* data, size_t len) {
+  int res = 0;
+  void* buffer;
+  if ((res = bufferAcquire(_self, len, &buffer)) < 0)
+    return res;
+
+  memcpy(buffer, data, len);
+  bufferCommit(_self, len);
+  return 0;
+}
+
+void http_body_sink_buffer_init(struct http_body_sink_buffer* self, void* buffer, size_t size) {
+  *self = (struct http_body_sink_buffer) {
+    .super = {
+      .begin = bufferBegin,
+      .write = bufferWrite,
+      .acquire = bufferAcquire,
+      .commit = bufferCommit
+    },
+    .buffer = buffer,
+    .size = size
+  };
+}
+
+// Fd sink
+#define FD_SELF(ptr) container_of(ptr, struct http_body_sink_fd, super)
+
+static int fdWrite(struct http_body_sink* _self, const void* data, size_t len) {
+  struct http_body_sink_fd* self = FD_SELF(_self);
+  while (len > 0) {
+    ssize_t written = write(self->fd, data, len);
+    if (written < 0) {
+      if (errno == EINTR)
+        continue;
+      return -EIO;
+    }
+
+    len -= written;
+    data = (const char*) data + written;
+  }
+  return 0;
+}
+
+void http_body_sink_fd_init(struct http_body_sink_fd* self, int fd) {
+  *self = (struct http_body_sink_fd) {
+    .super = {
+      .write = fdWrite
+    },
+    .fd = fd
+  };
+}
+
+// FILE sink
+#define FILE_SELF(ptr) container_of(ptr, struct http_body_sink_file, super)
+
+static int fileWrite(struct http_body_sink* _self, const void* data, size_t len) {
+  struct http_body_sink_file* self = FILE_SELF(_self);
+  if (fwrite(data, 1, len, self->file) != len)
+    return -EIO;
+  return 0;
+}
+
+static int fileFinish(struct http_body_sink* _self) {
+  struct http_body_sink_file* self = FILE_SELF(_self);
+  if (fflush(self->file) != 0)
+    return -EIO;
+  return 0;
+}
+
+void http_body_sink_file_init(struct http_body_sink_file* self, FILE* file) {
+  *self = (struct http_body_sink_file) {
+    .super = {
+      .write = fileWrite,
+      .finish = fileFinish
+    },
+    .file = file
+  };
+}
+
+// Callback sink
+#define CALLBACK_SELF(ptr) container_of(ptr, struct http_body_sink_callback, super)
+
+static int callbackWrite(struct http_body_sink* _self, const void* data, size_t len) {
+  struct http_body_sink_callback* self = CALLBACK_SELF(_self);
+  return self->callback(self->udata, data, len);
+}
+
+void http_body_sink_callback_init(struct http_body_sink_callback* self, http_body_sink_callback_func callback, void* udata) {
+  *self = (struct http_body_sink_callback) {
+    .super = {
+      .write = callbackWrite
+    },
+    .callback = callback,
+    .udata = udata
+  };
+}
+
@@ -0,0 +1,97 @@
+#ifndef _headers_1671611403_FluffyLauncher_http_body_sink
+#define _headers_1671611403_FluffyLauncher_http_body_sink
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+// Destination for response body, http_response_recv pushes
+// body to it as it arrives
+
+// Passed to `begin` if server didn't tell body length
+#define HTTP_BODY_SINK_UNKNOWN_LENGTH SIZE_MAX
+
+struct http_body_sink {
+  // Optional, called once before any write with length
+  // from Content-Length or HTTP_BODY_SINK_UNKNOWN_LENGTH
+  int (*begin)(struct http_body_sink* self, size_t contentLength);
+
+  int (*write)(struct http_body_sink* self, const void* data, size_t len);
+
+  // Optional, get writable region of `len` bytes so body read
+  // directly into it, followed by `commit` with number of
+  // bytes actually filled (at most `len`)
+  int (*acquire)(struct http_body_sink* self, size_t len, void** buffer);
+  void (*commit)(struct http_body_sink* self, size_t len);
+
+  // Optional, called after whole body received
+  int (*finish)(struct http_body_sink* self);
+};
+
+// Collect body into malloc'ed memory, preallocated
+// in one go when length known (data always NUL terminated)
+struct http_body_sink_memory {
+  struct http_body_sink super;
+
+  char* data;
+  size_t length;
+  size_t capacity;
+
+  // 0 for unlimited
+  size_t maxSize;
+};
+
+// Write body into caller supplied buffer
+struct http_body_sink_buffer {
+  struct http_body_sink super;
+
+  void* buffer;
+  size_t size;
+  size_t length;
+};
+
+// Write body to file descriptor as it arrives
+struct http_body_sink_fd {
+  struct http_body_sink super;
+  int fd;
+};
+
+// Write body to stdio stream
+struct http_body_sink_file {
+  struct http_body_sink super;
+  FILE* file;
+};
+
+// Pass body to callback as it arrives (data only valid during call)
+typedef int (*http_body_sink_callback_func)(void* udata, const void* data, size_t len);
+struct http_body_sink_callback {
+  struct http_body_sink super;
+  http_body_sink_callback_func callback;
+  void* udata;
+};
+
+// Errors on write:
+// -E2BIG: Body larger than `maxSize`
+// -ENOMEM: Not enough memory
+void http_body_sink_memory_init(struct http_body_sink_memory* self, size_t maxSize);
+void http_body_sink_memory_cleanup(struct http_body_sink_memory* self);
+
+// Take ownership of collected data (NULL if nothing collected)
+// Caller must free it and sink is empty after this
+[[nodiscard]]
+char* http_body_sink_memory_take(struct http_body_sink_memory* self, size_t* length);
+
+// Errors on write:
+// -E2BIG: Body larger than `size`
+void http_body_sink_buffer_init(struct http_body_sink_buffer* self, void* buffer, size_t size);
+
+// Errors on write:
+// -EIO: I/O Error
+void http_body_sink_fd_init(struct http_body_sink_fd* self, int fd);
+void http_body_sink_file_init(struct http_body_sink_file* self, FILE* file);
+
+// Callback returns 0 on success or negative errno to abort transfer
+void http_body_sink_callback_init(struct http_body_sink_callback* self, http_body_sink_callback_func callback, void* udata);
+
+#endif
+
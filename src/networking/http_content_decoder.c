@@ -0,0 +1,332 @@
+#include <errno.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+#include "config.h"
+
+#if IS_ENABLED(CONFIG_NETWORKING_CONTENT_ENCODING)
+# include <zlib.h>
+#endif
+
+#if IS_ENABLED(CONFIG_NETWORKING_CONTENT_ENCODING_BROTLI)
+# include <brotli/decode.h>
+#endif
+
+#include "http_content_decoder.h"
+#include "http_body_sink.h"
+#include "bug.h"
+#include "util/util.h"
+
+#define SELF(ptr) container_of(ptr, struct http_content_decoder, super)
+
+// Decoded body pushed to next sink in pieces this big
+#define DECODE_CHUNK (16 * 1024)
+
+static bool isEncoding(const char* value, size_t len, const char* name) {
+  return strlen(name) == len && strncasecmp(value, name, len) == 0;
+}
+
+int http_content_encoding_parse(const char* value, enum http_content_encoding* result) {
+  *result = HTTP_CONTENT_IDENTITY;
+  if (!value)
+    return 0;
+
+  while (*value == ' ' || *value == '\t')
+    value++;
+  size_t len = strcspn(value, ", \t");
+
+  // Encodings applied on top each other aren't supported
+  const char* rest = value + len;
+  while (*rest == ' ' || *rest == '\t')
+    rest++;
+  if (*rest != '\0')
+    return -ENOTSUP;
+
+  if (len == 0 || isEncoding(value, len, "identity"))
+    *result = HTTP_CONTENT_IDENTITY;
+  else if (isEncoding(value, len, "gzip") || isEncoding(value, len, "x-gzip"))
+    *result = HTTP_CONTENT_GZIP;
+  else if (isEncoding(value, len, "deflate"))
+    *result = HTTP_CONTENT_DEFLATE;
+  else if (isEncoding(value, len, "br"))
+    *result = HTTP_CONTENT_BROTLI;
+  else
+    return -ENOTSUP;
+  return 0;
+}
+
+const char* http_content_encoding_accepted() {
+  if (IS_ENABLED(CONFIG_NETWORKING_CONTENT_ENCODING_BROTLI))
+    return "br, gzip, deflate";
+  if (IS_ENABLED(CONFIG_NETWORKING_CONTENT_ENCODING))
+    return "gzip, deflate";
+  return NULL;
+}
+
+static int pushDecoded(struct http_content_decoder* self, const void* data, size_t len) {
+  self->decodedSize += len;
+  return self->next->write(self->next, data, len);
+}
+
+#if IS_ENABLED(CONFIG_NETWORKING_CONTENT_ENCODING)
+static int zlibInit(struct http_content_decoder* self) {
+  z_stream* stream = calloc(1, sizeof(*stream));
+  if (!stream)
+    return -ENOMEM;
+
+  // +16 for gzip wrapper
+  int windowBits = self->encoding == HTTP_CONTENT_GZIP ? MAX_WBITS + 16 : MAX_WBITS;
+  if (inflateInit2(stream, windowBits) != Z_OK) {
+    free(stream);
+    return -ENOMEM;
+  }
+
+  self->stream = stream;
+  return 0;
+}
+
+static void dropKeptInput(struct http_content_decoder* self) {
+  free(self->keptInput);
+  self->keptInput = NULL;
+  self->keptInputSize = 0;
+}
+
+static void zlibCleanup(struct http_content_decoder* self) {
+  dropKeptInput(self);
+  inflateEnd(self->stream);
+  free(self->stream);
+}
+
+// Whether raw deflate retry still possible, keeping `data` with
+// previous input for it
+static bool keepForRawDeflate(struct http_content_decoder* self, const void* data, size_t len) {
+  if (self->encoding != HTTP_CONTENT_DEFLATE || self->triedRawDeflate || self->decodedSize > 0)
+    return false;
+
+  // Replayed through avail_in which is only unsigned int
+  if (len > UINT_MAX - self->keptInputSize)
+    return false;
+
+  unsigned char* newKept = realloc(self->keptInput, self->keptInputSize + len);
+  if (!newKept)
+    return false;
+  memcpy(newKept + self->keptInputSize, data, len);
+  self->keptInput = newKept;
+  self->keptInputSize += len;
+  return true;
+}
+
+static int zlibFeed(struct http_content_decoder* self, const void* data, size_t len) {
+  int res = 0;
+  z_stream* stream = self->stream;
+  unsigned char output[DECODE_CHUNK];
+  bool canRetryRaw = keepForRawDeflate(self, data, len);
+
+  stream->next_in = (unsigned char*) data;
+  stream->avail_in = len;
+  while (true) {
+    if (self->streamEnded) {
+      if (stream->avail_in == 0)
+        break;
+
+      // Only gzip allows more members after the first
+      if (self->encoding != HTTP_CONTENT_GZIP)
+        return -EFAULT;
+      inflateReset(stream);
+      self->streamEnded = false;
+    }
+
+    stream->next_out = output;
+    stream->avail_out = sizeof(output);
+    int ret = inflate(stream, Z_NO_FLUSH);
+
+    // Raw deflate fails at zlib header check before any output,
+    // replay everything received so far as raw deflate
+    if (ret == Z_DATA_ERROR && canRetryRaw && self->decodedSize == 0) {
+      self->triedRawDeflate = true;
+      inflateReset2(stream, -MAX_WBITS);
+      stream->next_in = self->keptInput;
+      stream->avail_in = self->keptInputSize;
+      continue;
+    }
+
+    if (ret == Z_MEM_ERROR)
+      return -ENOMEM;
+    if (ret != Z_OK && ret != Z_STREAM_END && ret != Z_BUF_ERROR)
+      return -EFAULT;
+
+    size_t produced = sizeof(output) - stream->avail_out;
+    if (produced > 0 && (res = pushDecoded(self, output, produced)) < 0)
+      return res;
+
+    if (ret == Z_STREAM_END) {
+      self->streamEnded = true;
+      continue;
+    }
+
+    // Output not full means zlib has nothing pending
+    if (ret == Z_BUF_ERROR || (stream->avail_in == 0 && stream->avail_out != 0))
+      break;
+  }
+
+  // Retry no longer possible, replayed input (if any) consumed
+  if (self->triedRawDeflate || self->decodedSize > 0)
+    dropKeptInput(self);
+  return 0;
+}
+
+static int zlibWrite(struct http_content_decoder* self, const void* data, size_t len) {
+  int res = 0;
+
+  // avail_in is only unsigned int
+  const char* cur = data;
+  while (len > 0) {
+    size_t piece = len < UINT_MAX ? len : UINT_MAX;
+    if ((res = zlibFeed(self, cur, piece)) < 0)
+      return res;
+    cur += piece;
+    len -= piece;
+  }
+  return 0;
+}
+#endif
+
+#if IS_ENABLED(CONFIG_NETWORKING_CONTENT_ENCODING_BROTLI)
+static int brotliInit(struct http_content_decoder* self) {
+  if (!(self->stream = BrotliDecoderCreateInstance(NULL, NULL, NULL)))
+    return -ENOMEM;
+  return 0;
+}
+
+static void brotliCleanup(struct http_content_decoder* self) {
+  BrotliDecoderDestroyInstance(self->stream);
+}
+
+static int brotliWrite(struct http_content_decoder* self, const void* data, size_t len) {
+  int res = 0;
+  uint8_t output[DECODE_CHUNK];
+  const uint8_t* input = data;
+  size_t availableInput = len;
+
+  // Nothing allowed after end of brotli stream
+  if (self->streamEnded)
+    return len > 0 ? -EFAULT : 0;
+
+  while (true) {
+    uint8_t* nextOutput = output;
+    size_t availableOutput = sizeof(output);
+    BrotliDecoderResult ret = BrotliDecoderDecompressStream(self->stream, &availableInput, &input, &availableOutput, &nextOutput, NULL);
+    if (ret == BROTLI_DECODER_RESULT_ERROR)
+      return -EFAULT;
+
+    size_t produced = sizeof(output) - availableOutput;
+    if (produced > 0 && (res = pushDecoded(self, output, produced)) < 0)
+      return res;
+
+    if (ret == BROTLI_DECODER_RESULT_SUCCESS) {
+      self->streamEnded = true;
+      return availableInput > 0 ? -EFAULT : 0;
+    }
+    if (ret == BROTLI_DECODER_RESULT_NEEDS_MORE_INPUT)
+      return 0;
+  }
+}
+#endif
+
+static int decoderBegin(struct http_body_sink* _self, size_t contentLength) {
+  struct http_content_decoder* self = SELF(_self);
+  if (!self->next->begin)
+    return 0;
+
+  // Content-Length is of encoded body
+  if (self->encoding != HTTP_CONTENT_IDENTITY)
+    contentLength = HTTP_BODY_SINK_UNKNOWN_LENGTH;
+  return self->next->begin(self->next, contentLength);
+}
+
+static int decoderWrite(struct http_body_sink* _self, const void* data, size_t len) {
+  struct http_content_decoder* self = SELF(_self);
+  self->encodedSize += len;
+
+  switch (self->encoding) {
+    case HTTP_CONTENT_IDENTITY:
+      return pushDecoded(self, data, len);
+#if IS_ENABLED(CONFIG_NETWORKING_CONTENT_ENCODING)
+    case HTTP_CONTENT_GZIP:
+    case HTTP_CONTENT_DEFLATE:
+      return zlibWrite(self, data, len);
+#endif
+#if IS_ENABLED(CONFIG_NETWORKING_CONTENT_ENCODING_BROTLI)
+    case HTTP_CONTENT_BROTLI:
+      return brotliWrite(self, data, len);
+#endif
+    default:
+      BUG();
+  }
+}
+
+static int decoderFinish(struct http_body_sink* _self) {
+  struct http_content_decoder* self = SELF(_self);
+
+  // Empty body (like response to HEAD) has nothing to decode
+  if (self->encoding != HTTP_CONTENT_IDENTITY && self->encodedSize > 0 && !self->streamEnded)
+    return -EFAULT;
+
+  if (self->next->finish)
+    return self->next->finish(self->next);
+  return 0;
+}
+
+int http_content_decoder_init(struct http_content_decoder* self, enum http_content_encoding encoding, struct http_body_sink* next) {
+  *self = (struct http_content_decoder) {
+    .super = {
+      .begin = decoderBegin,
+      .write = decoderWrite,
+      .finish = decoderFinish
+    },
+    .next = next,
+    .encoding = encoding
+  };
+
+  switch (encoding) {
+    case HTTP_CONTENT_IDENTITY:
+      return 0;
+#if IS_ENABLED(CONFIG_NETWORKING_CONTENT_ENCODING)
+    case HTTP_CONTENT_GZIP:
+    case HTTP_CONTENT_DEFLATE:
+      return zlibInit(self);
+#endif
+#if IS_ENABLED(CONFIG_NETWORKING_CONTENT_ENCODING_BROTLI)
+    case HTTP_CONTENT_BROTLI:
+      return brotliInit(self);
+#endif
+    default:
+      return -ENOTSUP;
+  }
+}
+
+void http_content_decoder_cleanup(struct http_content_decoder* self) {
+  if (!self->stream)
+    return;
+
+  switch (self->encoding) {
+#if IS_ENABLED(CONFIG_NETWORKING_CONTENT_ENCODING)
+    case HTTP_CONTENT_GZIP:
+    case HTTP_CONTENT_DEFLATE:
+      zlibCleanup(self);
+      break;
+#endif
+#if IS_ENABLED(CONFIG_NETWORKING_CONTENT_ENCODING_BROTLI)
+    case HTTP_CONTENT_BROTLI:
+      brotliCleanup(self);
+      break;
+#endif
+    default:
+      BUG();
+  }
+  self->stream = NULL;
+}
+
@@ -0,0 +1,69 @@
+#ifndef _headers_1672208817_FluffyLauncher_http_content_decoder
+#define _headers_1672208817_FluffyLauncher_http_content_decoder
+
+#include <stddef.h>
+#include <stdbool.h>
+
+#include "http_body_sink.h"
+
+// Body sink decoding Content-Encoding (RFC 9110 section 8.4)
+// as body arrives and pushing decoded body to next sink, sits
+// between transfer decoding and caller's sink
+
+enum http_content_encoding {
+  HTTP_CONTENT_IDENTITY,
+  HTTP_CONTENT_GZIP,
+  HTTP_CONTENT_DEFLATE,
+  HTTP_CONTENT_BROTLI
+};
+
+struct http_content_decoder {
+  struct http_body_sink super;
+  struct http_body_sink* next;
+  enum http_content_encoding encoding;
+
+  // Bytes fed to decoder and bytes it produced
+  size_t encodedSize;
+  size_t decodedSize;
+
+  // z_stream or BrotliDecoderState
+  void* stream;
+  bool streamEnded;
+
+  // Deflate retried as raw deflate once if server sent it
+  // without zlib wrapper (which many do)
+  bool triedRawDeflate;
+
+  // Deflate input kept until first output so retry can replay
+  // it (header error may only show after several small writes)
+  unsigned char* keptInput;
+  size_t keptInputSize;
+};
+
+// Parse Content-Encoding value (NULL means identity)
+// Return 0 on success
+// Errors:
+// -ENOTSUP: Unknown or more than one encoding applied
+[[nodiscard]]
+int http_content_encoding_parse(const char* value, enum http_content_encoding* result);
+
+// Accept-Encoding value listing what this build can decode
+// or NULL if it can't decode any
+const char* http_content_encoding_accepted();
+
+// Errors on write:
+// -EFAULT: Corrupted encoded body
+// -ENOMEM: Not enough memory
+// Or errors from next sink
+// Errors on finish:
+// -EFAULT: Encoded body ended early
+// Or errors from next sink
+// Errors:
+// -ENOTSUP: Encoding not supported by this build
+// -ENOMEM: Not enough memory
+[[nodiscard]]
+int http_content_decoder_init(struct http_content_decoder* self, enum http_content_encoding encoding, struct http_body_sink* next);
+void http_content_decoder_cleanup(struct http_content_decoder* self);
+
+#endif
+
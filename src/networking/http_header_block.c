@@ -0,0 +1,313 @@
+#include <errno.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+# include <immintrin.h>
+#endif
+
+#include "http_header_block.h"
+#include "config.h"
+#include "http_headers.h"
+#include "transport/transport.h"
+
+// Scanner reads whole vector at a time so arena always has
+// this much readable bytes after the content
+#define SCAN_WIDTH 32
+
+// Bitmask of ':' and '\n' positions in SCAN_WIDTH bytes
+typedef uint32_t (*scan_func)(const char* data);
+
+static uint32_t scanScalar(const char* data) {
+  uint32_t mask = 0;
+  for (int i = 0; i < SCAN_WIDTH; i++)
+    if (data[i] == ':' || data[i] == '\n')
+      mask |= (uint32_t) 1 << i;
+  return mask;
+}
+
+#ifdef __SSE2__
+static uint32_t scanSSE2(const char* data) {
+  __m128i colon = _mm_set1_epi8(':');
+  __m128i newline = _mm_set1_epi8('\n');
+  __m128i low = _mm_loadu_si128((const __m128i*) data);
+  __m128i high = _mm_loadu_si128((const __m128i*) (data + 16));
+
+  uint32_t lowMask = (uint32_t) _mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi8(low, colon), _mm_cmpeq_epi8(low, newline)));
+  uint32_t highMask = (uint32_t) _mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi8(high, colon), _mm_cmpeq_epi8(high, newline)));
+  return lowMask | (highMask << 16);
+}
+#endif
+
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__)
+# define HAVE_AVX2_SCAN 1
+
+__attribute__((target("avx2")))
+static uint32_t scanAVX2(const char* data) {
+  __m256i chunk = _mm256_loadu_si256((const __m256i*) data);
+  __m256i found = _mm256_or_si256(_mm256_cmpeq_epi8(chunk, _mm256_set1_epi8(':')),
+                                  _mm256_cmpeq_epi8(chunk, _mm256_set1_epi8('\n')));
+  return (uint32_t) _mm256_movemask_epi8(found);
+}
+#endif
+
+static scan_func scanner = scanScalar;
+static pthread_once_t scannerOnce = PTHREAD_ONCE_INIT;
+
+static void selectScanner() {
+  if (!IS_ENABLED(CONFIG_NETWORKING_SIMD_HEADER_SCAN))
+    return;
+
+#ifdef __SSE2__
+  scanner = scanSSE2;
+#endif
+#ifdef HAVE_AVX2_SCAN
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2"))
+    scanner = scanAVX2;
+#endif
+}
+
+void http_header_block_init(struct http_header_block* self) {
+  *self = (struct http_header_block) {};
+}
+
+void http_header_block_cleanup(struct http_header_block* self) {
+  free(self->arena);
+  free(self->fields);
+  *self = (struct http_header_block) {};
+}
+
+void http_header_block_reset(struct http_header_block* self) {
+  self->length = 0;
+  self->fieldCount = 0;
+}
+
+static int reserveArena(struct http_header_block* self, size_t length) {
+  if (length + SCAN_WIDTH <= self->capacity)
+    return 0;
+
+  size_t newCapacity = self->capacity ? self->capacity : 1024;
+  while (newCapacity < length + SCAN_WIDTH)
+    newCapacity *= 2;
+
+  char* newArena = realloc(self->arena, newCapacity);
+  if (!newArena)
+    return -ENOMEM;
+  self->arena = newArena;
+  self->capacity = newCapacity;
+  return 0;
+}
+
+static int addField(struct http_header_block* self, struct http_header_field field) {
+  if (self->fieldCount == self->fieldCapacity) {
+    size_t newCapacity = self->fieldCapacity ? self->fieldCapacity * 2 : 16;
+    struct http_header_field* newFields = realloc(self->fields, newCapacity * sizeof(*newFields));
+    if (!newFields)
+      return -ENOMEM;
+    self->fields = newFields;
+    self->fieldCapacity = newCapacity;
+  }
+
+  self->fields[self->fieldCount++] = field;
+  return 0;
+}
+
+static bool isWhitespace(char chr) {
+  return chr == ' ' || chr == '\t';
+}
+
+// Line is [start, end) without line break, colon is first ':' in it
+static int emitLine(struct http_header_block* self, size_t start, size_t colon, size_t end) {
+  char* arena = self->arena;
+
+  // Continuation lines (obsolete line folding) and nameless
+  // fields are dropped like any other unacceptable field
+  if (colon == start || isWhitespace(arena[start]))
+    return 0;
+
+  size_t valueStart = colon + 1;
+  size_t valueEnd = end;
+  while (valueStart < valueEnd && isWhitespace(arena[valueStart]))
+    valueStart++;
+  while (valueEnd > valueStart && isWhitespace(arena[valueEnd - 1]))
+    valueEnd--;
+
+  arena[colon] = '\0';
+  arena[valueEnd] = '\0';
+  return addField(self, (struct http_header_field) {
+    .name = start,
+    .nameLength = colon - start,
+    .value = valueStart,
+    .valueLength = valueEnd - valueStart
+  });
+}
+
+int http_header_block_tokenize(struct http_header_block* self) {
+  int res = 0;
+  pthread_once(&scannerOnce, selectScanner);
+  scan_func scan = scanner;
+
+  self->fieldCount = 0;
+  if ((res = reserveArena(self, self->length)) < 0)
+    return res;
+  memset(self->arena + self->length, 0, SCAN_WIDTH);
+
+  const char* arena = self->arena;
+  size_t lineStart = 0;
+  size_t colon = SIZE_MAX;
+  for (size_t base = 0; base < self->length; base += SCAN_WIDTH) {
+    uint32_t mask = scan(arena + base);
+
+    while (mask != 0) {
+      size_t pos = base + __builtin_ctz(mask);
+      mask &= mask - 1;
+
+      if (arena[pos] == ':') {
+        if (colon == SIZE_MAX)
+          colon = pos;
+        continue;
+      }
+
+      size_t lineEnd = pos;
+      if (lineEnd > lineStart && arena[lineEnd - 1] == '\r')
+        lineEnd--;
+
+      // Empty line ends the section
+      if (lineEnd == lineStart)
+        return 0;
+
+      if (colon == SIZE_MAX || colon > lineEnd)
+        return -EFAULT;
+      if ((res = emitLine(self, lineStart, colon, lineEnd)) < 0)
+        return res;
+
+      lineStart = pos + 1;
+      colon = SIZE_MAX;
+    }
+  }
+
+  // Section wasn't terminated
+  return -EFAULT;
+}
+
+// Whether '\n' at `pos` ends empty line
+static bool isSectionEnd(const char* arena, size_t pos) {
+  if (pos == 0 || arena[pos - 1] == '\n')
+    return true;
+  return arena[pos - 1] == '\r' && (pos == 1 || arena[pos - 2] == '\n');
+}
+
+int http_header_block_feed(struct http_header_block* self, const void* data, size_t len, size_t* consumed) {
+  int res = 0;
+  *consumed = 0;
+  if (self->length + len > HTTP_MAX_HEADER_SECTION)
+    len = HTTP_MAX_HEADER_SECTION - self->length + 1;
+  if ((res = reserveArena(self, self->length + len)) < 0)
+    return res;
+  memcpy(self->arena + self->length, data, len);
+
+  // Only new bytes can contain the end, earlier ones checked
+  const char* cur = self->arena + self->length;
+  const char* arenaEnd = self->arena + self->length + len;
+  while ((cur = memchr(cur, '\n', arenaEnd - cur)) != NULL) {
+    if (isSectionEnd(self->arena, cur - self->arena)) {
+      // Rest belongs to body
+      size_t end = cur - self->arena + 1;
+      *consumed = end - self->length;
+      self->length = end;
+      if ((res = http_header_block_tokenize(self)) < 0)
+        return res;
+      return 1;
+    }
+    cur++;
+  }
+
+  *consumed = len;
+  self->length += len;
+  if (self->length > HTTP_MAX_HEADER_SECTION)
+    return -E2BIG;
+  return 0;
+}
+
+int http_header_block_read(struct http_header_block* self, struct transport* transport) {
+  int res = 0;
+  http_header_block_reset(self);
+
+  do {
+    const void* data;
+    size_t available;
+    if ((res = transport_peek(transport, &data, &available)) < 0)
+      return res == -ENODATA ? -EFAULT : res;
+
+    size_t consumed = 0;
+    res = http_header_block_feed(self, data, available, &consumed);
+    transport_consume(transport, consumed);
+  } while (res == 0);
+
+  return res < 0 ? res : 0;
+}
+
+int http_header_block_add(struct http_header_block* self, const char* name, size_t nameLength, const char* value, size_t valueLength) {
+  int res = 0;
+  size_t newLength = self->length + nameLength + valueLength + 2;
+  if (newLength > HTTP_MAX_HEADER_SECTION)
+    return -E2BIG;
+  if ((res = reserveArena(self, newLength)) < 0)
+    return res;
+
+  // Stored as "<name>\0<value>\0" like tokenizer leaves it
+  struct http_header_field field = {
+    .name = self->length,
+    .nameLength = nameLength,
+    .value = self->length + nameLength + 1,
+    .valueLength = valueLength
+  };
+  memcpy(self->arena + field.name, name, nameLength);
+  self->arena[field.name + nameLength] = '\0';
+  memcpy(self->arena + field.value, value, valueLength);
+  self->arena[field.value + valueLength] = '\0';
+
+  if ((res = addField(self, field)) < 0)
+    return res;
+  self->length = newLength;
+  return 0;
+}
+
+const char* http_header_block_next(struct http_header_block* self, const char* name, size_t* cursor) {
+  size_t nameLength = strlen(name);
+  for (; *cursor < self->fieldCount; (*cursor)++) {
+    struct http_header_field* field = &self->fields[*cursor];
+    if (field->nameLength == nameLength && strcasecmp(self->arena + field->name, name) == 0) {
+      (*cursor)++;
+      return self->arena + field->value;
+    }
+  }
+  return NULL;
+}
+
+const char* http_header_block_get(struct http_header_block* self, const char* name) {
+  size_t nameLength = strlen(name);
+  for (size_t i = self->fieldCount; i > 0; i--) {
+    struct http_header_field* field = &self->fields[i - 1];
+    if (field->nameLength == nameLength && strcasecmp(self->arena + field->name, name) == 0)
+      return self->arena + field->value;
+  }
+  return NULL;
+}
+
+int http_header_block_materialize(struct http_header_block* self, struct http_headers* headers) {
+  int res = 0;
+  for (size_t i = 0; i < self->fieldCount; i++) {
+    struct http_header_field* field = &self->fields[i];
+
+    // Field with characters we don't accept is skipped
+    if ((res = http_headers_add(headers, self->arena + field->name, self->arena + field->value)) < 0 && res != -EINVAL)
+      return res;
+    res = 0;
+  }
+  return res;
+}
@@ -0,0 +1,100 @@
+#ifndef _headers_1672121095_FluffyLauncher_http_header_block
+#define _headers_1672121095_FluffyLauncher_http_header_block
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Raw header (or trailer) section read into one arena and
+// tokenized in single pass, fields are slices into the arena
+// so nothing allocated per field. http_headers only built
+// when caller asks for it (http_header_block_materialize)
+
+// Largest header section accepted
+#define HTTP_MAX_HEADER_SECTION (64 * 1024)
+
+struct http_headers;
+struct transport;
+
+struct http_header_field {
+  // Offsets into arena, name and value are NUL terminated
+  // in place (value has surrounding whitespace trimmed)
+  uint32_t name;
+  uint32_t nameLength;
+  uint32_t value;
+  uint32_t valueLength;
+};
+
+struct http_header_block {
+  // Raw section with padding so scanner can read whole
+  // vectors past the end, reused across responses
+  char* arena;
+  size_t length;
+  size_t capacity;
+
+  struct http_header_field* fields;
+  size_t fieldCount;
+  size_t fieldCapacity;
+};
+
+void http_header_block_init(struct http_header_block* self);
+void http_header_block_cleanup(struct http_header_block* self);
+
+// Forget content but keep memory for next section
+void http_header_block_reset(struct http_header_block* self);
+
+// Read section up to and including empty line from `transport`
+// (bytes after it stay in transport) then tokenize it
+// Return 0 on success
+// Errors:
+// -EFAULT: Malformed section or connection closed early
+// -E2BIG: Section larger than HTTP_MAX_HEADER_SECTION
+// -ENOMEM: Not enough memory
+// Or errors from transport
+[[nodiscard]]
+int http_header_block_read(struct http_header_block* self, struct transport* transport);
+
+// Push variant of http_header_block_read for bytes arriving
+// from elsewhere (section must be reset before first call),
+// `consumed` set to number of bytes used, bytes after empty
+// line are left for caller
+// Return 1 if section complete and tokenized, 0 if more needed
+// Errors:
+// -EFAULT: Malformed section
+// -E2BIG: Section larger than HTTP_MAX_HEADER_SECTION
+// -ENOMEM: Not enough memory
+[[nodiscard]]
+int http_header_block_feed(struct http_header_block* self, const void* data, size_t len, size_t* consumed);
+
+// Tokenize `length` bytes already in arena which must end with
+// empty line, exposed for reuse on other sources
+// Errors:
+// -EFAULT: Malformed section
+// -ENOMEM: Not enough memory
+[[nodiscard]]
+int http_header_block_tokenize(struct http_header_block* self);
+
+// Append already parsed field (from HTTP/2 header block)
+// without going through tokenizer, section stays valid for
+// http_header_block_get and friends
+// Errors:
+// -E2BIG: Section larger than HTTP_MAX_HEADER_SECTION
+// -ENOMEM: Not enough memory
+[[nodiscard]]
+int http_header_block_add(struct http_header_block* self, const char* name, size_t nameLength, const char* value, size_t valueLength);
+
+// Last value of `name` (case insensitive) or NULL if absent
+const char* http_header_block_get(struct http_header_block* self, const char* name);
+
+// Iterate values of `name` in order received, `*cursor`
+// starts at 0, return NULL when there no more
+const char* http_header_block_next(struct http_header_block* self, const char* name, size_t* cursor);
+
+// Add every field into `headers`, fields with characters
+// http_headers refuses are skipped
+// Errors:
+// -ENOMEM: Not enough memory
+[[nodiscard]]
+int http_header_block_materialize(struct http_header_block* self, struct http_headers* headers);
+
+#endif
+
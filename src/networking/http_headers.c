@@ -1,110 +1,220 @@
-#include <ctype.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <errno.h>
 #include <string.h>
+#include <strings.h>
+#include <pthread.h>
 
 #include "http_headers.h"
-#include "list.h"
-#include "panic.h"
-#include "util/util.h"
-#include "hashmap.h"
 #include "http_headers_serializer/normal.h"
 #include "bug.h"
-#include "vec.h"
+
+// Must be power of two and comfortably larger than
+// HTTP_HEADER_WELL_KNOWN_COUNT so probes stay short
+#define WELL_KNOWN_TABLE_SIZE 64
+
+static const char* wellKnownNames[HTTP_HEADER_WELL_KNOWN_COUNT] = {
+  [HTTP_HEADER_ACCEPT] = "Accept",
+  [HTTP_HEADER_ACCEPT_ENCODING] = "Accept-Encoding",
+  [HTTP_HEADER_AUTHORIZATION] = "Authorization",
+  [HTTP_HEADER_CACHE_CONTROL] = "Cache-Control",
+  [HTTP_HEADER_CONNECTION] = "Connection",
+  [HTTP_HEADER_CONTENT_ENCODING] = "Content-Encoding",
+  [HTTP_HEADER_CONTENT_LENGTH] = "Content-Length",
+  [HTTP_HEADER_CONTENT_TYPE] = "Content-Type",
+  [HTTP_HEADER_DATE] = "Date",
+  [HTTP_HEADER_ETAG] = "ETag",
+  [HTTP_HEADER_EXPIRES] = "Expires",
+  [HTTP_HEADER_HOST] = "Host",
+  [HTTP_HEADER_KEEP_ALIVE] = "Keep-Alive",
+  [HTTP_HEADER_LAST_MODIFIED] = "Last-Modified",
+  [HTTP_HEADER_LOCATION] = "Location",
+  [HTTP_HEADER_RETRY_AFTER] = "Retry-After",
+  [HTTP_HEADER_SERVER] = "Server",
+  [HTTP_HEADER_SET_COOKIE] = "Set-Cookie",
+  [HTTP_HEADER_TRANSFER_ENCODING] = "Transfer-Encoding",
+  [HTTP_HEADER_USER_AGENT] = "User-Agent",
+  [HTTP_HEADER_VARY] = "Vary"
+};
+
+static uint8_t wellKnownLengths[HTTP_HEADER_WELL_KNOWN_COUNT];
+
+// Open addressed, slot contains id + 1 (0 is empty)
+static uint8_t wellKnownTable[WELL_KNOWN_TABLE_SIZE];
+static pthread_once_t wellKnownOnce = PTHREAD_ONCE_INIT;
+
+// FNV-1a over ASCII lowercased name
+static uint32_t hashName(const char* name, size_t length) {
+  uint32_t hash = 2166136261u;
+  for (size_t i = 0; i < length; i++) {
+    unsigned char chr = name[i];
+    if (chr >= 'A' && chr <= 'Z')
+      chr += 'a' - 'A';
+    hash = (hash ^ chr) * 16777619u;
+  }
+  return hash;
+}
+
+static void buildWellKnownTable() {
+  for (int id = 0; id < HTTP_HEADER_WELL_KNOWN_COUNT; id++) {
+    size_t length = strlen(wellKnownNames[id]);
+    wellKnownLengths[id] = length;
+
+    uint32_t slot = hashName(wellKnownNames[id], length) & (WELL_KNOWN_TABLE_SIZE - 1);
+    while (wellKnownTable[slot] != 0)
+      slot = (slot + 1) & (WELL_KNOWN_TABLE_SIZE - 1);
+    wellKnownTable[slot] = id + 1;
+  }
+}
+
+static enum http_header_id lookupHashed(const char* name, size_t length, uint32_t hash) {
+  pthread_once(&wellKnownOnce, buildWellKnownTable);
+
+  uint32_t slot = hash & (WELL_KNOWN_TABLE_SIZE - 1);
+  for (; wellKnownTable[slot] != 0; slot = (slot + 1) & (WELL_KNOWN_TABLE_SIZE - 1)) {
+    int id = wellKnownTable[slot] - 1;
+    if (wellKnownLengths[id] == length && strncasecmp(wellKnownNames[id], name, length) == 0)
+      return id;
+  }
+  return HTTP_HEADER_CUSTOM;
+}
+
+enum http_header_id http_header_lookup_id(const char* name, size_t length) {
+  return lookupHashed(name, length, hashName(name, length));
+}
+
+const char* http_header_id_name(enum http_header_id id) {
+  BUG_ON(id >= HTTP_HEADER_WELL_KNOWN_COUNT);
+  return wellKnownNames[id];
+}
 
 struct http_headers* http_headers_new() {
   struct http_headers* self = malloc(sizeof(*self));
   if (!self)
     return NULL;
   
-  hashmap_init(&self->headers, hashmap_hash_string, strcmp);
-  self->headers.map_base.key_dup = (void* (*)(const void*)) strdup;
-  self->headers.map_base.key_free = free;
-  
-  self->insertOrder = list_new();
-  if (!self->insertOrder)
-    goto failure;
-  self->insertOrder->free = free;
-    
+  *self = (struct http_headers) {
+    .entries = self->inlineEntries,
+    .capacity = HTTP_HEADERS_INLINE_ENTRIES
+  };
   return self;
-
-failure:
-  http_headers_free(self);
-  return NULL;
 }
 
 void http_headers_free(struct http_headers* self) {
   if (!self)
     return;
   
-  vec_str_t* data;
-  hashmap_foreach_data(data, &self->headers) {
-    int i = 0;
-    char* content;
-    vec_foreach(data, content, i)
-      free(content);
-    
-    vec_deinit(data);
-    free(data);
-  }
+  if (self->entries != self->inlineEntries)
+    free(self->entries);
+  free(self->arena);
+  free(self);
+}
+
+void http_headers_clear(struct http_headers* self) {
+  self->arenaLength = 0;
+  self->count = 0;
+  memset(self->lastIndex, 0, sizeof(self->lastIndex));
+}
+
+// Make room for `length` more bytes in arena
+static int reserveArena(struct http_headers* self, size_t length) {
+  if (self->arenaLength + length <= self->arenaCapacity)
+    return 0;
   
-  hashmap_cleanup(&self->headers);
+  // Offsets are 32 bit
+  if (self->arenaLength + length > UINT32_MAX)
+    return -ENOMEM;
   
-  list_destroy(self->insertOrder);
-  free(self);
+  size_t newCapacity = self->arenaCapacity ? self->arenaCapacity : 256;
+  while (newCapacity < self->arenaLength + length)
+    newCapacity *= 2;
+  if (newCapacity > UINT32_MAX)
+    newCapacity = UINT32_MAX;
+  
+  char* newArena = realloc(self->arena, newCapacity);
+  if (!newArena)
+    return -ENOMEM;
+  self->arena = newArena;
+  self->arenaCapacity = newCapacity;
+  return 0;
 }
 
-// `name` expect internal copy of name string
-static vec_str_t* getHeaderAutoAlloc(struct http_headers* self, const char* name) {
-  vec_str_t* res = NULL;
-  vec_str_t* headers = hashmap_get(&self->headers, name);
-  if (headers) {
-    res = headers;
-    goto lookup_hit;
+static int reserveEntry(struct http_headers* self) {
+  if (self->count < self->capacity)
+    return 0;
+  
+  size_t newCapacity = self->capacity * 2;
+  struct http_header_entry* newEntries;
+  if (self->entries == self->inlineEntries) {
+    if ((newEntries = malloc(newCapacity * sizeof(*newEntries))))
+      memcpy(newEntries, self->inlineEntries, sizeof(self->inlineEntries));
+  } else {
+    newEntries = realloc(self->entries, newCapacity * sizeof(*newEntries));
   }
   
-  char* copyOfName = strdup(name);
-  if (!copyOfName)
-    goto name_copy_error;
-  
-  list_node_t* node = list_node_new((char*) copyOfName);
-  if (!node)
-    goto node_alloc_failure;
-  
-  headers = malloc(sizeof(*headers));
-  if (!headers)
-    goto header_alloc_failure;
-  vec_init(headers); 
-  
-  if (hashmap_put(&self->headers, name, headers) < 0)
-    goto header_add_failure;
-  list_rpush(self->insertOrder, node);
-  
-  res = headers;  
-header_add_failure:
-  if (!res)
-    vec_deinit(headers);
-header_alloc_failure:
-node_alloc_failure:
-name_copy_error:
-lookup_hit:
-  return res;
+  if (!newEntries)
+    return -ENOMEM;
+  self->entries = newEntries;
+  self->capacity = newCapacity;
+  return 0;
 }
 
-vec_str_t* http_headers_get(struct http_headers* self, const char* name) {
-  vec_str_t* list = hashmap_get(&self->headers, name);
-  if (list && list->length == 0)
+static bool isSameName(struct http_headers* self, struct http_header_entry* entry, enum http_header_id id, const char* name, uint32_t hash) {
+  if (entry->id != id)
+    return false;
+  if (id != HTTP_HEADER_CUSTOM)
+    return true;
+  return entry->nameHash == hash && strcasecmp(self->arena + entry->name, name) == 0;
+}
+
+const char* http_headers_get_id(struct http_headers* self, enum http_header_id id) {
+  BUG_ON(id >= HTTP_HEADER_WELL_KNOWN_COUNT);
+  uint32_t index = self->lastIndex[id];
+  if (index == 0)
     return NULL;
-  return list;
+  return self->arena + self->entries[index - 1].value;
 }
 
-int http_headers_addf(struct http_headers* self, const char* name, const char* contentFmt, ...) {
-  va_list list;
-  va_start(list, contentFmt);
-  int res = http_headers_addf_va(self, name, contentFmt, list);
-  va_end(list);
-  return res;
+const char* http_headers_get(struct http_headers* self, const char* name) {
+  size_t length = strlen(name);
+  uint32_t hash = hashName(name, length);
+  enum http_header_id id = lookupHashed(name, length, hash);
+  if (id != HTTP_HEADER_CUSTOM)
+    return http_headers_get_id(self, id);
+  
+  for (size_t i = self->count; i > 0; i--)
+    if (isSameName(self, &self->entries[i - 1], id, name, hash))
+      return self->arena + self->entries[i - 1].value;
+  return NULL;
+}
+
+const char* http_headers_next(struct http_headers* self, const char* name, size_t* cursor) {
+  size_t length = strlen(name);
+  uint32_t hash = hashName(name, length);
+  enum http_header_id id = lookupHashed(name, length, hash);
+  
+  for (; *cursor < self->count; (*cursor)++) {
+    struct http_header_entry* entry = &self->entries[*cursor];
+    if (isSameName(self, entry, id, name, hash)) {
+      (*cursor)++;
+      return self->arena + entry->value;
+    }
+  }
+  return NULL;
+}
+
+bool http_headers_iterate(struct http_headers* self, size_t* cursor, const char** name, const char** value) {
+  for (; *cursor < self->count; (*cursor)++) {
+    struct http_header_entry* entry = &self->entries[*cursor];
+    if (entry->id == HTTP_HEADER_REMOVED)
+      continue;
+    
+    *name = entry->id == HTTP_HEADER_CUSTOM ? self->arena + entry->name : wellKnownNames[entry->id];
+    *value = self->arena + entry->value;
+    (*cursor)++;
+    return true;
+  }
+  return false;
 }
 
 static bool isValidHeaderNameAndContent(const char* name, const char* content) {
@@ -137,14 +247,14 @@ static bool isValidHeaderNameAndContent(const char* name, const char* content) {
   };
   
   while (*name != '\0') { 
-    if (!validNameCharLookup[(int) *name])
+    if (!validNameCharLookup[(unsigned char) *name])
       return false;
     
     name++;
   }
   
   while (*content != '\0') { 
-    if (!validContentCharLookup[(int) *content])
+    if (!validContentCharLookup[(unsigned char) *content])
       return false;
     
     content++;
@@ -152,46 +262,88 @@ static bool isValidHeaderNameAndContent(const char* name, const char* content) {
   return true;
 }
 
-int http_headers_add(struct http_headers* self, const char* name, const char* content) {
+// Value already appended to arena at `valueStart` (NUL
+// terminated), arena is rolled back if field not added
+static int addEntry(struct http_headers* self, const char* name, size_t valueStart) {
   int res = 0;
-  if (!isValidHeaderNameAndContent(name, content)) {
+  size_t valueLength = self->arenaLength - valueStart - 1;
+  if (!isValidHeaderNameAndContent(name, self->arena + valueStart)) {
     res = -EINVAL;
     goto header_verification_failure;
   }
   
-  char* copy = strdup(content);
-  if (copy == NULL)
-    return -ENOMEM;
+  size_t nameLength = strlen(name);
+  uint32_t hash = hashName(name, nameLength);
+  struct http_header_entry entry = {
+    .id = lookupHashed(name, nameLength, hash),
+    .value = valueStart,
+    .valueLength = valueLength
+  };
   
-  vec_str_t* headerList = getHeaderAutoAlloc(self, name);
-  if (headerList == NULL) { 
-    res = -ENOMEM;
-    goto header_get_failure;
+  if (entry.id == HTTP_HEADER_CUSTOM) {
+    if ((res = reserveArena(self, nameLength + 1)) < 0)
+      goto name_copy_failure;
+    
+    entry.nameHash = hash;
+    entry.name = self->arenaLength;
+    memcpy(self->arena + self->arenaLength, name, nameLength + 1);
+    self->arenaLength += nameLength + 1;
   }
   
-  if (vec_push(headerList, copy) < 0) {
-    res = -ENOMEM;
+  if ((res = reserveEntry(self)) < 0)
     goto add_header_failure;
-  }
+  
+  self->entries[self->count++] = entry;
+  if (entry.id != HTTP_HEADER_CUSTOM)
+    self->lastIndex[entry.id] = self->count;
+  return 0;
 
 add_header_failure:
-header_get_failure:
+name_copy_failure:
 header_verification_failure:
+  self->arenaLength = valueStart;
   return res;
 }
 
-int http_headers_addf_va(struct http_headers* self, const char* name, const char* contentFmt, va_list list) {
-  int res = 0; 
-  char* content;
-  util_asprintf(&content, contentFmt, list);
-  if (!content)
-    return -ENOMEM;
+int http_headers_add(struct http_headers* self, const char* name, const char* content) {
+  int res = 0;
+  size_t length = strlen(content);
+  if ((res = reserveArena(self, length + 1)) < 0)
+    return res;
   
-  res = http_headers_add(self, name, content);
-  free(content);
+  size_t valueStart = self->arenaLength;
+  memcpy(self->arena + valueStart, content, length + 1);
+  self->arenaLength += length + 1;
+  return addEntry(self, name, valueStart);
+}
+
+int http_headers_addf(struct http_headers* self, const char* name, const char* contentFmt, ...) {
+  va_list list;
+  va_start(list, contentFmt);
+  int res = http_headers_addf_va(self, name, contentFmt, list);
+  va_end(list);
   return res;
 }
 
+int http_headers_addf_va(struct http_headers* self, const char* name, const char* contentFmt, va_list list) {
+  int res = 0;
+  va_list copy;
+  va_copy(copy, list);
+  int length = vsnprintf(NULL, 0, contentFmt, copy);
+  va_end(copy);
+  if (length < 0)
+    return -EINVAL;
+  
+  // Formatted straight into arena
+  if ((res = reserveArena(self, length + 1)) < 0)
+    return res;
+  
+  size_t valueStart = self->arenaLength;
+  vsnprintf(self->arena + valueStart, length + 1, contentFmt, list);
+  self->arenaLength += length + 1;
+  return addEntry(self, name, valueStart);
+}
+
 int http_headers_setf(struct http_headers* self, const char* name, const char* contentFmt, ...) {
   va_list list;
   va_start(list, contentFmt);
@@ -200,18 +352,18 @@ int http_headers_setf(struct http_headers* self, const char* name, const char* c
   return res;
 }
 
+// Removed fields' strings stay in arena until cleared
 static void clearHeaderFor(struct http_headers* self, const char* name) {
-  vec_str_t* headerList = getHeaderAutoAlloc(self, name);
-  if (!headerList)
-    return;
+  size_t length = strlen(name);
+  uint32_t hash = hashName(name, length);
+  enum http_header_id id = lookupHashed(name, length, hash);
   
-  int i = 0;
-  const char* content = NULL;
-  vec_foreach(headerList, content, i)
-    free((char*) content);
+  for (size_t i = 0; i < self->count; i++)
+    if (isSameName(self, &self->entries[i], id, name, hash))
+      self->entries[i].id = HTTP_HEADER_REMOVED;
   
-  vec_clear(headerList);
-  return;
+  if (id != HTTP_HEADER_CUSTOM)
+    self->lastIndex[id] = 0;
 }
 
 int http_headers_setf_va(struct http_headers* self, const char* name, const char* contentFmt, va_list list) {
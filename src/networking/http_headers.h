@@ -3,15 +3,78 @@
 
 #include <stdbool.h>
 #include <stdarg.h>
+#include <stddef.h>
+#include <stdint.h>
 
-#include "hashmap.h"
-#include "vec.h"
 #include "buffer.h"
-#include "list.h"
+
+// Fields kept in insertion order as flat array of (name id,
+// value) pairs with strings in one bump arena, common names
+// interned to static IDs so looking them up is O(1)
+// Names are case insensitive (RFC 9110 section 5.1)
+
+enum http_header_id {
+  HTTP_HEADER_ACCEPT,
+  HTTP_HEADER_ACCEPT_ENCODING,
+  HTTP_HEADER_AUTHORIZATION,
+  HTTP_HEADER_CACHE_CONTROL,
+  HTTP_HEADER_CONNECTION,
+  HTTP_HEADER_CONTENT_ENCODING,
+  HTTP_HEADER_CONTENT_LENGTH,
+  HTTP_HEADER_CONTENT_TYPE,
+  HTTP_HEADER_DATE,
+  HTTP_HEADER_ETAG,
+  HTTP_HEADER_EXPIRES,
+  HTTP_HEADER_HOST,
+  HTTP_HEADER_KEEP_ALIVE,
+  HTTP_HEADER_LAST_MODIFIED,
+  HTTP_HEADER_LOCATION,
+  HTTP_HEADER_RETRY_AFTER,
+  HTTP_HEADER_SERVER,
+  HTTP_HEADER_SET_COOKIE,
+  HTTP_HEADER_TRANSFER_ENCODING,
+  HTTP_HEADER_USER_AGENT,
+  HTTP_HEADER_VARY,
+  HTTP_HEADER_WELL_KNOWN_COUNT,
+
+  // Name isn't one of above, stored with the field
+  HTTP_HEADER_CUSTOM = HTTP_HEADER_WELL_KNOWN_COUNT,
+
+  // Field replaced by http_headers_set
+  HTTP_HEADER_REMOVED
+};
+
+struct http_header_entry {
+  uint16_t id;
+
+  // Case insensitive hash and arena offset of the name
+  // (only for HTTP_HEADER_CUSTOM)
+  uint32_t nameHash;
+  uint32_t name;
+
+  uint32_t value;
+  uint32_t valueLength;
+};
+
+// Typical request or response fits without another allocation
+#define HTTP_HEADERS_INLINE_ENTRIES 16
 
 struct http_headers {
-  HASHMAP(char, vec_str_t) headers;
-  list_t* insertOrder;
+  // Names and values NUL terminated, grows so pointers into
+  // it only valid until next modification
+  char* arena;
+  size_t arenaLength;
+  size_t arenaCapacity;
+
+  // Points to inlineEntries until there more than fits
+  struct http_header_entry* entries;
+  size_t count;
+  size_t capacity;
+
+  // Index + 1 of last field with well-known name (0 if none)
+  uint32_t lastIndex[HTTP_HEADER_WELL_KNOWN_COUNT];
+
+  struct http_header_entry inlineEntries[HTTP_HEADERS_INLINE_ENTRIES];
 };
 
 enum http_headers_serialize_type {
@@ -20,10 +83,20 @@ enum http_headers_serialize_type {
   HTTP_HEADER_NORMAL
 };
 
+// ID of `name` (`length` bytes, case insensitive) or
+// HTTP_HEADER_CUSTOM if its not well-known one
+enum http_header_id http_header_lookup_id(const char* name, size_t length);
+
+// Canonical spelling of well-known header
+const char* http_header_id_name(enum http_header_id id);
+
 [[nodiscard]]
 struct http_headers* http_headers_new();
 void http_headers_free(struct http_headers* self);
 
+// Remove every field but keep memory
+void http_headers_clear(struct http_headers* self);
+
 [[nodiscard]]
 int http_headers_add(struct http_headers* self, const char* name, const char* content);
 
@@ -42,8 +115,17 @@ int http_headers_setf(struct http_headers* self, const char* name, const char* c
 [[nodiscard]]
 int http_headers_setf_va(struct http_headers* self, const char* name, const char* contentFmt, va_list list);
 
-// Return non-empty header or NULL if not found or empty
-vec_str_t* http_headers_get(struct http_headers* self, const char* name);
+// Return last value of `name` or NULL if not found
+const char* http_headers_get(struct http_headers* self, const char* name);
+const char* http_headers_get_id(struct http_headers* self, enum http_header_id id);
+
+// Iterate values of `name` in order added, `*cursor` starts
+// at 0, return NULL when there no more
+const char* http_headers_next(struct http_headers* self, const char* name, size_t* cursor);
+
+// Iterate every field in order added, `*cursor` starts at 0
+// Return false when there no more
+bool http_headers_iterate(struct http_headers* self, size_t* cursor, const char** name, const char** value);
 
 // Return serialized header
 [[nodiscard]]
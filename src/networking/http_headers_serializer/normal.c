@@ -2,29 +2,19 @@
 #include <stdio.h>
 
 #include "buffer.h"
-#include "hashmap.h"
 #include "networking/http_headers.h"
 #include "networking/http_headers_serializer/normal.h"
-#include "list.h"
-#include "vec.h"
 
 buffer_t* http_headers_serialize_normal(struct http_headers* self) {
   buffer_t* buffer = buffer_new();
   if (!buffer)
     goto buffer_alloc_failure;
   
-  list_node_t* current = self->insertOrder->head;
-  while (current) {
-    const char* name = current->val;
-    vec_str_t* list = hashmap_get(&self->headers, name);
-    int i = 0;
-    const char* str = NULL;
-    
-    vec_foreach(list, str, i) 
-      buffer_appendf(buffer, "%s: %s\r\n", name, str);
-    
-    current = current->next;
-  }
+  size_t cursor = 0;
+  const char* name;
+  const char* value;
+  while (http_headers_iterate(self, &cursor, &name, &value))
+    buffer_appendf(buffer, "%s: %s\r\n", name, value);
 buffer_alloc_failure:
   return buffer;
 }
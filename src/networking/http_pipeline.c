@@ -0,0 +1,105 @@
+#include <errno.h>
+#include <stdbool.h>
+
+#include "http_pipeline.h"
+#include "config.h"
+#include "http_request.h"
+#include "http_response.h"
+#include "transport/transport.h"
+
+bool http_pipeline_can_pipeline(struct http_request* request) {
+  switch (request->method) {
+    case HTTP_GET:
+    case HTTP_PUT:
+    case HTTP_DELETE:
+      return true;
+    case HTTP_POST:
+    case HTTP_PATCH:
+      return false;
+  }
+  return false;
+}
+
+// Receive response for an entry, `canReuse` set to whether
+// connection still usable for next responses
+static int receiveOne(struct http_pipeline_entry* entry, struct transport* transport, bool* canReuse) {
+  int res = 0;
+  struct http_response localResponse;
+  struct http_response* response = entry->response;
+  if (!response) {
+    if ((res = http_response_static_init(&localResponse)) < 0)
+      goto init_response_error;
+    response = &localResponse;
+  }
+  
+  response->status = 0;
+  res = http_response_recv(response, transport, entry->sink);
+  *canReuse = res >= 0 && response->canReuseConnection;
+  
+  // Once status line received part of body may already be in
+  // sink and response, resending would duplicate it
+  if (res == -ECONNRESET && response->status != 0)
+    res = -EFAULT;
+  
+  if (response == &localResponse)
+    http_response_free(&localResponse);
+init_response_error:
+  return res;
+}
+
+int http_pipeline_run(struct transport* transport, struct http_pipeline_entry* entries, size_t count, size_t window) {
+  if (window == 0)
+    window = CONFIG_NETWORKING_PIPELINE_DEPTH;
+  
+  for (size_t i = 0; i < count; i++)
+    if (!entries[i].request || !http_pipeline_can_pipeline(entries[i].request))
+      return -EINVAL;
+  
+  // Until proven otherwise, the server never answered it
+  for (size_t i = 0; i < count; i++)
+    entries[i].result = -ECONNRESET;
+  
+  size_t sent = 0;
+  size_t received = 0;
+  bool canSend = true;
+  while (received < count) {
+    // Keep window full, limiting outstanding requests so both
+    // side's socket buffers can't fill up and deadlock as we
+    // only read after writes done
+    // Corked so batch of small requests fills whole segments
+    // instead one segment each
+    bool corked = canSend && count - sent > 1 && window - (sent - received) > 1 &&
+                  transport_set_cork(transport, true) >= 0;
+    while (canSend && sent < count && sent - received < window) {
+      if (http_request_send(entries[sent].request, transport) < 0) {
+        // Previous requests may still be answered
+        canSend = false;
+        break;
+      }
+      sent++;
+    }
+    if (corked)
+      transport_set_cork(transport, false);
+    
+    // Nothing in flight anymore
+    if (received == sent)
+      break;
+    
+    struct http_pipeline_entry* entry = &entries[received];
+    bool canReuse = false;
+    entry->result = receiveOne(entry, transport, &canReuse);
+    
+    // Connection state unknown after failure, rest
+    // marked as unanswered
+    if (entry->result < 0)
+      break;
+    received++;
+    
+    // Server closing connection after this response, requests
+    // after this is dropped by the server
+    if (!canReuse)
+      break;
+  }
+  
+  return received;
+}
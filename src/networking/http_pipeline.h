@@ -0,0 +1,44 @@
+#ifndef _headers_1671589120_FluffyLauncher_http_pipeline
+#define _headers_1671589120_FluffyLauncher_http_pipeline
+
+#include <stdbool.h>
+#include <stddef.h>
+
+// HTTP/1.1 pipelining: write several requests to one
+// connection without waiting each response, responses
+// then read in same order as requests sent
+
+struct http_request;
+struct http_response;
+struct transport;
+struct http_body_sink;
+
+struct http_pipeline_entry {
+  struct http_request* request;
+
+  // Optional, must be initialized if not NULL
+  struct http_response* response;
+  struct http_body_sink* sink;
+
+  // Http status code on success or negative errno
+  // -ECONNRESET: Connection closed before status line for
+  //              this request received (safe to resend
+  //              as only idempotent requests are pipelined
+  //              and nothing written to sink or response yet)
+  int result;
+};
+
+// Only idempotent methods may be pipelined (RFC 9112 section 9.3.2)
+bool http_pipeline_can_pipeline(struct http_request* request);
+
+// Send requests in `entries` over `transport` with at most `window`
+// requests awaiting response (0 for CONFIG_NETWORKING_PIPELINE_DEPTH)
+// Return number of entries completed (from first entry) and result
+// of each entry is stored into it
+// Errors:
+// -EINVAL: There non idempotent request
+[[nodiscard]]
+int http_pipeline_run(struct transport* transport, struct http_pipeline_entry* entries, size_t count, size_t window);
+
+#endif
+
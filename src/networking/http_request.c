@@ -1,13 +1,16 @@
 #include <stdarg.h>
 #include <stdint.h>
 #include <stdlib.h>
+#include <string.h>
 #include <errno.h>
 
 #include "bug.h"
 #include "buffer.h"
+#include "config.h"
 #include "http_headers.h"
 #include "transport/transport.h"
 #include "http_request.h"
+#include "http_request_template.h"
 #include "hashmap.h"
 #include "util/util.h"
 #include "vec.h"
@@ -21,6 +24,11 @@ struct http_request* http_request_new() {
   self->headers = http_headers_new();
   self->isMethodSet = false;
   self->canFreeLocation = false;
+  self->timeouts = (struct http_timeouts) {
+    .connectMilis = CONFIG_NETWORKING_CONNECT_TIMEOUT > 0 ? CONFIG_NETWORKING_CONNECT_TIMEOUT : -1,
+    .ioMilis = CONFIG_NETWORKING_IO_TIMEOUT > 0 ? CONFIG_NETWORKING_IO_TIMEOUT : -1,
+    .requestMilis = CONFIG_NETWORKING_REQUEST_TIMEOUT > 0 ? CONFIG_NETWORKING_REQUEST_TIMEOUT : -1
+  };
   if (!self->headers)
     goto headers_alloc_fail;
   
@@ -36,6 +44,7 @@ void http_request_free(struct http_request* self) {
     return;
   
   http_headers_free(self->headers);
+  http_request_template_free(self->template);
   if (self->canFreeLocation)
     free((char*) self->location);
   free(self);
@@ -107,7 +116,7 @@ void http_request_set_method(struct http_request* self, enum http_method method)
   self->isMethodSet = true; 
 }
 
-static const char* methodAsString(enum http_method method) {
+const char* http_request_method_tostring(enum http_method method) {
   switch (method) {
     case HTTP_GET:
       return "GET";
@@ -126,10 +135,10 @@ static const char* methodAsString(enum http_method method) {
 
 static int sendRequest(struct http_request* self, struct transport* transport, const char* httpVer) {
   int res = 0;
-  buffer_t* requestPayload = buffer_new();
-  if (!requestPayload) {
+  buffer_t* requestLine = buffer_new();
+  if (!requestLine) {
     res = -ENOMEM;
-    goto request_buffer_alloc_failure;
+    goto request_line_alloc_failure;
   }
   
   buffer_t* requestHeader = http_headers_serialize(self->headers, HTTP_HEADER_NORMAL);
@@ -138,33 +147,75 @@ static int sendRequest(struct http_request* self, struct transport* transport, c
     goto serialize_request_header_failure;
   }
   
-  res = buffer_appendf(requestPayload, "%s %s %s\r\n%s\r\n", methodAsString(self->method), self->location, httpVer, buffer_string(requestHeader));
-  buffer_free(requestHeader);
-  if (res < 0) {
+  if (buffer_appendf(requestLine, "%s %s %s\r\n", http_request_method_tostring(self->method), self->location, httpVer) < 0) {
     res = -ENOMEM;
-    goto payload_creation_failure;
+    goto request_line_creation_failure;
   }
   
-  // Sending request
-  res = transport->write(transport, buffer_string(requestPayload), buffer_length(requestPayload));
-  buffer_free(requestPayload);
-  if (res < 0) 
-    goto write_request_payload_failure;
-  
-  // Sending request body if exist
-  if (self->requestData) 
-    if ((res = transport->write(transport, self->requestData, self->requestDataLen)) < 0) 
-      goto write_request_payload_failure; 
-write_request_payload_failure:
-payload_creation_failure:
+  // Request line, headers and body go out together
+  struct iovec iov[] = {
+    {buffer_string(requestLine), buffer_length(requestLine)},
+    {buffer_string(requestHeader), buffer_length(requestHeader)},
+    {"\r\n", 2},
+    {(void*) self->requestData, self->requestData ? self->requestDataLen : 0}
+  };
+  res = transport->writev(transport, iov, sizeof(iov) / sizeof(*iov));
+
+request_line_creation_failure:
+  buffer_free(requestHeader);
 serialize_request_header_failure:
-request_buffer_alloc_failure:
+  buffer_free(requestLine);
+request_line_alloc_failure:
   return res;
 }
 
 
 
+// Transport collecting what request sends instead sending it
+struct capture_transport {
+  struct transport super;
+  vec_char_t* result;
+};
+
+static int captureWritev(struct transport* _self, const struct iovec* iov, int iovcnt) {
+  struct capture_transport* self = container_of(_self, struct capture_transport, super);
+  for (int i = 0; i < iovcnt; i++) {
+    if (iov[i].iov_len == 0)
+      continue;
+    if (vec_reserve(self->result, self->result->length + iov[i].iov_len) < 0)
+      return -ENOMEM;
+    memcpy(self->result->data + self->result->length, iov[i].iov_base, iov[i].iov_len);
+    self->result->length += iov[i].iov_len;
+  }
+  return 0;
+}
+
+int http_request_serialize(struct http_request* self, vec_char_t* result) {
+  struct capture_transport capture = {
+    .super.writev = captureWritev,
+    .result = result
+  };
+  return http_request_send(self, &capture.super);
+}
+
+int http_request_compile(struct http_request* self) {
+  if (self->location == NULL || !self->isMethodSet) 
+    return -EINVAL;
+  
+  struct http_request_template* template = NULL;
+  int res = http_request_template_new(&template, self->method, self->location, self->headers);
+  if (res < 0)
+    return res;
+  
+  http_request_template_free(self->template);
+  self->template = template;
+  return 0;
+}
+
 int http_request_send(struct http_request* self, struct transport* transport) {
+  if (self->template)
+    return http_request_template_send(self->template, transport, self->requestData, self->requestDataLen);
+  
   if (self->location == NULL || !self->isMethodSet) 
     return -EINVAL;
   
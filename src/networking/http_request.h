@@ -14,6 +14,7 @@
 #define HTTP_PROTOCOL_VERSION "HTTP/1.1"
 
 struct http_headers;
+struct http_request_template;
 struct transport;
 
 enum http_method {
@@ -24,6 +25,18 @@ enum http_method {
   HTTP_DELETE
 };
 
+// Limits in miliseconds, -1 for no limit
+struct http_timeouts {
+  // Resolving, connecting and TLS handshake of new connection
+  int connectMilis;
+  
+  // Each read or write
+  int ioMilis;
+  
+  // Whole request (including connecting)
+  int requestMilis;
+};
+
 struct http_request {
   bool isMethodSet;
   enum http_method method;
@@ -35,6 +48,14 @@ struct http_request {
   
   size_t requestDataLen;
   const void* requestData;
+  
+  // Defaults from CONFIG_NETWORKING_*_TIMEOUT, only used
+  // by easy API (networking_easy_send_http and friends)
+  struct http_timeouts timeouts;
+  
+  // Owned, sent instead of serializing method, location and
+  // headers if not NULL (see http_request_compile)
+  struct http_request_template* template;
 };
 
 [[nodiscard]]
@@ -56,6 +77,26 @@ void http_request_free(struct http_request* self);
 [[nodiscard]]
 int http_request_send(struct http_request* self, struct transport* transport);
 
+// Append request exactly as http_request_send would send
+// it to `result` (for sending it some other way)
+// Errors:
+// -ENOMEM: Not enough memory
+// -EINVAL: Invalid state
+[[nodiscard]]
+int http_request_serialize(struct http_request* self, vec_char_t* result);
+
+// Serialize method, location and headers once for request
+// sent repeatedly, changing them afterward has no effect until
+// compiled again (body and Host/Authorization via template slots
+// still can change, see http_request_template.h)
+// Errors:
+// -ENOMEM: Not enough memory
+// -EINVAL: Invalid state
+[[nodiscard]]
+int http_request_compile(struct http_request* self);
+
+const char* http_request_method_tostring(enum http_method method);
+
 void http_request_set_method(struct http_request* self, enum http_method method);
 void http_request_set_location(struct http_request* self, const char* location);
 
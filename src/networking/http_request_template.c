@@ -0,0 +1,168 @@
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/uio.h>
+
+#include "http_request_template.h"
+#include "buffer.h"
+#include "http_headers.h"
+#include "http_request.h"
+#include "transport/transport.h"
+
+static const enum http_header_id slotHeaders[HTTP_TEMPLATE_SLOT_COUNT] = {
+  [HTTP_TEMPLATE_HOST] = HTTP_HEADER_HOST,
+  [HTTP_TEMPLATE_AUTHORIZATION] = HTTP_HEADER_AUTHORIZATION
+};
+
+static int findSlot(enum http_header_id id) {
+  for (int slot = 0; slot < HTTP_TEMPLATE_SLOT_COUNT; slot++)
+    if (slotHeaders[slot] == id)
+      return slot;
+  return -1;
+}
+
+int http_request_template_set(struct http_request_template* self, enum http_request_template_slot slot, const char* value) {
+  char* rendered = NULL;
+  size_t renderedLen = 0;
+
+  if (value) {
+    if (strpbrk(value, "\r\n"))
+      return -EINVAL;
+
+    const char* name = http_header_id_name(slotHeaders[slot]);
+    size_t nameLen = strlen(name);
+    size_t valueLen = strlen(value);
+    renderedLen = nameLen + 2 + valueLen + 2;
+    if (!(rendered = malloc(renderedLen + 1)))
+      return -ENOMEM;
+
+    memcpy(rendered, name, nameLen);
+    memcpy(rendered + nameLen, ": ", 2);
+    memcpy(rendered + nameLen + 2, value, valueLen);
+    memcpy(rendered + nameLen + 2 + valueLen, "\r\n", 3);
+  }
+
+  free(self->slots[slot]);
+  self->slots[slot] = rendered;
+  self->slotLengths[slot] = renderedLen;
+  return 0;
+}
+
+const char* http_request_template_get(struct http_request_template* self, enum http_request_template_slot slot, size_t* length) {
+  if (!self->slots[slot])
+    return NULL;
+
+  // Rendered as "<name>: <value>\r\n"
+  size_t prefixLen = strlen(http_header_id_name(slotHeaders[slot])) + 2;
+  *length = self->slotLengths[slot] - prefixLen - 2;
+  return self->slots[slot] + prefixLen;
+}
+
+int http_request_template_new(struct http_request_template** result, enum http_method method, const char* location, struct http_headers* headers) {
+  int res = 0;
+  struct http_request_template* self = malloc(sizeof(*self));
+  if (!self) {
+    res = -ENOMEM;
+    goto alloc_error;
+  }
+  *self = (struct http_request_template) {};
+
+  if (!(self->head = buffer_new())) {
+    res = -ENOMEM;
+    goto head_alloc_error;
+  }
+
+  if (buffer_appendf(self->head, "%s %s %s\r\n", http_request_method_tostring(method), location, HTTP_PROTOCOL_VERSION) < 0) {
+    res = -ENOMEM;
+    goto serialize_error;
+  }
+  self->requestLineLength = buffer_length(self->head);
+
+  // Same order as http_headers_serialize_normal
+  size_t cursor = 0;
+  const char* name;
+  const char* value;
+  while (http_headers_iterate(headers, &cursor, &name, &value)) {
+    enum http_header_id id = http_header_lookup_id(name, strlen(name));
+
+    // Computed from body on each send
+    if (id == HTTP_HEADER_CONTENT_LENGTH)
+      continue;
+
+    // Later value of slot replaces earlier one
+    int slot = findSlot(id);
+    if (slot >= 0) {
+      if ((res = http_request_template_set(self, slot, value)) < 0)
+        goto serialize_error;
+      continue;
+    }
+
+    if (buffer_appendf(self->head, "%s: %s\r\n", name, value) < 0) {
+      res = -ENOMEM;
+      goto serialize_error;
+    }
+  }
+
+serialize_error:
+head_alloc_error:
+  if (res < 0) {
+    http_request_template_free(self);
+    self = NULL;
+  }
+alloc_error:
+  *result = self;
+  return res;
+}
+
+void http_request_template_free(struct http_request_template* self) {
+  if (!self)
+    return;
+
+  for (int slot = 0; slot < HTTP_TEMPLATE_SLOT_COUNT; slot++)
+    free(self->slots[slot]);
+  if (self->head)
+    buffer_free(self->head);
+  free(self);
+}
+
+// Write "Content-Length: <len>\r\n" into `buffer` from the back
+// so no formatting needed, return start of it
+static char* renderContentLength(char* bufferEnd, size_t len) {
+  static const char prefix[] = "Content-Length: ";
+  char* cur = bufferEnd;
+  *--cur = '\n';
+  *--cur = '\r';
+  do {
+    *--cur = '0' + len % 10;
+    len /= 10;
+  } while (len > 0);
+
+  cur -= sizeof(prefix) - 1;
+  memcpy(cur, prefix, sizeof(prefix) - 1);
+  return cur;
+}
+
+int http_request_template_send(struct http_request_template* self, struct transport* transport, const void* body, size_t bodyLen) {
+  struct iovec iov[HTTP_TEMPLATE_SLOT_COUNT + 5];
+  int count = 0;
+
+  // Slots right after request line so Host stays first
+  iov[count++] = (struct iovec) {buffer_string(self->head), self->requestLineLength};
+  for (int slot = 0; slot < HTTP_TEMPLATE_SLOT_COUNT; slot++)
+    if (self->slots[slot])
+      iov[count++] = (struct iovec) {self->slots[slot], self->slotLengths[slot]};
+  iov[count++] = (struct iovec) {buffer_string(self->head) + self->requestLineLength, buffer_length(self->head) - self->requestLineLength};
+
+  // Enough for prefix, 20 digits and line break
+  char contentLength[48];
+  char* contentLengthEnd = contentLength + sizeof(contentLength);
+  if (body) {
+    char* start = renderContentLength(contentLengthEnd, bodyLen);
+    iov[count++] = (struct iovec) {start, contentLengthEnd - start};
+  }
+
+  iov[count++] = (struct iovec) {"\r\n", 2};
+  if (body && bodyLen > 0)
+    iov[count++] = (struct iovec) {(void*) body, bodyLen};
+  return transport->writev(transport, iov, count);
+}
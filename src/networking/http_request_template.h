@@ -0,0 +1,60 @@
+#ifndef _headers_1672034170_FluffyLauncher_http_request_template
+#define _headers_1672034170_FluffyLauncher_http_request_template
+
+#include <stddef.h>
+
+#include "buffer.h"
+#include "http_request.h"
+
+// Request line and headers serialized once so repeated
+// request only writes the bytes, the few headers which
+// change between sends kept in slots
+
+struct http_headers;
+struct transport;
+
+enum http_request_template_slot {
+  HTTP_TEMPLATE_HOST,
+  HTTP_TEMPLATE_AUTHORIZATION,
+  HTTP_TEMPLATE_SLOT_COUNT
+};
+
+struct http_request_template {
+  // "<method> <location> HTTP/1.1\r\n" and every static header
+  buffer_t* head;
+  size_t requestLineLength;
+
+  // Rendered "<name>: <value>\r\n" or NULL if not sent
+  char* slots[HTTP_TEMPLATE_SLOT_COUNT];
+  size_t slotLengths[HTTP_TEMPLATE_SLOT_COUNT];
+};
+
+// Headers matching a slot (and Content-Length which computed
+// on each send) go to slots, rest serialized into head
+// Errors:
+// -ENOMEM: Not enough memory
+// -EINVAL: Invalid slot value (see http_request_template_set)
+[[nodiscard]]
+int http_request_template_new(struct http_request_template** result, enum http_method method, const char* location, struct http_headers* headers);
+void http_request_template_free(struct http_request_template* self);
+
+// Set `slot` header to `value` (NULL to omit the header)
+// Errors:
+// -ENOMEM: Not enough memory
+// -EINVAL: `value` contains line break
+[[nodiscard]]
+int http_request_template_set(struct http_request_template* self, enum http_request_template_slot slot, const char* value);
+
+// Value of `slot` header (`*length` bytes, not NUL terminated)
+// or NULL if its omitted
+const char* http_request_template_get(struct http_request_template* self, enum http_request_template_slot slot, size_t* length);
+
+// Send request with `body` (NULL for none) in one gathered write,
+// Content-Length added if there body
+// Errors:
+// Errors from transport's writev
+[[nodiscard]]
+int http_request_template_send(struct http_request_template* self, struct transport* transport, const void* body, size_t bodyLen);
+
+#endif
+
@@ -2,9 +2,13 @@
 #include <inttypes.h>
 #include <stdlib.h>
 #include <limits.h>
+#include <string.h>
+#include <strings.h>
 
 #include "http_response.h"
 #include "http_headers.h"
+#include "http_body_sink.h"
+#include "http_content_decoder.h"
 #include "bug.h"
 #include "util/util.h"
 #include "http_request.h"
@@ -13,11 +17,16 @@
 static int initResponse(struct http_response* self, bool isStatic) {
   int res = 0;
   *self = (struct http_response) {
-    .staticlyAllocated = isStatic
+    .staticlyAllocated = isStatic,
+    .keepAliveTimeout = -1,
+    .keepAliveMax = -1
   };
   
-  self->headers = http_headers_new();
-  if (!self->headers) {
+  // Headers only built if asked (http_response_get_headers)
+  http_header_block_init(&self->headerBlock);
+  self->headers = NULL;
+  self->trailers = http_headers_new();
+  if (!self->trailers) {
     res = -ENOMEM;
     goto failure;
   }
@@ -28,6 +37,9 @@ failure:
 
 struct http_response* http_response_new() {
   struct http_response* self = malloc(sizeof(*self));
+  if (!self)
+    return NULL;
+  
   int res = initResponse(self, false);
   
   if (res < 0) {
@@ -47,99 +59,113 @@ void http_response_free(struct http_response* self) {
   
   free((char*) self->description);
   http_headers_free(self->headers);
+  http_headers_free(self->trailers);
+  http_header_block_cleanup(&self->headerBlock);
   
   self->description = NULL;
   self->headers = NULL;
+  self->trailers = NULL;
   
   if (self->staticlyAllocated)
     return;
   free(self);
 }
 
+const char* http_response_get_header(struct http_response* self, const char* name) {
+  return http_header_block_get(&self->headerBlock, name);
+}
+
+struct http_headers* http_response_get_headers(struct http_response* self) {
+  if (self->headers)
+    return self->headers;
+  
+  struct http_headers* headers = http_headers_new();
+  if (!headers)
+    return NULL;
+  if (http_header_block_materialize(&self->headerBlock, headers) < 0) {
+    http_headers_free(headers);
+    return NULL;
+  }
+  
+  self->headers = headers;
+  return headers;
+}
+
+// Append bytes up to and including first \n to `lineBuffer`,
+// `consumed` set to number of bytes used
+// Return 1 if line terminated by \r\n complete (terminator
+// replaced by NUL) or 0 if more needed
+// Errors:
+// -E2BIG: Line longer than HTTP_MAX_LINE_LENGTH
+// -ENOMEM: Not enough memory
+static int feedLine(buffer_t* lineBuffer, const char* data, size_t available, size_t* consumed) {
+  *consumed = 0;
+  const char* newline = memchr(data, '\n', available);
+  size_t len = newline ? (size_t) (newline - data) + 1 : available;
+  
+  if (buffer_length(lineBuffer) + len > HTTP_MAX_LINE_LENGTH)
+    return -E2BIG;
+  if (buffer_append_n(lineBuffer, data, len) < 0)
+    return -ENOMEM;
+  *consumed = len;
+  
+  // EOL found
+  size_t lineLen = buffer_length(lineBuffer);
+  if (newline && lineLen >= 2 && lineBuffer->data[lineLen - 2] == '\r') {
+    lineBuffer->data[lineLen - 2] = '\0';
+    return 1;
+  }
+  return 0;
+}
+
 // Read one line terminated by \r\n
 // Return 0 on success
+// Errors:
+// -E2BIG: Line longer than HTTP_MAX_LINE_LENGTH
+// Or errors from transport
 static int readOneLine(struct transport* transport, buffer_t* lineBuffer) {
-  char currentLine = '\0';
   int res = 0;
-  bool isPreviousCarriage = false;
-  while ((res = transport->read(transport, &currentLine, 1, NULL)) >= 0) {
-    if (buffer_append_n(lineBuffer, &currentLine, 1) < 0)
-      return -ENOMEM;
-    
-    if (currentLine == '\r') {
-      isPreviousCarriage = true;
-      continue;
-    }
-    
-    // EOL found
-    if (currentLine == '\n' && isPreviousCarriage) {
-      lineBuffer->data[buffer_length(lineBuffer) - 2] = '\0';
+  const void* data;
+  size_t available;
+  while ((res = transport_peek(transport, &data, &available)) >= 0) {
+    size_t consumed = 0;
+    res = feedLine(lineBuffer, data, available, &consumed);
+    transport_consume(transport, consumed);
+    if (res != 0)
       break;
-    }
-    
-    isPreviousCarriage = false;
   }
   
-  return res;
+  return res < 0 ? res : 0;
 }
 
-static int readHeaders(struct http_response* self, struct transport* transport) {
+// Read trailer section until empty line
+static int readFieldSection(struct http_headers* fields, struct transport* transport) {
   int res = 0;
-  buffer_t* line = buffer_new();
-  if (!line)
-    return -ENOMEM;
+  struct http_header_block block;
+  http_header_block_init(&block);
   
-  do {
-    buffer_clear(line);
-    if (readOneLine(transport, line) < 0) {
-      res = -EFAULT;
-      goto malformed_response;
-    }
+  if ((res = http_header_block_read(&block, transport)) < 0)
+    goto read_error;
+  res = http_header_block_materialize(&block, fields);
 
-    // End of headers list (the \r\n end is stripped of by readOneLine)
-    if (buffer_length(line) == 0)
-      break;
-
-    // Add it to response header list
-    char* current = line->data;
-    while (*current != ':' && *current != '\0')
-      current++;
-    
-    if (*current != ':') {
-      res = -EFAULT;
-      goto malformed_response;
-    }
-    *current = '\0';
-    
-    const char* name = line->data;
-    const char* value = current + 1; 
-    if ((res = http_headers_add(self->headers, name, value)) < 0) {
-      if (res != -ENOMEM)
-        res = -EFAULT;
-      goto malformed_response;
-    }
-  } while (buffer_length(line) > 0);
+read_error:
+  http_header_block_cleanup(&block);
+  return res;
+}
 
-malformed_response:
-  buffer_free(line);
-  return 0;
+static int readHeaders(struct http_response* self, struct transport* transport) {
+  // Built from previous response on same struct
+  http_headers_free(self->headers);
+  self->headers = NULL;
+  return http_header_block_read(&self->headerBlock, transport);
 }
 
-static int readStatusLine(struct http_response* self, struct transport* transport) {
+// Parse status line (without line break) in place
+static int parseStatusLine(struct http_response* self, char* line) {
   int res = 0;
-  buffer_t* line = buffer_new();
-  if (!line)
-    return -ENOMEM;
-  
-  if (readOneLine(transport, line) < 0) {
-    res = -EFAULT;
-    goto malformed_response;
-  }
-  
-  // Parse response
   const char* delim = " ";
   char* current = NULL;
-  char* protocol = strtok_r(buffer_string(line), delim, &current);
+  char* protocol = strtok_r(line, delim, &current);
   char* statusString = strtok_r(NULL, delim, &current);
   char* description = current;
   
@@ -164,10 +190,32 @@ static int readStatusLine(struct http_response* self, struct transport* transpor
     goto malformed_response;
   }
   
+  free((char*) self->description);
   self->description = strdup(description);
   self->status = status;
   
+  // HTTP/1.1 connections are persistent by default, HTTP/1.0 aren't
+  self->canReuseConnection = strcmp(protocol, "HTTP/1.0") != 0;
+  
 malformed_response:
+  return res;
+}
+
+static int readStatusLine(struct http_response* self, struct transport* transport) {
+  int res = 0;
+  buffer_t* line = buffer_new();
+  if (!line)
+    return -ENOMEM;
+  
+  if (readOneLine(transport, line) < 0) {
+    // Connection closed before server sent anything which
+    // normally mean server closed idle persistent connection
+    res = buffer_length(line) == 0 ? -ECONNRESET : -EFAULT;
+    goto read_error;
+  }
+  res = parseStatusLine(self, buffer_string(line));
+  
+read_error:
   buffer_free(line);
   return res;
 }
@@ -188,7 +236,10 @@ enum transfer_method {
 // Contain information about transfer method
 struct transfer_method_data {
   struct http_response* response; 
-  FILE* writeTarget;
+  struct http_body_sink* sink;
+  
+  // HTTP_BODY_SINK_UNKNOWN_LENGTH if unknown
+  size_t totalLength;
   
   union {
     struct {
@@ -200,10 +251,8 @@ struct transfer_method_data {
 // Determine what transfer method the server uses
 static enum transfer_method determineTransferMethod(struct http_response* self, struct transfer_method_data* transferMethodData) {
   // Check for Transfer-Encoding 
-  vec_str_t* transferEncoding = http_headers_get(self->headers, "Transfer-Encoding");
-  if (transferEncoding) {
-    const char* method = vec_last(transferEncoding);
-    
+  const char* method = http_header_block_get(&self->headerBlock, "Transfer-Encoding");
+  if (method) {
     if (strstr(method, "chunked") != NULL) 
       return HTTP_TRANSFER_CHUNKED;
     else if (strstr(method, "identity") != NULL) 
@@ -215,10 +264,9 @@ static enum transfer_method determineTransferMethod(struct http_response* self,
 
 identity_encoding:;
   // Check for Content-Length
-  vec_str_t* contentLength = http_headers_get(self->headers, "Content-Length");
-  if (contentLength) {
+  const char* content = http_header_block_get(&self->headerBlock, "Content-Length");
+  if (content) {
     size_t length = 0;
-    const char* content = vec_last(contentLength);
     while (*content == ' ' && *content != '\0')
       content++;
     if (*content == '\0')
@@ -234,10 +282,8 @@ identity_encoding:;
   }
 
   // Check for Connection
-  vec_str_t* connection = http_headers_get(self->headers, "Connection");
-  if (connection) {
-    const char* connectionType = vec_last(connection);
-    
+  const char* connectionType = http_header_block_get(&self->headerBlock, "Connection");
+  if (connectionType) {
     if (strstr(connectionType, "close") != NULL) {
       return HTTP_TRANSFER_UNTIL_CLOSED;
     }
@@ -250,6 +296,70 @@ unknown_transfer_encoding:
   return HTTP_TRANSFER_UNKNOWN;
 }
 
+// Check whether comma seperated header value contain `token`
+// (case insensitive)
+static bool headerHasToken(const char* value, const char* token) {
+  size_t tokenLen = strlen(token);
+  while (*value != '\0') {
+    while (*value == ' ' || *value == ',')
+      value++;
+    
+    size_t len = strcspn(value, ",");
+    size_t trimmedLen = len;
+    while (trimmedLen > 0 && value[trimmedLen - 1] == ' ')
+      trimmedLen--;
+    
+    if (trimmedLen == tokenLen && strncasecmp(value, token, tokenLen) == 0)
+      return true;
+    value += len;
+  }
+  return false;
+}
+
+// Parse `timeout=5, max=100` from Keep-Alive header
+static void parseKeepAlive(struct http_response* self, const char* value) {
+  while (*value != '\0') {
+    while (*value == ' ' || *value == ',')
+      value++;
+    
+    int* target = NULL;
+    if (strncasecmp(value, "timeout=", 8) == 0)
+      target = &self->keepAliveTimeout;
+    else if (strncasecmp(value, "max=", 4) == 0)
+      target = &self->keepAliveMax;
+    
+    if (target) {
+      char* end = NULL;
+      errno = 0;
+      uintmax_t parsed = strtoumax(strchr(value, '=') + 1, &end, 10);
+      if (errno == 0 && parsed <= INT_MAX && (*end == '\0' || *end == ',' || *end == ' '))
+        *target = (int) parsed;
+    }
+    value += strcspn(value, ",");
+  }
+}
+
+static void determineConnectionReuse(struct http_response* self, enum transfer_method transferMethod) {
+  // Body delimited by connection close obviously can't be reused
+  if (transferMethod == HTTP_TRANSFER_UNTIL_CLOSED) {
+    self->canReuseConnection = false;
+    return;
+  }
+  
+  const char* value;
+  size_t cursor = 0;
+  while ((value = http_header_block_next(&self->headerBlock, "Connection", &cursor)) != NULL) {
+    if (headerHasToken(value, "close"))
+      self->canReuseConnection = false;
+    else if (headerHasToken(value, "keep-alive"))
+      self->canReuseConnection = true;
+  }
+  
+  const char* keepAlive = http_header_block_get(&self->headerBlock, "Keep-Alive");
+  if (keepAlive)
+    parseKeepAlive(self, keepAlive);
+}
+
 static bool isHex(char chr) {
   static bool lookup[256] = {
     ['0'] = true, ['1'] = true, ['2'] = true, ['3'] = true, ['4'] = true, ['5'] = true, ['6'] = true, ['7'] = true,
@@ -260,175 +370,591 @@ static bool isHex(char chr) {
   return lookup[(int) chr];
 } 
 
+static void bodyCommitted(struct transfer_method_data* transferMethodData, size_t len) {
+  struct http_response* response = transferMethodData->response;
+  response->writtenSize += len;
+  if (response->onProgress)
+    response->onProgress(response->progressUdata, response->writtenSize, transferMethodData->totalLength);
+}
+
 static int bodyReceived(struct transfer_method_data* transferMethodData, const void* data, size_t len) {
-  fwrite(data, 1, len, transferMethodData->writeTarget);
-  if (ferror(transferMethodData->writeTarget) != 0)
-    return -EIO;
-  transferMethodData->response->writtenSize += len; 
+  int res = 0;
+  struct http_body_sink* sink = transferMethodData->sink;
+  if (sink && (res = sink->write(sink, data, len)) < 0)
+    return res;
+  bodyCommitted(transferMethodData, len);
   return 0;
 }
 
-// TODO: Implement chunk-extension as defined by https://www.rfc-editor.org/rfc/rfc9112.html#section-7.1
-static int readChunkedMode(struct http_response* self, struct transport* transport, struct transfer_method_data* transferMethodData) {
-  int res = 0;
-  buffer_t* line = buffer_new();
-  if (!line)
-    return -ENOMEM;
+enum chunked_state {
+  // Hex digits of chunk size
+  CHUNKED_SIZE,
+  // Chunk extensions after chunk size till CR
+  CHUNKED_EXTENSION,
+  CHUNKED_EXTENSION_QUOTED,
+  CHUNKED_EXTENSION_QUOTED_ESCAPE,
+  CHUNKED_SIZE_LF,
+  
+  CHUNKED_DATA,
+  CHUNKED_DATA_CR,
+  CHUNKED_DATA_LF,
+  
+  // Last chunk received, trailer section left
+  CHUNKED_TRAILER
+};
+
+// Decoder state persist across reads so chunk boundaries
+// can be anywhere in the read buffer
+struct chunked_decoder {
+  enum chunked_state state;
+  size_t chunkRemaining;
+  int sizeDigits;
+  
+  // Length of chunk size line so far, bounded by HTTP_MAX_LINE_LENGTH
+  size_t lineLength;
+};
+
+static int hexValue(char chr) {
+  if (chr >= '0' && chr <= '9')
+    return chr - '0';
+  if (chr >= 'a' && chr <= 'f')
+    return chr - 'a' + 10;
+  if (chr >= 'A' && chr <= 'F')
+    return chr - 'A' + 10;
+  return -1;
+}
+
+// Process bytes of chunk size line and CRLF after chunk data
+// Return 0 on success
+// Errors:
+// -EFAULT: Malformed chunked encoding
+static int chunkedFeedControl(struct chunked_decoder* decoder, char chr) {
+  if (decoder->state < CHUNKED_SIZE_LF && ++decoder->lineLength > HTTP_MAX_LINE_LENGTH)
+    return -EFAULT;
   
-  size_t chunkSize = 0;
-  do {
-    if ((res = readOneLine(transport, line)) < 0)
-      goto fail_line_read;
+  switch (decoder->state) {
+    case CHUNKED_SIZE:
+      if (isHex(chr)) {
+        // Chunk size doesn't fit, refuse instead trusting it
+        if (decoder->chunkRemaining > SIZE_MAX >> 4)
+          return -EFAULT;
+        decoder->chunkRemaining = (decoder->chunkRemaining << 4) | hexValue(chr);
+        decoder->sizeDigits++;
+        return 0;
+      }
+      
+      if (decoder->sizeDigits == 0)
+        return -EFAULT;
+      if (chr == '\r')
+        decoder->state = CHUNKED_SIZE_LF;
+      else if (chr == ';' || chr == ' ' || chr == '\t')
+        decoder->state = CHUNKED_EXTENSION;
+      else
+        return -EFAULT;
+      return 0;
     
-    // Found great trick by just check for 0x and non hex then bail out instead
-    if (isHex(buffer_string(line)[0]) == false || 
-        strncmp(buffer_string(line), "0x", 2) == 0) {
-      res = -EFAULT;
-      goto malformed_chunked;
-    }
+    // Extensions (RFC 9112 section 7.1.1) are validated and ignored
+    // as we dont understand any of them
+    case CHUNKED_EXTENSION:
+      if (chr == '\r')
+        decoder->state = CHUNKED_SIZE_LF;
+      else if (chr == '"')
+        decoder->state = CHUNKED_EXTENSION_QUOTED;
+      else if (chr == '\n' || chr == '\0')
+        return -EFAULT;
+      return 0;
+    case CHUNKED_EXTENSION_QUOTED:
+      if (chr == '\\')
+        decoder->state = CHUNKED_EXTENSION_QUOTED_ESCAPE;
+      else if (chr == '"')
+        decoder->state = CHUNKED_EXTENSION;
+      else if (chr == '\r' || chr == '\n')
+        return -EFAULT;
+      return 0;
+    case CHUNKED_EXTENSION_QUOTED_ESCAPE:
+      if (chr == '\r' || chr == '\n')
+        return -EFAULT;
+      decoder->state = CHUNKED_EXTENSION_QUOTED;
+      return 0;
     
-    errno = 0;
-    uintmax_t tmp = strtoumax(buffer_string(line), NULL, 16);
-    if (errno || tmp > SIZE_MAX) {
-      res = -EFAULT;
-      goto malformed_chunked;
-    }
-    chunkSize = (size_t) tmp;
+    case CHUNKED_SIZE_LF:
+      if (chr != '\n')
+        return -EFAULT;
+      decoder->state = decoder->chunkRemaining == 0 ? CHUNKED_TRAILER : CHUNKED_DATA;
+      return 0;
     
-    if (chunkSize == 0)
-      goto skip_read;
+    case CHUNKED_DATA_CR:
+      if (chr != '\r')
+        return -EFAULT;
+      decoder->state = CHUNKED_DATA_LF;
+      return 0;
+    case CHUNKED_DATA_LF:
+      if (chr != '\n')
+        return -EFAULT;
+      *decoder = (struct chunked_decoder) {
+        .state = CHUNKED_SIZE
+      };
+      return 0;
     
-    // Read data here
-    size_t readSize = 0;
-    char* buffer = malloc(chunkSize);
+    case CHUNKED_DATA:
+    case CHUNKED_TRAILER:
+      break;
+  }
+  
+  BUG();
+}
+
+// Feed bytes to decoder, chunk data goes directly from
+// transport's buffer to the sink
+// `consumed` set to number of bytes used
+static int chunkedFeed(struct chunked_decoder* decoder, struct transfer_method_data* transferMethodData, const char* data, size_t len, size_t* consumed) {
+  int res = 0;
+  size_t pos = 0;
+  while (pos < len && decoder->state != CHUNKED_TRAILER) {
+    if (decoder->state != CHUNKED_DATA) {
+      if ((res = chunkedFeedControl(decoder, data[pos])) < 0)
+        goto malformed_chunked;
+      pos++;
+      continue;
+    }
     
-    res = transport->read(transport, buffer, chunkSize, &readSize);
-    if (res < 0)
-      goto transport_error;
-      
-    res = bodyReceived(transferMethodData, buffer, chunkSize);
-    free(buffer);
-    if (res < 0)
+    size_t dataLen = len - pos;
+    if (dataLen > decoder->chunkRemaining)
+      dataLen = decoder->chunkRemaining;
+    if ((res = bodyReceived(transferMethodData, data + pos, dataLen)) < 0)
       goto io_error;
     
-    buffer_clear(line);
+    pos += dataLen;
+    decoder->chunkRemaining -= dataLen;
+    if (decoder->chunkRemaining == 0)
+      decoder->state = CHUNKED_DATA_CR;
+  }
+
+io_error:
+malformed_chunked:
+  *consumed = pos;
+  return res;
+}
+
+static int readChunkedMode(struct http_response* self, struct transport* transport, struct transfer_method_data* transferMethodData) {
+  int res = 0;
+  struct chunked_decoder decoder = {
+    .state = CHUNKED_SIZE
+  };
+  
+  while (decoder.state != CHUNKED_TRAILER) {
+    const void* data;
+    size_t available;
+    if ((res = transport_peek(transport, &data, &available)) < 0)
+      goto transport_error;
+    
+    size_t consumed = 0;
+    res = chunkedFeed(&decoder, transferMethodData, data, available, &consumed);
+    transport_consume(transport, consumed);
+    if (res < 0)
+      goto decode_error;
+  }
+  
+  // Trailer section ends with empty line like headers
+  if ((res = readFieldSection(self->trailers, transport)) < 0)
+    goto trailer_error;
+
+trailer_error:
+decode_error:
+transport_error:
+  if (res == -ENODATA)
+    res = -EFAULT;
+  return res;
+}
+
+// Read Content-Length body straight into sink's memory
+static int readByLengthDirect(struct http_response* self, struct transport* transport, struct transfer_method_data* transferMethodData) {
+  int res = 0;
+  struct http_body_sink* sink = transferMethodData->sink;
+  size_t remaining = transferMethodData->data.byContentLength.length;
+  
+  // Read in large slices so progress still reported for
+  // big downloads
+  while (remaining > 0) {
+    size_t toRead = remaining < HTTP_BODY_READ_SLICE ? remaining : HTTP_BODY_READ_SLICE;
+    void* buffer = NULL;
+    if ((res = sink->acquire(sink, toRead, &buffer)) < 0)
+      goto acquire_error;
     
-    // Check for last \r\n sequence 
-    if ((res = readOneLine(transport, line)) < 0)
-      goto fail_line_read;
+    size_t readSize = 0;
+    res = transport_read(transport, buffer, toRead, &readSize);
+    sink->commit(sink, readSize);
+    bodyCommitted(transferMethodData, readSize);
     
-    if (buffer_length(line) != 0) {
+    // Server closed before sending everything
+    if (res == -ENODATA || (res >= 0 && readSize < toRead))
       res = -EFAULT;
-      goto malformed_chunked;
-    }
-skip_read:
-    buffer_clear(line);
-  } while (chunkSize != 0);
+    if (res < 0)
+      goto transport_error;
+    remaining -= readSize;
+  }
 
-io_error:
 transport_error:
-malformed_chunked:
-fail_line_read:  
-  buffer_free(line);
+acquire_error:
   return res;
 }
 
 static int readByLengthMode(struct http_response* self, struct transport* transport, struct transfer_method_data* transferMethodData) {
+  struct http_body_sink* sink = transferMethodData->sink;
+  if (sink && sink->acquire)
+    return readByLengthDirect(self, transport, transferMethodData);
+  
   int res = 0;
-  char buffer[4096] = {};
-  size_t initialReadSize = transferMethodData->data.byContentLength.length % sizeof(buffer);
-  size_t readSize = 0;
-  if ((res = transport->read(transport, buffer, initialReadSize, &readSize)) < 0)
-    goto transport_error;
-  if ((res = bodyReceived(transferMethodData, buffer, readSize)) < 0)
-    goto io_error;
-  
-  // Number of full buffers to read
-  size_t bufferCount = (transferMethodData->data.byContentLength.length - initialReadSize) / sizeof(buffer);
-  for (size_t i = 0; i < bufferCount; i++) {
-    res = transport->read(transport, buffer, sizeof(buffer), &readSize);
-    if (fwrite(buffer, 1, readSize, transferMethodData->writeTarget) == 0)
-      return -EIO;
-    self->writtenSize += readSize;
+  char buffer[16 * 1024];
+  size_t remaining = transferMethodData->data.byContentLength.length;
+  
+  // Read exactly Content-Length bytes so nothing belongs to this
+  // response left in the connection (important if it reused)
+  while (remaining > 0) {
+    size_t readSize = 0;
+    size_t toRead = remaining < sizeof(buffer) ? remaining : sizeof(buffer);
+    res = transport_read(transport, buffer, toRead, &readSize);
+    if (res < 0 && res != -ENODATA)
+      goto transport_error;
     
-    if (res < 0)
+    if (readSize > 0 && (res = bodyReceived(transferMethodData, buffer, readSize)) < 0)
+      goto io_error;
+    
+    // Server closed before sending everything
+    if (readSize < toRead) {
+      res = -EFAULT;
       goto transport_error;
+    }
+    remaining -= readSize;
   }
 
 io_error:
 transport_error:
-  BUG_ON(res == -ENODATA);
   return res;
 }
 
 static int readUntilClosed(struct http_response* self, struct transport* transport, struct transfer_method_data* transferMethodData) {
   int res = 0;
-  char buffer[4096] = {};
+  const void* data;
+  size_t available;
   
-  size_t sizeRead = 0;
-  while ((res = transport->read(transport, buffer, sizeof(buffer), &sizeRead)) >= 0)
-    if ((res = bodyReceived(transferMethodData, buffer, sizeRead)) < 0)
+  // Pass read buffer directly to avoid another copy
+  while ((res = transport_peek(transport, &data, &available)) >= 0) {
+    if ((res = bodyReceived(transferMethodData, data, available)) < 0)
       goto io_error;
+    transport_consume(transport, available);
+  }
   
-  if (res == -ENODATA) {
-    if ((res = bodyReceived(transferMethodData, buffer, sizeRead)) < 0)
-      goto io_error;
+  if (res == -ENODATA)
     res = 0;
-  }
 
 io_error:
   return res;
 }
 
-int http_response_recv(struct http_response* _self, struct transport* transport, FILE* writeTo) {
+int http_response_setup_decoding(struct http_response* self, struct http_content_decoder* decoder, struct http_body_sink** sink) {
   int res = 0;
+  self->contentEncoding = HTTP_CONTENT_IDENTITY;
+  
+  // Discarded body doesn't need decoding
+  if (!*sink)
+    return 0;
   
-  struct http_response self = {};
-  if ((res = http_response_static_init(&self)) < 0)
-    goto error_init_self;
+  const char* encoding = http_header_block_get(&self->headerBlock, "Content-Encoding");
+  if ((res = http_content_encoding_parse(encoding, &self->contentEncoding)) < 0)
+    return res;
+  if (self->contentEncoding == HTTP_CONTENT_IDENTITY)
+    return 0;
+  
+  if ((res = http_content_decoder_init(decoder, self->contentEncoding, *sink)) < 0)
+    return res;
+  *sink = &decoder->super;
+  return 0;
+}
+
+// Pick transfer method and put content decoder in front of
+// sink then tell sink body is coming
+static int beginBody(struct http_response* self, struct http_content_decoder* contentDecoder, struct transfer_method_data* transferMethodData, enum transfer_method* transferMethod) {
+  int res = 0;
+  *transferMethod = determineTransferMethod(self, transferMethodData);
+  if ((res = http_response_setup_decoding(self, contentDecoder, &transferMethodData->sink)) < 0)
+    return res;
+  
+  if (*transferMethod == HTTP_TRANSFER_BY_CONTENT_LENGTH)
+    transferMethodData->totalLength = transferMethodData->data.byContentLength.length;
+  struct http_body_sink* sink = transferMethodData->sink;
+  if (*transferMethod != HTTP_TRANSFER_UNKNOWN && sink && sink->begin &&
+      (res = sink->begin(sink, transferMethodData->totalLength)) < 0)
+    return res;
+  return *transferMethod == HTTP_TRANSFER_UNKNOWN ? -ENOTSUP : 0;
+}
+
+static int finishBody(struct http_response* self, struct transfer_method_data* transferMethodData, enum transfer_method transferMethod) {
+  int res = 0;
+  struct http_body_sink* sink = transferMethodData->sink;
+  if (sink && sink->finish && (res = sink->finish(sink)) < 0)
+    return res;
+  
+  determineConnectionReuse(self, transferMethod);
+  return self->status;
+}
+
+int http_response_recv(struct http_response* _self, struct transport* transport, struct http_body_sink* sink) {
+  int res = 0;
+  struct http_content_decoder contentDecoder = {};
+  
+  struct http_response localResponse;
+  struct http_response* self = _self;
+  if (!self) {
+    if ((res = http_response_static_init(&localResponse)) < 0)
+      goto error_init_self;
+    self = &localResponse;
+  }
+  
+  self->writtenSize = 0;
+  self->decodedSize = 0;
   
   // Reading response
-  if ((res = readStatusLine(&self, transport)) < 0)
+  if ((res = readStatusLine(self, transport)) < 0)
     goto read_response_failure;
-  if ((res = readHeaders(&self, transport)) < 0)
+  if ((res = readHeaders(self, transport)) < 0)
     goto read_response_failure;
   
   struct transfer_method_data transferMethodData = {
-    .writeTarget = writeTo,
-    .response = &self
+    .sink = sink,
+    .response = self,
+    .totalLength = HTTP_BODY_SINK_UNKNOWN_LENGTH
   };
-  enum transfer_method transferMethod = determineTransferMethod(&self, &transferMethodData);
+  enum transfer_method transferMethod;
+  if ((res = beginBody(self, &contentDecoder, &transferMethodData, &transferMethod)) < 0)
+    goto begin_body_error;
+  
   switch (transferMethod) {
     case HTTP_TRANSFER_CHUNKED:
-      res = readChunkedMode(&self, transport, &transferMethodData);
+      res = readChunkedMode(self, transport, &transferMethodData);
       break;
     case HTTP_TRANSFER_BY_CONTENT_LENGTH:
-      res = readByLengthMode(&self, transport, &transferMethodData);
+      res = readByLengthMode(self, transport, &transferMethodData);
       break;
     case HTTP_TRANSFER_UNTIL_CLOSED:
-      res = readUntilClosed(&self, transport, &transferMethodData);
+      res = readUntilClosed(self, transport, &transferMethodData);
       break;
-    case HTTP_TRANSFER_UNKNOWN:
-      res = -ENOTSUP;
-      goto unknown_transfer_method;
     default:
       BUG();
   }
   
   if (res < 0)
     goto transfer_error;
-
-  res = self.status;
-  if (_self) {
-    self.staticlyAllocated = false;
-    *_self = self;
-  } else { 
-    http_response_free(&self);
-  }
+  res = finishBody(self, &transferMethodData, transferMethod);
 
 transfer_error: 
-unknown_transfer_method:
+begin_body_error:
+  self->decodedSize = transferMethodData.sink == &contentDecoder.super ? contentDecoder.decodedSize : self->writtenSize;
+  http_content_decoder_cleanup(&contentDecoder);
 read_response_failure: 
+  if (res < 0)
+    self->canReuseConnection = false;
+  if (self == &localResponse)
+    http_response_free(&localResponse);
 error_init_self:
   return res;
 }
+
+enum parser_state {
+  PARSER_STATUS_LINE,
+  PARSER_HEADERS,
+  PARSER_BODY,
+  PARSER_TRAILERS,
+  PARSER_DONE,
+  PARSER_FAILED
+};
+
+struct http_response_parser {
+  struct http_response* response;
+  enum parser_state state;
+  buffer_t* line;
+  
+  struct transfer_method_data transferMethodData;
+  enum transfer_method transferMethod;
+  struct http_content_decoder contentDecoder;
+  struct chunked_decoder chunkedDecoder;
+  size_t remaining;
+  struct http_header_block trailerBlock;
+};
+
+struct http_response_parser* http_response_parser_new(struct http_response* response, struct http_body_sink* sink) {
+  struct http_response_parser* self = malloc(sizeof(*self));
+  if (!self)
+    return NULL;
+  
+  *self = (struct http_response_parser) {
+    .response = response,
+    .state = PARSER_STATUS_LINE,
+    .transferMethodData = {
+      .sink = sink,
+      .response = response,
+      .totalLength = HTTP_BODY_SINK_UNKNOWN_LENGTH
+    },
+    .chunkedDecoder.state = CHUNKED_SIZE
+  };
+  http_header_block_init(&self->trailerBlock);
+  if (!(self->line = buffer_new())) {
+    free(self);
+    return NULL;
+  }
+  
+  response->writtenSize = 0;
+  response->decodedSize = 0;
+  response->status = 0;
+  return self;
+}
+
+void http_response_parser_free(struct http_response_parser* self) {
+  if (!self)
+    return;
+  
+  http_content_decoder_cleanup(&self->contentDecoder);
+  http_header_block_cleanup(&self->trailerBlock);
+  buffer_free(self->line);
+  free(self);
+}
+
+static int parserFinishBody(struct http_response_parser* self) {
+  self->state = PARSER_DONE;
+  return finishBody(self->response, &self->transferMethodData, self->transferMethod);
+}
+
+static int parserBeginBody(struct http_response_parser* self) {
+  int res = 0;
+  if ((res = beginBody(self->response, &self->contentDecoder, &self->transferMethodData, &self->transferMethod)) < 0)
+    return res;
+  
+  self->state = PARSER_BODY;
+  self->remaining = self->transferMethodData.data.byContentLength.length;
+  if (self->transferMethod == HTTP_TRANSFER_BY_CONTENT_LENGTH && self->remaining == 0)
+    return parserFinishBody(self);
+  return 0;
+}
+
+static int parserFeedBody(struct http_response_parser* self, const char* data, size_t len, size_t* consumed) {
+  int res = 0;
+  switch (self->transferMethod) {
+    case HTTP_TRANSFER_CHUNKED:
+      if ((res = chunkedFeed(&self->chunkedDecoder, &self->transferMethodData, data, len, consumed)) < 0)
+        return res;
+      if (self->chunkedDecoder.state == CHUNKED_TRAILER)
+        self->state = PARSER_TRAILERS;
+      return 0;
+    case HTTP_TRANSFER_BY_CONTENT_LENGTH:
+      *consumed = len < self->remaining ? len : self->remaining;
+      if ((res = bodyReceived(&self->transferMethodData, data, *consumed)) < 0)
+        return res;
+      self->remaining -= *consumed;
+      return self->remaining == 0 ? parserFinishBody(self) : 0;
+    case HTTP_TRANSFER_UNTIL_CLOSED:
+      *consumed = len;
+      return bodyReceived(&self->transferMethodData, data, len);
+    default:
+      BUG();
+  }
+}
+
+static int parserStep(struct http_response_parser* self, const char* data, size_t len, size_t* consumed) {
+  int res = 0;
+  struct http_response* response = self->response;
+  switch (self->state) {
+    case PARSER_STATUS_LINE:
+      if ((res = feedLine(self->line, data, len, consumed)) <= 0)
+        return res;
+      if ((res = parseStatusLine(response, buffer_string(self->line))) < 0)
+        return res;
+      
+      http_headers_free(response->headers);
+      response->headers = NULL;
+      http_header_block_reset(&response->headerBlock);
+      self->state = PARSER_HEADERS;
+      return 0;
+    case PARSER_HEADERS:
+      if ((res = http_header_block_feed(&response->headerBlock, data, len, consumed)) <= 0)
+        return res;
+      return parserBeginBody(self);
+    case PARSER_BODY:
+      return parserFeedBody(self, data, len, consumed);
+    case PARSER_TRAILERS:
+      if ((res = http_header_block_feed(&self->trailerBlock, data, len, consumed)) <= 0)
+        return res;
+      if ((res = http_header_block_materialize(&self->trailerBlock, response->trailers)) < 0)
+        return res;
+      return parserFinishBody(self);
+    case PARSER_DONE:
+    case PARSER_FAILED:
+      break;
+  }
+  BUG();
+}
+
+// Response ended (successfully or not) record what it
+// decoded and whether connection still usable
+static int parserEnd(struct http_response_parser* self, int res) {
+  struct http_response* response = self->response;
+  struct transfer_method_data* transferMethodData = &self->transferMethodData;
+  response->decodedSize = transferMethodData->sink == &self->contentDecoder.super ? self->contentDecoder.decodedSize : response->writtenSize;
+  if (res < 0) {
+    self->state = PARSER_FAILED;
+    response->canReuseConnection = false;
+  }
+  return res;
+}
+
+int http_response_parser_feed(struct http_response_parser* self, const void* data, size_t len, size_t* consumed) {
+  int res = 0;
+  size_t pos = 0;
+  if (self->state == PARSER_FAILED)
+    return -EINVAL;
+  
+  // Empty Content-Length body completes with headers, so
+  // check state after every step rather than only when
+  // bytes left
+  while (self->state != PARSER_DONE && pos < len) {
+    size_t stepConsumed = 0;
+    res = parserStep(self, (const char*) data + pos, len - pos, &stepConsumed);
+    pos += stepConsumed;
+    if (res < 0)
+      break;
+  }
+  
+  *consumed = pos;
+  if (res < 0)
+    return parserEnd(self, res);
+  if (self->state != PARSER_DONE)
+    return -EAGAIN;
+  return parserEnd(self, self->response->status);
+}
+
+int http_response_parser_finish(struct http_response_parser* self) {
+  int res = 0;
+  switch (self->state) {
+    case PARSER_DONE:
+      return self->response->status;
+    case PARSER_FAILED:
+      return -EINVAL;
+    
+    // Same as http_response_recv, closed before anything
+    // received normally mean server closed idle connection
+    case PARSER_STATUS_LINE:
+      res = buffer_length(self->line) == 0 ? -ECONNRESET : -EFAULT;
+      break;
+    case PARSER_BODY:
+      if (self->transferMethod == HTTP_TRANSFER_UNTIL_CLOSED) {
+        res = parserFinishBody(self);
+        break;
+      }
+      res = -EFAULT;
+      break;
+    case PARSER_HEADERS:
+    case PARSER_TRAILERS:
+      res = -EFAULT;
+      break;
+  }
+  return parserEnd(self, res);
+}
@@ -5,15 +5,58 @@
 #include <stdio.h>
 #include <stdbool.h>
 
+#include "http_header_block.h"
+#include "http_content_decoder.h"
+
 struct transport;
+struct http_body_sink;
+
+// Longest status line, header line or chunk size line accepted
+#define HTTP_MAX_LINE_LENGTH 8192
+
+// Content-Length body read and reported in slices this big
+#define HTTP_BODY_READ_SLICE (256 * 1024)
+
+// `total` is HTTP_BODY_SINK_UNKNOWN_LENGTH if server didn't
+// tell body length
+typedef void (*http_response_progress_func)(void* udata, size_t received, size_t total);
 
 struct http_response {
   int status;
+  
+  // Reason phrase, NULL for HTTP/2 which has none
   const char* description;
+  
+  // Body bytes as server sent them (after transfer decoding)
+  // and after Content-Encoding decoded, same if body wasn't
+  // encoded or was discarded
   size_t writtenSize;
+  size_t decodedSize;
+  enum http_content_encoding contentEncoding;
   
+  // Raw header section, use http_response_get_header or
+  // http_response_get_headers instead reading these
+  struct http_header_block headerBlock;
   struct http_headers* headers;
   
+  // Trailer fields sent after chunked body (kept seperate
+  // from headers as RFC 9110 section 6.5.1 requires)
+  struct http_headers* trailers;
+  
+  // Whether the connection can be used for next request
+  // (persistent connection and response fully consumed)
+  bool canReuseConnection;
+  
+  // Parameters from Keep-Alive header or -1 if server
+  // didn't specify it
+  int keepAliveTimeout;
+  int keepAliveMax;
+  
+  // Optional, set by caller before http_response_recv
+  // to get notified as body received
+  http_response_progress_func onProgress;
+  void* progressUdata;
+  
   bool staticlyAllocated;
 };
 
@@ -21,7 +64,30 @@ struct http_response* http_response_new();
 int http_response_static_init(struct http_response* self);
 void http_response_free(struct http_response* self);
 
+// Last value of header `name` (case insensitive) without
+// building http_headers, NULL if server didn't send it
+const char* http_response_get_header(struct http_response* self, const char* name);
+
+// Every header as http_headers (built on first call)
+// Return NULL if not enough memory
+struct http_headers* http_response_get_headers(struct http_response* self);
+
+// Put decoder for response's Content-Encoding in front of
+// `*sink` (replaced with the decoder) and set contentEncoding,
+// `decoder` only initialized if needed and must be zeroed
+// before so http_content_decoder_cleanup is always safe
+// Errors:
+// -ENOTSUP: Content encoding unsupported
+// -ENOMEM: Not enough memory
+[[nodiscard]]
+int http_response_setup_decoding(struct http_response* self, struct http_content_decoder* decoder, struct http_body_sink** sink);
+
 // Wait for request result
+// `self` must be initialized with http_response_new or
+// http_response_static_init (or NULL if caller doesn't need it)
+// and its content is undefined on error
+// Body is pushed to `sink` as it arrives (or discarded if NULL)
+// after Content-Encoding decoded
 // Return http status code on success
 // Errors:
 // -ENOMEM: Not enough memory
@@ -32,9 +98,42 @@ void http_response_free(struct http_response* self);
 // -ECONNRESET: Connection reset
 // -EFAULT: Malformed server response
 // -EINVAL: Invalid state
-// -ENOTSUP: Server transfer encoding unsupported
+// -ENOTSUP: Server transfer or content encoding unsupported
+// -EFAULT: Corrupted or truncated encoded body
+// Or errors from sink
+[[nodiscard]]
+int http_response_recv(struct http_response* self, struct transport* transport, struct http_body_sink* sink);
+
+// Push based counterpart of http_response_recv for responses
+// read from non blocking transport, bytes are fed as they
+// arrive and body goes to `sink` same way
+struct http_response_parser;
+
+// `response` must be initialized and outlive the parser
+// Return NULL if not enough memory
+struct http_response_parser* http_response_parser_new(struct http_response* response, struct http_body_sink* sink);
+void http_response_parser_free(struct http_response_parser* self);
+
+// Feed received bytes, `consumed` set to number of bytes
+// used (rest came after the response)
+// Return http status code once response complete
+// Errors:
+// -EAGAIN: Response not complete yet, feed more
+// -EINVAL: Parser failed earlier
+// Or same errors as http_response_recv
+[[nodiscard]]
+int http_response_parser_feed(struct http_response_parser* self, const void* data, size_t len, size_t* consumed);
+
+// Server closed connection, completes response whose body
+// runs until close
+// Return http status code on success
+// Errors:
+// -ECONNRESET: Closed before anything received
+// -EFAULT: Response truncated
+// -EINVAL: Parser failed earlier
+// Or errors from sink
 [[nodiscard]]
-int http_response_recv(struct http_response* self, struct transport* transport, FILE* writeTo);
+int http_response_parser_finish(struct http_response_parser* self);
 
 #endif
 
@@ -1,99 +1,44 @@
 #include <arpa/inet.h>
-#include <netdb.h>
+#include <fcntl.h>
 #include <netinet/in.h>
+#include <poll.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <errno.h>
 #include <string.h>
 #include <sys/socket.h>
+#include <unistd.h>
 
 #include "bug.h"
 #include "networking.h"
 #include "logging/logging.h"
-
-static int doResolve(const char* name, struct addrinfo** result) {
-  struct addrinfo* lookupResult;
-  int getAddrRes = getaddrinfo(name, NULL, NULL, &lookupResult);
-  int res = 0;
-  
-  switch (getAddrRes) {
-    case -EAI_AGAIN:
-      res = -EAGAIN;
-      goto lookup_error;
-    case -EAI_MEMORY:
-      res = -ENOMEM;
-      goto lookup_error;
-    default:
-      if (res >= 0 && lookupResult != NULL)
-        break;
-      res = -ESRCH;
-      goto lookup_error;
-  }
-
-lookup_error:
-  if (result)
-    *result = lookupResult;
-  else if (res >= 0)
-    freeaddrinfo(lookupResult);
-  return res;
-}
+#include "resolver.h"
+#include "util/util.h"
 
 int networking_resolve(const char* name, struct ip_address* addr, int flags) {
   if ((flags & ~NETWORKING_RESOLVE_FLAG_MASK) != 0)
     return -EINVAL;
   
-  struct ip_address result = {};
   int res = 0;
-  struct addrinfo* lookupResultList = NULL;
-  struct addrinfo* lookupResult = NULL;
-  
-  if ((res = doResolve(name, &lookupResultList)) < 0)
-    goto resolve_error;
-  lookupResult = lookupResultList;
-  BUG_ON(!lookupResult);
+  struct resolver_result* resolved = NULL;
+  if ((res = resolver_resolve(name, &resolved, -1)) < 0)
+    return res;
   
+  struct ip_address* result = &resolved->addresses[0];
   if (flags & NETWORKING_RESOLVE_PREFER_MASK) {
-    int filterFor = flags & NETWORKING_RESOLVE_PREFER_IPV4 ? AF_INET : 
-                    flags & NETWORKING_RESOLVE_PREFER_IPV6 ? AF_INET6 : -1;
-    BUG_ON(filterFor == -1);
-    
-    bool foundMatch = false;
-    struct addrinfo* current = lookupResultList;
-    while (current) {
-      if (current->ai_family == filterFor) {
-        foundMatch = true;
+    enum ip_family filterFor = flags & NETWORKING_RESOLVE_PREFER_IPV4 ? NETWORKING_IPV4 : NETWORKING_IPV6;
+    for (size_t i = 0; i < resolved->count; i++) {
+      if (resolved->addresses[i].family == filterFor) {
+        result = &resolved->addresses[i];
         break;
       }
-      
-      current = current->ai_next;
     }
-    
-    lookupResult = foundMatch ? current : lookupResultList;
   }
   
-  switch (lookupResult->ai_family) {
-    case AF_INET:
-      result.family = NETWORKING_IPV4;
-      BUG_ON(lookupResult->ai_addrlen != sizeof(struct sockaddr_in));
-      struct in_addr tmp1 = ((struct sockaddr_in*) lookupResult->ai_addr)->sin_addr;
-      memcpy(&result.addr.ipv4, &tmp1.s_addr, sizeof(result.addr.ipv4));
-      break;
-    case AF_INET6:
-      result.family = NETWORKING_IPV6;
-      BUG_ON(lookupResult->ai_addrlen != sizeof(struct sockaddr_in6));
-      struct in6_addr tmp2 = ((struct sockaddr_in6*) lookupResult->ai_addr)->sin6_addr;
-      memcpy(&result.addr.ipv6, tmp2.s6_addr, sizeof(result.addr.ipv6));
-      break;
-  }
-  
-  freeaddrinfo(lookupResultList);
-resolve_error:
-  if (res < 0)
-    pr_error("Unable to resolve %s: %d", name, res);
-  
   if (addr)
-    *addr = result;
+    *addr = *result;
+  free(resolved);
   return res;
 }
 
@@ -176,49 +121,116 @@ int networking_socket(struct ip_address* addr, int sockType) {
   return res < 0 ? -errno : res;
 }
 
-int networking_connect(struct ip_address* addr, enum network_protocol protocol) {
-  int socket = networking_socket(addr, networking_to_sock_type(protocol));
-  if (socket < 0)
-    return -EFAULT;
-  
-  struct sockaddr* sockAddr = NULL;
-  size_t sockAddrLen = 0;
-  struct sockaddr_in asIPv4 = {
-    .sin_family = AF_INET
-  };
-  struct sockaddr_in6 asIPv6 = {
-    .sin6_family = AF_INET6
-  };
+static void toSockaddr(struct ip_address* addr, struct sockaddr_storage* storage, socklen_t* sockAddrLen) {
+  *storage = (struct sockaddr_storage) {};
+  struct sockaddr_in* asIPv4 = (struct sockaddr_in*) storage;
+  struct sockaddr_in6* asIPv6 = (struct sockaddr_in6*) storage;
   switch (addr->family) {
     case NETWORKING_IPV4:
-      sockAddr = (struct sockaddr*) &asIPv4;
-      sockAddrLen = sizeof(asIPv4);
-      memcpy(&asIPv4.sin_addr.s_addr, &addr->addr.ipv4, sizeof(asIPv4.sin_addr.s_addr));
-      asIPv4.sin_port = htons(addr->port);
+      asIPv4->sin_family = AF_INET;
+      *sockAddrLen = sizeof(*asIPv4);
+      memcpy(&asIPv4->sin_addr.s_addr, &addr->addr.ipv4, sizeof(asIPv4->sin_addr.s_addr));
+      asIPv4->sin_port = htons(addr->port);
       break;
     case NETWORKING_IPV6:
-      sockAddr = (struct sockaddr*) &asIPv6;
-      sockAddrLen = sizeof(asIPv6);
-      memcpy(asIPv6.sin6_addr.s6_addr, &addr->addr.ipv6, sizeof(asIPv6.sin6_addr.s6_addr));
-      asIPv6.sin6_port = htons(addr->port);
+      asIPv6->sin6_family = AF_INET6;
+      *sockAddrLen = sizeof(*asIPv6);
+      memcpy(asIPv6->sin6_addr.s6_addr, &addr->addr.ipv6, sizeof(asIPv6->sin6_addr.s6_addr));
+      asIPv6->sin6_port = htons(addr->port);
       break;
   }
-  
-  int res = connect(socket, sockAddr, sockAddrLen);
-  if (res < 0) {
-    res = -errno;
-    switch (errno) {
-      case ENETUNREACH:
-      case ETIMEDOUT:
-      case ENETDOWN:
-      case ECONNREFUSED:
-      case EHOSTUNREACH:
-        break;
-      default:
-        res = -EFAULT;
-        break;
+}
+
+static int translateConnectError(int err) {
+  switch (err) {
+    case ENETUNREACH:
+    case ETIMEDOUT:
+    case ENETDOWN:
+    case ECONNREFUSED:
+    case EHOSTUNREACH:
+    case EINPROGRESS:
+      return -err;
+  }
+  return -EFAULT;
+}
+
+int networking_connect(struct ip_address* addr, enum network_protocol protocol, int timeoutMilis) {
+  int socket = -1;
+  int res = networking_connect_nonblocking(addr, protocol, &socket);
+  if (res == -EINPROGRESS) {
+    struct pollfd pollFd = {
+      .fd = socket,
+      .events = POLLOUT
+    };
+    
+    double deadline = util_get_monotonic() + timeoutMilis / 1000.0;
+    int waitMilis = timeoutMilis;
+    while ((res = poll(&pollFd, 1, waitMilis)) < 0 && errno == EINTR) {
+      if (timeoutMilis < 0)
+        continue;
+      
+      waitMilis = (int) ((deadline - util_get_monotonic()) * 1000.0) + 1;
+      if (waitMilis < 0)
+        waitMilis = 0;
     }
+    
+    if (res < 0)
+      res = -EFAULT;
+    else if (res == 0)
+      res = -ETIMEDOUT;
+    else
+      res = networking_connect_finish(socket);
+    
+    if (res < 0)
+      close(socket);
+  }
+  if (res < 0)
+    return res;
+  
+  // Caller expects ordinary blocking socket
+  int flags = fcntl(socket, F_GETFL);
+  if (flags < 0 || fcntl(socket, F_SETFL, flags & ~O_NONBLOCK) < 0) {
+    close(socket);
+    return -EFAULT;
+  }
+  return socket;
+}
+
+int networking_connect_nonblocking(struct ip_address* addr, enum network_protocol protocol, int* fd) {
+  int res = 0;
+  int socket = networking_socket(addr, networking_to_sock_type(protocol));
+  if (socket < 0)
+    return -EFAULT;
+  
+  int flags = fcntl(socket, F_GETFL);
+  if (flags < 0 || fcntl(socket, F_SETFL, flags | O_NONBLOCK) < 0) {
+    res = -EFAULT;
+    goto set_nonblock_error;
   }
-  return res < 0 ? res : socket;
+  
+  struct sockaddr_storage sockAddr;
+  socklen_t sockAddrLen = 0;
+  toSockaddr(addr, &sockAddr, &sockAddrLen);
+  
+  while ((res = connect(socket, (struct sockaddr*) &sockAddr, sockAddrLen)) < 0 && errno == EINTR)
+    ;
+  if (res < 0)
+    res = translateConnectError(errno);
+
+set_nonblock_error:
+  if (res < 0 && res != -EINPROGRESS)
+    close(socket);
+  else
+    *fd = socket;
+  return res;
 }
 
+int networking_connect_finish(int fd) {
+  int err = 0;
+  socklen_t errLen = sizeof(err);
+  if (getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &errLen) < 0)
+    return -EFAULT;
+  if (err == 0)
+    return 0;
+  return translateConnectError(err);
+}
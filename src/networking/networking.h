@@ -38,6 +38,7 @@ struct ip_address {
 
 #define NETWORKING_RESOLVE_FLAG_MASK   0b0011
 
+// Pick one address of `name` (see resolver.h for all addresses)
 // Return 0 on success
 // Errors:
 // -ESRCH: Can't be resolved
@@ -59,7 +60,8 @@ int networking_to_sock_type(enum network_protocol family);
 [[nodiscard]]
 int networking_socket(struct ip_address* addr, int sockType);
 
-// Return socket fd on success
+// Return blocking socket fd on success, connect is given
+// up after `timeoutMilis` (-1 to wait forever)
 // Errors:
 // -ENETUNREACH: Network unreachable
 // -ETIMEDOUT: Time out
@@ -67,7 +69,21 @@ int networking_socket(struct ip_address* addr, int sockType);
 // -ECONNREFUSED: Connnection refused
 // -EHOSTUNREACH: Host is down
 [[nodiscard]]
-int networking_connect(struct ip_address* addr, enum network_protocol protocol);
+int networking_connect(struct ip_address* addr, enum network_protocol protocol, int timeoutMilis);
+
+// Start connecting with non blocking socket stored into `fd`
+// Return 0 if connected immediately
+// Errors:
+// -EINPROGRESS: Connection in progress, wait for fd to be
+//               writable then call networking_connect_finish
+// And errors from networking_connect (`fd` closed)
+[[nodiscard]]
+int networking_connect_nonblocking(struct ip_address* addr, enum network_protocol protocol, int* fd);
+
+// Return 0 if non blocking connect succeeded
+// Errors same as networking_connect
+[[nodiscard]]
+int networking_connect_finish(int fd);
 
 #endif
 
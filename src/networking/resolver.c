@@ -0,0 +1,508 @@
+#include <errno.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+
+#include "resolver.h"
+#include "bug.h"
+#include "config.h"
+#include "logging/logging.h"
+#include "networking.h"
+#include "util/util.h"
+#include "vec.h"
+
+struct waiter {
+  resolver_callback callback;
+  void* udata;
+};
+typedef vec_t(struct waiter) waiter_vec_t;
+
+struct cache_entry;
+typedef vec_t(struct cache_entry*) entry_vec_t;
+
+struct cache_entry {
+  char* hostname;
+
+  // Result of latest lookup, `result` may be kept (stale)
+  // even if refreshing it failed
+  int res;
+  struct resolver_result* result;
+  bool hasResult;
+  bool isResolving;
+
+  // Monotonic time, fresh until `expireAt` and may be
+  // served stale until `staleUntil` while refreshing
+  double expireAt;
+  double staleUntil;
+
+  waiter_vec_t waiters;
+};
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t jobAvailable = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t lookupDone = PTHREAD_COND_INITIALIZER;
+
+static entry_vec_t entries;
+static entry_vec_t jobs;
+static pthread_t* threads = NULL;
+static int threadCount = 0;
+static bool isStopping = false;
+
+static int translateGaiError(int err) {
+  switch (err) {
+    case EAI_AGAIN:
+      return -EAGAIN;
+    case EAI_MEMORY:
+      return -ENOMEM;
+  }
+  return -ESRCH;
+}
+
+static bool isSameAddress(struct ip_address* a, struct ip_address* b) {
+  if (a->family != b->family)
+    return false;
+  if (a->family == NETWORKING_IPV4)
+    return memcmp(&a->addr.ipv4, &b->addr.ipv4, sizeof(a->addr.ipv4)) == 0;
+  return memcmp(&a->addr.ipv6, &b->addr.ipv6, sizeof(a->addr.ipv6)) == 0;
+}
+
+// Blocking lookup with system resolver
+static int lookup(const char* hostname, struct resolver_result** resultPtr) {
+  struct addrinfo hints = {
+    .ai_family = AF_UNSPEC,
+    .ai_socktype = SOCK_STREAM,
+    .ai_flags = AI_ADDRCONFIG
+  };
+
+  struct addrinfo* lookupResult = NULL;
+  int res = getaddrinfo(hostname, NULL, &hints, &lookupResult);
+  if (res != 0)
+    return translateGaiError(res);
+
+  size_t count = 0;
+  for (struct addrinfo* current = lookupResult; current; current = current->ai_next)
+    count++;
+
+  struct resolver_result* result = malloc(sizeof(*result) + count * sizeof(*result->addresses));
+  if (!result) {
+    res = -ENOMEM;
+    goto alloc_result_error;
+  }
+  result->count = 0;
+
+  for (struct addrinfo* current = lookupResult; current; current = current->ai_next) {
+    struct ip_address addr = {};
+    switch (current->ai_family) {
+      case AF_INET:
+        BUG_ON(current->ai_addrlen != sizeof(struct sockaddr_in));
+        addr.family = NETWORKING_IPV4;
+        memcpy(&addr.addr.ipv4, &((struct sockaddr_in*) current->ai_addr)->sin_addr.s_addr, sizeof(addr.addr.ipv4));
+        break;
+      case AF_INET6:
+        BUG_ON(current->ai_addrlen != sizeof(struct sockaddr_in6));
+        addr.family = NETWORKING_IPV6;
+        memcpy(&addr.addr.ipv6, ((struct sockaddr_in6*) current->ai_addr)->sin6_addr.s6_addr, sizeof(addr.addr.ipv6));
+        break;
+      default:
+        continue;
+    }
+
+    bool isDuplicate = false;
+    for (size_t i = 0; i < result->count && !isDuplicate; i++)
+      isDuplicate = isSameAddress(&result->addresses[i], &addr);
+    if (!isDuplicate)
+      result->addresses[result->count++] = addr;
+  }
+
+  if (result->count == 0) {
+    free(result);
+    res = -ESRCH;
+    goto no_usable_address;
+  }
+  *resultPtr = result;
+
+no_usable_address:
+alloc_result_error:
+  freeaddrinfo(lookupResult);
+  return res;
+}
+
+static struct resolver_result* copyResult(struct resolver_result* result) {
+  size_t size = sizeof(*result) + result->count * sizeof(*result->addresses);
+  struct resolver_result* copy = malloc(size);
+  if (copy)
+    memcpy(copy, result, size);
+  return copy;
+}
+
+static struct cache_entry* findEntry(const char* hostname) {
+  struct cache_entry* entry;
+  int i;
+  vec_foreach(&entries, entry, i)
+    if (strcmp(entry->hostname, hostname) == 0)
+      return entry;
+  return NULL;
+}
+
+static void freeEntry(struct cache_entry* entry) {
+  free(entry->hostname);
+  free(entry->result);
+  vec_deinit(&entry->waiters);
+  free(entry);
+}
+
+static struct cache_entry* getEntry(const char* hostname) {
+  struct cache_entry* entry = findEntry(hostname);
+  if (entry)
+    return entry;
+
+  if (vec_reserve(&entries, entries.length + 1) < 0)
+    return NULL;
+
+  entry = malloc(sizeof(*entry));
+  if (!entry)
+    return NULL;
+
+  *entry = (struct cache_entry) {
+    .hostname = strdup(hostname)
+  };
+  if (!entry->hostname) {
+    free(entry);
+    return NULL;
+  }
+
+  vec_init(&entry->waiters);
+  vec_push(&entries, entry);
+  return entry;
+}
+
+// Queue lookup of `entry` unless already in progress
+static int startLookup(struct cache_entry* entry) {
+  if (entry->isResolving)
+    return 0;
+  if (isStopping)
+    return -ECANCELED;
+  if (vec_reserve(&jobs, jobs.length + 1) < 0)
+    return -ENOMEM;
+
+  entry->isResolving = true;
+  vec_push(&jobs, entry);
+  pthread_cond_signal(&jobAvailable);
+  return 0;
+}
+
+static void storeResult(struct cache_entry* entry, int res, struct resolver_result* result) {
+  double now = util_get_monotonic();
+  entry->isResolving = false;
+  entry->hasResult = true;
+
+  if (res >= 0) {
+    free(entry->result);
+    entry->result = result;
+    entry->res = 0;
+    entry->expireAt = now + CONFIG_NETWORKING_DNS_CACHE_TTL;
+    entry->staleUntil = entry->expireAt + CONFIG_NETWORKING_DNS_STALE_GRACE;
+    return;
+  }
+
+  // Resolver having trouble, keep using old addresses a bit
+  // longer rather than failing (RFC 8767)
+  if (entry->result && now < entry->staleUntil) {
+    pr_warn("Refreshing %s failed (%d), using stale addresses", entry->hostname, res);
+    entry->expireAt = now + CONFIG_NETWORKING_DNS_NEGATIVE_TTL;
+    return;
+  }
+
+  free(entry->result);
+  entry->result = NULL;
+  entry->res = res;
+
+  // Only remember names which really don't exist
+  entry->expireAt = res == -ESRCH ? now + CONFIG_NETWORKING_DNS_NEGATIVE_TTL : now;
+  entry->staleUntil = entry->expireAt;
+}
+
+// Copy entry's answer to caller, must be called with lock held
+static int answer(struct cache_entry* entry, struct resolver_result** result) {
+  if (!entry->result)
+    return entry->res < 0 ? entry->res : -ESRCH;
+
+  if (!(*result = copyResult(entry->result)))
+    return -ENOMEM;
+  return 0;
+}
+
+// Return true if entry can be answered right now, also
+// start refresh if stale
+static bool canAnswerNow(struct cache_entry* entry) {
+  double now = util_get_monotonic();
+  if (entry->hasResult && !entry->isResolving && now < entry->expireAt)
+    return true;
+
+  if (entry->result && now < entry->staleUntil) {
+    // Failing to refresh is fine, stale result still usable
+    int res = startLookup(entry);
+    if (res < 0)
+      pr_warn("Cannot refresh %s: %d", entry->hostname, res);
+    return true;
+  }
+  return false;
+}
+
+static void notifyWaiters(struct cache_entry* entry) {
+  waiter_vec_t waiters = entry->waiters;
+  vec_init(&entry->waiters);
+
+  struct resolver_result* snapshot = NULL;
+  int res = answer(entry, &snapshot);
+  pthread_mutex_unlock(&lock);
+
+  struct waiter* current;
+  int i;
+  vec_foreach_ptr(&waiters, current, i) {
+    struct resolver_result* result = NULL;
+    int currentRes = res;
+
+    // Last one take snapshot itself
+    if (res >= 0 && i == waiters.length - 1)
+      result = snapshot;
+    else if (res >= 0 && !(result = copyResult(snapshot)))
+      currentRes = -ENOMEM;
+    current->callback(current->udata, currentRes, result);
+  }
+  if (waiters.length == 0)
+    free(snapshot);
+  vec_deinit(&waiters);
+
+  pthread_mutex_lock(&lock);
+}
+
+static void* resolverThread(void* udata) {
+  pthread_mutex_lock(&lock);
+  while (!isStopping) {
+    if (jobs.length == 0) {
+      pthread_cond_wait(&jobAvailable, &lock);
+      continue;
+    }
+
+    // Entries being resolved are never freed so hostname
+    // stay valid without lock
+    struct cache_entry* entry = jobs.data[0];
+    vec_splice(&jobs, 0, 1);
+    pthread_mutex_unlock(&lock);
+
+    struct resolver_result* result = NULL;
+    int res = lookup(entry->hostname, &result);
+
+    pthread_mutex_lock(&lock);
+    storeResult(entry, res, result);
+    pthread_cond_broadcast(&lookupDone);
+    notifyWaiters(entry);
+  }
+  pthread_mutex_unlock(&lock);
+  return NULL;
+}
+
+int resolver_init() {
+  int res = 0;
+  pthread_mutex_lock(&lock);
+  if (threads) {
+    res = -EINVAL;
+    goto already_initialized;
+  }
+
+  vec_init(&entries);
+  vec_init(&jobs);
+  isStopping = false;
+
+  threads = calloc(CONFIG_NETWORKING_DNS_THREADS, sizeof(*threads));
+  if (!threads) {
+    res = -ENOMEM;
+    goto alloc_threads_error;
+  }
+
+  for (threadCount = 0; threadCount < CONFIG_NETWORKING_DNS_THREADS; threadCount++) {
+    if ((res = util_thread_create(&threads[threadCount], NULL, resolverThread, NULL)) < 0)
+      break;
+
+    char name[32];
+    snprintf(name, sizeof(name), "Resolver-%d", threadCount);
+    util_set_thread_name(threads[threadCount], name);
+  }
+
+  // Resolving still works with less threads
+  if (threadCount > 0)
+    res = 0;
+  else
+    goto create_thread_error;
+
+  pthread_mutex_unlock(&lock);
+  return 0;
+
+create_thread_error:
+  free(threads);
+  threads = NULL;
+alloc_threads_error:
+already_initialized:
+  pthread_mutex_unlock(&lock);
+  return res;
+}
+
+void resolver_cleanup() {
+  pthread_mutex_lock(&lock);
+  if (!threads) {
+    pthread_mutex_unlock(&lock);
+    return;
+  }
+
+  isStopping = true;
+  pthread_cond_broadcast(&jobAvailable);
+  pthread_mutex_unlock(&lock);
+
+  for (int i = 0; i < threadCount; i++)
+    pthread_join(threads[i], NULL);
+
+  pthread_mutex_lock(&lock);
+  free(threads);
+  threads = NULL;
+  threadCount = 0;
+
+  // Lookups never started, tell whoever waiting (lock
+  // dropped while notifying so detach the queue first)
+  entry_vec_t cancelled = jobs;
+  vec_init(&jobs);
+
+  struct cache_entry* entry;
+  int i;
+  vec_foreach(&cancelled, entry, i) {
+    storeResult(entry, -ECANCELED, NULL);
+    notifyWaiters(entry);
+  }
+  pthread_cond_broadcast(&lookupDone);
+  vec_deinit(&cancelled);
+
+  vec_foreach(&entries, entry, i)
+    freeEntry(entry);
+  vec_deinit(&entries);
+  pthread_mutex_unlock(&lock);
+}
+
+void resolver_flush() {
+  pthread_mutex_lock(&lock);
+  for (int i = 0; i < entries.length;) {
+    struct cache_entry* entry = entries.data[i];
+    if (entry->isResolving) {
+      i++;
+      continue;
+    }
+
+    freeEntry(entry);
+    vec_splice(&entries, i, 1);
+  }
+  pthread_mutex_unlock(&lock);
+}
+
+static struct timespec toDeadline(int timeoutMilis) {
+  struct timespec deadline;
+  clock_gettime(CLOCK_REALTIME, &deadline);
+  deadline.tv_sec += timeoutMilis / 1000;
+  deadline.tv_nsec += (long) (timeoutMilis % 1000) * 1000000;
+  if (deadline.tv_nsec >= 1000000000) {
+    deadline.tv_sec++;
+    deadline.tv_nsec -= 1000000000;
+  }
+  return deadline;
+}
+
+int resolver_resolve(const char* hostname, struct resolver_result** result, int timeoutMilis) {
+  int res = 0;
+  pthread_mutex_lock(&lock);
+
+  // Not started, just do it here
+  if (!threads) {
+    pthread_mutex_unlock(&lock);
+    return lookup(hostname, result);
+  }
+
+  struct timespec deadline = toDeadline(timeoutMilis);
+  struct cache_entry* entry;
+  while (true) {
+    // Looked up again after each wait as flush may free it
+    if (!(entry = getEntry(hostname))) {
+      res = -ENOMEM;
+      goto out;
+    }
+
+    if (canAnswerNow(entry))
+      break;
+    if ((res = startLookup(entry)) < 0)
+      goto out;
+
+    if (timeoutMilis < 0) {
+      pthread_cond_wait(&lookupDone, &lock);
+    } else if (pthread_cond_timedwait(&lookupDone, &lock, &deadline) == ETIMEDOUT) {
+      entry = findEntry(hostname);
+      if (entry && !entry->isResolving && entry->hasResult)
+        break;
+      res = -ETIMEDOUT;
+      goto out;
+    }
+
+    if ((entry = findEntry(hostname)) && !entry->isResolving && entry->hasResult)
+      break;
+  }
+
+  res = answer(entry, result);
+out:
+  pthread_mutex_unlock(&lock);
+  if (res < 0)
+    pr_error("Unable to resolve %s: %d", hostname, res);
+  return res;
+}
+
+int resolver_resolve_async(const char* hostname, resolver_callback callback, void* udata) {
+  int res = 0;
+  struct resolver_result* result = NULL;
+  pthread_mutex_lock(&lock);
+
+  if (!threads) {
+    pthread_mutex_unlock(&lock);
+    res = lookup(hostname, &result);
+    callback(udata, res, result);
+    return 0;
+  }
+
+  struct cache_entry* entry = getEntry(hostname);
+  if (!entry) {
+    res = -ENOMEM;
+    goto out;
+  }
+
+  if (canAnswerNow(entry)) {
+    res = answer(entry, &result);
+    pthread_mutex_unlock(&lock);
+    callback(udata, res, result);
+    return 0;
+  }
+
+  if (vec_reserve(&entry->waiters, entry->waiters.length + 1) < 0) {
+    res = -ENOMEM;
+    goto out;
+  }
+  if ((res = startLookup(entry)) < 0)
+    goto out;
+
+  vec_push(&entry->waiters, ((struct waiter) {
+    .callback = callback,
+    .udata = udata
+  }));
+out:
+  pthread_mutex_unlock(&lock);
+  return res;
+}
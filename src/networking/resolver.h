@@ -0,0 +1,52 @@
+#ifndef _headers_1671861220_FluffyLauncher_resolver
+#define _headers_1671861220_FluffyLauncher_resolver
+
+#include <stddef.h>
+
+#include "networking.h"
+
+// Hostname resolver with in-memory cache, lookups run on
+// resolver threads so callers can wait with timeout or get
+// notified, and concurrent lookups of same name are merged
+
+struct resolver_result {
+  // In order given by system resolver (RFC 6724 sorted),
+  // port is always 0
+  size_t count;
+  struct ip_address addresses[];
+};
+
+// `result` is owned by callee (free() it) and NULL if `res` < 0
+typedef void (*resolver_callback)(void* udata, int res, struct resolver_result* result);
+
+// Errors:
+// -ENOMEM: Not enough memory
+// -EINVAL: Already initialized
+[[nodiscard]]
+int resolver_init();
+void resolver_cleanup();
+
+// Forget every cached result
+void resolver_flush();
+
+// Wait up to `timeoutMilis` (-1 for forever) for addresses
+// of `hostname`, result must be free()'d
+// Errors:
+// -ESRCH: Can't be resolved
+// -EAGAIN: Temporary failure, try again later
+// -ETIMEDOUT: Lookup didn't finish in time (still continue
+//             in background and cached when done)
+// -ENOMEM: Not enough memory
+[[nodiscard]]
+int resolver_resolve(const char* hostname, struct resolver_result** result, int timeoutMilis);
+
+// Same as resolver_resolve but `callback` is called once
+// resolved (from resolver thread or immediately from this
+// call if cached), return 0 if callback will be called
+// Errors:
+// -ENOMEM: Not enough memory
+[[nodiscard]]
+int resolver_resolve_async(const char* hostname, resolver_callback callback, void* udata);
+
+#endif
+
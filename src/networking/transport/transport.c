@@ -1,8 +1,24 @@
 #include <errno.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+
+#include "bug.h"
+#include "config.h"
 #include "transport.h"
+#include "io/io_threads.h"
+#include "util/util.h"
 
 struct transport_private {
   int emulatedSockFD;
+  
+  // Read ahead buffer, valid data in [readPos, readEnd)
+  char* readBuffer;
+  size_t readPos;
+  size_t readEnd;
 };
 
 // TODO: Implement this and create socket faker
@@ -12,15 +28,206 @@ static int impl_get_sockfd(struct transport* self) {
   return -ENOSYS;
 }
 
+// Fallback for transport without native read_some
+static int impl_read_some(struct transport* self, void* result, size_t len, size_t* szRead) {
+  return self->read(self, result, len, szRead);
+}
+
+// Fallback for transport without native writev
+static int impl_writev(struct transport* self, const struct iovec* iov, int iovcnt) {
+  int res = 0;
+  for (int i = 0; i < iovcnt; i++)
+    if (iov[i].iov_len > 0 && (res = self->write(self, iov[i].iov_base, iov[i].iov_len)) < 0)
+      break;
+  return res;
+}
+
+static int impl_try_read(struct transport* self, void* result, size_t len, size_t* szRead, int* wantedEvents) {
+  return -ENOSYS;
+}
+
+static int impl_try_write(struct transport* self, const void* data, size_t len, size_t* szWritten, int* wantedEvents) {
+  return -ENOSYS;
+}
+
 int transport_base_init(struct transport* self, int timeoutMilis) {
   *self = (struct transport) {};
   self->timeoutMilis = timeoutMilis;
+  self->deadline = -1;
   self->get_sockfd = impl_get_sockfd;
+  self->read_some = impl_read_some;
+  self->writev = impl_writev;
+  self->try_read = impl_try_read;
+  self->try_write = impl_try_write;
+  
+  self->private = malloc(sizeof(*self->private));
+  if (!self->private)
+    return -ENOMEM;
+  *self->private = (struct transport_private) {
+    .emulatedSockFD = -1
+  };
   
+  self->private->readBuffer = malloc(CONFIG_NETWORKING_READ_BUFFER_SIZE);
+  if (!self->private->readBuffer) {
+    free(self->private);
+    self->private = NULL;
+    return -ENOMEM;
+  }
   return 0;
 }
 
 void transport_base_close(struct transport* self) {
+  if (!self->private)
+    return;
+  
+  free(self->private->readBuffer);
+  free(self->private);
+  self->private = NULL;
+}
+
+int transport_wait(struct transport* self, int events, int timeoutMilis) {
+  int fd = self->get_sockfd(self);
+  if (fd < 0)
+    return -ENOSYS;
+  
+  struct pollfd pollFd = {
+    .fd = fd,
+    .events = (events & IO_EVENT_READ ? POLLIN : 0) |
+              (events & IO_EVENT_WRITE ? POLLOUT : 0)
+  };
+  
+  int res;
+  while ((res = poll(&pollFd, 1, timeoutMilis)) < 0 && errno == EINTR)
+    ;
+  if (res < 0)
+    return -EFAULT;
+  if (res == 0)
+    return -ETIMEDOUT;
+  
+  // Errors reported by following read/write
+  return 0;
+}
+
+int transport_set_cork(struct transport* self, bool corked) {
+#ifdef TCP_CORK
+  int fd = self->get_sockfd(self);
+  if (fd < 0)
+    return -ENOSYS;
+  
+  int value = corked;
+  if (setsockopt(fd, IPPROTO_TCP, TCP_CORK, &value, sizeof(value)) < 0)
+    return -EFAULT;
+  return 0;
+#else
+  return -ENOTSUP;
+#endif
+}
+
+void transport_set_timeout(struct transport* self, int timeoutMilis) {
+  self->timeoutMilis = timeoutMilis;
+}
+
+void transport_set_deadline(struct transport* self, double deadline) {
+  self->deadline = deadline < 0 ? -1 : deadline;
+}
+
+double transport_begin_operation(struct transport* self) {
+  if (self->timeoutMilis < 0)
+    return self->deadline;
+  
+  double deadline = util_get_monotonic() + self->timeoutMilis / 1000.0;
+  if (self->deadline >= 0 && self->deadline < deadline)
+    deadline = self->deadline;
+  return deadline;
+}
+
+int transport_wait_until(struct transport* self, int events, double deadline) {
+  if (deadline < 0)
+    return transport_wait(self, events, -1);
+  
+  double remaining = deadline - util_get_monotonic();
+  if (remaining <= 0)
+    return -ETIMEDOUT;
+  
+  // Round up so poll doesn't wake just before deadline
+  return transport_wait(self, events, (int) (remaining * 1000.0) + 1);
+}
+
+size_t transport_get_buffered_size(struct transport* self) {
+  return self->private->readEnd - self->private->readPos;
+}
+
+static int fillBuffer(struct transport* self) {
+  struct transport_private* priv = self->private;
+  BUG_ON(priv->readPos != priv->readEnd);
+  
+  size_t readSize = 0;
+  int res = self->read_some(self, priv->readBuffer, CONFIG_NETWORKING_READ_BUFFER_SIZE, &readSize);
+  priv->readPos = 0;
+  priv->readEnd = readSize;
+  if (res >= 0 && readSize == 0)
+    res = -ENODATA;
   
+  // Partial data still usable
+  if (res < 0 && readSize > 0)
+    res = 0;
+  return res;
+}
+
+int transport_peek(struct transport* self, const void** data, size_t* len) {
+  int res = 0;
+  struct transport_private* priv = self->private;
+  if (priv->readPos == priv->readEnd && (res = fillBuffer(self)) < 0) {
+    *len = 0;
+    return res;
+  }
+  
+  *data = priv->readBuffer + priv->readPos;
+  *len = priv->readEnd - priv->readPos;
+  return res;
+}
+
+void transport_consume(struct transport* self, size_t len) {
+  struct transport_private* priv = self->private;
+  BUG_ON(len > priv->readEnd - priv->readPos);
+  priv->readPos += len;
+}
+
+int transport_read(struct transport* self, void* result, size_t len, size_t* szRead) {
+  int res = 0;
+  struct transport_private* priv = self->private;
+  size_t totalRead = 0;
+  
+  // Serve buffered bytes first
+  size_t buffered = priv->readEnd - priv->readPos;
+  size_t fromBuffer = len < buffered ? len : buffered;
+  memcpy(result, priv->readBuffer + priv->readPos, fromBuffer);
+  priv->readPos += fromBuffer;
+  totalRead += fromBuffer;
+  
+  // Large reads go directly into caller's buffer, copying
+  // through read buffer is pointless there
+  if (len - totalRead >= CONFIG_NETWORKING_READ_BUFFER_SIZE) {
+    size_t readSize = 0;
+    res = self->read(self, (char*) result + totalRead, len - totalRead, &readSize);
+    totalRead += readSize;
+    goto read_done;
+  }
+  
+  while (totalRead < len) {
+    if ((res = fillBuffer(self)) < 0)
+      break;
+    
+    size_t available = priv->readEnd - priv->readPos;
+    size_t copySize = len - totalRead < available ? len - totalRead : available;
+    memcpy((char*) result + totalRead, priv->readBuffer + priv->readPos, copySize);
+    priv->readPos += copySize;
+    totalRead += copySize;
+  }
+
+read_done:
+  if (szRead)
+    *szRead = totalRead;
+  return res;
 }
 
@@ -1,13 +1,40 @@
 #ifndef _headers_1667641607_FluffyLauncher_transport_base
 #define _headers_1667641607_FluffyLauncher_transport_base
 
+#include <stdbool.h>
 #include <stddef.h>
+#include <sys/uio.h>
 
 struct transport {
+  // Limit for each blocking read/write/connect (-1 for none)
   int timeoutMilis;
+  
+  // util_get_monotonic() time every blocking operation must
+  // finish by regardless of `timeoutMilis` (negative for none)
+  // used to bound whole request
+  double deadline;
 
   int (*write)(struct transport* self, const void* data, size_t len);
+  
+  // Write every byte of `iov` in order, gathered so transport
+  // can send it with fewer syscalls (or TLS records) than
+  // separate writes would
+  int (*writev)(struct transport* self, const struct iovec* iov, int iovcnt);
+  
+  // Read exactly `len` bytes unless error (bypasses read buffer,
+  // use transport_read instead)
   int (*read)(struct transport* self, void* result, size_t len, size_t* szRead); 
+  
+  // Read whatever available up to `len` bytes (at least one)
+  // with single underlying read
+  int (*read_some)(struct transport* self, void* result, size_t len, size_t* szRead);
+  
+  // Non blocking variants, process whatever possible without
+  // waiting. Return -EAGAIN if nothing can be done now with
+  // `wantedEvents` set to IO_EVENT_* the transport waiting
+  // for (TLS may need socket to be writable to read)
+  int (*try_read)(struct transport* self, void* result, size_t len, size_t* szRead, int* wantedEvents);
+  int (*try_write)(struct transport* self, const void* data, size_t len, size_t* szWritten, int* wantedEvents);
   void (*close)(struct transport* self); 
  
   // Override this to avoid creation of emulated fds
@@ -20,5 +47,64 @@ struct transport {
 int transport_base_init(struct transport* self, int timeoutMilis);
 void transport_base_close(struct transport* self);
 
+// Wait until transport's socket has `events` (IO_EVENT_*)
+// `timeoutMilis` is -1 to wait forever
+// Return 0 on success
+// Errors:
+// -ETIMEDOUT: Timed out
+// -ENOSYS: Transport has no socket
+[[nodiscard]]
+int transport_wait(struct transport* self, int events, int timeoutMilis);
+
+// Hold back partial TCP segments while corked so several
+// writes go out as full segments, uncorking flushes them
+// Errors:
+// -ENOTSUP: Not supported by platform
+// -ENOSYS: Transport has no socket
+int transport_set_cork(struct transport* self, bool corked);
+
+void transport_set_timeout(struct transport* self, int timeoutMilis);
+
+// Set deadline as util_get_monotonic time (negative to
+// remove it) so several operations share one time limit
+void transport_set_deadline(struct transport* self, double deadline);
+
+// Time blocking operation starting now must finish by, nearer
+// of `timeoutMilis` from now and transport deadline (negative
+// for none)
+double transport_begin_operation(struct transport* self);
+
+// Same as transport_wait but waiting until `deadline` (from
+// transport_begin_operation) on `self`'s socket
+// Errors:
+// -ETIMEDOUT: Deadline passed
+// Or errors from transport_wait
+[[nodiscard]]
+int transport_wait_until(struct transport* self, int events, double deadline);
+
+// Buffered reads, bytes read ahead stay in transport
+// for next response on same connection
+
+// Read exactly `len` bytes
+// Return 0 on success
+// Errors:
+// -ENODATA: Connection closed before `len` bytes read
+// Or errors from transport's read
+[[nodiscard]]
+int transport_read(struct transport* self, void* result, size_t len, size_t* szRead);
+
+// Get buffered bytes, reading from transport if there none
+// Pointer valid until next read/consume call
+// Return 0 on success
+// Errors from transport's read_some
+[[nodiscard]]
+int transport_peek(struct transport* self, const void** data, size_t* len);
+
+// Discard `len` bytes from buffer previously returned by transport_peek
+void transport_consume(struct transport* self, size_t len);
+
+// Number of bytes read ahead but not consumed yet
+size_t transport_get_buffered_size(struct transport* self);
+
 #endif
 
@@ -1,10 +1,19 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
 #include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
 #include <errno.h>
+#include <stdbool.h>
 
 #include "bug.h"
+#include "config.h"
+#include "io/io_threads.h"
+#include "logging/logging.h"
+#include "networking/happy_eyeballs.h"
 #include "transport.h"
 #include "transport_socket.h"
 #include "util/util.h"
@@ -12,7 +21,11 @@
 #define SELF(ptr) container_of(ptr, struct transport_socket, super)
 
 static int impl_write(struct transport* _self, const void* data, size_t len);
+static int impl_writev(struct transport* _self, const struct iovec* iov, int iovcnt);
 static int impl_read(struct transport* _self, void* result, size_t len, size_t* szRead); 
+static int impl_read_some(struct transport* _self, void* result, size_t len, size_t* szRead);
+static int impl_try_read(struct transport* _self, void* result, size_t len, size_t* szRead, int* wantedEvents);
+static int impl_try_write(struct transport* _self, const void* data, size_t len, size_t* szWritten, int* wantedEvents);
 static void impl_close(struct transport* _self);
 static int impl_get_sockfd(struct transport* _self);
 
@@ -21,13 +34,19 @@ struct transport_socket* transport_socket_new(int timeoutMilis) {
   if (!self)
     return NULL;
   
-  if (transport_base_init(&self->super, timeoutMilis) < 0)
+  if (transport_base_init(&self->super, timeoutMilis) < 0) {
+    free(self);
     return NULL;
+  }
   
   self->super.close = impl_close;
   self->super.read = impl_read;
+  self->super.read_some = impl_read_some;
+  self->super.try_read = impl_try_read;
+  self->super.try_write = impl_try_write;
   self->super.get_sockfd = impl_get_sockfd;
   self->super.write = impl_write;
+  self->super.writev = impl_writev;
   
   self->fd = -1;
   return self;
@@ -44,75 +63,229 @@ void transport_socket_free(struct transport_socket* self) {
   free(self);
 }
 
-static int commonPerformIO(ssize_t (*action)(int,void*,size_t,int), int fd, void* data, size_t len, size_t* szProcessed) {
+static int translateError(int err) {
+  switch (err) {
+    case ENETDOWN:
+    case ENETUNREACH:
+    case ECONNRESET:
+    case EPIPE:
+    case ETIMEDOUT:
+      return -err;
+    case EAGAIN:
+#if EAGAIN != EWOULDBLOCK
+    case EWOULDBLOCK:
+#endif
+      return -EAGAIN;
+  }
+  return -EFAULT;
+}
+
+// Single non blocking send/recv
+// Return 0 on success or -EAGAIN if would block
+static int performOnce(struct transport_socket* self, bool isWrite, void* data, size_t len, size_t* szProcessed) {
+  ssize_t processedCount;
+  *szProcessed = 0;
+  if (self->fd < 0)
+    return -EINVAL;
+  if (len == 0)
+    return 0;
+  
+  // Pooled connection may be closed by server anytime, dont let
+  // that kill the process with SIGPIPE
+  do {
+    if (isWrite)
+      processedCount = send(self->fd, data, len, MSG_NOSIGNAL);
+    else
+      processedCount = recv(self->fd, data, len, 0);
+  } while (processedCount < 0 && errno == EINTR);
+  
+  if (processedCount < 0)
+    return translateError(errno);
+  if (processedCount == 0 && !isWrite)
+    return -ENODATA;
+  
+  *szProcessed = processedCount;
+  return 0;
+}
+
+// Blocking I/O on top of non blocking socket, waiting
+// for readiness when socket would block
+static int commonPerformIO(struct transport_socket* self, bool isWrite, void* data, size_t len, bool needFull, size_t* szProcessed) {
   int res = 0;
   size_t processedSize = 0;
-    
+  double deadline = transport_begin_operation(&self->super);
+  
   while (len > 0) {
-    ssize_t processedCount = action(fd, data, len, 0);
-    if (processedCount < 0) {
-      // Retry if interrupted
-      if (errno == EINTR)
-        continue;
-      
-      res = -errno;
-      break;
+    size_t processedCount = 0;
+    res = performOnce(self, isWrite, data, len, &processedCount);
+    if (res == -EAGAIN) {
+      if ((res = transport_wait_until(&self->super, isWrite ? IO_EVENT_WRITE : IO_EVENT_READ, deadline)) < 0)
+        break;
+      continue;
     }
     
-    if (processedCount == 0) {
-      res = -ENODATA;
+    if (res < 0)
       break;
-    }
     
     len -= processedCount;
     processedSize += processedCount;
     data = &((char*) data)[processedCount];
-  }
-  
-  switch (res) {
-    case -ENETDOWN:
-    case -ENETUNREACH:
-    case -ENODATA:
-    case -ECONNRESET:
-    case -ETIMEDOUT:
-      break;
-    
-    default:
-      if (res < 0)
-        res = -EFAULT;
+    if (!needFull)
       break;
   }
   
   if (szProcessed)
     *szProcessed = processedSize;
-  
   return res;
 }
 
-int transport_socket_connect(struct transport_socket* self, struct ip_address* addr) {
-  self->connectAddr = *addr;
+// Number of iovec given to single sendmsg
+#define IOV_BATCH 16
+
+static int writeGathered(struct transport_socket* self, const struct iovec* iov, int iovcnt) {
   int res = 0;
-  int socketFd = networking_connect(addr, NETWORKING_TCP);
-  if (socketFd < 0) 
-    return -errno;
+  struct iovec batch[IOV_BATCH];
+  double deadline = transport_begin_operation(&self->super);
+  if (self->fd < 0)
+    return -EINVAL;
+  
+  // Progress is `offset` bytes into iov[current]
+  int current = 0;
+  size_t offset = 0;
+  while (current < iovcnt) {
+    if (offset == iov[current].iov_len) {
+      current++;
+      offset = 0;
+      continue;
+    }
+    
+    int batchCount = 0;
+    for (int i = current; i < iovcnt && batchCount < IOV_BATCH; i++)
+      batch[batchCount++] = iov[i];
+    batch[0].iov_base = (char*) batch[0].iov_base + offset;
+    batch[0].iov_len -= offset;
+    
+    struct msghdr msg = {
+      .msg_iov = batch,
+      .msg_iovlen = batchCount
+    };
+    
+    ssize_t sent;
+    do {
+      sent = sendmsg(self->fd, &msg, MSG_NOSIGNAL);
+    } while (sent < 0 && errno == EINTR);
+    
+    if (sent < 0) {
+      if ((res = translateError(errno)) != -EAGAIN)
+        break;
+      if ((res = transport_wait_until(&self->super, IO_EVENT_WRITE, deadline)) < 0)
+        break;
+      continue;
+    }
+    
+    size_t left = sent;
+    while (left > 0) {
+      size_t available = iov[current].iov_len - offset;
+      if (left < available) {
+        offset += left;
+        break;
+      }
+      
+      left -= available;
+      current++;
+      offset = 0;
+    }
+  }
+  return res;
+}
+
+// Request is written in one go so there nothing for Nagle
+// to merge, waiting for ACK only delay next request
+static void applySocketOptions(struct transport_socket* self) {
+  if (!IS_ENABLED(CONFIG_NETWORKING_TCP_NODELAY))
+    return;
   
-  self->fd = socketFd;
+  int value = 1;
+  if (setsockopt(self->fd, IPPROTO_TCP, TCP_NODELAY, &value, sizeof(value)) < 0)
+    pr_warn("Cannot set TCP_NODELAY: %s", strerror(errno));
+}
+
+int transport_socket_connect_start(struct transport_socket* self, struct ip_address* addr) {
+  self->connectAddr = *addr;
+  return networking_connect_nonblocking(addr, NETWORKING_TCP, &self->fd);
+}
+
+int transport_socket_connect_finish(struct transport_socket* self) {
+  int res = networking_connect_finish(self->fd);
+  if (res >= 0)
+    applySocketOptions(self);
   return res;
 }
 
+int transport_socket_connect(struct transport_socket* self, struct ip_address* addr) {
+  int res = transport_socket_connect_start(self, addr);
+  if (res == 0)
+    applySocketOptions(self);
+  if (res != -EINPROGRESS)
+    return res;
+  
+  if ((res = transport_wait_until(&self->super, IO_EVENT_WRITE, transport_begin_operation(&self->super))) < 0)
+    return res;
+  return transport_socket_connect_finish(self);
+}
+
+int transport_socket_connect_any(struct transport_socket* self, struct ip_address* addresses, size_t count, uint16_t port) {
+  int timeoutMilis = -1;
+  double deadline = transport_begin_operation(&self->super);
+  if (deadline >= 0) {
+    double remaining = deadline - util_get_monotonic();
+    timeoutMilis = remaining > 0 ? (int) (remaining * 1000.0) + 1 : 0;
+  }
+  
+  struct ip_address winner;
+  int fd = happy_eyeballs_connect(addresses, count, port, timeoutMilis, &winner);
+  if (fd < 0)
+    return fd;
+  
+  transport_socket_adopt(self, fd, &winner);
+  return 0;
+}
+
+void transport_socket_adopt(struct transport_socket* self, int fd, struct ip_address* addr) {
+  self->fd = fd;
+  self->connectAddr = *addr;
+  applySocketOptions(self);
+}
+
 // Implementations 
 static int impl_write(struct transport* _self, const void* data, size_t len) {
-  struct transport_socket* self = SELF(_self);
-  if (self->fd < 0)
-    return -EINVAL;
-  return commonPerformIO((void*) send, self->fd, (void*) data, len, NULL);
+  return commonPerformIO(SELF(_self), true, (void*) data, len, true, NULL);
+}
+
+static int impl_writev(struct transport* _self, const struct iovec* iov, int iovcnt) {
+  return writeGathered(SELF(_self), iov, iovcnt);
 }
 
 static int impl_read(struct transport* _self, void* result, size_t len, size_t* szRead) {
-  struct transport_socket* self = SELF(_self);
-  if (self->fd < 0)
-    return -EINVAL;
-  return commonPerformIO(recv, self->fd, result, len, szRead);
+  return commonPerformIO(SELF(_self), false, result, len, true, szRead);
+}
+
+static int impl_read_some(struct transport* _self, void* result, size_t len, size_t* szRead) {
+  return commonPerformIO(SELF(_self), false, result, len, false, szRead);
+}
+
+static int impl_try_read(struct transport* _self, void* result, size_t len, size_t* szRead, int* wantedEvents) {
+  int res = performOnce(SELF(_self), false, result, len, szRead);
+  if (res == -EAGAIN)
+    *wantedEvents = IO_EVENT_READ;
+  return res;
+}
+
+static int impl_try_write(struct transport* _self, const void* data, size_t len, size_t* szWritten, int* wantedEvents) {
+  int res = performOnce(SELF(_self), true, (void*) data, len, szWritten);
+  if (res == -EAGAIN)
+    *wantedEvents = IO_EVENT_WRITE;
+  return res;
 }
 
 static void impl_close(struct transport* _self) {
@@ -1,6 +1,7 @@
 #ifndef _headers_1667641752_FluffyLauncher_transport_socket
 #define _headers_1667641752_FluffyLauncher_transport_socket
 
+#include <stddef.h>
 #include <stdint.h>
 #include "transport.h"
 #include "networking/networking.h"
@@ -15,8 +16,27 @@ struct transport_socket {
 struct transport_socket* transport_socket_new(int timeoutMilis);
 void transport_socket_free(struct transport_socket* self);
 
+// Socket is always non blocking, blocking methods of
+// `struct transport` wait for readiness internally up to
+// `timeoutMilis` and transport deadline then fail with
+// -ETIMEDOUT (connect included)
 [[nodiscard]]
 int transport_socket_connect(struct transport_socket* self, struct ip_address* addr);
 
+// Race connects to every address (see happy_eyeballs_connect)
+// and keep the first one established
+[[nodiscard]]
+int transport_socket_connect_any(struct transport_socket* self, struct ip_address* addresses, size_t count, uint16_t port);
+
+// Take over already connected non blocking socket `fd`
+// (e.g. from happy_eyeballs_connect_async) connected to `addr`
+void transport_socket_adopt(struct transport_socket* self, int fd, struct ip_address* addr);
+
+// Non blocking connect, see networking_connect_nonblocking
+[[nodiscard]]
+int transport_socket_connect_start(struct transport_socket* self, struct ip_address* addr);
+[[nodiscard]]
+int transport_socket_connect_finish(struct transport_socket* self);
+
 #endif
 
@@ -1,73 +1,246 @@
 #include <errno.h> 
 #include <openssl/ssl.h> 
+#include <openssl/x509v3.h>
+#include <pthread.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
 #include "networking/ssl_method_compat_layer.h"
 #include "bug.h"
+#include "config.h"
+#include "io/io_threads.h"
+#include "logging/logging.h"
 #include "networking/transport/transport.h"
 #include "transport_ssl.h"
 #include "util/util.h"
 #include "transport.h"
+#include "vec.h"
 
 #define SELF(ptr) container_of(ptr, struct transport_ssl, super)
 
 struct transport_ssl_private {
-  SSL_CTX* sslContext;
   SSL* ssl;
   
   bool hasHandshakePerformed;
   enum ssl_version sslVersion;
+  
+  // Protocol server picked with ALPN or NULL
+  char* alpnProtocol;
 };
 
 static int impl_write(struct transport* _self, const void* data, size_t len);
+static int impl_writev(struct transport* _self, const struct iovec* iov, int iovcnt);
 static int impl_read(struct transport* _self, void* result, size_t len, size_t* szRead); 
+static int impl_read_some(struct transport* _self, void* result, size_t len, size_t* szRead);
+static int impl_try_read(struct transport* _self, void* result, size_t len, size_t* szRead, int* wantedEvents);
+static int impl_try_write(struct transport* _self, const void* data, size_t len, size_t* szWritten, int* wantedEvents);
 static void impl_close(struct transport* _self);
+static int impl_get_sockfd(struct transport* _self);
+
+// Shared by every connection so CA store only loaded once
+static SSL_CTX* sharedContext = NULL;
+
+// Last session given by each host for resumption
+struct session_cache_entry {
+  char* hostname;
+  SSL_SESSION* session;
+};
+
+static pthread_mutex_t sessionCacheLock = PTHREAD_MUTEX_INITIALIZER;
+static vec_t(struct session_cache_entry) sessionCache;
+
+static struct session_cache_entry* findSession(const char* hostname) {
+  struct session_cache_entry* entry;
+  int i;
+  vec_foreach_ptr(&sessionCache, entry, i)
+    if (strcmp(entry->hostname, hostname) == 0)
+      return entry;
+  return NULL;
+}
+
+// Called by OpenSSL when server gives new session (after handshake
+// for TLS 1.2 or on each ticket for TLS 1.3)
+static int onNewSession(SSL* ssl, SSL_SESSION* _session) {
+  const char* hostname = SSL_get_servername(ssl, TLSEXT_NAMETYPE_host_name);
+  if (!hostname || !SSL_SESSION_is_resumable(_session))
+    return 0;
+  
+  // Copied as OpenSSL marks connection's own session not
+  // resumable if it freed without clean shutdown
+  SSL_SESSION* session = SSL_SESSION_dup(_session);
+  if (!session)
+    return 0;
+  
+  pthread_mutex_lock(&sessionCacheLock);
+  struct session_cache_entry* entry = findSession(hostname);
+  if (entry) {
+    SSL_SESSION_free(entry->session);
+    entry->session = session;
+    goto session_stored;
+  }
+  
+  struct session_cache_entry newEntry = {
+    .hostname = strdup(hostname),
+    .session = session
+  };
+  if (!newEntry.hostname || vec_reserve(&sessionCache, sessionCache.length + 1) < 0) {
+    free(newEntry.hostname);
+    SSL_SESSION_free(session);
+    goto no_memory;
+  }
+  vec_push(&sessionCache, newEntry);
+no_memory:
+session_stored:
+  pthread_mutex_unlock(&sessionCacheLock);
+  return 0;
+}
+
+// Get session to resume (caller owns reference) or NULL
+static SSL_SESSION* takeSession(const char* hostname) {
+  SSL_SESSION* session = NULL;
+  pthread_mutex_lock(&sessionCacheLock);
+  struct session_cache_entry* entry = findSession(hostname);
+  if (!entry || !entry->session)
+    goto not_found;
+  
+  // TLS 1.3 tickets are meant for single use (RFC 8446 appendix C.4),
+  // server sends fresh one on resumed connection anyway
+  if (SSL_SESSION_get_protocol_version(entry->session) >= TLS1_3_VERSION) {
+    session = entry->session;
+    entry->session = NULL;
+  } else {
+    // Copy for same reason as in onNewSession
+    session = SSL_SESSION_dup(entry->session);
+  }
+not_found:
+  pthread_mutex_unlock(&sessionCacheLock);
+  return session;
+}
+
+static void flushSessionCache() {
+  pthread_mutex_lock(&sessionCacheLock);
+  struct session_cache_entry* entry;
+  int i;
+  vec_foreach_ptr(&sessionCache, entry, i) {
+    SSL_SESSION_free(entry->session);
+    free(entry->hostname);
+  }
+  vec_clear(&sessionCache);
+  pthread_mutex_unlock(&sessionCacheLock);
+}
+
+int transport_ssl_init() {
+  if (sharedContext)
+    return -EINVAL;
+  
+  SSL_CTX* ctx = SSL_CTX_new(TLS_client_method());
+  if (!ctx)
+    return -ENOMEM;
+  
+  if (SSL_CTX_set_default_verify_paths(ctx) != 1) {
+    pr_error("Cannot load system CA certificates");
+    SSL_CTX_free(ctx);
+    return -EFAULT;
+  }
+  
+  // Cache client sessions ourself keyed by hostname as OpenSSL's
+  // internal cache is only used on server side
+  if (IS_ENABLED(CONFIG_NETWORKING_TLS_SESSION_CACHE)) {
+    SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_CLIENT | SSL_SESS_CACHE_NO_INTERNAL_STORE);
+    SSL_CTX_sess_set_new_cb(ctx, onNewSession);
+  } else {
+    SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_OFF);
+  }
+  
+  vec_init(&sessionCache);
+  sharedContext = ctx;
+  return 0;
+}
 
-struct transport_ssl* transport_ssl_new(struct transport* socket, bool verify) {
+void transport_ssl_cleanup() {
+  if (!sharedContext)
+    return;
+  
+  flushSessionCache();
+  vec_deinit(&sessionCache);
+  SSL_CTX_free(sharedContext);
+  sharedContext = NULL;
+}
+
+struct transport_ssl* transport_ssl_new(struct transport* socket, const char* hostname, bool verify) {
+  if (!sharedContext) {
+    pr_error("transport_ssl_init wasn't called");
+    return NULL;
+  }
+  
   struct transport_ssl* self = malloc(sizeof(*self));
   if (!self)
     return NULL;
   
   self->priv = malloc(sizeof(*self->priv));
-  if (!self->priv)
+  if (!self->priv) {
+    free(self);
+    return NULL;
+  }
+  
+  if (transport_base_init(&self->super, socket->timeoutMilis) < 0) {
+    free(self->priv);
+    free(self);
     return NULL;
+  }
   
   self->transportLayer = socket;
   self->super.close = impl_close;
   self->super.read = impl_read;
+  self->super.read_some = impl_read_some;
+  self->super.try_read = impl_try_read;
+  self->super.try_write = impl_try_write;
   self->super.write = impl_write;
+  self->super.writev = impl_writev;
+  self->super.get_sockfd = impl_get_sockfd;
   
   self->priv->ssl = NULL;
-  self->priv->sslContext = NULL;
   self->priv->hasHandshakePerformed = false;
   self->priv->sslVersion = TRANSPORT_SSL_UNKNOWN;
+  self->priv->alpnProtocol = NULL;
   
-  SSL_CTX* sslCtx = SSL_CTX_new(TLS_method());
-  if (!sslCtx) 
-    goto error_creating_ssl_context;
-  
-  SSL* ssl = SSL_new(sslCtx);
+  SSL* ssl = SSL_new(sharedContext);
   if (!ssl) 
     goto error_creating_ssl; 
   
-  if (SSL_CTX_set_default_verify_paths(sslCtx) != 1) 
-    goto error_load_verify_path;
+  // SNI, also used as key for session cache
+  if (SSL_set_tlsext_host_name(ssl, hostname) != 1)
+    goto error_setting_hostname;
+  if (verify && SSL_set1_host(ssl, hostname) != 1)
+    goto error_setting_hostname;
+  
+  SSL_SESSION* session = takeSession(hostname);
+  if (session) {
+    SSL_set_session(ssl, session);
+    SSL_SESSION_free(session);
+  }
   
   int sockFd = self->transportLayer->get_sockfd(self->transportLayer);
   if (sockFd < 0 || SSL_set_fd(ssl, sockFd) == 0)
     goto error_setting_sockfd;
   
-  self->priv->sslContext = sslCtx;
+  // Underlying socket is non blocking, SSL_write may write partially
+  // and retried with different buffer address
+  SSL_set_mode(ssl, SSL_MODE_ENABLE_PARTIAL_WRITE | SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER);
+  
   self->priv->ssl = ssl;
   return self;
 
-error_load_verify_path:
+// Caller still owns `socket` on failure
 error_setting_sockfd:
+error_setting_hostname:
+  SSL_free(ssl);
 error_creating_ssl:
-error_creating_ssl_context:
-  transport_ssl_free(self);
+  transport_base_close(&self->super);
+  free(self->priv);
+  free(self);
   return NULL;
 }
 
@@ -80,6 +253,57 @@ bool transport_ssl_verify_host(struct transport_ssl* self) {
   return SSL_get_verify_result(self->priv->ssl) == X509_V_OK;
 }
 
+int transport_ssl_set_alpn(struct transport_ssl* self, const char* const* protocols) {
+  int res = 0;
+  BUG_ON(self->priv->hasHandshakePerformed);
+  
+  // Wire format is list of length prefixed names (RFC 7301 section 3.1)
+  size_t wireLength = 0;
+  for (const char* const* protocol = protocols; *protocol; protocol++) {
+    size_t len = strlen(*protocol);
+    if (len == 0 || len > 255)
+      return -EINVAL;
+    wireLength += len + 1;
+  }
+  if (wireLength == 0 || wireLength > UINT16_MAX)
+    return -EINVAL;
+  
+  unsigned char* wire = malloc(wireLength);
+  if (!wire)
+    return -ENOMEM;
+  
+  unsigned char* cur = wire;
+  for (const char* const* protocol = protocols; *protocol; protocol++) {
+    size_t len = strlen(*protocol);
+    *cur++ = len;
+    memcpy(cur, *protocol, len);
+    cur += len;
+  }
+  
+  // Unlike most of OpenSSL, this one returns 0 on success
+  if (SSL_set_alpn_protos(self->priv->ssl, wire, wireLength) != 0)
+    res = -ENOMEM;
+  free(wire);
+  return res;
+}
+
+const char* transport_ssl_get_alpn(struct transport_ssl* self) {
+  BUG_ON(transport_ssl_get_handshake_state(self) == false);
+  return self->priv->alpnProtocol;
+}
+
+static int computeALPN(struct transport_ssl* self) {
+  const unsigned char* protocol;
+  unsigned int len;
+  SSL_get0_alpn_selected(self->priv->ssl, &protocol, &len);
+  if (len == 0)
+    return 0;
+  
+  if (!(self->priv->alpnProtocol = strndup((const char*) protocol, len)))
+    return -ENOMEM;
+  return 0;
+}
+
 static void computeSSLVersion(struct transport_ssl* self) {
   self->priv->sslVersion = TRANSPORT_SSL_UNKNOWN;
   const char* sslVersion = SSL_get_version(self->priv->ssl);
@@ -96,52 +320,193 @@ static void computeSSLVersion(struct transport_ssl* self) {
 #undef X
 }
 
-int transport_ssl_connect(struct transport_ssl* self, enum ssl_version minVersion) {
-  int ret = SSL_connect(self->priv->ssl);
-  if (ret != 1) {
-    ret = -EFAULT;
-    goto connect_failure;
+// Translate SSL_get_error into errno, `wantedEvents` set if -EAGAIN
+static int translateSSLError(struct transport_ssl* self, int ret, int* wantedEvents) {
+  switch (SSL_get_error(self->priv->ssl, ret)) {
+    case SSL_ERROR_NONE:
+      return 0;
+    case SSL_ERROR_WANT_READ:
+      *wantedEvents = IO_EVENT_READ;
+      return -EAGAIN;
+    case SSL_ERROR_WANT_WRITE:
+      *wantedEvents = IO_EVENT_WRITE;
+      return -EAGAIN;
+    case SSL_ERROR_ZERO_RETURN:
+      return -ENODATA;
+    case SSL_ERROR_SYSCALL:
+      return -ECONNRESET;
   }
+  return -EFAULT;
+}
+
+int transport_ssl_connect_step(struct transport_ssl* self, enum ssl_version minVersion, int* wantedEvents) {
+  if (self->priv->hasHandshakePerformed)
+    return 0;
+  
+  int res = translateSSLError(self, SSL_connect(self->priv->ssl), wantedEvents);
+  if (res == -EAGAIN)
+    return res;
+  if (res < 0)
+    return -EFAULT;
   self->priv->hasHandshakePerformed = true;
   
   computeSSLVersion(self);
   if (self->priv->sslVersion < minVersion)
     return -ENOTSUP;
-    
-connect_failure:
-  return ret;
+  return computeALPN(self);
 }
 
-int transport_ssl_write(struct transport_ssl* self, const void* data, size_t len) {
-  if (len > INT_MAX)
-    return -E2BIG;
-  if (len == 0)
-    return 0;
+// Retry `res` == -EAGAIN after waiting wanted events until
+// `deadline` (from transport_begin_operation on self)
+static int waitIfNeeded(struct transport_ssl* self, int res, int wantedEvents, double deadline) {
+  if (res != -EAGAIN)
+    return res;
   
-  int ret = SSL_write(self->priv->ssl, data, len);
-  switch (SSL_get_error(self->priv->ssl, ret)) {
-    case SSL_ERROR_NONE:
+  res = transport_wait_until(self->transportLayer, wantedEvents, deadline);
+  return res < 0 ? res : -EAGAIN;
+}
+
+int transport_ssl_connect(struct transport_ssl* self, enum ssl_version minVersion) {
+  int res;
+  double deadline = transport_begin_operation(&self->super);
+  do {
+    // Step must run before wantedEvents is read
+    int wantedEvents = 0;
+    res = transport_ssl_connect_step(self, minVersion, &wantedEvents);
+    res = waitIfNeeded(self, res, wantedEvents, deadline);
+  } while (res == -EAGAIN);
+  return res;
+}
+
+int transport_ssl_try_write(struct transport_ssl* self, const void* data, size_t len, size_t* szWritten, int* wantedEvents) {
+  size_t written = 0;
+  int res = 0;
+  if (len > 0)
+    res = translateSSLError(self, SSL_write_ex(self->priv->ssl, data, len, &written), wantedEvents);
+  
+  if (szWritten)
+    *szWritten = written;
+  return res;
+}
+
+int transport_ssl_write(struct transport_ssl* self, const void* data, size_t len) {
+  int res = 0;
+  double deadline = transport_begin_operation(&self->super);
+  while (len > 0) {
+    size_t written = 0;
+    int wantedEvents = 0;
+    res = transport_ssl_try_write(self, data, len, &written, &wantedEvents);
+    if ((res = waitIfNeeded(self, res, wantedEvents, deadline)) == -EAGAIN)
+      continue;
+    if (res < 0)
       break;
-    default:
-      return -EFAULT;
+    
+    len -= written;
+    data = (const char*) data + written;
   }
-  return ret;
+  return res;
 }
 
-int transport_ssl_read(struct transport_ssl* self, void* result, size_t len, size_t* szRead) {
-  int ret;
+// Largest TLS record plaintext (RFC 8446 section 5.1)
+#define MAX_RECORD_SIZE 16384
+
+int transport_ssl_writev(struct transport_ssl* self, const struct iovec* iov, int iovcnt) {
+  int res = 0;
+  char* staging = NULL;
+  size_t stagedLen = 0;
+  
+  // Small pieces are merged so each SSL_write carry full
+  // record instead of one record per piece, pieces too big
+  // to benefit are written directly
+  for (int i = 0; i < iovcnt; i++) {
+    const char* data = iov[i].iov_base;
+    size_t len = iov[i].iov_len;
+    
+    if (len >= MAX_RECORD_SIZE) {
+      if (stagedLen > 0 && (res = transport_ssl_write(self, staging, stagedLen)) < 0)
+        goto write_error;
+      stagedLen = 0;
+      if ((res = transport_ssl_write(self, data, len)) < 0)
+        goto write_error;
+      continue;
+    }
+    
+    if (!staging && !(staging = malloc(MAX_RECORD_SIZE))) {
+      res = -ENOMEM;
+      goto alloc_error;
+    }
+    
+    while (len > 0) {
+      size_t copySize = MAX_RECORD_SIZE - stagedLen;
+      if (copySize > len)
+        copySize = len;
+      memcpy(staging + stagedLen, data, copySize);
+      stagedLen += copySize;
+      data += copySize;
+      len -= copySize;
+      
+      if (stagedLen == MAX_RECORD_SIZE) {
+        if ((res = transport_ssl_write(self, staging, stagedLen)) < 0)
+          goto write_error;
+        stagedLen = 0;
+      }
+    }
+  }
+  
+  if (stagedLen > 0)
+    res = transport_ssl_write(self, staging, stagedLen);
+
+write_error:
+alloc_error:
+  free(staging);
+  return res;
+}
+
+int transport_ssl_try_read(struct transport_ssl* self, void* result, size_t len, size_t* szRead, int* wantedEvents) {
+  size_t readSize = 0;
+  int res = 0;
+  if (len > 0)
+    res = translateSSLError(self, SSL_read_ex(self->priv->ssl, result, len, &readSize), wantedEvents);
+  
   if (szRead)
-    ret = SSL_read_ex(self->priv->ssl, result, len, szRead);
-  else
-    ret = SSL_read(self->priv->ssl, result, len); 
+    *szRead = readSize;
+  return res;
+}
+
+// Same semantic as socket transport, reads until `len` bytes
+// read or error (SSL_read only return one record at a time)
+static int blockingRead(struct transport_ssl* self, void* result, size_t len, bool needFull, size_t* szRead) {
+  int res = 0;
+  size_t totalRead = 0;
+  double deadline = transport_begin_operation(&self->super);
   
-  switch (SSL_get_error(self->priv->ssl, ret)) {
-    case SSL_ERROR_NONE:
+  while (totalRead < len) {
+    size_t readSize = 0;
+    int wantedEvents = 0;
+    res = transport_ssl_try_read(self, (char*) result + totalRead, len - totalRead, &readSize, &wantedEvents);
+    if ((res = waitIfNeeded(self, res, wantedEvents, deadline)) == -EAGAIN)
+      continue;
+    
+    totalRead += readSize;
+    if (res < 0 || !needFull)
       break;
-    default:
-      return -EFAULT;
   }
-  return ret;
+  
+  if (szRead)
+    *szRead = totalRead;
+  return res;
+}
+
+int transport_ssl_read(struct transport_ssl* self, void* result, size_t len, size_t* szRead) {
+  return blockingRead(self, result, len, true, szRead);
+}
+
+int transport_ssl_read_some(struct transport_ssl* self, void* result, size_t len, size_t* szRead) {
+  return blockingRead(self, result, len, false, szRead);
+}
+
+bool transport_ssl_is_session_reused(struct transport_ssl* self) {
+  return SSL_session_reused(self->priv->ssl) == 1;
 }
 
 bool transport_ssl_get_handshake_state(struct transport_ssl* self) {
@@ -157,9 +522,9 @@ void transport_ssl_free(struct transport_ssl* self) {
   transport_base_close(&self->super);
   
   SSL_free(self->priv->ssl);
-  SSL_CTX_free(self->priv->sslContext);
   
   self->transportLayer->close(self->transportLayer);
+  free(self->priv->alpnProtocol);
   free(self->priv);
   free(self);
 }
@@ -169,10 +534,31 @@ static int impl_write(struct transport* _self, const void* data, size_t len) {
   return transport_ssl_write(SELF(_self), data, len);
 }
 
+static int impl_writev(struct transport* _self, const struct iovec* iov, int iovcnt) {
+  return transport_ssl_writev(SELF(_self), iov, iovcnt);
+}
+
 static int impl_read(struct transport* _self, void* result, size_t len, size_t* szRead) {
   return transport_ssl_read(SELF(_self), result, len, szRead);
 }
 
+static int impl_read_some(struct transport* _self, void* result, size_t len, size_t* szRead) {
+  return transport_ssl_read_some(SELF(_self), result, len, szRead);
+}
+
+static int impl_try_read(struct transport* _self, void* result, size_t len, size_t* szRead, int* wantedEvents) {
+  return transport_ssl_try_read(SELF(_self), result, len, szRead, wantedEvents);
+}
+
+static int impl_try_write(struct transport* _self, const void* data, size_t len, size_t* szWritten, int* wantedEvents) {
+  return transport_ssl_try_write(SELF(_self), data, len, szWritten, wantedEvents);
+}
+
 static void impl_close(struct transport* _self) {
   transport_ssl_free(SELF(_self));
 }
+
+static int impl_get_sockfd(struct transport* _self) {
+  struct transport* transportLayer = SELF(_self)->transportLayer;
+  return transportLayer->get_sockfd(transportLayer);
+}
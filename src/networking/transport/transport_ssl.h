@@ -39,21 +39,50 @@ enum ssl_version {
   X(TRANSPORT_TLS_V1_2, "TLSv1.2") \
   X(TRANSPORT_TLS_V1_3, "TLSv1.3") \
 
+// Create process wide TLS context (loads CA store once)
+// Errors:
+// -ENOMEM: Not enough memory
+// -EFAULT: Cannot load CA store
+// -EINVAL: Already initialized
 [[nodiscard]]
 int transport_ssl_init();
 void transport_ssl_cleanup();
 
+// `hostname` used for SNI, certificate check (if `verify`)
+// and to find previous session to resume
 [[nodiscard]]
-struct transport_ssl* transport_ssl_new(struct transport* socket, bool verify);
+struct transport_ssl* transport_ssl_new(struct transport* socket, const char* hostname, bool verify);
+
+// Offer `protocols` (NULL terminated, most preferred first)
+// with ALPN in next handshake
+// Errors:
+// -EINVAL: Empty list or name too long
+// -ENOMEM: Not enough memory
+[[nodiscard]]
+int transport_ssl_set_alpn(struct transport_ssl* self, const char* const* protocols);
+
+// Protocol server selected with ALPN or NULL if it didn't
+// (or none offered), valid until transport freed
+const char* transport_ssl_get_alpn(struct transport_ssl* self);
 
 // Errors:
 // -ENOTSUP: Minimum SSL/TLS version requirement not met
 // -EFAULT: Error doing handshake
 // -EINVAL: Invalid min version
+// -ENOMEM: Not enough memory
 int transport_ssl_connect(struct transport_ssl* self, enum ssl_version minimumVersion);
 
+// Non blocking handshake, call again when `wantedEvents`
+// (IO_EVENT_*) happened on the socket
+// Errors same as transport_ssl_connect and
+// -EAGAIN: Handshake in progress
+int transport_ssl_connect_step(struct transport_ssl* self, enum ssl_version minimumVersion, int* wantedEvents);
+
 bool transport_ssl_verify_host(struct transport_ssl* self);
 
+// Whether handshake was abbreviated by resuming previous session
+bool transport_ssl_is_session_reused(struct transport_ssl* self);
+
 bool transport_ssl_get_handshake_state(struct transport_ssl* self);
 enum ssl_version transport_ssl_get_version(struct transport_ssl* self);
 
@@ -61,7 +90,11 @@ void transport_ssl_free(struct transport_ssl* self);
 
 // Methods for `struct transport`
 int transport_ssl_write(struct transport_ssl* self, const void* data, size_t len);
+int transport_ssl_writev(struct transport_ssl* self, const struct iovec* iov, int iovcnt);
 int transport_ssl_read(struct transport_ssl* self, void* result, size_t len, size_t* szRead); 
+int transport_ssl_read_some(struct transport_ssl* self, void* result, size_t len, size_t* szRead); 
+int transport_ssl_try_read(struct transport_ssl* self, void* result, size_t len, size_t* szRead, int* wantedEvents); 
+int transport_ssl_try_write(struct transport_ssl* self, const void* data, size_t len, size_t* szWritten, int* wantedEvents); 
 void transport_ssl_free(struct transport_ssl* self);
 
 #endif
@@ -6,11 +6,34 @@
 #if IS_ENABLED(CONFIG_JSON_DECODER_DEFAULT_DAVEGAMBLE_CJSON)
 # include "decoder/cjson.h"
 #endif
+#if IS_ENABLED(CONFIG_JSON_DECODER_HAS_SIMD)
+# include "decoder/simd.h"
+#endif
 
 int json_decode_default(struct json_node** root, const char* data, size_t len) { 
 # if IS_ENABLED(CONFIG_JSON_DECODER_DEFAULT_DAVEGAMBLE_CJSON)
   return json_decode_cjson(root, data, len);
 # elif IS_ENABLED(CONFIG_JSON_DECODER_DEFAULT_BUILTIN)
   return json_decode_builtin(root, data, len);
+# elif IS_ENABLED(CONFIG_JSON_DECODER_DEFAULT_SIMD)
+  return json_decode_simd(root, data, len);
+# endif
+}
+
+int json_decode_default_document(struct json_node** root, const char* data, size_t len) { 
+# if IS_ENABLED(CONFIG_JSON_DECODER_DEFAULT_DAVEGAMBLE_CJSON)
+  return json_decode_cjson_document(root, data, len);
+# elif IS_ENABLED(CONFIG_JSON_DECODER_DEFAULT_BUILTIN)
+  return json_decode_builtin_document(root, data, len);
+# elif IS_ENABLED(CONFIG_JSON_DECODER_DEFAULT_SIMD)
+  return json_decode_simd_document(root, data, len);
+# endif
+}
+
+int json_decode_lazy(struct json_node** root, const char* data, size_t len) {
+# if IS_ENABLED(CONFIG_JSON_DECODER_HAS_SIMD)
+  return json_decode_simd_lazy(root, data, len);
+# else
+  return json_decode_default_document(root, data, len);
 # endif
 }
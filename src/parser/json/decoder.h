@@ -4,8 +4,22 @@
 #include <stddef.h>
 
 #include "json.h"
+#include "config.h"
+
+// CONFIG_JSON_DECODE_MAX_SIZE in bytes (0 for unlimited), also
+// limit for bodies collected before decoding
+#define JSON_DECODE_MAX_BYTES ((size_t) CONFIG_JSON_DECODE_MAX_SIZE * 1024 * 1024)
 
 int json_decode_default(struct json_node** root, const char* data, size_t len);
 
+// Whole tree allocated in one json_document (see json.h), for
+// read only responses which are freed right after reading
+int json_decode_default_document(struct json_node** root, const char* data, size_t len);
+
+// Decode only what is looked up (see json_decode_simd_lazy), for
+// responses read through json_schema_load. Same as
+// json_decode_default_document without SIMD decoder
+int json_decode_lazy(struct json_node** root, const char* data, size_t len);
+
 #endif
 
@@ -2,6 +2,9 @@
 #include <errno.h>
 #include <stdbool.h>
 #include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
 #include <threads.h>
 
 #include "buffer.h"
@@ -9,97 +12,523 @@
 #include "builtin.h"
 #include "config.h"
 #include "bug.h"
+#include "vec.h"
 
-struct decoder_entry;
-struct decoder_context;
+static const bool isWhitespace[256] = {
+  [' '] = true,
+  ['\n'] = true,
+  ['\r'] = true,
+  ['\t'] = true
+};
 
-struct decoder_entry {
-  int (*decodeFunc)(struct decoder_context*, struct decoder_entry*);
-  struct json_node* node;
+static const bool isNumberChar[256] = {
+  ['0' ... '9'] = true,
+  ['-'] = true,
+  ['+'] = true,
+  ['.'] = true,
+  ['e'] = true,
+  ['E'] = true
 };
 
-struct decoder_context {
-  const char* data;
-  size_t size;
-  int offset;
-  
-  int sp;
-  struct decoder_entry stack[CONFIG_JSON_NEST_MAX];
+// Characters which end plain run inside string
+static const bool isStringSpecial[256] = {
+  [0x00 ... 0x1F] = true,
+  ['"'] = true,
+  ['\\'] = true
 };
 
-static int stackPush(struct decoder_context* ctx, struct decoder_entry entry) {
-  if (ctx->sp >= CONFIG_JSON_NEST_MAX)
-    return -EOVERFLOW;
-  
-  ctx->stack[ctx->sp] = entry;
-  ctx->sp++;
-  return 0;
+void json_builtin_decoder_init(struct json_builtin_decoder* self, struct json_document* document) {
+  self->document = document;
+  self->state = JSON_BUILTIN_STATE_VALUE;
+  self->error = 0;
+  self->totalLength = 0;
+  self->root = NULL;
+  self->sp = 0;
+  self->highSurrogate = 0;
+  vec_init(&self->token);
+  vec_init(&self->key);
 }
 
-static void stackPop(struct decoder_context* ctx, struct decoder_entry* entry) {
-  BUG_ON(ctx->sp <= 0);
-  *entry = ctx->stack[ctx->sp - 1];
-  ctx->sp--;
+void json_builtin_decoder_cleanup(struct json_builtin_decoder* self) {
+  json_free(self->root);
+  self->root = NULL;
+  // Not handed over yet
+  json_document_free(self->document);
+  self->document = NULL;
+  vec_deinit(&self->token);
+  vec_deinit(&self->key);
 }
 
-#define peek(ctx) (ctx->data[ctx->offset])
+// Token always has room for NUL after it
+static int appendToken(struct json_builtin_decoder* self, const char* data, size_t len) {
+  size_t needed = (size_t) self->token.length + len + 1;
+  if (needed > INT_MAX)
+    return -E2BIG;
+
+  // vec_reserve grows exactly to requested size
+  if (needed > (size_t) self->token.capacity) {
+    size_t newCapacity = (size_t) self->token.capacity * 2;
+    if (newCapacity < needed)
+      newCapacity = needed < 32 ? 32 : needed;
+    if (newCapacity > INT_MAX)
+      newCapacity = INT_MAX;
+    if (vec_reserve(&self->token, (int) newCapacity) < 0)
+      return -ENOMEM;
+  }
 
-// Return EOF 
-static int getChar(struct decoder_context* ctx) {
-  if (ctx->offset >= ctx->size)
-    return EOF;
-  return ctx->data[ctx->offset++];
+  memcpy(self->token.data + self->token.length, data, len);
+  self->token.length += len;
+  self->token.data[self->token.length] = '\0';
+  return 0;
+}
+
+static int appendCodepoint(struct json_builtin_decoder* self, uint32_t codepoint) {
+  char utf8[4];
+  size_t len;
+  if (codepoint < 0x80) {
+    utf8[0] = codepoint;
+    len = 1;
+  } else if (codepoint < 0x800) {
+    utf8[0] = 0xC0 | (codepoint >> 6);
+    utf8[1] = 0x80 | (codepoint & 0x3F);
+    len = 2;
+  } else if (codepoint < 0x10000) {
+    utf8[0] = 0xE0 | (codepoint >> 12);
+    utf8[1] = 0x80 | ((codepoint >> 6) & 0x3F);
+    utf8[2] = 0x80 | (codepoint & 0x3F);
+    len = 3;
+  } else {
+    utf8[0] = 0xF0 | (codepoint >> 18);
+    utf8[1] = 0x80 | ((codepoint >> 12) & 0x3F);
+    utf8[2] = 0x80 | ((codepoint >> 6) & 0x3F);
+    utf8[3] = 0x80 | (codepoint & 0x3F);
+    len = 4;
+  }
+  return appendToken(self, utf8, len);
 }
 
-static int skipWhitespace(struct decoder_context* ctx) {
-  static bool isWhite[256] = {
-    [' '] = true,
-    ['\n'] = true,
-    ['\r'] = true,
-    ['\t'] = true
+// Put completed value into current container (or make it root)
+// and descend into it if it is container
+static int addValue(struct json_builtin_decoder* self, struct json_node* node) {
+  int res = 0;
+  if (self->sp == 0) {
+    BUG_ON(self->root);
+    self->root = node;
+    goto added;
+  }
+
+  struct json_node* parent = self->stack[self->sp - 1];
+  if (parent->type == JSON_ARRAY) {
+    if (json_array_append(parent, node) < 0) {
+      res = -ENOMEM;
+      goto add_error;
+    }
+    goto added;
+  }
+
+  // Key isn't owned by buffer, object clones it
+  buffer_t key = {
+    .len = self->key.length,
+    .data = self->key.data,
+    .alloc = NULL
   };
-  
-  int res;
-  while ((res = getChar(ctx)))
-    if (!isWhite[res] || res == EOF)
-      return -ENODATA;
-  
+
+  // Later duplicate replaces earlier one
+  if ((res = json_set_member_buffer(parent, &key, node)) < 0) {
+    BUG_ON(res == -EINVAL);
+    res = -ENOMEM;
+    goto add_error;
+  }
+
+added:
+  if (node->type == JSON_ARRAY) {
+    self->stack[self->sp++] = node;
+    self->state = JSON_BUILTIN_STATE_ARRAY_FIRST;
+  } else if (node->type == JSON_OBJECT) {
+    self->stack[self->sp++] = node;
+    self->state = JSON_BUILTIN_STATE_OBJECT_FIRST;
+  } else {
+    self->state = self->sp == 0 ? JSON_BUILTIN_STATE_DONE : JSON_BUILTIN_STATE_AFTER_VALUE;
+  }
+  return 0;
+
+add_error:
+  json_free(node);
+  return res;
+}
+
+static void closeContainer(struct json_builtin_decoder* self) {
+  BUG_ON(self->sp <= 0);
+  self->sp--;
+  self->state = self->sp == 0 ? JSON_BUILTIN_STATE_DONE : JSON_BUILTIN_STATE_AFTER_VALUE;
+}
+
+static int startString(struct json_builtin_decoder* self, bool isKey) {
+  self->isKey = isKey;
+  self->state = JSON_BUILTIN_STATE_STRING;
+
+  // Empty string still needs its NUL
+  vec_clear(&self->token);
+  return appendToken(self, "", 0);
+}
+
+static int finishString(struct json_builtin_decoder* self) {
+  if (self->isKey) {
+    // Token becomes key and old key's memory reused for next token
+    vec_char_t tmp = self->key;
+    self->key = self->token;
+    self->token = tmp;
+    vec_clear(&self->token);
+    self->state = JSON_BUILTIN_STATE_COLON;
+    return 0;
+  }
+
+  struct json_string* string = json_new_string_copy_in(self->document, self->token.data, self->token.length);
+  if (!string)
+    return -ENOMEM;
+  return addValue(self, &string->node);
+}
+
+static int finishNumber(struct json_builtin_decoder* self) {
+  if (!json_is_valid_number(self->token.data, self->token.length))
+    return -EINVAL;
+
+  struct json_number* number = json_new_number_in(self->document, strtod(self->token.data, NULL));
+  if (!number)
+    return -ENOMEM;
+  return addValue(self, &number->node);
+}
+
+static int finishLiteral(struct json_builtin_decoder* self) {
+  struct json_node* node;
+  switch (self->literal[0]) {
+    case 't':
+    case 'f': {
+      struct json_boolean* boolean = json_new_boolean_in(self->document, self->literal[0] == 't');
+      node = boolean ? &boolean->node : NULL;
+      break;
+    }
+    case 'n': {
+      struct json_null* null = json_new_null_in(self->document);
+      node = null ? &null->node : NULL;
+      break;
+    }
+    default:
+      BUG();
+  }
+
+  if (!node)
+    return -ENOMEM;
+  return addValue(self, node);
+}
+
+static int startValue(struct json_builtin_decoder* self, char c) {
+  struct json_node* node = NULL;
+  switch (c) {
+    case '{':
+    case '[':
+      if (self->sp >= CONFIG_JSON_NEST_MAX)
+        return -EOVERFLOW;
+
+      if (c == '{') {
+        struct json_object* object = json_new_object_in(self->document);
+        node = object ? &object->node : NULL;
+      } else {
+        struct json_array* array = json_new_array_in(self->document);
+        node = array ? &array->node : NULL;
+      }
+
+      if (!node)
+        return -ENOMEM;
+      return addValue(self, node);
+    case '"':
+      return startString(self, false);
+    case '-':
+    case '0' ... '9':
+      vec_clear(&self->token);
+      self->state = JSON_BUILTIN_STATE_NUMBER;
+      return appendToken(self, &c, 1);
+    case 't':
+      self->literal = "true";
+      goto start_literal;
+    case 'f':
+      self->literal = "false";
+      goto start_literal;
+    case 'n':
+      self->literal = "null";
+      goto start_literal;
+start_literal:
+      self->literalIndex = 1;
+      self->state = JSON_BUILTIN_STATE_LITERAL;
+      return 0;
+    default:
+      return -EINVAL;
+  }
+}
+
+static int hexValue(char c) {
+  if (c >= '0' && c <= '9')
+    return c - '0';
+  if (c >= 'a' && c <= 'f')
+    return c - 'a' + 10;
+  if (c >= 'A' && c <= 'F')
+    return c - 'A' + 10;
+  return -1;
+}
+
+static int finishUnicodeEscape(struct json_builtin_decoder* self) {
+  uint32_t codepoint = self->codepoint;
+  self->state = JSON_BUILTIN_STATE_STRING;
+
+  if (self->highSurrogate) {
+    if (codepoint < 0xDC00 || codepoint > 0xDFFF)
+      return -EINVAL;
+    codepoint = 0x10000 + ((self->highSurrogate - 0xD800) << 10) + (codepoint - 0xDC00);
+    self->highSurrogate = 0;
+    return appendCodepoint(self, codepoint);
+  }
+
+  if (codepoint >= 0xD800 && codepoint <= 0xDBFF) {
+    self->highSurrogate = codepoint;
+    return 0;
+  }
+
+  if (codepoint >= 0xDC00 && codepoint <= 0xDFFF)
+    return -EINVAL;
+  return appendCodepoint(self, codepoint);
+}
+
+static int process(struct json_builtin_decoder* self, const char* data, size_t len) {
+  int res = 0;
+  for (size_t i = 0; i < len; i++) {
+    unsigned char c = data[i];
+
+reprocess:
+    switch (self->state) {
+      case JSON_BUILTIN_STATE_DONE:
+        if (!isWhitespace[c])
+          return -EINVAL;
+        break;
+      case JSON_BUILTIN_STATE_ARRAY_FIRST:
+        if (c == ']') {
+          closeContainer(self);
+          break;
+        }
+        [[fallthrough]];
+      case JSON_BUILTIN_STATE_VALUE:
+        if (isWhitespace[c])
+          break;
+        if ((res = startValue(self, c)) < 0)
+          return res;
+        break;
+      case JSON_BUILTIN_STATE_OBJECT_FIRST:
+        if (c == '}') {
+          closeContainer(self);
+          break;
+        }
+        [[fallthrough]];
+      case JSON_BUILTIN_STATE_OBJECT_KEY:
+        if (isWhitespace[c])
+          break;
+        if (c != '"')
+          return -EINVAL;
+        if ((res = startString(self, true)) < 0)
+          return res;
+        break;
+      case JSON_BUILTIN_STATE_COLON:
+        if (isWhitespace[c])
+          break;
+        if (c != ':')
+          return -EINVAL;
+        self->state = JSON_BUILTIN_STATE_VALUE;
+        break;
+      case JSON_BUILTIN_STATE_AFTER_VALUE: {
+        if (isWhitespace[c])
+          break;
+
+        enum json_type type = self->stack[self->sp - 1]->type;
+        if (c == ',')
+          self->state = type == JSON_ARRAY ? JSON_BUILTIN_STATE_VALUE : JSON_BUILTIN_STATE_OBJECT_KEY;
+        else if ((c == ']' && type == JSON_ARRAY) || (c == '}' && type == JSON_OBJECT))
+          closeContainer(self);
+        else
+          return -EINVAL;
+        break;
+      }
+      case JSON_BUILTIN_STATE_STRING: {
+        // Only another escape can follow high surrogate
+        if (self->highSurrogate) {
+          if (c != '\\')
+            return -EINVAL;
+          self->state = JSON_BUILTIN_STATE_STRING_ESCAPE;
+          break;
+        }
+
+        // Copy run of plain characters in one go
+        size_t start = i;
+        while (i < len && !isStringSpecial[(unsigned char) data[i]])
+          i++;
+        if (i > start && (res = appendToken(self, data + start, i - start)) < 0)
+          return res;
+        if (i == len)
+          break;
+
+        c = data[i];
+        if (c == '"') {
+          if ((res = finishString(self)) < 0)
+            return res;
+        } else if (c == '\\') {
+          self->state = JSON_BUILTIN_STATE_STRING_ESCAPE;
+        } else {
+          // Unescaped control character
+          return -EINVAL;
+        }
+        break;
+      }
+      case JSON_BUILTIN_STATE_STRING_ESCAPE: {
+        char unescaped;
+        if (self->highSurrogate && c != 'u')
+          return -EINVAL;
+
+        switch (c) {
+          case '"':
+          case '\\':
+          case '/':
+            unescaped = c;
+            break;
+          case 'b':
+            unescaped = '\b';
+            break;
+          case 'f':
+            unescaped = '\f';
+            break;
+          case 'n':
+            unescaped = '\n';
+            break;
+          case 'r':
+            unescaped = '\r';
+            break;
+          case 't':
+            unescaped = '\t';
+            break;
+          case 'u':
+            self->codepoint = 0;
+            self->hexDigits = 0;
+            self->state = JSON_BUILTIN_STATE_STRING_UNICODE;
+            goto escape_done;
+          default:
+            return -EINVAL;
+        }
+
+        if ((res = appendToken(self, &unescaped, 1)) < 0)
+          return res;
+        self->state = JSON_BUILTIN_STATE_STRING;
+escape_done:
+        break;
+      }
+      case JSON_BUILTIN_STATE_STRING_UNICODE: {
+        int digit = hexValue(c);
+        if (digit < 0)
+          return -EINVAL;
+
+        self->codepoint = (self->codepoint << 4) | digit;
+        if (++self->hexDigits == 4 && (res = finishUnicodeEscape(self)) < 0)
+          return res;
+        break;
+      }
+      case JSON_BUILTIN_STATE_NUMBER:
+        if (isNumberChar[c]) {
+          if ((res = appendToken(self, (const char*) &c, 1)) < 0)
+            return res;
+          break;
+        }
+
+        // Character after number belongs to next token
+        if ((res = finishNumber(self)) < 0)
+          return res;
+        goto reprocess;
+      case JSON_BUILTIN_STATE_LITERAL:
+        if (c != self->literal[self->literalIndex])
+          return -EINVAL;
+
+        if (self->literal[++self->literalIndex] == '\0' && (res = finishLiteral(self)) < 0)
+          return res;
+        break;
+    }
+  }
+
   return 0;
 }
 
-static int parseObject(struct decoder_context* ctx, struct decoder_entry* entry) {
-  BUG_ON(peek(ctx) != '{');
+int json_builtin_decoder_feed(struct json_builtin_decoder* self, const char* data, size_t len) {
+  if (self->error < 0)
+    return self->error;
+
+  self->totalLength += len;
+  if (CONFIG_JSON_DECODE_MAX_SIZE > 0 && self->totalLength > (size_t) CONFIG_JSON_DECODE_MAX_SIZE * 1024 * 1024) {
+    self->error = -E2BIG;
+    return self->error;
+  }
+
+  int res = process(self, data, len);
+  if (res < 0)
+    self->error = res;
+  return res;
+}
+
+int json_builtin_decoder_finish(struct json_builtin_decoder* self, struct json_node** root) {
   int res = 0;
-  
+  if (self->error < 0)
+    return self->error;
+
+  // Number at end of document only ends here
+  if (self->state == JSON_BUILTIN_STATE_NUMBER && (res = finishNumber(self)) < 0)
+    goto finish_error;
+
+  if (self->state != JSON_BUILTIN_STATE_DONE) {
+    res = -EINVAL;
+    goto finish_error;
+  }
+
+  // Root now owns the document
+  if (self->document) {
+    self->document->root = self->root;
+    self->document = NULL;
+  }
+
+  if (root)
+    *root = self->root;
+  else
+    json_free(self->root);
+  self->root = NULL;
+  return 0;
+
+finish_error:
+  self->error = res;
   return res;
 }
 
-int json_decode_builtin(struct json_node** root, const char* data, size_t len) {
-  // TODO: Built in decoder not ready yet
-  BUG();
-  
-  (void) parseObject;
-  (void) skipWhitespace;
-  (void) stackPush;
-  (void) stackPop;
-  
-  if (len > INT_MAX)
-    return -E2BIG;
-  
+static int decode(struct json_document* document, struct json_node** root, const char* data, size_t len) {
   int res = 0;
-  
-  static thread_local struct decoder_context ctx = {
-    .stack = {}
-  };
-  ctx.data = data;
-  ctx.offset = 0;
-  ctx.sp = 0;
-  ctx.size = len;
-  
-  if (res < 0)
-    json_free(ctx.stack[0].node);
-  
-  else if (root)
-    *root = ctx.stack[0].node;
+  static thread_local struct json_builtin_decoder decoder;
+  json_builtin_decoder_init(&decoder, document);
+
+  if ((res = json_builtin_decoder_feed(&decoder, data, len)) < 0)
+    goto feed_error;
+  res = json_builtin_decoder_finish(&decoder, root);
+
+feed_error:
+  json_builtin_decoder_cleanup(&decoder);
   return res;
 }
+
+int json_decode_builtin(struct json_node** root, const char* data, size_t len) {
+  return decode(NULL, root, data, len);
+}
+
+int json_decode_builtin_document(struct json_node** root, const char* data, size_t len) {
+  struct json_document* document = json_document_new();
+  if (!document)
+    return -ENOMEM;
+  return decode(document, root, data, len);
+}
@@ -1,10 +1,95 @@
 #ifndef _headers_1670739325_FluffyLauncher_builtin
 #define _headers_1670739325_FluffyLauncher_builtin
 
+#include <stdbool.h>
 #include <stddef.h>
+#include <stdint.h>
+
 #include "parser/json/json.h"
+#include "config.h"
+#include "vec.h"
+
+// Single pass JSON decoder building json_node tree directly
+// Document can be fed in arbitrary chunks (e.g. body as
+// http_response_recv receives it) so it never has to be
+// collected in one piece first
+
+enum json_builtin_state {
+  // Expecting value (top level, after '[', ',' or ':')
+  JSON_BUILTIN_STATE_VALUE,
+  // After '[', value or ']'
+  JSON_BUILTIN_STATE_ARRAY_FIRST,
+  // After '{', key or '}'
+  JSON_BUILTIN_STATE_OBJECT_FIRST,
+  // After ',' in object, key only
+  JSON_BUILTIN_STATE_OBJECT_KEY,
+  JSON_BUILTIN_STATE_COLON,
+  // Expecting ',' or end of container
+  JSON_BUILTIN_STATE_AFTER_VALUE,
+  JSON_BUILTIN_STATE_STRING,
+  JSON_BUILTIN_STATE_STRING_ESCAPE,
+  JSON_BUILTIN_STATE_STRING_UNICODE,
+  JSON_BUILTIN_STATE_NUMBER,
+  JSON_BUILTIN_STATE_LITERAL,
+  // Root value complete, only whitespace allowed
+  JSON_BUILTIN_STATE_DONE
+};
+
+struct json_builtin_decoder {
+  enum json_builtin_state state;
+
+  // First error, every later call returns it
+  int error;
+  size_t totalLength;
+
+  struct json_node* root;
+  // Arena for the tree or NULL for malloc'ed nodes, freed by
+  // cleanup unless finish gave it to caller with the root
+  struct json_document* document;
+
+  // Containers being filled, innermost last
+  int sp;
+  struct json_node* stack[CONFIG_JSON_NEST_MAX];
+
+  // String, number or literal being read (may span chunks)
+  vec_char_t token;
+
+  // Member key waiting for its value
+  vec_char_t key;
+
+  bool isKey;
+  uint32_t codepoint;
+  int hexDigits;
+  // High surrogate waiting for its low half
+  uint32_t highSurrogate;
+
+  const char* literal;
+  int literalIndex;
+};
+
+void json_builtin_decoder_init(struct json_builtin_decoder* self, struct json_document* document);
+void json_builtin_decoder_cleanup(struct json_builtin_decoder* self);
+
+// Feed next chunk of document
+// Errors:
+// -EINVAL: Malformed document
+// -EOVERFLOW: Nested deeper than CONFIG_JSON_NEST_MAX
+// -E2BIG: Document larger than CONFIG_JSON_DECODE_MAX_SIZE
+// -ENOMEM: Not enough memory
+[[nodiscard]]
+int json_builtin_decoder_feed(struct json_builtin_decoder* self, const char* data, size_t len);
+
+// End of document, hands decoded tree to caller
+// Errors:
+// -EINVAL: Document incomplete
+// Or error from json_builtin_decoder_feed
+[[nodiscard]]
+int json_builtin_decoder_finish(struct json_builtin_decoder* self, struct json_node** root);
 
 int json_decode_builtin(struct json_node** root, const char* data, size_t len);
 
+// Same but whole tree in one json_document
+int json_decode_builtin_document(struct json_node** root, const char* data, size_t len);
+
 #endif
 
@@ -1,6 +1,7 @@
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <errno.h>
 #include <threads.h>
 
@@ -13,175 +14,208 @@
 #include "config.h"
 #include "vec.h"
 
-struct cjson_data {  
-  cJSON* json;
-  vec_t(buffer_t*) buffers;
+// Conversion moves strings and keys out of cJSON tree (cJSON
+// allocates them with malloc, same as buffer_t frees them) and
+// frees every cJSON item as soon as it is converted so both
+// trees never exist in full at same time. Document trees copy
+// them into the arena instead
+
+struct decoder_entry {
+  // Container whose remaining children are unconverted
+  cJSON* cjsonNode;
+  struct json_node* node;
 };
 
-static void finalizer(struct json_node* node, void* _self) {
-  struct cjson_data* self = _self;
-  
-  int i = 0;
-  buffer_t* v = NULL;
-  vec_foreach(&self->buffers, v, i)
-    buffer_free(v);
-  
-  vec_deinit(&self->buffers);
-  cJSON_Delete(self->json);
-  free(self);
+static struct json_node* newNode(struct json_document* document, cJSON* item) {
+  switch (item->type & 0xFF) {
+    case cJSON_Object: {
+      struct json_object* object = json_new_object_in(document);
+      return object ? &object->node : NULL;
+    }
+    case cJSON_Array: {
+      struct json_array* array = json_new_array_in(document);
+      return array ? &array->node : NULL;
+    }
+    case cJSON_Number: {
+      struct json_number* number = json_new_number_in(document, cJSON_GetNumberValue(item));
+      return number ? &number->node : NULL;
+    }
+    case cJSON_NULL: {
+      struct json_null* null = json_new_null_in(document);
+      return null ? &null->node : NULL;
+    }
+    case cJSON_True:
+    case cJSON_False: {
+      struct json_boolean* boolean = json_new_boolean_in(document, (item->type & 0xFF) == cJSON_True);
+      return boolean ? &boolean->node : NULL;
+    }
+    case cJSON_String: {
+      BUG_ON(item->type & cJSON_IsReference);
+      if (document) {
+        struct json_string* string = json_new_string_copy_in(document, item->valuestring, strlen(item->valuestring));
+        return string ? &string->node : NULL;
+      }
+
+      buffer_t* buff = buffer_new_with_string(item->valuestring);
+      if (!buff)
+        return NULL;
+
+      struct json_string* string = json_new_string(buff);
+      if (!string) {
+        // Still cJSON's
+        buff->alloc = NULL;
+        buffer_free(buff);
+        return NULL;
+      }
+      item->valuestring = NULL;
+      return &string->node;
+    }
+    default:
+      BUG();
+  }
 }
 
-struct decoder_entry {
-  cJSON* currentCJSONNode;
-  struct json_node* currentNode;
-  cJSON* currentCJSONChild; 
-};
+static int addChild(struct json_node* parent, cJSON* item, struct json_node* node) {
+  int res = 0;
+  if (parent->type == JSON_ARRAY) {
+    if (json_array_append(parent, node) < 0)
+      return -ENOMEM;
+    return 0;
+  }
 
-static buffer_t* newBuffer(struct cjson_data* self, const char* str) {
-  BUG_ON(!str);
-  
-  buffer_t* buff = buffer_new_with_string((char*) str);
-  if (!buff)
-    return NULL;
-  
-  buff->alloc = NULL;
-  if (vec_push(&self->buffers, buff) < 0) {
-    buffer_free(buff);
-    return NULL;
+  // Later duplicate replaces earlier one (same as other decoders)
+  if (parent->document) {
+    buffer_t key = {
+      .len = strlen(item->string),
+      .data = item->string,
+      .alloc = NULL
+    };
+
+    if ((res = json_set_member_buffer(parent, &key, node)) < 0) {
+      BUG_ON(res == -EINVAL);
+      return -ENOMEM;
+    }
+    return 0;
   }
-  return buff;
+
+  BUG_ON(item->type & cJSON_StringIsConst);
+  buffer_t* key = buffer_new_with_string(item->string);
+  if (!key)
+    return -ENOMEM;
+
+  if ((res = json_set_member_buffer_move(parent, key, node)) < 0) {
+    // Still cJSON's
+    key->alloc = NULL;
+    buffer_free(key);
+
+    BUG_ON(res == -EINVAL);
+    return -ENOMEM;
+  }
+
+  item->string = NULL;
+  return 0;
 }
 
-int json_decode_cjson(struct json_node** root, const char* data, size_t len) {
+static int decode(struct json_document* document, struct json_node** root, const char* data, size_t len) {
   int res = 0;
   const char* end;
   cJSON* json = cJSON_ParseWithLengthOpts(data, len, &end, false);
-  if (!json)
-    return -EINVAL;
-  
-  struct cjson_data* self = malloc(sizeof(*self));
-  if (!self) {
+  if (!json) {
+    res = -EINVAL;
+    goto parse_failure;
+  }
+
+  struct json_node* rootNode = newNode(document, json);
+  if (!rootNode) {
     res = -ENOMEM;
-    goto alloc_self_failure;
+    goto alloc_root_failure;
   }
-  *self = (struct cjson_data) {
-    .json = json
-  };
-  vec_init(&self->buffers);
-  
+
   int sp = 0;
-  static thread_local struct decoder_entry stack[CONFIG_JSON_NEST_MAX + 1];
-  stack[sp++] = (struct decoder_entry) {
-    .currentCJSONNode = json
-  };
-  
-  #define checkStack(delta) do { \
-    BUG_ON(sp + delta < 0); \
-    if (sp + delta >= ARRAY_SIZE(stack)) { \
-      res = -EOVERFLOW; \
-      goto stack_overflow_or_underflow; \
-    } \
-  } while (0)
-  
+  static thread_local struct decoder_entry stack[CONFIG_JSON_NEST_MAX];
+  if (rootNode->type == JSON_OBJECT || rootNode->type == JSON_ARRAY)
+    stack[sp++] = (struct decoder_entry) {
+      .cjsonNode = json,
+      .node = rootNode
+    };
+  else
+    cJSON_Delete(json);
+
+  cJSON* child = NULL;
   while (sp > 0) {
     struct decoder_entry* cur = &stack[sp - 1];
-    buffer_t* buff;
-    bool alreadyInited = cur->currentNode != NULL;
-    BUG_ON(cur->currentCJSONNode->type == cJSON_Invalid);
-    
-    switch (cur->currentCJSONNode->type) {
-      case cJSON_Object:
-        if (!alreadyInited) {
-          cur->currentNode = &json_new_object()->node;
-        } else {
-          // Add the child to the result
-          checkStack(+1);
-          if ((buff = newBuffer(self, stack[sp].currentCJSONNode->string)) == NULL) {
-            res = -ENOMEM;
-            goto alloc_buff_failure;
-          }
-          
-          if ((res = json_set_member_buffer_no_overwrite(cur->currentNode, buff, stack[sp].currentNode)) < 0) {
-            json_free(stack[sp].currentNode);
-            buffer_free(buff);
-            
-            BUG_ON(stack[sp].currentNode == NULL);
-            BUG_ON(res == -EINVAL);
-            res = -ENOMEM;
-            goto add_child_failure;
-          }
-        }
-        goto advance_to_next_child;
-      case cJSON_Array:
-        if (!alreadyInited) {
-          cur->currentNode = &json_new_array()->node;
-        } else {
-          // Add the child to the result
-          checkStack(+1);
-          
-          if (vec_push(&JSON_ARRAY(cur->currentNode)->array, stack[sp].currentNode) < 0) {
-            json_free(stack[sp].currentNode);
-            buffer_free(buff);
-            
-            res = -ENOMEM;
-            goto add_child_failure;
-          }
-        }
-        goto advance_to_next_child;
-advance_to_next_child:
-        if (!alreadyInited) 
-          cur->currentCJSONChild = cur->currentCJSONNode->child;
-        else 
-          cur->currentCJSONChild = cur->currentCJSONChild->next;
-        
-        if (cur->currentCJSONChild) {
-          checkStack(+1);
-          stack[sp++] = (struct decoder_entry) {
-            .currentCJSONNode = cur->currentCJSONChild,
-          };
-          
-          goto continue_no_pop;
-        }
-        break;
-      case cJSON_Number:
-        cur->currentNode = &json_new_number(cJSON_GetNumberValue(cur->currentCJSONNode))->node;
-        break;
-      case cJSON_NULL:
-        cur->currentNode = &json_new_null()->node;
-        break;
-      case cJSON_True:
-      case cJSON_False:
-        cur->currentNode = &json_new_boolean(cur->currentCJSONNode->type == cJSON_True)->node;
-        break;
-      case cJSON_String:
-        if ((buff = newBuffer(self, cJSON_GetStringValue(cur->currentCJSONNode))) == NULL) {
-          res = -ENOMEM;
-          goto alloc_buff_failure;
-        }
-        cur->currentNode = &json_new_string(buff)->node;
-        break; 
-      default:
-        BUG();
+    child = cur->cjsonNode->child;
+
+    // Every child converted and freed
+    if (!child) {
+      cJSON_Delete(cur->cjsonNode);
+      sp--;
+      continue;
+    }
+
+    // Unlink before converting so remaining cJSON tree never
+    // points to freed items
+    cur->cjsonNode->child = child->next;
+    child->next = NULL;
+    child->prev = NULL;
+
+    struct json_node* node = newNode(document, child);
+    if (!node) {
+      res = -ENOMEM;
+      goto convert_failure;
+    }
+
+    if ((res = addChild(cur->node, child, node)) < 0) {
+      json_free(node);
+      goto convert_failure;
     }
-    
-    checkStack(-1);
-    sp--;
 
-continue_no_pop:
-    json_set_unmanaged(cur->currentNode, NULL, NULL);
+    if (node->type != JSON_OBJECT && node->type != JSON_ARRAY) {
+      cJSON_Delete(child);
+      continue;
+    }
+
+    if (sp >= ARRAY_SIZE(stack)) {
+      res = -EOVERFLOW;
+      goto convert_failure;
+    }
+    stack[sp++] = (struct decoder_entry) {
+      .cjsonNode = child,
+      .node = node
+    };
   }
-  
-  // Install custom finalizer on JSON root
-  json_set_unmanaged(stack[0].currentNode, finalizer, self);
+
+  // Root now owns the document
+  if (document)
+    document->root = rootNode;
+
   if (root)
-    *root = stack[0].currentNode;
+    *root = rootNode;
   else
-    json_free(stack[0].currentNode); 
-alloc_buff_failure:
-add_child_failure:
-stack_overflow_or_underflow:
-alloc_self_failure:
-  if (res < 0) 
-    json_free(stack[0].currentNode);
+    json_free(rootNode);
+  return 0;
+
+convert_failure:
+  // Items on stack were unlinked from their parents when
+  // conversion started on them
+  cJSON_Delete(child);
+  while (sp > 1)
+    cJSON_Delete(stack[--sp].cjsonNode);
+  json_free(rootNode);
+alloc_root_failure:
+  cJSON_Delete(json);
+parse_failure:
+  json_document_free(document);
   return res;
 }
+
+int json_decode_cjson(struct json_node** root, const char* data, size_t len) {
+  return decode(NULL, root, data, len);
+}
+
+int json_decode_cjson_document(struct json_node** root, const char* data, size_t len) {
+  struct json_document* document = json_document_new();
+  if (!document)
+    return -ENOMEM;
+  return decode(document, root, data, len);
+}
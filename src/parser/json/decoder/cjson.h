@@ -6,5 +6,8 @@
 
 int json_decode_cjson(struct json_node** root, const char* data, size_t len);
 
+// Same but whole tree in one json_document
+int json_decode_cjson_document(struct json_node** root, const char* data, size_t len);
+
 #endif
 
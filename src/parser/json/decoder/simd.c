@@ -0,0 +1,980 @@
+#include <errno.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <threads.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+# include <immintrin.h>
+#endif
+
+#include "buffer.h"
+#include "parser/json/json.h"
+#include "simd.h"
+#include "config.h"
+#include "bug.h"
+#include "vec.h"
+
+#define BLOCK_SIZE 64
+
+// Bit N set if byte N of block is in that class
+struct block_masks {
+  uint64_t backslash;
+  uint64_t quote;
+  // {}[]:,
+  uint64_t op;
+  uint64_t whitespace;
+  // Below 0x20, can't appear unescaped in strings
+  uint64_t control;
+};
+
+typedef void (*classify_func)(const char* block, struct block_masks* masks);
+
+enum {
+  CLASS_BACKSLASH = 1 << 0,
+  CLASS_QUOTE = 1 << 1,
+  CLASS_OP = 1 << 2,
+  CLASS_WHITESPACE = 1 << 3,
+  CLASS_CONTROL = 1 << 4
+};
+
+static const uint8_t charClass[256] = {
+  [0x00 ... 0x08] = CLASS_CONTROL,
+  ['\t'] = CLASS_CONTROL | CLASS_WHITESPACE,
+  ['\n'] = CLASS_CONTROL | CLASS_WHITESPACE,
+  [0x0B ... 0x0C] = CLASS_CONTROL,
+  ['\r'] = CLASS_CONTROL | CLASS_WHITESPACE,
+  [0x0E ... 0x1F] = CLASS_CONTROL,
+  [' '] = CLASS_WHITESPACE,
+  ['"'] = CLASS_QUOTE,
+  ['\\'] = CLASS_BACKSLASH,
+  ['{'] = CLASS_OP,
+  ['}'] = CLASS_OP,
+  ['['] = CLASS_OP,
+  [']'] = CLASS_OP,
+  [':'] = CLASS_OP,
+  [','] = CLASS_OP
+};
+
+static void classifyScalar(const char* block, struct block_masks* masks) {
+  *masks = (struct block_masks) {};
+  for (int i = 0; i < BLOCK_SIZE; i++) {
+    uint64_t class = charClass[(uint8_t) block[i]];
+    masks->backslash |= (class & 1) << i;
+    masks->quote |= ((class >> 1) & 1) << i;
+    masks->op |= ((class >> 2) & 1) << i;
+    masks->whitespace |= ((class >> 3) & 1) << i;
+    masks->control |= ((class >> 4) & 1) << i;
+  }
+}
+
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__)
+# define HAVE_AVX2_CLASSIFY 1
+
+__attribute__((target("avx2")))
+static inline uint64_t maskAVX2(__m256i low, __m256i high) {
+  return (uint64_t) (uint32_t) _mm256_movemask_epi8(low) |
+         (uint64_t) (uint32_t) _mm256_movemask_epi8(high) << 32;
+}
+
+__attribute__((target("avx2")))
+static inline uint64_t equalAVX2(__m256i low, __m256i high, char c) {
+  __m256i wanted = _mm256_set1_epi8(c);
+  return maskAVX2(_mm256_cmpeq_epi8(low, wanted), _mm256_cmpeq_epi8(high, wanted));
+}
+
+__attribute__((target("avx2")))
+static void classifyAVX2(const char* block, struct block_masks* masks) {
+  __m256i low = _mm256_loadu_si256((const __m256i*) block);
+  __m256i high = _mm256_loadu_si256((const __m256i*) (block + 32));
+
+  masks->backslash = equalAVX2(low, high, '\\');
+  masks->quote = equalAVX2(low, high, '"');
+  masks->op = equalAVX2(low, high, '{') | equalAVX2(low, high, '}') |
+              equalAVX2(low, high, '[') | equalAVX2(low, high, ']') |
+              equalAVX2(low, high, ':') | equalAVX2(low, high, ',');
+  masks->whitespace = equalAVX2(low, high, ' ') | equalAVX2(low, high, '\t') |
+                      equalAVX2(low, high, '\n') | equalAVX2(low, high, '\r');
+
+  // Unsigned x <= 0x1F is min(x, 0x1F) == x
+  __m256i limit = _mm256_set1_epi8(0x1F);
+  masks->control = maskAVX2(_mm256_cmpeq_epi8(_mm256_min_epu8(low, limit), low),
+                            _mm256_cmpeq_epi8(_mm256_min_epu8(high, limit), high));
+}
+#endif
+
+static classify_func classify = classifyScalar;
+static pthread_once_t classifyOnce = PTHREAD_ONCE_INIT;
+
+static void selectClassifier() {
+#ifdef HAVE_AVX2_CLASSIFY
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2"))
+    classify = classifyAVX2;
+#endif
+}
+
+// Characters escaped by backslash, `carry` is set when last
+// byte of block is unescaped backslash (so next block's first
+// byte is escaped)
+static uint64_t findEscaped(uint64_t backslash, uint64_t* carry) {
+  uint64_t escaped = *carry;
+  *carry = 0;
+
+  // Backslashes are rare, walking them one by one is cheap
+  while (backslash) {
+    int pos = __builtin_ctzll(backslash);
+    backslash &= backslash - 1;
+    if (escaped & ((uint64_t) 1 << pos))
+      continue;
+
+    if (pos == BLOCK_SIZE - 1)
+      *carry = 1;
+    else
+      escaped |= (uint64_t) 1 << (pos + 1);
+  }
+  return escaped;
+}
+
+// Bit N is XOR of bits 0 to N, with quote bits it gives
+// inside string mask (opening quote included, closing not)
+static uint64_t prefixXor(uint64_t bits) {
+  bits ^= bits << 1;
+  bits ^= bits << 2;
+  bits ^= bits << 4;
+  bits ^= bits << 8;
+  bits ^= bits << 16;
+  bits ^= bits << 32;
+  return bits;
+}
+
+struct structural_index {
+  uint32_t* positions;
+  size_t count;
+  size_t capacity;
+};
+
+static int reserveIndex(struct structural_index* index, size_t count) {
+  if (count <= index->capacity)
+    return 0;
+
+  size_t newCapacity = index->capacity ? index->capacity * 2 : 1024;
+  while (newCapacity < count)
+    newCapacity *= 2;
+
+  uint32_t* newPositions = realloc(index->positions, newCapacity * sizeof(*newPositions));
+  if (!newPositions)
+    return -ENOMEM;
+  index->positions = newPositions;
+  index->capacity = newCapacity;
+  return 0;
+}
+
+// Stage 1, position of every structural character and quote
+// outside strings and first byte of every number or literal
+static int buildIndex(struct structural_index* index, const char* data, size_t len) {
+  int res = 0;
+  uint64_t escapeCarry = 0;
+  uint64_t inStringCarry = 0;
+  uint64_t scalarCarry = 0;
+  char tail[BLOCK_SIZE];
+
+  for (size_t base = 0; base < len; base += BLOCK_SIZE) {
+    const char* block = data + base;
+    if (len - base < BLOCK_SIZE) {
+      // Whitespace padding changes nothing
+      memset(tail, ' ', BLOCK_SIZE);
+      memcpy(tail, block, len - base);
+      block = tail;
+    }
+
+    if ((res = reserveIndex(index, index->count + BLOCK_SIZE)) < 0)
+      return res;
+
+    struct block_masks masks;
+    classify(block, &masks);
+
+    uint64_t escaped = findEscaped(masks.backslash, &escapeCarry);
+    uint64_t quote = masks.quote & ~escaped;
+    uint64_t inString = prefixXor(quote) ^ inStringCarry;
+    inStringCarry = (uint64_t) ((int64_t) inString >> 63);
+    if (masks.control & inString)
+      return -EINVAL;
+
+    // Bytes of numbers and literals, only first of each run
+    // is indexed and stage 2 reads rest itself
+    uint64_t scalar = ~(masks.op | masks.whitespace | masks.quote | inString);
+    uint64_t scalarStart = scalar & ~((scalar << 1) | scalarCarry);
+    scalarCarry = scalar >> 63;
+
+    uint64_t structural = (masks.op & ~inString) | quote | scalarStart;
+    while (structural) {
+      index->positions[index->count++] = (uint32_t) (base + __builtin_ctzll(structural));
+      structural &= structural - 1;
+    }
+  }
+
+  // Unterminated string
+  if (inStringCarry)
+    return -EINVAL;
+  return 0;
+}
+
+enum decoder_state {
+  STATE_VALUE,
+  STATE_ARRAY_FIRST,
+  STATE_OBJECT_FIRST,
+  STATE_OBJECT_KEY,
+  STATE_COLON,
+  STATE_AFTER_VALUE,
+  STATE_DONE
+};
+
+struct decoder_context {
+  const char* data;
+  size_t len;
+
+  const uint32_t* positions;
+  size_t count;
+  size_t next;
+
+  enum decoder_state state;
+  struct json_node* root;
+  // NULL for malloc'ed nodes
+  struct json_document* document;
+
+  int sp;
+  struct json_node* stack[CONFIG_JSON_NEST_MAX];
+
+  // Member key waiting for its value
+  vec_char_t key;
+  // NUL terminated copy of number for strtod or
+  // unescaped string
+  vec_char_t scratch;
+};
+
+static int hexValue(char c) {
+  if (c >= '0' && c <= '9')
+    return c - '0';
+  if (c >= 'a' && c <= 'f')
+    return c - 'a' + 10;
+  if (c >= 'A' && c <= 'F')
+    return c - 'A' + 10;
+  return -1;
+}
+
+static int readHex4(const char* str, size_t len, size_t i, uint32_t* codepoint) {
+  if (len - i < 4)
+    return -EINVAL;
+
+  *codepoint = 0;
+  for (size_t j = i; j < i + 4; j++) {
+    int digit = hexValue(str[j]);
+    if (digit < 0)
+      return -EINVAL;
+    *codepoint = (*codepoint << 4) | digit;
+  }
+  return 0;
+}
+
+static size_t encodeUTF8(uint32_t codepoint, char* out) {
+  if (codepoint < 0x80) {
+    out[0] = codepoint;
+    return 1;
+  } else if (codepoint < 0x800) {
+    out[0] = 0xC0 | (codepoint >> 6);
+    out[1] = 0x80 | (codepoint & 0x3F);
+    return 2;
+  } else if (codepoint < 0x10000) {
+    out[0] = 0xE0 | (codepoint >> 12);
+    out[1] = 0x80 | ((codepoint >> 6) & 0x3F);
+    out[2] = 0x80 | (codepoint & 0x3F);
+    return 3;
+  }
+
+  out[0] = 0xF0 | (codepoint >> 18);
+  out[1] = 0x80 | ((codepoint >> 12) & 0x3F);
+  out[2] = 0x80 | ((codepoint >> 6) & 0x3F);
+  out[3] = 0x80 | (codepoint & 0x3F);
+  return 4;
+}
+
+// Unescape string content into `out` (never longer than
+// input as every escape is longer than what it encodes)
+// and NUL terminate it, return unescaped length
+static ssize_t unescape(const char* str, size_t len, char* out) {
+  const char* backslash = memchr(str, '\\', len);
+  if (!backslash) {
+    memcpy(out, str, len);
+    out[len] = '\0';
+    return len;
+  }
+
+  size_t outLen = backslash - str;
+  memcpy(out, str, outLen);
+
+  for (size_t i = outLen; i < len;) {
+    if (str[i] != '\\') {
+      out[outLen++] = str[i++];
+      continue;
+    }
+
+    // Stage 1 never ends string on escaped quote
+    BUG_ON(i + 1 >= len);
+    char c = str[i + 1];
+    i += 2;
+    switch (c) {
+      case '"':
+      case '\\':
+      case '/':
+        out[outLen++] = c;
+        continue;
+      case 'b':
+        out[outLen++] = '\b';
+        continue;
+      case 'f':
+        out[outLen++] = '\f';
+        continue;
+      case 'n':
+        out[outLen++] = '\n';
+        continue;
+      case 'r':
+        out[outLen++] = '\r';
+        continue;
+      case 't':
+        out[outLen++] = '\t';
+        continue;
+      case 'u':
+        break;
+      default:
+        return -EINVAL;
+    }
+
+    uint32_t codepoint;
+    if (readHex4(str, len, i, &codepoint) < 0)
+      return -EINVAL;
+    i += 4;
+
+    if (codepoint >= 0xDC00 && codepoint <= 0xDFFF)
+      return -EINVAL;
+
+    if (codepoint >= 0xD800 && codepoint <= 0xDBFF) {
+      uint32_t low;
+      if (len - i < 2 || str[i] != '\\' || str[i + 1] != 'u')
+        return -EINVAL;
+      if (readHex4(str, len, i + 2, &low) < 0 || low < 0xDC00 || low > 0xDFFF)
+        return -EINVAL;
+      i += 6;
+      codepoint = 0x10000 + ((codepoint - 0xD800) << 10) + (low - 0xDC00);
+    }
+
+    outLen += encodeUTF8(codepoint, out + outLen);
+  }
+
+  out[outLen] = '\0';
+  return outLen;
+}
+
+static int reserveChars(vec_char_t* vec, size_t len) {
+  if (len > INT_MAX)
+    return -E2BIG;
+  if (vec_reserve(vec, (int) len) < 0)
+    return -ENOMEM;
+  return 0;
+}
+
+// Put completed value into current container (or make it root)
+// and descend into it if it is container
+static int addValue(struct decoder_context* ctx, struct json_node* node) {
+  int res = 0;
+  if (ctx->sp == 0) {
+    BUG_ON(ctx->root);
+    ctx->root = node;
+    goto added;
+  }
+
+  struct json_node* parent = ctx->stack[ctx->sp - 1];
+  if (parent->type == JSON_ARRAY) {
+    if (json_array_append(parent, node) < 0) {
+      res = -ENOMEM;
+      goto add_error;
+    }
+    goto added;
+  }
+
+  buffer_t key = {
+    .len = ctx->key.length,
+    .data = ctx->key.data,
+    .alloc = NULL
+  };
+
+  // Later duplicate replaces earlier one (same as built-in)
+  if ((res = json_set_member_buffer(parent, &key, node)) < 0) {
+    BUG_ON(res == -EINVAL);
+    res = -ENOMEM;
+    goto add_error;
+  }
+
+added:
+  if (node->type == JSON_ARRAY) {
+    ctx->stack[ctx->sp++] = node;
+    ctx->state = STATE_ARRAY_FIRST;
+  } else if (node->type == JSON_OBJECT) {
+    ctx->stack[ctx->sp++] = node;
+    ctx->state = STATE_OBJECT_FIRST;
+  } else {
+    ctx->state = ctx->sp == 0 ? STATE_DONE : STATE_AFTER_VALUE;
+  }
+  return 0;
+
+add_error:
+  json_free(node);
+  return res;
+}
+
+static void closeContainer(struct decoder_context* ctx) {
+  BUG_ON(ctx->sp <= 0);
+  ctx->sp--;
+  ctx->state = ctx->sp == 0 ? STATE_DONE : STATE_AFTER_VALUE;
+}
+
+// Content of string whose opening quote at `start`, closing
+// quote is always next index entry
+static int nextString(struct decoder_context* ctx, size_t start, const char** str, size_t* len) {
+  if (ctx->next >= ctx->count)
+    return -EINVAL;
+
+  size_t end = ctx->positions[ctx->next++];
+  BUG_ON(ctx->data[end] != '"');
+  *str = ctx->data + start + 1;
+  *len = end - start - 1;
+  return 0;
+}
+
+static int parseKey(struct decoder_context* ctx, size_t start) {
+  int res = 0;
+  const char* str;
+  size_t len;
+  if ((res = nextString(ctx, start, &str, &len)) < 0)
+    return res;
+  if ((res = reserveChars(&ctx->key, len + 1)) < 0)
+    return res;
+
+  ssize_t keyLen = unescape(str, len, ctx->key.data);
+  if (keyLen < 0)
+    return keyLen;
+  ctx->key.length = keyLen;
+  ctx->state = STATE_COLON;
+  return 0;
+}
+
+static int parseString(struct decoder_context* ctx, size_t start) {
+  int res = 0;
+  const char* str;
+  size_t len;
+  if ((res = nextString(ctx, start, &str, &len)) < 0)
+    return res;
+
+  // Unescaped is never longer
+  if ((res = reserveChars(&ctx->scratch, len + 1)) < 0)
+    return res;
+
+  ssize_t stringLen = unescape(str, len, ctx->scratch.data);
+  if (stringLen < 0)
+    return stringLen;
+
+  struct json_string* string = json_new_string_copy_in(ctx->document, ctx->scratch.data, stringLen);
+  if (!string)
+    return -ENOMEM;
+  return addValue(ctx, &string->node);
+}
+
+// Number or literal, runs until whitespace, structural or quote
+static int parseAtom(struct decoder_context* ctx, size_t start) {
+  int res = 0;
+  size_t end = start;
+  while (end < ctx->len && !(charClass[(uint8_t) ctx->data[end]] & (CLASS_OP | CLASS_WHITESPACE | CLASS_QUOTE)))
+    end++;
+
+  const char* atom = ctx->data + start;
+  size_t len = end - start;
+  struct json_node* node = NULL;
+
+  #define isLiteral(str) (len == sizeof(str) - 1 && memcmp(atom, str, len) == 0)
+  if (isLiteral("true") || isLiteral("false")) {
+    struct json_boolean* boolean = json_new_boolean_in(ctx->document, atom[0] == 't');
+    node = boolean ? &boolean->node : NULL;
+  } else if (isLiteral("null")) {
+    struct json_null* null = json_new_null_in(ctx->document);
+    node = null ? &null->node : NULL;
+  } else {
+    if (!json_is_valid_number(atom, len))
+      return -EINVAL;
+
+    // Document isn't NUL terminated so strtod gets a copy
+    if ((res = reserveChars(&ctx->scratch, len + 1)) < 0)
+      return res;
+    memcpy(ctx->scratch.data, atom, len);
+    ctx->scratch.data[len] = '\0';
+
+    struct json_number* number = json_new_number_in(ctx->document, strtod(ctx->scratch.data, NULL));
+    node = number ? &number->node : NULL;
+  }
+  #undef isLiteral
+
+  if (!node)
+    return -ENOMEM;
+  return addValue(ctx, node);
+}
+
+static int parseValue(struct decoder_context* ctx, size_t pos) {
+  struct json_node* node = NULL;
+  switch (ctx->data[pos]) {
+    case '{':
+    case '[':
+      if (ctx->sp >= CONFIG_JSON_NEST_MAX)
+        return -EOVERFLOW;
+
+      if (ctx->data[pos] == '{') {
+        struct json_object* object = json_new_object_in(ctx->document);
+        node = object ? &object->node : NULL;
+      } else {
+        struct json_array* array = json_new_array_in(ctx->document);
+        node = array ? &array->node : NULL;
+      }
+
+      if (!node)
+        return -ENOMEM;
+      return addValue(ctx, node);
+    case '"':
+      return parseString(ctx, pos);
+    case '}':
+    case ']':
+    case ':':
+    case ',':
+      return -EINVAL;
+    default:
+      return parseAtom(ctx, pos);
+  }
+}
+
+// Stage 2, walk the index building tree
+static int buildTree(struct decoder_context* ctx) {
+  int res = 0;
+  while (ctx->next < ctx->count) {
+    size_t pos = ctx->positions[ctx->next++];
+    char c = ctx->data[pos];
+
+    switch (ctx->state) {
+      case STATE_DONE:
+        return -EINVAL;
+      case STATE_ARRAY_FIRST:
+        if (c == ']') {
+          closeContainer(ctx);
+          break;
+        }
+        [[fallthrough]];
+      case STATE_VALUE:
+        if ((res = parseValue(ctx, pos)) < 0)
+          return res;
+        break;
+      case STATE_OBJECT_FIRST:
+        if (c == '}') {
+          closeContainer(ctx);
+          break;
+        }
+        [[fallthrough]];
+      case STATE_OBJECT_KEY:
+        if (c != '"')
+          return -EINVAL;
+        if ((res = parseKey(ctx, pos)) < 0)
+          return res;
+        break;
+      case STATE_COLON:
+        if (c != ':')
+          return -EINVAL;
+        ctx->state = STATE_VALUE;
+        break;
+      case STATE_AFTER_VALUE: {
+        enum json_type type = ctx->stack[ctx->sp - 1]->type;
+        if (c == ',')
+          ctx->state = type == JSON_ARRAY ? STATE_VALUE : STATE_OBJECT_KEY;
+        else if ((c == ']' && type == JSON_ARRAY) || (c == '}' && type == JSON_OBJECT))
+          closeContainer(ctx);
+        else
+          return -EINVAL;
+        break;
+      }
+    }
+  }
+
+  if (ctx->state != STATE_DONE)
+    return -EINVAL;
+  return 0;
+}
+
+static int decode(struct json_document* document, struct json_node** root, const char* data, size_t len) {
+  int res = 0;
+  struct structural_index index = {};
+  if (len > UINT32_MAX || (CONFIG_JSON_DECODE_MAX_SIZE > 0 && len > (size_t) CONFIG_JSON_DECODE_MAX_SIZE * 1024 * 1024)) {
+    res = -E2BIG;
+    goto build_index_error;
+  }
+
+  pthread_once(&classifyOnce, selectClassifier);
+
+  if ((res = buildIndex(&index, data, len)) < 0)
+    goto build_index_error;
+
+  static thread_local struct decoder_context ctx;
+  ctx.data = data;
+  ctx.len = len;
+  ctx.positions = index.positions;
+  ctx.count = index.count;
+  ctx.next = 0;
+  ctx.state = STATE_VALUE;
+  ctx.root = NULL;
+  ctx.document = document;
+  ctx.sp = 0;
+  vec_init(&ctx.key);
+  vec_init(&ctx.scratch);
+
+  res = buildTree(&ctx);
+  if (res >= 0 && document) {
+    // Root now owns the document
+    document->root = ctx.root;
+    document = NULL;
+  }
+
+  if (res >= 0 && root)
+    *root = ctx.root;
+  else
+    json_free(ctx.root);
+
+  vec_deinit(&ctx.key);
+  vec_deinit(&ctx.scratch);
+build_index_error:
+  free(index.positions);
+  json_document_free(document);
+  return res;
+}
+
+int json_decode_simd(struct json_node** root, const char* data, size_t len) {
+  return decode(NULL, root, data, len);
+}
+
+int json_decode_simd_document(struct json_node** root, const char* data, size_t len) {
+  struct json_document* document = json_document_new();
+  if (!document)
+    return -ENOMEM;
+  return decode(document, root, data, len);
+}
+
+// Lazy mode keeps copy of document and its index in the arena
+// and only checks structure up front. Objects are decoded one
+// level at a time when member is first looked up, arrays are
+// decoded with their parent so readers can index them directly
+struct lazy_document {
+  // NUL terminated so strtod can read numbers in place
+  const char* data;
+  size_t len;
+
+  const uint32_t* positions;
+  size_t count;
+
+  // Entry of matching '}' or ']' for every '{' and '[' entry
+  uint32_t* closing;
+};
+
+// Check structure of the index and match containers (values
+// themselves are checked when decoded)
+static int matchContainers(struct lazy_document* lazy) {
+  static thread_local uint32_t stack[CONFIG_JSON_NEST_MAX];
+  int sp = 0;
+  enum decoder_state state = STATE_VALUE;
+
+  for (size_t i = 0; i < lazy->count; i++) {
+    char c = lazy->data[lazy->positions[i]];
+    switch (state) {
+      case STATE_DONE:
+        return -EINVAL;
+      case STATE_ARRAY_FIRST:
+        if (c == ']')
+          goto close_container;
+        [[fallthrough]];
+      case STATE_VALUE:
+        if (c == '{' || c == '[') {
+          if (sp >= CONFIG_JSON_NEST_MAX)
+            return -EOVERFLOW;
+          stack[sp++] = i;
+          state = c == '{' ? STATE_OBJECT_FIRST : STATE_ARRAY_FIRST;
+          break;
+        }
+
+        if (c == '}' || c == ']' || c == ':' || c == ',')
+          return -EINVAL;
+        // Closing quote is always next entry
+        if (c == '"' && ++i >= lazy->count)
+          return -EINVAL;
+        state = sp == 0 ? STATE_DONE : STATE_AFTER_VALUE;
+        break;
+      case STATE_OBJECT_FIRST:
+        if (c == '}')
+          goto close_container;
+        [[fallthrough]];
+      case STATE_OBJECT_KEY:
+        if (c != '"' || ++i >= lazy->count)
+          return -EINVAL;
+        state = STATE_COLON;
+        break;
+      case STATE_COLON:
+        if (c != ':')
+          return -EINVAL;
+        state = STATE_VALUE;
+        break;
+      case STATE_AFTER_VALUE: {
+        char open = lazy->data[lazy->positions[stack[sp - 1]]];
+        if (c == ',') {
+          state = open == '[' ? STATE_VALUE : STATE_OBJECT_KEY;
+          break;
+        }
+        if ((c == ']' && open == '[') || (c == '}' && open == '{'))
+          goto close_container;
+        return -EINVAL;
+      }
+    }
+    continue;
+
+close_container:
+    lazy->closing[stack[--sp]] = i;
+    state = sp == 0 ? STATE_DONE : STATE_AFTER_VALUE;
+  }
+
+  if (state != STATE_DONE)
+    return -EINVAL;
+  return 0;
+}
+
+static int lazyExpandArray(struct json_document* document, struct lazy_document* lazy, struct json_node* array, size_t entry);
+
+// Decode value at index entry `entry`, `*next` is entry after it
+static int lazyValue(struct json_document* document, struct lazy_document* lazy, size_t entry, struct json_node** nodePtr, size_t* next) {
+  int res = 0;
+  size_t pos = lazy->positions[entry];
+  struct json_node* node = NULL;
+
+  switch (lazy->data[pos]) {
+    case '{': {
+      struct json_object* object = json_new_object_in(document);
+      if (!object)
+        return -ENOMEM;
+      object->isLazy = true;
+      object->lazyData = entry;
+      node = &object->node;
+      *next = lazy->closing[entry] + 1;
+      break;
+    }
+    case '[': {
+      struct json_array* array = json_new_array_in(document);
+      if (!array)
+        return -ENOMEM;
+      node = &array->node;
+      if ((res = lazyExpandArray(document, lazy, node, entry)) < 0)
+        return res;
+      *next = lazy->closing[entry] + 1;
+      break;
+    }
+    case '"': {
+      size_t len = lazy->positions[entry + 1] - pos - 1;
+      buffer_t* buff = arena_alloc(&document->arena, sizeof(*buff));
+      char* str = arena_alloc(&document->arena, len + 1);
+      if (!buff || !str)
+        return -ENOMEM;
+
+      ssize_t stringLen = unescape(lazy->data + pos + 1, len, str);
+      if (stringLen < 0)
+        return stringLen;
+      *buff = (buffer_t) {
+        .len = stringLen,
+        .data = str,
+        .alloc = NULL
+      };
+
+      struct json_string* string = json_new_string_in(document, buff);
+      if (!string)
+        return -ENOMEM;
+      node = &string->node;
+      *next = entry + 2;
+      break;
+    }
+    default: {
+      size_t end = pos;
+      while (end < lazy->len && !(charClass[(uint8_t) lazy->data[end]] & (CLASS_OP | CLASS_WHITESPACE | CLASS_QUOTE)))
+        end++;
+
+      const char* atom = lazy->data + pos;
+      size_t len = end - pos;
+      #define isLiteral(str) (len == sizeof(str) - 1 && memcmp(atom, str, len) == 0)
+      if (isLiteral("true") || isLiteral("false")) {
+        struct json_boolean* boolean = json_new_boolean_in(document, atom[0] == 't');
+        node = boolean ? &boolean->node : NULL;
+      } else if (isLiteral("null")) {
+        struct json_null* null = json_new_null_in(document);
+        node = null ? &null->node : NULL;
+      } else {
+        if (!json_is_valid_number(atom, len))
+          return -EINVAL;
+        struct json_number* number = json_new_number_in(document, strtod(atom, NULL));
+        node = number ? &number->node : NULL;
+      }
+      #undef isLiteral
+
+      if (!node)
+        return -ENOMEM;
+      *next = entry + 1;
+      break;
+    }
+  }
+
+  *nodePtr = node;
+  return 0;
+}
+
+static int lazyExpandArray(struct json_document* document, struct lazy_document* lazy, struct json_node* array, size_t entry) {
+  int res = 0;
+  size_t end = lazy->closing[entry];
+
+  // Entry after every value is ',' or the closing ']'
+  for (size_t i = entry + 1; i < end;) {
+    struct json_node* node;
+    size_t next;
+    if ((res = lazyValue(document, lazy, i, &node, &next)) < 0)
+      return res;
+    if (json_array_append(array, node) < 0)
+      return -ENOMEM;
+    i = next + 1;
+  }
+  return 0;
+}
+
+static int lazyExpandObject(struct json_object* object, void* udata) {
+  int res = 0;
+  struct json_document* document = object->node.document;
+  struct lazy_document* lazy = udata;
+  size_t entry = object->lazyData;
+  size_t end = lazy->closing[entry];
+
+  // Key, its closing quote, ':', value then ',' or '}'
+  for (size_t i = entry + 1; i < end;) {
+    size_t keyPos = lazy->positions[i];
+    size_t keyLen = lazy->positions[i + 1] - keyPos - 1;
+    buffer_t key = {
+      .len = keyLen,
+      .data = (char*) lazy->data + keyPos + 1,
+      .alloc = NULL
+    };
+
+    // Object copies key so only escaped one needs scratch
+    if (memchr(key.data, '\\', keyLen)) {
+      char* unescaped = arena_alloc(&document->arena, keyLen + 1);
+      if (!unescaped)
+        return -ENOMEM;
+      ssize_t unescapedLen = unescape(key.data, keyLen, unescaped);
+      if (unescapedLen < 0)
+        return unescapedLen;
+      key.data = unescaped;
+      key.len = unescapedLen;
+    }
+
+    struct json_node* node;
+    size_t next;
+    if ((res = lazyValue(document, lazy, i + 3, &node, &next)) < 0)
+      return res;
+
+    // Later duplicate replaces earlier one (same as other decoders)
+    if ((res = json_set_member_buffer(&object->node, &key, node)) < 0) {
+      BUG_ON(res == -EINVAL);
+      return -ENOMEM;
+    }
+    i = next + 1;
+  }
+  return 0;
+}
+
+int json_decode_simd_lazy(struct json_node** root, const char* data, size_t len) {
+  int res = 0;
+  struct structural_index index = {};
+  struct json_document* document = NULL;
+  if (len > UINT32_MAX || (CONFIG_JSON_DECODE_MAX_SIZE > 0 && len > (size_t) CONFIG_JSON_DECODE_MAX_SIZE * 1024 * 1024))
+    return -E2BIG;
+
+  pthread_once(&classifyOnce, selectClassifier);
+
+  if (!(document = json_document_new()))
+    return -ENOMEM;
+
+  // Caller's buffer doesn't outlive this call
+  struct lazy_document* lazy = arena_alloc(&document->arena, sizeof(*lazy));
+  char* copy = arena_alloc(&document->arena, len + 1);
+  if (!lazy || !copy) {
+    res = -ENOMEM;
+    goto lazy_error;
+  }
+  memcpy(copy, data, len);
+  copy[len] = '\0';
+
+  if ((res = buildIndex(&index, copy, len)) < 0)
+    goto lazy_error;
+
+  // Nothing but whitespace
+  if (index.count == 0) {
+    res = -EINVAL;
+    goto lazy_error;
+  }
+
+  uint32_t* positions = arena_alloc(&document->arena, sizeof(*positions) * index.count);
+  uint32_t* closing = arena_alloc(&document->arena, sizeof(*closing) * index.count);
+  if (!positions || !closing) {
+    res = -ENOMEM;
+    goto lazy_error;
+  }
+  memcpy(positions, index.positions, sizeof(*positions) * index.count);
+
+  *lazy = (struct lazy_document) {
+    .data = copy,
+    .len = len,
+    .positions = positions,
+    .count = index.count,
+    .closing = closing
+  };
+  if ((res = matchContainers(lazy)) < 0)
+    goto lazy_error;
+
+  document->expand = lazyExpandObject;
+  document->expandUdata = lazy;
+
+  struct json_node* rootNode;
+  size_t next;
+  if ((res = lazyValue(document, lazy, 0, &rootNode, &next)) < 0)
+    goto lazy_error;
+  BUG_ON(next != lazy->count);
+  free(index.positions);
+
+  // Root now owns the document
+  document->root = rootNode;
+  if (root)
+    *root = rootNode;
+  else
+    json_free(rootNode);
+  return 0;
+
+lazy_error:
+  free(index.positions);
+  json_document_free(document);
+  return res;
+}
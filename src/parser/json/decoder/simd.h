@@ -0,0 +1,32 @@
+#ifndef _headers_1672311730_FluffyLauncher_simd
+#define _headers_1672311730_FluffyLauncher_simd
+
+#include <stddef.h>
+#include "parser/json/json.h"
+
+// Two stage decoder for big documents (version manifests,
+// asset indexes). Stage 1 classifies 64 bytes at a time
+// (AVX2 if CPU has it) into index of structural characters,
+// string quotes and start of numbers/literals, stage 2 builds
+// tree walking that index instead of every byte
+
+// Errors:
+// -EINVAL: Malformed document
+// -EOVERFLOW: Nested deeper than CONFIG_JSON_NEST_MAX
+// -E2BIG: Document larger than CONFIG_JSON_DECODE_MAX_SIZE
+// -ENOMEM: Not enough memory
+int json_decode_simd(struct json_node** root, const char* data, size_t len);
+
+// Same but whole tree in one json_document
+int json_decode_simd_document(struct json_node** root, const char* data, size_t len);
+
+// Only builds the index and checks structure, objects decode
+// their members when first looked up (json_get_member, which
+// json_schema_load uses) and arrays with their parent object.
+// Errors in values never looked up are never reported and
+// errors in looked up ones make lookup fail with -EINVAL.
+// Tree is in one json_document
+int json_decode_simd_lazy(struct json_node** root, const char* data, size_t len);
+
+#endif
+
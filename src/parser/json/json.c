@@ -10,20 +10,59 @@
 #include "json.h"
 #include "vec.h"
 #include "util/util.h"
+#include "config.h"
 
-struct json_object* json_new_object() {
-  struct json_object* self = malloc(sizeof(*self));
+// Node of `size` bytes, zeroed
+static void* allocNode(struct json_document* document, size_t size) {
+  struct json_node* node;
+  if (document)
+    node = arena_alloc(&document->arena, size);
+  else
+    node = malloc(size);
+  if (!node)
+    return NULL;
+  
+  memset(node, 0, size);
+  node->document = document;
+  return node;
+}
+
+struct json_document* json_document_new() {
+  struct json_document* self = malloc(sizeof(*self));
+  if (!self)
+    return NULL;
+  *self = (struct json_document) {};
+  arena_init(&self->arena);
+  return self;
+}
+
+void json_document_free(struct json_document* self) {
+  if (!self)
+    return;
+  arena_cleanup(&self->arena);
+  free(self);
+}
+
+struct json_object* json_new_object_in(struct json_document* document) {
+  struct json_object* self = allocNode(document, sizeof(*self));
   if (!self)
     return NULL;
-  *self = (struct json_object) {};
   self->node.type = JSON_OBJECT;
   
-  hashmap_init(&self->members, util_hash_buffer, util_compare_buffer);
-  json_set_managed(&self->node);
+  // Document objects use entries array instead
+  if (!document) {
+    hashmap_init(&self->members, util_hash_buffer, util_compare_buffer);
+    json_set_managed(&self->node);
+  }
   return self; 
 }
 
+struct json_object* json_new_object() {
+  return json_new_object_in(NULL);
+}
+
 void json_set_unmanaged(struct json_node* node, json_finalizer_func finalizer, void* udata) {
+  BUG_ON(node->document);
   node->isUnmananged = true;
   node->udata = udata;
   node->finalizer = finalizer;
@@ -36,32 +75,40 @@ void json_set_managed(struct json_node* node) {
   node->isUnmananged = false;
   node->finalizer = NULL;
   
+  // Keys copied by addMember unless moved in
   if (node->type == JSON_OBJECT)
-    hashmap_set_key_alloc_funcs(&JSON_OBJECT(node)->members, util_clone_buffer, buffer_free);
+    hashmap_set_key_alloc_funcs(&JSON_OBJECT(node)->members, NULL, buffer_free);
 }
 
-struct json_array* json_new_array() {
-  struct json_array* self = malloc(sizeof(*self));
+struct json_array* json_new_array_in(struct json_document* document) {
+  struct json_array* self = allocNode(document, sizeof(*self));
   if (!self)
     return NULL;
-  *self = (struct json_array) {};
   self->node.type = JSON_ARRAY;
   
   vec_init(&self->array);
-  json_set_managed(&self->node);
+  if (!document)
+    json_set_managed(&self->node);
   return self;
 }
 
+struct json_array* json_new_array() {
+  return json_new_array_in(NULL);
+}
+
 #define trivial_constructor(ret, name, tag, dataType, dataField) \
-ret* name(dataType val) { \
-  ret* self = malloc(sizeof(*self)); \
+ret* name##_in(struct json_document* document, dataType val) { \
+  ret* self = allocNode(document, sizeof(*self)); \
   if (!self) \
     return NULL; \
-  *self = (ret) {}; \
   self->node.type = tag; \
   self->dataField = val; \
-  json_set_managed(&self->node); \
+  if (!document) \
+    json_set_managed(&self->node); \
   return self; \
+} \
+ret* name(dataType val) { \
+  return name##_in(NULL, val); \
 }
 #define trivial_deconstructor(T, name) \
 static void name(T* val) { \
@@ -73,21 +120,82 @@ trivial_constructor(struct json_number, json_new_number, JSON_NUMBER, double, nu
 trivial_deconstructor(struct json_boolean, freeBoolean);
 trivial_deconstructor(struct json_number, freeNumber);
 
-trivial_constructor(struct json_string, json_new_string, JSON_STRING, buffer_t*, string);
+struct json_string* json_new_string_in(struct json_document* document, buffer_t* val) {
+  struct json_string* self = allocNode(document, sizeof(*self));
+  if (!self)
+    return NULL;
+  self->node.type = JSON_STRING;
+  self->string = val;
+  if (!document)
+    json_set_managed(&self->node);
+  return self;
+}
+
+struct json_string* json_new_string(buffer_t* val) {
+  return json_new_string_in(NULL, val);
+}
+
 static void freeString(struct json_string* val) { 
   if (!val->node.isUnmananged)
     buffer_free(val->string);
   free(val); 
 }
 
-struct json_null* json_new_null() {
-  struct json_null* self = malloc(sizeof(*self));
+// Non owning buffer_t with NUL terminated copy of data
+// in document's arena
+static buffer_t* copyToArena(struct json_document* document, const char* data, size_t len) {
+  buffer_t* buff = arena_alloc(&document->arena, sizeof(*buff));
+  char* copy = arena_alloc(&document->arena, len + 1);
+  if (!buff || !copy)
+    return NULL;
+  
+  memcpy(copy, data, len);
+  copy[len] = '\0';
+  *buff = (buffer_t) {
+    .len = len,
+    .data = copy,
+    .alloc = NULL
+  };
+  return buff;
+}
+
+struct json_string* json_new_string_copy_in(struct json_document* document, const char* str, size_t len) {
+  if (document) {
+    buffer_t* buff = copyToArena(document, str, len);
+    if (!buff)
+      return NULL;
+    return json_new_string_in(document, buff);
+  }
+  
+  char* copy = malloc(len + 1);
+  if (!copy)
+    return NULL;
+  memcpy(copy, str, len);
+  copy[len] = '\0';
+  
+  buffer_t* buff = buffer_new_with_string_length(copy, len);
+  if (!buff) {
+    free(copy);
+    return NULL;
+  }
+  
+  struct json_string* self = json_new_string(buff);
+  if (!self)
+    buffer_free(buff);
+  return self;
+}
+
+struct json_null* json_new_null_in(struct json_document* document) {
+  struct json_null* self = allocNode(document, sizeof(*self));
   if (!self)
     return NULL;
-  *self = (struct json_null) {};
   self->node.type = JSON_NULL;
   return self;
 }
+
+struct json_null* json_new_null() {
+  return json_new_null_in(NULL);
+}
 trivial_deconstructor(struct json_null, freeNull);
 
 #undef trivial_constructor
@@ -101,20 +209,34 @@ static void freeArray(struct json_array* array) {
   free(array);
 }
 
-static void freeObject(struct json_object* array) {
+static void freeObject(struct json_object* object) {
+  for (uint32_t i = 0; i < object->entryCount; i++) {
+    json_free(object->entries[i].value);
+    if (!object->node.isUnmananged)
+      buffer_free(object->entries[i].key);
+  }
+  free(object->entries);
+  
   const buffer_t* key;
   struct json_node* value;
-  hashmap_foreach(key, value, &array->members) 
+  hashmap_foreach(key, value, &object->members) 
     json_free(value);
   
-  hashmap_cleanup(&array->members);
-  free(array);
+  hashmap_cleanup(&object->members);
+  free(object);
 }
 
 void json_free(struct json_node* self) {
   if (!self)
     return;
   
+  // Rest of document goes with its root
+  if (self->document) {
+    if (self->document->root == self)
+      json_document_free(self->document);
+    return;
+  }
+  
   if (self->isUnmananged && self->finalizer)
     self->finalizer(self, self->udata);
   
@@ -140,6 +262,228 @@ void json_free(struct json_node* self) {
   }
 }
 
+static uint32_t hashKey(const buffer_t* key) {
+  // FNV-1a
+  uint32_t hash = 2166136261u;
+  for (size_t i = 0; i < key->len; i++)
+    hash = (hash ^ (unsigned char) key->data[i]) * 16777619u;
+  return hash;
+}
+
+static bool keyEquals(const buffer_t* a, const buffer_t* b) {
+  return a->len == b->len && memcmp(a->data, b->data, a->len) == 0;
+}
+
+// Slot of document's index where `key` is or would be inserted
+static uint32_t* findSlot(struct json_object* self, const buffer_t* key) {
+  uint32_t mask = self->indexSize - 1;
+  uint32_t i = hashKey(key) & mask;
+  while (self->index[i] && !keyEquals(self->entries[self->index[i] - 1].key, key))
+    i = (i + 1) & mask;
+  return &self->index[i];
+}
+
+// Member still in entries array, NULL if not found there
+// (also when object was moved into `members`)
+static struct json_member* findEntry(struct json_object* self, const buffer_t* key) {
+  if (!self->isHashed) {
+    for (uint32_t i = 0; i < self->entryCount; i++)
+      if (keyEquals(self->entries[i].key, key))
+        return &self->entries[i];
+    return NULL;
+  }
+  
+  if (!self->node.document)
+    return NULL;
+  
+  uint32_t* slot = findSlot(self, key);
+  return *slot ? &self->entries[*slot - 1] : NULL;
+}
+
+// Rebuild document's index at twice the size (old one
+// stays in arena)
+static int growIndex(struct json_object* self) {
+  struct arena* arena = &self->node.document->arena;
+  uint32_t newSize = self->indexSize ? self->indexSize * 2 : 16;
+  while (newSize < self->entryCount * 2)
+    newSize *= 2;
+  
+  uint32_t* index = arena_alloc(arena, sizeof(*index) * newSize);
+  if (!index)
+    return -ENOMEM;
+  memset(index, 0, sizeof(*index) * newSize);
+  
+  self->index = index;
+  self->indexSize = newSize;
+  for (uint32_t i = 0; i < self->entryCount; i++)
+    *findSlot(self, self->entries[i].key) = i + 1;
+  return 0;
+}
+
+// Object grew past CONFIG_JSON_OBJECT_LINEAR_MAX. Document
+// gets index over its entries, malloc'ed object moves them
+// into `members`
+static int promote(struct json_object* self) {
+  if (self->node.document) {
+    if (growIndex(self) < 0)
+      return -ENOMEM;
+    self->isHashed = true;
+    return 0;
+  }
+  
+  // Nothing can fail after this (no key_dup)
+  if (hashmap_reserve(&self->members, self->entryCount + 1) < 0)
+    return -ENOMEM;
+  
+  for (uint32_t i = 0; i < self->entryCount; i++) {
+    int res = hashmap_put(&self->members, self->entries[i].key, self->entries[i].value);
+    BUG_ON(res < 0);
+  }
+  
+  free(self->entries);
+  self->entries = NULL;
+  self->entryCount = 0;
+  self->entryCapacity = 0;
+  self->isHashed = true;
+  return 0;
+}
+
+static int growEntries(struct json_object* self) {
+  uint32_t newCapacity = self->entryCapacity ? self->entryCapacity * 2 : 2;
+  struct json_member* entries;
+  if (self->node.document)
+    entries = arena_grow(&self->node.document->arena, self->entries,
+                         sizeof(*entries) * self->entryCapacity,
+                         sizeof(*entries) * newCapacity);
+  else
+    entries = realloc(self->entries, sizeof(*entries) * newCapacity);
+  if (!entries)
+    return -ENOMEM;
+  
+  self->entries = entries;
+  self->entryCapacity = newCapacity;
+  return 0;
+}
+
+// Copy of key with its length (keys may contain NUL)
+static buffer_t* cloneKey(const buffer_t* key) {
+  char* copy = malloc(key->len + 1);
+  if (!copy)
+    return NULL;
+  memcpy(copy, key->data, key->len);
+  copy[key->len] = '\0';
+  
+  buffer_t* buff = buffer_new_with_string_length(copy, key->len);
+  if (!buff)
+    free(copy);
+  return buff;
+}
+
+// Decode members of lazy object, on failure it stays lazy
+// so every lookup reports the error
+static int expandLazy(struct json_object* self) {
+  struct json_document* document = self->node.document;
+  if (!self->isLazy)
+    return 0;
+  
+  // Expand function adds members with json_set_member*
+  self->isLazy = false;
+  int res = document->expand(self, document->expandUdata);
+  if (res < 0) {
+    self->entryCount = 0;
+    self->isHashed = false;
+    self->index = NULL;
+    self->indexSize = 0;
+    self->isLazy = true;
+  }
+  return res;
+}
+
+// `move` means managed object takes `key` on success. Document
+// copies key into the arena even then and frees the given one
+static int addMember(struct json_node* self, buffer_t* key, struct json_node* node, bool move) {
+  struct json_object* object = JSON_OBJECT(self);
+  int res = 0;
+  if (self->document != node->document)
+    return -EINVAL;
+  if ((res = expandLazy(object)) < 0)
+    return res;
+  if (findEntry(object, key) || (object->isHashed && !self->document && hashmap_get(&object->members, key)))
+    return -EEXIST;
+  
+  if (!object->isHashed && object->entryCount >= CONFIG_JSON_OBJECT_LINEAR_MAX && promote(object) < 0)
+    return -ENOMEM;
+  
+  buffer_t* storedKey = key;
+  if (self->document)
+    storedKey = copyToArena(self->document, key->data, key->len);
+  else if (!move && !self->isUnmananged)
+    storedKey = cloneKey(key);
+  if (!storedKey)
+    return -ENOMEM;
+  
+  if (object->isHashed && !self->document) {
+    res = hashmap_put(&object->members, storedKey, node);
+    if (res == -EADDRNOTAVAIL || res == -ENODATA)
+      res = -ENODATA;
+    if (res < 0)
+      goto add_failure;
+    goto added;
+  }
+  
+  // Keep document's index at most half full
+  if (object->isHashed && (object->entryCount + 1) * 2 > object->indexSize && growIndex(object) < 0) {
+    res = -ENOMEM;
+    goto add_failure;
+  }
+  
+  if (object->entryCount == object->entryCapacity && growEntries(object) < 0) {
+    res = -ENOMEM;
+    goto add_failure;
+  }
+  
+  object->entries[object->entryCount++] = (struct json_member) {
+    .key = storedKey,
+    .value = node
+  };
+  if (object->isHashed)
+    *findSlot(object, storedKey) = object->entryCount;
+  
+added:
+  if (self->document && move)
+    buffer_free(key);
+  node->parent = self;
+  return 0;
+
+add_failure:
+  if (storedKey != key && !self->document)
+    buffer_free(storedKey);
+  return res;
+}
+
+// Member known to exist, old value is freed
+static int replaceMember(struct json_node* self, buffer_t* key, struct json_node* node, bool move) {
+  struct json_object* object = JSON_OBJECT(self);
+  if (self->document != node->document)
+    return -EINVAL;
+  
+  struct json_member* member = findEntry(object, key);
+  if (member) {
+    // Existing key stays
+    json_free(member->value);
+    member->value = node;
+    node->parent = self;
+    if (move && (self->document || !self->isUnmananged))
+      buffer_free(key);
+    return 0;
+  }
+  
+  json_free(hashmap_remove(&object->members, key));
+  int res = addMember(self, key, node, move);
+  BUG_ON(res == -EEXIST);
+  return res;
+}
+
 int json_set_member(struct json_node* self, const char* key, struct json_node* node) {
   buffer_t* keyBuffer;
   if (self->isUnmananged) {
@@ -161,10 +505,19 @@ int json_set_member_buffer(struct json_node* self, buffer_t* key, struct json_no
   if (self->type != JSON_OBJECT)
     return -EINVAL;
   
-  // Unconditional remove if it fail it fails (normally mean nothing exist)
-  hashmap_remove(&JSON_OBJECT(self)->members, key);
   int res = json_set_member_buffer_no_overwrite(self, key, node);
-  BUG_ON(res == -EEXIST);
+  if (res == -EEXIST)
+    res = replaceMember(self, key, node, false);
+  return res;
+}
+
+int json_set_member_buffer_move(struct json_node* self, buffer_t* key, struct json_node* node) {
+  if (self->type != JSON_OBJECT)
+    return -EINVAL;
+  
+  int res = json_set_member_buffer_move_no_overwrite(self, key, node);
+  if (res == -EEXIST)
+    res = replaceMember(self, key, node, true);
   return res;
 }
 
@@ -185,12 +538,13 @@ int json_set_member_no_overwrite(struct json_node* self, const char* key, struct
 int json_set_member_buffer_no_overwrite(struct json_node* self, buffer_t* key, struct json_node* node) {
   if (self->type != JSON_OBJECT)
     return -EINVAL;
-  
-  int res = hashmap_put(&JSON_OBJECT(self)->members, key, node);
-  if (res == -EADDRNOTAVAIL || res == -ENODATA)
-    res = -ENODATA;
-  
-  return res;
+  return addMember(self, key, node, false);
+}
+
+int json_set_member_buffer_move_no_overwrite(struct json_node* self, buffer_t* key, struct json_node* node) {
+  if (self->type != JSON_OBJECT)
+    return -EINVAL;
+  return addMember(self, key, node, true);
 }
 
 int json_get_member(struct json_node* self, const char* key, struct json_node** node) {
@@ -211,7 +565,18 @@ int json_get_member_buffer(struct json_node* self, buffer_t* key, struct json_no
   if (self->type != JSON_OBJECT)
     return -EINVAL;
   
-  struct json_node* node = hashmap_get(&JSON_OBJECT(self)->members, key);
+  struct json_object* object = JSON_OBJECT(self);
+  int res = 0;
+  if ((res = expandLazy(object)) < 0)
+    return res;
+  
+  struct json_node* node = NULL;
+  struct json_member* member = findEntry(object, key);
+  if (member)
+    node = member->value;
+  else if (object->isHashed && !self->document)
+    node = hashmap_get(&object->members, key);
+  
   if (!node)
     return -ENODATA;
   
@@ -219,3 +584,71 @@ int json_get_member_buffer(struct json_node* self, buffer_t* key, struct json_no
     *nodePtr = node;
   return 0;
 }
+
+int json_array_append(struct json_node* self, struct json_node* node) {
+  if (self->type != JSON_ARRAY || self->document != node->document)
+    return -EINVAL;
+  
+  struct json_array* array = JSON_ARRAY(self);
+  if (!self->document) {
+    if (vec_push(&array->array, node) < 0)
+      return -ENOMEM;
+    node->parent = self;
+    return 0;
+  }
+  
+  // Same layout as vec_t so readers don't care where it came from
+  if (array->array.length == array->array.capacity) {
+    int newCapacity = array->array.capacity ? array->array.capacity * 2 : 4;
+    struct json_node** data = arena_grow(&self->document->arena, array->array.data,
+                                         sizeof(*data) * array->array.capacity,
+                                         sizeof(*data) * newCapacity);
+    if (!data)
+      return -ENOMEM;
+    array->array.data = data;
+    array->array.capacity = newCapacity;
+  }
+  
+  array->array.data[array->array.length++] = node;
+  node->parent = self;
+  return 0;
+}
+
+// -?(0|[1-9][0-9]*)(\.[0-9]+)?([eE][+-]?[0-9]+)?
+bool json_is_valid_number(const char* str, size_t len) {
+  size_t i = 0;
+  #define isDigit(i) ((i) < len && str[(i)] >= '0' && str[(i)] <= '9')
+
+  if (i < len && str[i] == '-')
+    i++;
+
+  if (i < len && str[i] == '0') {
+    i++;
+  } else {
+    if (!isDigit(i))
+      return false;
+    while (isDigit(i))
+      i++;
+  }
+
+  if (i < len && str[i] == '.') {
+    i++;
+    if (!isDigit(i))
+      return false;
+    while (isDigit(i))
+      i++;
+  }
+
+  if (i < len && (str[i] == 'e' || str[i] == 'E')) {
+    i++;
+    if (i < len && (str[i] == '+' || str[i] == '-'))
+      i++;
+    if (!isDigit(i))
+      return false;
+    while (isDigit(i))
+      i++;
+  }
+
+  #undef isDigit
+  return i == len;
+}
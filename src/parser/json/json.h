@@ -3,10 +3,12 @@
 
 #include <stddef.h>
 #include <stdbool.h>
+#include <stdint.h>
 
 #include "buffer.h"
 #include "hashmap.h"
 #include "vec.h"
+#include "util/arena.h"
 #include "util/util.h"
 
 // JSON (also can handle NUL bytes in keys or values)
@@ -23,13 +25,34 @@ enum json_type {
 };
 
 struct json_node;
+struct json_object;
 typedef void (*json_finalizer_func)(struct json_node* node, void* udata);
 
+// Fills members of lazy object, 0 on success
+typedef int (*json_expand_func)(struct json_object* object, void* udata);
+
+// Every node, key and string of document live in one arena
+// so whole tree goes in one json_free on its root (json_free
+// on other nodes of document does nothing). Nodes can only
+// be added to containers of same document
+struct json_document {
+  struct arena arena;
+  struct json_node* root;
+  
+  // Set by lazy decoders, called on first member lookup
+  // of object marked lazy
+  json_expand_func expand;
+  void* expandUdata;
+};
+
 struct json_node {
   struct json_node* parent;
   enum json_type type; 
   bool isUnmananged;
   
+  // NULL if node is malloc'ed on its own
+  struct json_document* document;
+  
   void* udata;
   json_finalizer_func finalizer;
 };
@@ -49,9 +72,33 @@ struct json_string {
   buffer_t* string;
 };
 
+struct json_member {
+  buffer_t* key;
+  struct json_node* value;
+};
+
+// Members are kept in flat array in insertion order and searched
+// linearly until there are more than CONFIG_JSON_OBJECT_LINEAR_MAX
+// of them. Then malloc'ed object moves them into `members` and
+// document's object gets open addressing `index` into the
+// array (entry index + 1, 0 is empty slot)
 struct json_object {
   struct json_node node;
   HASHMAP(buffer_t, struct json_node) members;
+  
+  struct json_member* entries;
+  uint32_t entryCount;
+  uint32_t entryCapacity;
+  bool isHashed;
+  
+  uint32_t* index;
+  uint32_t indexSize;
+  
+  // Members not decoded yet (lazy document), json_get_member
+  // and json_set_member* decode them first. `lazyData` is for
+  // the document's expand function
+  bool isLazy;
+  uint32_t lazyData;
 };
 
 struct json_array {
@@ -70,6 +117,24 @@ struct json_object* json_new_object();
 struct json_array* json_new_array();
 struct json_null* json_new_null();
 
+// Same but in `document`'s arena (or malloc'ed if NULL)
+struct json_boolean* json_new_boolean_in(struct json_document* document, bool val);
+struct json_number* json_new_number_in(struct json_document* document, double val);
+struct json_object* json_new_object_in(struct json_document* document);
+struct json_array* json_new_array_in(struct json_document* document);
+struct json_null* json_new_null_in(struct json_document* document);
+
+// String node with copy of `len` bytes of `str`
+struct json_string* json_new_string_copy_in(struct json_document* document, const char* str, size_t len);
+
+// String node taking `val` which must be allocated from
+// `document`'s arena (or owned by node if NULL like json_new_string)
+struct json_string* json_new_string_in(struct json_document* document, buffer_t* val);
+
+[[nodiscard]]
+struct json_document* json_document_new();
+void json_document_free(struct json_document* self);
+
 // In unmanaged mode the caller provide buffer for object's keys and string's data
 // and associated destructor to deallocate it (the JSON system wont deallocate or allocate it)
 // The idea is alloe decoder to do more optimization if it can
@@ -80,20 +145,39 @@ void json_free(struct json_node* self);
 
 // 0 on sucess
 // Errors:
-// -EINVAL: Incorrect type
+// -EINVAL: Incorrect type (or malformed lazy object)
 // -ENODATA: Not found
+// -ENOMEM: Not enough memory (for lazy object)
 
 // These copies the key unless unmanaged mode
+// Overwritten member is freed
 int json_set_member(struct json_node* self, const char* key, struct json_node* node);
 int json_set_member_buffer(struct json_node* self, buffer_t* key, struct json_node* node);
 
+// Same but managed object takes `key` itself instead of copying
+// it (only on success), unmanaged object just references it
+int json_set_member_buffer_move(struct json_node* self, buffer_t* key, struct json_node* node);
+
 // Same but disallow overwriting
 int json_set_member_no_overwrite(struct json_node* self, const char* key, struct json_node* node);
 int json_set_member_buffer_no_overwrite(struct json_node* self, buffer_t* key, struct json_node* node);
 
+// Same but managed object takes `key` itself instead of copying
+// it (only on success), unmanaged object just references it
+int json_set_member_buffer_move_no_overwrite(struct json_node* self, buffer_t* key, struct json_node* node);
+
 int json_get_member(struct json_node* self, const char* key, struct json_node** node);
 int json_get_member_buffer(struct json_node* self, buffer_t* key, struct json_node** node);
 
+// Errors:
+// -EINVAL: Not array or node from different document
+// -ENOMEM: Not enough memory
+int json_array_append(struct json_node* self, struct json_node* node);
+
+// Whether `str` is exactly one number as RFC 8259 defines
+// it, for decoders before handing it to strtod
+bool json_is_valid_number(const char* str, size_t len);
+
 #define JSON_OBJECT(x) container_of(x, struct json_object, node)
 #define JSON_ARRAY(x) container_of(x, struct json_array, node)
 #define JSON_NUMBER(x) container_of(x, struct json_number, node)
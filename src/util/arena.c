@@ -0,0 +1,88 @@
+#include <stdalign.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "arena.h"
+#include "bug.h"
+
+#define ALIGNMENT alignof(max_align_t)
+
+struct arena_chunk {
+  struct arena_chunk* next;
+  alignas(max_align_t) char data[];
+};
+
+static size_t alignSize(size_t size) {
+  return (size + ALIGNMENT - 1) & ~(ALIGNMENT - 1);
+}
+
+void arena_init(struct arena* self) {
+  *self = (struct arena) {
+    .nextChunkSize = ARENA_MIN_CHUNK_SIZE
+  };
+}
+
+void arena_cleanup(struct arena* self) {
+  struct arena_chunk* chunk = self->chunks;
+  while (chunk) {
+    struct arena_chunk* next = chunk->next;
+    free(chunk);
+    chunk = next;
+  }
+  arena_init(self);
+}
+
+static struct arena_chunk* newChunk(struct arena* self, size_t size) {
+  struct arena_chunk* chunk = malloc(sizeof(*chunk) + size);
+  if (!chunk)
+    return NULL;
+
+  chunk->next = self->chunks;
+  self->chunks = chunk;
+  return chunk;
+}
+
+void* arena_alloc(struct arena* self, size_t size) {
+  size = alignSize(size ? size : 1);
+  if (size <= self->remaining) {
+    void* ptr = self->current;
+    self->current += size;
+    self->remaining -= size;
+    return ptr;
+  }
+
+  // Big allocation gets chunk of its own so rest of current
+  // chunk still gets used
+  if (size > self->nextChunkSize / 4) {
+    struct arena_chunk* chunk = newChunk(self, size);
+    return chunk ? chunk->data : NULL;
+  }
+
+  struct arena_chunk* chunk = newChunk(self, self->nextChunkSize);
+  if (!chunk)
+    return NULL;
+
+  self->current = chunk->data + size;
+  self->remaining = self->nextChunkSize - size;
+  if (self->nextChunkSize < ARENA_MAX_CHUNK_SIZE)
+    self->nextChunkSize *= 2;
+  return chunk->data;
+}
+
+void* arena_grow(struct arena* self, void* ptr, size_t oldSize, size_t newSize) {
+  BUG_ON(newSize < oldSize);
+  oldSize = alignSize(oldSize ? oldSize : 1);
+  newSize = alignSize(newSize);
+
+  if (ptr && (char*) ptr + oldSize == self->current && newSize - oldSize <= self->remaining) {
+    self->current += newSize - oldSize;
+    self->remaining -= newSize - oldSize;
+    return ptr;
+  }
+
+  void* newPtr = arena_alloc(self, newSize);
+  if (newPtr && ptr)
+    memcpy(newPtr, ptr, oldSize);
+  return newPtr;
+}
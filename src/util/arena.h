@@ -0,0 +1,39 @@
+#ifndef _headers_1672318205_FluffyLauncher_arena
+#define _headers_1672318205_FluffyLauncher_arena
+
+#include <stddef.h>
+
+// Bump allocator, individual allocations are never freed
+// and everything goes at once in arena_cleanup
+
+// Chunks start small and double up to the max
+#define ARENA_MIN_CHUNK_SIZE (4 * 1024)
+#define ARENA_MAX_CHUNK_SIZE (1024 * 1024)
+
+struct arena_chunk;
+
+struct arena {
+  struct arena_chunk* chunks;
+
+  // Free part of chunk being filled
+  char* current;
+  size_t remaining;
+
+  size_t nextChunkSize;
+};
+
+void arena_init(struct arena* self);
+void arena_cleanup(struct arena* self);
+
+// Memory aligned for any type, NULL if out of memory
+[[nodiscard]]
+void* arena_alloc(struct arena* self, size_t size);
+
+// Grow allocation to `newSize` (in place if it was latest
+// allocation and chunk has room) or NULL if out of memory,
+// old memory stays valid either way
+[[nodiscard]]
+void* arena_grow(struct arena* self, void* ptr, size_t oldSize, size_t newSize);
+
+#endif
+
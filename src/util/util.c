@@ -206,3 +206,9 @@ double util_get_realtime() {
   clock_gettime(CLOCK_REALTIME, &timespec);
   return (double) timespec.tv_sec + ((double) timespec.tv_nsec / (double) 1000000000);
 }
+
+double util_get_monotonic() {
+  struct timespec timespec;
+  clock_gettime(CLOCK_MONOTONIC, &timespec);
+  return (double) timespec.tv_sec + ((double) timespec.tv_nsec / (double) 1000000000);
+}
@@ -41,6 +41,10 @@ void util_nanosleep(uint64_t nanosecs);
 
 double util_get_realtime();
 
+// Monotonic clock in seconds for measuring intervals (unaffected
+// by wall clock changes)
+double util_get_monotonic();
+
 #define util_microsec_to_timespec_ptr(t) (struct timespec*) {&(struct timespec) { \
   .tv_sec = (t) / 1000000, \
   .tv_nsec = (t * 1000) % 1000000000 \